@@ -0,0 +1,821 @@
+/*
+ * usb-vhci-lib.c -- user space library for serving controllers of
+ *                   usb-vhci-iocifc
+ *
+ * Copyright (C) 2010 Michael Singer <michael@a-singer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#include "usb-vhci-lib.h"
+
+#define LIB_HASH_SIZE  256 // buckets of the table of urbs which are with the emulation (a power of two)
+#define POOL_MIN_SHIFT 12  // the smallest pooled buffer has 4 KiB,
+#define POOL_CLASSES   9   // the largest one 1 MiB (larger ones aren't pooled)
+#define POOL_DEPTH     32  // max. number of free buffers of each size
+
+#define lib_container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+struct lib_urb;
+
+// something a worker has to do
+struct lib_job
+{
+	struct lib_job *next;
+	struct lib_urb *u;
+	int cancel;                 // call ops->cancel instead of ops->urb
+};
+
+struct lib_urb
+{
+	struct usb_vhci_lib_urb pub;
+	struct lib_urb *hash_next;  // entry in lib->hash while the emulation has the urb
+	struct lib_urb *done_next;  // entry in lib->done_head after it was given back, or in lib->free_urbs
+	struct lib_job job;         // for processing (every cancelation gets a job of its own)
+	int status, actual;
+	int completed;              // usb_vhci_lib_giveback was called
+	int refs;                   // the urb is recycled when this drops to zero
+	unsigned int iso_size;      // number of elements iso and iso_result have room for
+	unsigned int buf_class;     // size class of pub.buffer (POOL_CLASSES: not pooled)
+};
+
+struct lib_worker
+{
+	struct usb_vhci_lib *lib;
+	pthread_t thread;
+	pthread_mutex_t lock;       // protects everything below
+	pthread_cond_t cond;
+	struct lib_job *head, **tail;
+	int stop;
+};
+
+struct usb_vhci_lib
+{
+	int fd;
+	int wake[2];                // pipe which wakes up the event loop
+	__u8 controller;
+	int busnum;
+	char bus_id[20];
+	const struct usb_vhci_lib_ops *ops;
+	void *user;
+	volatile int stop;
+
+	pthread_mutex_t lock;       // protects everything below (except for the workers)
+	struct lib_urb *hash[LIB_HASH_SIZE];
+	struct lib_urb *done_head, **done_tail;
+	struct lib_urb *free_urbs;
+	void *free_bufs[POOL_CLASSES]; // linked through their first bytes
+	unsigned int free_buf_count[POOL_CLASSES];
+
+	unsigned int worker_count;
+	struct lib_worker *workers;
+
+	// used by the event loop only
+	struct usb_vhci_ioc_work works[USB_VHCI_WORK_MULTI_MAX];
+	struct usb_vhci_ioc_giveback gbs[USB_VHCI_GIVEBACK_MULTI_MAX];
+	struct lib_urb *gb_urbs[USB_VHCI_GIVEBACK_MULTI_MAX];
+};
+
+/*
+ * pools
+ */
+
+// returns a buffer with room for len bytes (len > 0)
+static void *buf_get(struct usb_vhci_lib *lib, size_t len, unsigned int *cls)
+{
+	unsigned int c;
+	void *p;
+
+	for(c = 0; c < POOL_CLASSES && ((size_t)1 << (POOL_MIN_SHIFT + c)) < len; c++);
+	*cls = c;
+	if(c == POOL_CLASSES)
+		return malloc(len);
+	pthread_mutex_lock(&lib->lock);
+	if((p = lib->free_bufs[c]))
+	{
+		lib->free_bufs[c] = *(void **)p;
+		lib->free_buf_count[c]--;
+	}
+	pthread_mutex_unlock(&lib->lock);
+	return p ? p : malloc((size_t)1 << (POOL_MIN_SHIFT + c));
+}
+
+// caller has lib->lock
+static void buf_put_locked(struct usb_vhci_lib *lib, void *p, unsigned int c)
+{
+	if(c < POOL_CLASSES && lib->free_buf_count[c] < POOL_DEPTH)
+	{
+		*(void **)p = lib->free_bufs[c];
+		lib->free_bufs[c] = p;
+		lib->free_buf_count[c]++;
+	}
+	else
+		free(p);
+}
+
+static struct lib_urb *urb_get(struct usb_vhci_lib *lib)
+{
+	struct lib_urb *u;
+
+	pthread_mutex_lock(&lib->lock);
+	if((u = lib->free_urbs))
+		lib->free_urbs = u->done_next;
+	pthread_mutex_unlock(&lib->lock);
+	if(!u && !(u = calloc(1, sizeof *u)))
+		return NULL;
+	u->pub.buffer = NULL;
+	u->pub.user_data = NULL;
+	u->completed = 0;
+	u->refs = 1;
+	return u;
+}
+
+// caller has lib->lock and has dropped the last reference
+static void urb_put_locked(struct usb_vhci_lib *lib, struct lib_urb *u)
+{
+	if(u->pub.buffer)
+		buf_put_locked(lib, u->pub.buffer, u->buf_class);
+	u->pub.buffer = NULL;
+	u->done_next = lib->free_urbs;
+	lib->free_urbs = u;
+}
+
+static void urb_unref(struct usb_vhci_lib *lib, struct lib_urb *u)
+{
+	pthread_mutex_lock(&lib->lock);
+	if(!--u->refs)
+		urb_put_locked(lib, u);
+	pthread_mutex_unlock(&lib->lock);
+}
+
+static void urb_free(struct lib_urb *u)
+{
+	free(u->pub.buffer);
+	free(u->pub.iso);
+	free(u->pub.iso_result);
+	free(u);
+}
+
+/*
+ * urbs which are with the emulation
+ */
+
+static inline unsigned int hash_index(__u64 handle)
+{
+	return (unsigned int)(handle ^ (handle >> 32)) & (LIB_HASH_SIZE - 1);
+}
+
+// caller has lib->lock
+static void hash_add(struct usb_vhci_lib *lib, struct lib_urb *u)
+{
+	struct lib_urb **b = &lib->hash[hash_index(u->pub.handle)];
+	u->hash_next = *b;
+	*b = u;
+}
+
+// caller has lib->lock
+static void hash_del(struct usb_vhci_lib *lib, struct lib_urb *u)
+{
+	struct lib_urb **pp;
+	for(pp = &lib->hash[hash_index(u->pub.handle)]; *pp; pp = &(*pp)->hash_next)
+		if(*pp == u)
+		{
+			*pp = u->hash_next;
+			return;
+		}
+}
+
+// caller has lib->lock
+static struct lib_urb *hash_find(struct usb_vhci_lib *lib, __u64 handle)
+{
+	struct lib_urb *u;
+	for(u = lib->hash[hash_index(handle)]; u; u = u->hash_next)
+		if(u->pub.handle == handle)
+			return u;
+	return NULL;
+}
+
+/*
+ * workers
+ */
+
+static void run_job(struct usb_vhci_lib *lib, struct lib_job *j)
+{
+	struct lib_urb *u = j->u;
+	int completed;
+
+	if(!j->cancel)
+	{
+		// (the urb may be recycled as soon as the callback has given it back)
+		lib->ops->urb(lib, &u->pub, lib->user);
+		return;
+	}
+	pthread_mutex_lock(&lib->lock);
+	completed = u->completed;
+	pthread_mutex_unlock(&lib->lock);
+	if(!completed && lib->ops->cancel)
+		lib->ops->cancel(lib, &u->pub, lib->user);
+	free(j);
+	urb_unref(lib, u);
+}
+
+static void *worker_main(void *arg)
+{
+	struct lib_worker *w = arg;
+	struct lib_job *j;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&w->lock);
+		while(!w->head && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if(!(j = w->head))
+		{
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		if(!(w->head = j->next))
+			w->tail = &w->head;
+		pthread_mutex_unlock(&w->lock);
+		run_job(w->lib, j);
+	}
+	return NULL;
+}
+
+// All jobs of an endpoint go to the same worker, so that its urbs are processed in order and its
+// cancelations come after its urbs.
+static void dispatch(struct usb_vhci_lib *lib, struct lib_job *j)
+{
+	const struct usb_vhci_ioc_urb *urb = &j->u->pub.urb;
+	struct lib_worker *w;
+	unsigned int key;
+
+	if(!lib->worker_count)
+	{
+		run_job(lib, j);
+		return;
+	}
+	// both directions of a control endpoint are the same endpoint
+	key = (urb->address << 8) | (urb->type == USB_VHCI_URB_TYPE_CONTROL ? urb->endpoint & 0x0f : urb->endpoint);
+	w = &lib->workers[(key * 2654435761u >> 16) % lib->worker_count];
+	j->next = NULL;
+	pthread_mutex_lock(&w->lock);
+	*w->tail = j;
+	w->tail = &j->next;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * event loop
+ */
+
+static void wake_loop(struct usb_vhci_lib *lib)
+{
+	const char c = 0;
+	// (if the pipe is full, the loop is going to wake up anyway)
+	if(write(lib->wake[1], &c, 1) == -1 && errno != EAGAIN)
+		perror("usb-vhci-lib: write");
+}
+
+// gives back an urb which never reached the emulation
+static void giveback_now(struct usb_vhci_lib *lib, __u64 handle, int status)
+{
+	struct usb_vhci_ioc_giveback gb;
+	memset(&gb, 0, sizeof gb);
+	gb.handle = handle;
+	gb.status = status;
+	if(ioctl(lib->fd, USB_VHCI_HCD_IOCGIVEBACK, &gb) == -1 && errno != ECANCELED && errno != ENOENT)
+		perror("usb-vhci-lib: USB_VHCI_HCD_IOCGIVEBACK");
+}
+
+static void process_urb(struct usb_vhci_lib *lib, const struct usb_vhci_ioc_work *w)
+{
+	const struct usb_vhci_ioc_urb *urb = &w->work.urb;
+	const int iso = urb->type == USB_VHCI_URB_TYPE_ISO;
+	struct usb_vhci_ioc_urb_data ud;
+	struct lib_urb *u;
+	unsigned int count;
+	void *p;
+	int err;
+
+	if(!(u = urb_get(lib)))
+		goto nomem;
+	u->pub.handle = w->handle;
+	u->pub.urb = *urb;
+	u->pub.in = !!(urb->type == USB_VHCI_URB_TYPE_CONTROL ? urb->setup_packet.bmRequestType & 0x80 : urb->endpoint & 0x80);
+	if(urb->buffer_length > 0 && !(u->pub.buffer = buf_get(lib, urb->buffer_length, &u->buf_class)))
+		goto release;
+	if(iso && urb->packet_count > 0)
+	{
+		count = urb->packet_count;
+		if(count > u->iso_size)
+		{
+			if(!(p = realloc(u->pub.iso, count * sizeof *u->pub.iso)))
+				goto release;
+			u->pub.iso = p;
+			if(!(p = realloc(u->pub.iso_result, count * sizeof *u->pub.iso_result)))
+				goto release;
+			u->pub.iso_result = p;
+			u->iso_size = count;
+		}
+		memset(u->pub.iso_result, 0, count * sizeof *u->pub.iso_result);
+	}
+
+	if((!u->pub.in && urb->buffer_length > 0) || iso)
+	{
+		memset(&ud, 0, sizeof ud);
+		ud.handle = w->handle;
+		ud.buffer = u->pub.buffer;
+		ud.buffer_length = urb->buffer_length;
+		ud.iso_packets = u->pub.iso;
+		ud.packet_count = iso ? urb->packet_count : 0;
+		if(ioctl(lib->fd, USB_VHCI_HCD_IOCFETCHDATA, &ud) == -1 && errno != ENODATA)
+		{
+			err = errno;
+			urb_unref(lib, u);
+			// a canceled urb has to be given back, too
+			giveback_now(lib, w->handle, err == ECANCELED ? -ECONNRESET : -EPIPE);
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&lib->lock);
+	hash_add(lib, u);
+	pthread_mutex_unlock(&lib->lock);
+	u->job.u = u;
+	u->job.cancel = 0;
+	dispatch(lib, &u->job);
+	return;
+
+release:
+	urb_unref(lib, u);
+nomem:
+	giveback_now(lib, w->handle, -ENOMEM);
+}
+
+// splits a group of bulk OUT urbs (USB_VHCI_REGISTER_FLAG_COALESCE_OUT) into single urbs, so the
+// emulation sees them like any other urbs
+static void process_group(struct usb_vhci_lib *lib, const struct usb_vhci_ioc_work *w)
+{
+	struct usb_vhci_ioc_iso_packet_data desc[USB_VHCI_URB_GROUP_MAX];
+	const unsigned int count = w->work.urb.packet_count;
+	struct usb_vhci_ioc_urb_data ud;
+	struct lib_urb *u;
+	unsigned int i, cls = POOL_CLASSES;
+	void *data = NULL;
+	int status;
+
+	if(count > USB_VHCI_URB_GROUP_MAX)
+		return;
+	if(w->work.urb.buffer_length > 0 && !(data = buf_get(lib, w->work.urb.buffer_length, &cls)))
+	{
+		status = -ENOMEM;
+		goto fail;
+	}
+	memset(&ud, 0, sizeof ud);
+	ud.handle = w->handle;
+	ud.buffer = data;
+	ud.buffer_length = w->work.urb.buffer_length;
+	ud.iso_packets = desc;
+	ud.packet_count = count;
+	if(ioctl(lib->fd, USB_VHCI_HCD_IOCFETCHDATA, &ud) == -1)
+	{
+		status = -EPIPE;
+		goto fail;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		if(desc[i].offset == USB_VHCI_URB_GROUP_GONE)
+		{
+			// canceled meanwhile (or already given back)
+			giveback_now(lib, w->handle + i, -ECONNRESET);
+			continue;
+		}
+		if(!(u = urb_get(lib)))
+		{
+			giveback_now(lib, w->handle + i, -ENOMEM);
+			continue;
+		}
+		u->pub.handle = w->handle + i;
+		u->pub.urb = w->work.urb;
+		u->pub.urb.buffer_length = desc[i].packet_length;
+		u->pub.urb.packet_count = 0;
+		u->pub.in = 0;
+		if(desc[i].packet_length > 0)
+		{
+			if(!(u->pub.buffer = buf_get(lib, desc[i].packet_length, &u->buf_class)))
+			{
+				urb_unref(lib, u);
+				giveback_now(lib, w->handle + i, -ENOMEM);
+				continue;
+			}
+			memcpy(u->pub.buffer, (char *)data + desc[i].offset, desc[i].packet_length);
+		}
+		pthread_mutex_lock(&lib->lock);
+		hash_add(lib, u);
+		pthread_mutex_unlock(&lib->lock);
+		u->job.u = u;
+		u->job.cancel = 0;
+		dispatch(lib, &u->job);
+	}
+	goto end;
+
+fail:
+	for(i = 0; i < count; i++)
+		giveback_now(lib, w->handle + i, status);
+end:
+	if(data)
+	{
+		pthread_mutex_lock(&lib->lock);
+		buf_put_locked(lib, data, cls);
+		pthread_mutex_unlock(&lib->lock);
+	}
+}
+
+static void cancel_urb(struct usb_vhci_lib *lib, __u64 handle)
+{
+	struct lib_urb *u;
+	struct lib_job *j;
+
+	pthread_mutex_lock(&lib->lock);
+	if((u = hash_find(lib, handle)))
+		u->refs++;
+	pthread_mutex_unlock(&lib->lock);
+	// if it isn't found, then it was given back already
+	if(!u)
+		return;
+	if(!(j = malloc(sizeof *j)))
+	{
+		urb_unref(lib, u);
+		return;
+	}
+	j->u = u;
+	j->cancel = 1;
+	dispatch(lib, j);
+}
+
+// returns the number of fetched work items or a negative errno
+static int fetch_batch(struct usb_vhci_lib *lib)
+{
+	struct usb_vhci_ioc_work_multi wm;
+	const struct usb_vhci_ioc_work *w;
+	unsigned int i;
+
+	memset(&wm, 0, sizeof wm);
+	wm.works = lib->works;
+	wm.count = USB_VHCI_WORK_MULTI_MAX;
+	wm.timeout = 0;
+	if(ioctl(lib->fd, USB_VHCI_HCD_IOCFETCHWORKMULTI, &wm) == -1)
+	{
+		if(errno == ETIMEDOUT || errno == ENODATA || errno == EINTR)
+			return 0;
+		return -errno;
+	}
+	for(i = 0; i < wm.fetched; i++)
+	{
+		w = &lib->works[i];
+		switch(w->type)
+		{
+		case USB_VHCI_WORK_TYPE_PORT_STAT:
+			if(lib->ops->port_stat)
+				lib->ops->port_stat(lib, &w->work.port, lib->user);
+			break;
+		case USB_VHCI_WORK_TYPE_PROCESS_URB:
+			process_urb(lib, w);
+			break;
+		case USB_VHCI_WORK_TYPE_PROCESS_URBS:
+			process_group(lib, w);
+			break;
+		case USB_VHCI_WORK_TYPE_CANCEL_URB:
+			cancel_urb(lib, w->handle);
+			break;
+		}
+	}
+	return wm.fetched;
+}
+
+static void fill_giveback(struct usb_vhci_ioc_giveback *gb, const struct lib_urb *u)
+{
+	const struct usb_vhci_lib_urb *p = &u->pub;
+	int i;
+
+	memset(gb, 0, sizeof *gb);
+	gb->handle = p->handle;
+	if(p->urb.type == USB_VHCI_URB_TYPE_ISO)
+	{
+		gb->iso_packets = p->iso_result;
+		gb->packet_count = p->urb.packet_count;
+		for(i = 0; i < p->urb.packet_count; i++)
+			if(p->iso_result[i].status)
+				gb->error_count++;
+		if(p->in)
+		{
+			gb->buffer = p->buffer;
+			gb->buffer_actual = p->urb.buffer_length;
+		}
+		return;
+	}
+	gb->status = u->status;
+	gb->buffer_actual = u->actual < 0 ? 0 : u->actual > p->urb.buffer_length ? p->urb.buffer_length : u->actual;
+	if(p->in && gb->buffer_actual)
+		gb->buffer = p->buffer;
+}
+
+// gives back all urbs which were completed by the emulation, in batches
+static int flush_givebacks(struct usb_vhci_lib *lib)
+{
+	struct usb_vhci_ioc_giveback_multi gm;
+	struct lib_urb *u;
+	unsigned int i, n;
+	int ret = 0;
+
+	do
+	{
+		pthread_mutex_lock(&lib->lock);
+		for(n = 0; n < USB_VHCI_GIVEBACK_MULTI_MAX && (u = lib->done_head); n++)
+		{
+			if(!(lib->done_head = u->done_next))
+				lib->done_tail = &lib->done_head;
+			lib->gb_urbs[n] = u;
+		}
+		pthread_mutex_unlock(&lib->lock);
+		if(!n)
+			break;
+
+		for(i = 0; i < n; i++)
+			fill_giveback(&lib->gbs[i], lib->gb_urbs[i]);
+		memset(&gm, 0, sizeof gm);
+		gm.givebacks = lib->gbs;
+		gm.results = NULL; // (urbs which were canceled meanwhile are given back anyway)
+		gm.count = n;
+		if(ioctl(lib->fd, USB_VHCI_HCD_IOCGIVEBACKMULTI, &gm) == -1)
+			ret = -errno;
+
+		pthread_mutex_lock(&lib->lock);
+		for(i = 0; i < n; i++)
+			if(!--lib->gb_urbs[i]->refs)
+				urb_put_locked(lib, lib->gb_urbs[i]);
+		pthread_mutex_unlock(&lib->lock);
+	}
+	while(!ret);
+	return ret;
+}
+
+int usb_vhci_lib_run(struct usb_vhci_lib *lib)
+{
+	struct pollfd pfd[2];
+	char buf[64];
+	int ret = 0;
+
+	while(!lib->stop)
+	{
+		pfd[0].fd = lib->fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = lib->wake[0];
+		pfd[1].events = POLLIN;
+		if(poll(pfd, 2, -1) == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if(pfd[1].revents & POLLIN)
+			while(read(lib->wake[0], buf, sizeof buf) > 0);
+		if(pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+			return -EIO;
+		// a full batch means that there is probably more; the completions go first, though
+		if(pfd[0].revents & POLLIN)
+			while((ret = fetch_batch(lib)) == USB_VHCI_WORK_MULTI_MAX && !(ret = flush_givebacks(lib)));
+		if(ret < 0 || (ret = flush_givebacks(lib)))
+			return ret;
+	}
+	return 0;
+}
+
+void usb_vhci_lib_stop(struct usb_vhci_lib *lib)
+{
+	lib->stop = 1;
+	wake_loop(lib);
+}
+
+int usb_vhci_lib_giveback(struct usb_vhci_lib *lib, struct usb_vhci_lib_urb *urb, int status, int actual)
+{
+	struct lib_urb *u = lib_container_of(urb, struct lib_urb, pub);
+	int was_empty;
+
+	pthread_mutex_lock(&lib->lock);
+	if(u->completed)
+	{
+		pthread_mutex_unlock(&lib->lock);
+		return -EALREADY;
+	}
+	u->completed = 1;
+	u->status = status;
+	u->actual = actual;
+	hash_del(lib, u);
+	u->done_next = NULL;
+	was_empty = !lib->done_head;
+	*lib->done_tail = u;
+	lib->done_tail = &u->done_next;
+	pthread_mutex_unlock(&lib->lock);
+	// (if the list wasn't empty, the loop has been woken up already)
+	if(was_empty)
+		wake_loop(lib);
+	return 0;
+}
+
+int usb_vhci_lib_port_stat(struct usb_vhci_lib *lib, __u8 index, __u16 status, __u16 change)
+{
+	struct usb_vhci_ioc_port_stat ps;
+	memset(&ps, 0, sizeof ps);
+	ps.status = status;
+	ps.change = change;
+	ps.index = index;
+	ps.controller = lib->controller;
+	return ioctl(lib->fd, USB_VHCI_HCD_IOCPORTSTATEX, &ps) == -1 ? -errno : 0;
+}
+
+int usb_vhci_lib_post_in(struct usb_vhci_lib *lib, __u8 address, __u8 endpoint, const void *data, __u32 length)
+{
+	struct usb_vhci_ioc_post_in pi;
+	memset(&pi, 0, sizeof pi);
+	pi.data = (void *)data;
+	pi.length = length;
+	pi.controller = lib->controller;
+	pi.address = address;
+	pi.endpoint = endpoint;
+	return ioctl(lib->fd, USB_VHCI_HCD_IOCPOSTIN, &pi) == -1 ? -errno : 0;
+}
+
+/*
+ * setup
+ */
+
+struct usb_vhci_lib *usb_vhci_lib_open(const struct usb_vhci_lib_config *cfg, const struct usb_vhci_lib_ops *ops, void *user)
+{
+	struct usb_vhci_ioc_register reg;
+	struct usb_vhci_ioc_busy_poll bp;
+	struct usb_vhci_lib *lib;
+	struct lib_worker *w;
+	unsigned int i;
+	int err;
+
+	if(!cfg || !ops || !ops->urb)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if(!(lib = calloc(1, sizeof *lib)))
+		return NULL;
+	lib->fd = lib->wake[0] = lib->wake[1] = -1;
+	lib->ops = ops;
+	lib->user = user;
+	lib->done_tail = &lib->done_head;
+	pthread_mutex_init(&lib->lock, NULL);
+
+	if(pipe2(lib->wake, O_NONBLOCK | O_CLOEXEC) == -1)
+		goto fail;
+	if((lib->fd = open(cfg->path ? cfg->path : "/dev/usb-vhci", O_RDWR | O_CLOEXEC)) == -1)
+		goto fail;
+	if(cfg->busy_poll)
+	{
+		memset(&bp, 0, sizeof bp);
+		bp.usecs = cfg->busy_poll;
+		if(ioctl(lib->fd, USB_VHCI_HCD_IOCBUSYPOLL, &bp) == -1)
+			goto fail;
+	}
+	memset(&reg, 0, sizeof reg);
+	reg.port_count = cfg->port_count;
+	reg.flags = cfg->flags;
+	if(ioctl(lib->fd, USB_VHCI_HCD_IOCREGISTEREX, &reg) == -1)
+		goto fail;
+	lib->controller = reg.controller;
+	lib->busnum = reg.usb_busnum;
+	memcpy(lib->bus_id, reg.bus_id, sizeof lib->bus_id);
+	lib->bus_id[sizeof lib->bus_id - 1] = '\0';
+
+	if(cfg->workers)
+	{
+		if(!(lib->workers = calloc(cfg->workers, sizeof *lib->workers)))
+			goto fail;
+		for(i = 0; i < cfg->workers; i++)
+		{
+			w = &lib->workers[i];
+			w->lib = lib;
+			w->tail = &w->head;
+			pthread_mutex_init(&w->lock, NULL);
+			pthread_cond_init(&w->cond, NULL);
+			if((err = pthread_create(&w->thread, NULL, worker_main, w)))
+			{
+				pthread_cond_destroy(&w->cond);
+				pthread_mutex_destroy(&w->lock);
+				errno = err;
+				goto fail;
+			}
+			lib->worker_count = i + 1;
+		}
+	}
+	return lib;
+
+fail:
+	err = errno;
+	usb_vhci_lib_close(lib);
+	errno = err;
+	return NULL;
+}
+
+void usb_vhci_lib_close(struct usb_vhci_lib *lib)
+{
+	struct lib_worker *w;
+	struct lib_urb *u;
+	unsigned int i;
+	void *p;
+
+	// the workers finish their queues first
+	for(i = 0; i < lib->worker_count; i++)
+	{
+		w = &lib->workers[i];
+		pthread_mutex_lock(&w->lock);
+		w->stop = 1;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+	}
+	free(lib->workers);
+
+	// this unregisters the controller, which completes all urbs the kernel still knows
+	if(lib->fd != -1)
+		close(lib->fd);
+	if(lib->wake[0] != -1)
+		close(lib->wake[0]);
+	if(lib->wake[1] != -1)
+		close(lib->wake[1]);
+
+	for(i = 0; i < LIB_HASH_SIZE; i++)
+		while((u = lib->hash[i]))
+		{
+			lib->hash[i] = u->hash_next;
+			urb_free(u);
+		}
+	while((u = lib->done_head))
+	{
+		lib->done_head = u->done_next;
+		urb_free(u);
+	}
+	while((u = lib->free_urbs))
+	{
+		lib->free_urbs = u->done_next;
+		urb_free(u);
+	}
+	for(i = 0; i < POOL_CLASSES; i++)
+		while((p = lib->free_bufs[i]))
+		{
+			lib->free_bufs[i] = *(void **)p;
+			free(p);
+		}
+	pthread_mutex_destroy(&lib->lock);
+	free(lib);
+}
+
+int usb_vhci_lib_fd(const struct usb_vhci_lib *lib)
+{
+	return lib->fd;
+}
+
+int usb_vhci_lib_busnum(const struct usb_vhci_lib *lib)
+{
+	return lib->busnum;
+}
+
+const char *usb_vhci_lib_bus_id(const struct usb_vhci_lib *lib)
+{
+	return lib->bus_id;
+}
@@ -0,0 +1,120 @@
+/*
+ * usb-vhci-lib.h -- user space library for serving controllers of
+ *                   usb-vhci-iocifc
+ *
+ * Copyright (C) 2010 Michael Singer <michael@a-singer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _USB_VHCI_LIB_H
+#define _USB_VHCI_LIB_H
+
+// The library registers one controller and runs the protocol of usb-vhci-iocifc for it: An event
+// loop (usb_vhci_lib_run) waits with poll, fetches the work in batches (FETCHWORKMULTI), fetches
+// the data of OUT urbs into pooled buffers and hands the urbs to a pool of worker threads. All urbs
+// of an endpoint go to the same worker, so they are seen in order. The device emulation completes
+// an urb with usb_vhci_lib_giveback (from any thread, also long after the callback returned); the
+// event loop collects the completions and gives them back in batches (GIVEBACKMULTI).
+//
+// build: make lib (in the vhci-hcd sourcedir); link with -lpthread
+
+#include <linux/types.h>
+#include "../usb-vhci.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct usb_vhci_lib;
+
+// an urb which the kernel handed to the library
+struct usb_vhci_lib_urb
+{
+	__u64 handle;                // identifies the urb (see usb_vhci_ioc_work.handle)
+	struct usb_vhci_ioc_urb urb; // description of the urb
+	int in;                      // nonzero for IN urbs (for control urbs this comes from the setup packet)
+
+	// urb.buffer_length bytes (NULL if zero): For OUT urbs it holds the data. IN urbs put their
+	// data here. (ISO: the packets are located by iso[i].offset.)
+	void *buffer;
+	struct usb_vhci_ioc_iso_packet_data *iso;            // urb.packet_count descriptors (ISO only)
+	struct usb_vhci_ioc_iso_packet_giveback *iso_result; // urb.packet_count results, to be filled by ISO urbs
+
+	void *user_data;             // free for the device emulation (NULL initially)
+};
+
+struct usb_vhci_lib_ops
+{
+	// The state of a port has changed (called in the thread of usb_vhci_lib_run).
+	void (*port_stat)(struct usb_vhci_lib *lib, const struct usb_vhci_ioc_port_stat *ps, void *user);
+
+	// A new urb has to be processed (called in the worker of its endpoint, or in the thread of
+	// usb_vhci_lib_run, if there are no workers). The urb belongs to the emulation until it calls
+	// usb_vhci_lib_giveback.
+	void (*urb)(struct usb_vhci_lib *lib, struct usb_vhci_lib_urb *urb, void *user);
+
+	// The urb was canceled by its owner (called like urb and after it). If the emulation still
+	// has the urb, it should give it back soon (the status doesn't matter). May be NULL, if every
+	// urb is given back quickly anyway.
+	void (*cancel)(struct usb_vhci_lib *lib, struct usb_vhci_lib_urb *urb, void *user);
+};
+
+struct usb_vhci_lib_config
+{
+	const char *path;        // device file (NULL: /dev/usb-vhci)
+	__u8 port_count;         // number of ports of the controller
+	__u8 flags;              // USB_VHCI_REGISTER_FLAG_*
+	unsigned int workers;    // number of worker threads (0: everything runs in the event loop)
+	unsigned int busy_poll;  // see USB_VHCI_HCD_IOCBUSYPOLL (0: off)
+};
+
+// Opens the device file and registers a controller. Returns NULL (and sets errno) on failure.
+struct usb_vhci_lib *usb_vhci_lib_open(const struct usb_vhci_lib_config *cfg, const struct usb_vhci_lib_ops *ops, void *user);
+
+// Stops the workers and unregisters the controller; the urbs which weren't given back yet are
+// completed by the kernel with -ESHUTDOWN.
+void usb_vhci_lib_close(struct usb_vhci_lib *lib);
+
+// Runs the event loop until usb_vhci_lib_stop is called (returns 0 then) or an error occurs
+// (returns a negative errno).
+int usb_vhci_lib_run(struct usb_vhci_lib *lib);
+
+// Makes usb_vhci_lib_run return (may be called from any thread or from a callback).
+void usb_vhci_lib_stop(struct usb_vhci_lib *lib);
+
+// Completes the urb. For IN urbs, actual bytes of urb->buffer are the data; for ISO urbs status
+// and actual are ignored and urb->iso_result is used. The urb must not be touched afterwards.
+// Returns -EALREADY if the urb was given back already. (May be called from any thread.)
+int usb_vhci_lib_giveback(struct usb_vhci_lib *lib, struct usb_vhci_lib_urb *urb, int status, int actual);
+
+// Reports a changed port to the kernel (see USB_VHCI_HCD_IOCPORTSTATEX). Returns 0 or a negative
+// errno.
+int usb_vhci_lib_port_stat(struct usb_vhci_lib *lib, __u8 index, __u16 status, __u16 change);
+
+// Posts data for a bulk IN endpoint ahead of its urbs (see USB_VHCI_HCD_IOCPOSTIN); the urbs
+// which are answered with it never reach the callbacks. Returns 0 or a negative errno.
+int usb_vhci_lib_post_in(struct usb_vhci_lib *lib, __u8 address, __u8 endpoint, const void *data, __u32 length);
+
+// information from the registration
+int usb_vhci_lib_fd(const struct usb_vhci_lib *lib);
+int usb_vhci_lib_busnum(const struct usb_vhci_lib *lib);
+const char *usb_vhci_lib_bus_id(const struct usb_vhci_lib *lib);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -32,6 +32,16 @@
 #include <linux/usb.h>
 #include <linux/fs.h>
 #include <linux/device.h>
+#include <linux/scatterlist.h>
+#ifdef TEST_RUNTIME_AUTOSUSPEND
+#	include <linux/pm_runtime.h>
+#endif
+#ifdef TEST_TRACE_EVENTS
+#	include <linux/tracepoint.h>
+#	if !defined(DECLARE_EVENT_CLASS) || !defined(EXPORT_TRACEPOINT_SYMBOL_GPL)
+#		error "trace events are not available"
+#	endif
+#endif
 #ifdef KBUILD_EXTMOD
 #	include "../usb-vhci.h"
 #else
@@ -68,6 +78,12 @@ static struct usb_hcd testhcd = {
 };
 #endif
 
+#ifdef TEST_SHARED_HCD
+static struct hc_driver testdrv = {
+	.flags = HCD_USB3 | HCD_SHARED
+};
+#endif
+
 static int __init init(void)
 {
 	if(usb_disabled()) return -ENODEV;
@@ -81,6 +97,23 @@ static int __init init(void)
 	dev_set_name((struct device *)NULL, foo);
 #endif
 
+#ifdef TEST_SHARED_HCD
+	struct usb_hcd *shared = usb_create_shared_hcd(&testdrv, (struct device *)NULL, "test", (struct usb_hcd *)NULL);
+	if(usb_hcd_is_primary_hcd(shared)) return -ENODEV;
+#endif
+
+#ifdef TEST_URB_SG
+	struct urb *urb = (struct urb *)NULL;
+	struct sg_mapping_iter miter;
+	sg_miter_start(&miter, urb->sg, urb->num_sgs, SG_MITER_FROM_SG);
+	((struct usb_hcd *)NULL)->self.sg_tablesize = ~0;
+#endif
+
+#ifdef TEST_RUNTIME_AUTOSUSPEND
+	pm_runtime_set_autosuspend_delay(&((struct usb_device *)NULL)->dev, 0);
+	usb_enable_autosuspend((struct usb_device *)NULL);
+#endif
+
 	return 0;
 }
 module_init(init);
@@ -0,0 +1,800 @@
+/*
+ * vhci-bench.c -- throughput and latency benchmark for vhci-hcd
+ *
+ * Copyright (C) 2010 Michael Singer <michael@a-singer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// This is a user space program. It registers a controller with one port at usb-vhci-iocifc and
+// emulates a high speed device behind it (the device thread). The main thread opens that device
+// through usbfs and floods its endpoints with urbs, while it measures how fast they come back.
+// Both sides run in the same process, so both are measured together; for comparing versions or
+// protocol variants this is what matters.
+//
+// Endpoints of the emulated device (interface 0):
+//   ep 0       control: vendor request 0x01 (IN) returns wLength bytes, 0x02 (OUT) swallows them
+//   ep 0x01    bulk OUT sink
+//   ep 0x81    bulk IN source
+//   ep 0x02    bulk OUT, loopback: the data comes back through ep 0x82
+//   ep 0x82    bulk IN, loopback
+//   ep 0x83    interrupt IN source (64 bytes per packet, every microframe)
+//   ep 0x84    isochronous IN source (1024 bytes per packet, every microframe)
+//
+// build: make bench (in the vhci-hcd sourcedir); needs root for /dev/usb-vhci and usbfs
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/usb/ch9.h>
+
+#include "../usb-vhci.h"
+
+#define VENDOR_ID  0xffff
+#define PRODUCT_ID 0x0b00
+
+#define EP_SINK      0x01
+#define EP_SOURCE    0x81
+#define EP_LOOP_OUT  0x02
+#define EP_LOOP_IN   0x82
+#define EP_INT       0x83
+#define EP_ISO       0x84
+
+#define REQ_VENDOR_IN  0x01
+#define REQ_VENDOR_OUT 0x02
+
+#define INT_PACKET_SIZE 64
+#define ISO_PACKET_SIZE 1024
+
+#define MAX_BUFFER     (1024 * 1024)
+#define MAX_ISO_PACKETS 1024
+#define LOOP_FIFO_SIZE (4 * 1024 * 1024)
+
+static const char *vhci_path = "/dev/usb-vhci";
+static int vhci_fd = -1;
+static volatile int stop_device;
+
+// written by the device thread, read by the main thread
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+static int dev_address;
+static int dev_configured;
+static int busnum;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static inline double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * device side
+ */
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength            = USB_DT_DEVICE_SIZE,
+	.bDescriptorType    = USB_DT_DEVICE,
+	.bcdUSB             = 0x0200,
+	.bDeviceClass       = USB_CLASS_VENDOR_SPEC,
+	.bDeviceSubClass    = 0,
+	.bDeviceProtocol    = 0,
+	.bMaxPacketSize0    = 64,
+	.idVendor           = VENDOR_ID,
+	.idProduct          = PRODUCT_ID,
+	.bcdDevice          = 0x0100,
+	.iManufacturer      = 0,
+	.iProduct           = 0,
+	.iSerialNumber      = 0,
+	.bNumConfigurations = 1
+};
+
+#define CONF_DESC_SIZE (USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE + 6 * USB_DT_ENDPOINT_SIZE)
+
+static unsigned char conf_desc[CONF_DESC_SIZE];
+
+static void put_endpoint(unsigned char *p, unsigned char addr, unsigned char attr, unsigned int maxp, unsigned char interval)
+{
+	p[0] = USB_DT_ENDPOINT_SIZE;
+	p[1] = USB_DT_ENDPOINT;
+	p[2] = addr;
+	p[3] = attr;
+	p[4] = maxp & 0xff;
+	p[5] = maxp >> 8;
+	p[6] = interval;
+}
+
+static void build_conf_desc(void)
+{
+	unsigned char *p = conf_desc;
+	p[0] = USB_DT_CONFIG_SIZE;
+	p[1] = USB_DT_CONFIG;
+	p[2] = CONF_DESC_SIZE & 0xff;
+	p[3] = CONF_DESC_SIZE >> 8;
+	p[4] = 1;    // bNumInterfaces
+	p[5] = 1;    // bConfigurationValue
+	p[6] = 0;    // iConfiguration
+	p[7] = 0x80; // bmAttributes
+	p[8] = 50;   // bMaxPower (100 mA)
+	p += USB_DT_CONFIG_SIZE;
+	p[0] = USB_DT_INTERFACE_SIZE;
+	p[1] = USB_DT_INTERFACE;
+	p[2] = 0;    // bInterfaceNumber
+	p[3] = 0;    // bAlternateSetting
+	p[4] = 6;    // bNumEndpoints
+	p[5] = USB_CLASS_VENDOR_SPEC;
+	p[6] = 0;
+	p[7] = 0;
+	p[8] = 0;
+	p += USB_DT_INTERFACE_SIZE;
+	put_endpoint(p, EP_SINK,     USB_ENDPOINT_XFER_BULK, 512, 0); p += USB_DT_ENDPOINT_SIZE;
+	put_endpoint(p, EP_SOURCE,   USB_ENDPOINT_XFER_BULK, 512, 0); p += USB_DT_ENDPOINT_SIZE;
+	put_endpoint(p, EP_LOOP_OUT, USB_ENDPOINT_XFER_BULK, 512, 0); p += USB_DT_ENDPOINT_SIZE;
+	put_endpoint(p, EP_LOOP_IN,  USB_ENDPOINT_XFER_BULK, 512, 0); p += USB_DT_ENDPOINT_SIZE;
+	put_endpoint(p, EP_INT,      USB_ENDPOINT_XFER_INT, INT_PACKET_SIZE, 1); p += USB_DT_ENDPOINT_SIZE;
+	put_endpoint(p, EP_ISO,      USB_ENDPOINT_XFER_ISOC, ISO_PACKET_SIZE, 1);
+}
+
+static unsigned char *work_buf;   // receives the data of OUT urbs
+static unsigned char *source_buf; // data of IN urbs
+static struct usb_vhci_ioc_iso_packet_data iso_desc[MAX_ISO_PACKETS];
+static struct usb_vhci_ioc_iso_packet_giveback iso_result[MAX_ISO_PACKETS];
+
+static int giveback(__u64 handle, void *buf, int actual, int status)
+{
+	struct usb_vhci_ioc_giveback gb;
+	memset(&gb, 0, sizeof gb);
+	gb.handle = handle;
+	gb.buffer = buf;
+	gb.status = status;
+	gb.buffer_actual = actual;
+	if(ioctl(vhci_fd, USB_VHCI_HCD_IOCGIVEBACK, &gb) == -1 && errno != ECANCELED && errno != ENOENT)
+		return -1;
+	return 0;
+}
+
+// IN urbs of the loopback endpoint wait here for data; OUT urbs wait for room in the fifo
+struct pending
+{
+	struct pending *next;
+	__u64 handle;
+	int length;
+	unsigned char *data; // OUT only
+};
+
+static struct pending *loop_in_head, **loop_in_tail = &loop_in_head;
+static struct pending *loop_out_head, **loop_out_tail = &loop_out_head;
+static unsigned char *loop_fifo;
+static size_t loop_fifo_head, loop_fifo_fill;
+
+static void fifo_put(const unsigned char *data, size_t len)
+{
+	size_t pos = (loop_fifo_head + loop_fifo_fill) % LOOP_FIFO_SIZE, n;
+	while(len)
+	{
+		n = LOOP_FIFO_SIZE - pos < len ? LOOP_FIFO_SIZE - pos : len;
+		memcpy(loop_fifo + pos, data, n);
+		data += n;
+		len -= n;
+		loop_fifo_fill += n;
+		pos = 0;
+	}
+}
+
+static void fifo_get(unsigned char *data, size_t len)
+{
+	size_t n;
+	while(len)
+	{
+		n = LOOP_FIFO_SIZE - loop_fifo_head < len ? LOOP_FIFO_SIZE - loop_fifo_head : len;
+		memcpy(data, loop_fifo + loop_fifo_head, n);
+		data += n;
+		len -= n;
+		loop_fifo_fill -= n;
+		loop_fifo_head = (loop_fifo_head + n) % LOOP_FIFO_SIZE;
+	}
+}
+
+// moves data from waiting OUT urbs into the fifo and from the fifo into waiting IN urbs
+static void loop_service(void)
+{
+	struct pending *p;
+	int n;
+	for(;;)
+	{
+		if(loop_in_head && loop_fifo_fill)
+		{
+			p = loop_in_head;
+			if(!(loop_in_head = p->next))
+				loop_in_tail = &loop_in_head;
+			n = (size_t)p->length < loop_fifo_fill ? p->length : (int)loop_fifo_fill;
+			fifo_get(work_buf, n);
+			giveback(p->handle, work_buf, n, 0);
+			free(p);
+		}
+		else if(loop_out_head && LOOP_FIFO_SIZE - loop_fifo_fill >= (size_t)loop_out_head->length)
+		{
+			p = loop_out_head;
+			if(!(loop_out_head = p->next))
+				loop_out_tail = &loop_out_head;
+			fifo_put(p->data, p->length);
+			giveback(p->handle, NULL, p->length, 0);
+			free(p->data);
+			free(p);
+		}
+		else
+			break;
+	}
+}
+
+static void loop_queue(__u64 handle, int length, const unsigned char *data)
+{
+	struct pending *p = calloc(1, sizeof *p);
+	if(!p) die("calloc");
+	p->handle = handle;
+	p->length = length;
+	if(data)
+	{
+		if(!(p->data = malloc(length ? length : 1))) die("malloc");
+		memcpy(p->data, data, length);
+		*loop_out_tail = p;
+		loop_out_tail = &p->next;
+	}
+	else
+	{
+		*loop_in_tail = p;
+		loop_in_tail = &p->next;
+	}
+	loop_service();
+}
+
+// returns non-zero, if the urb was waiting in one of the loopback queues
+static int loop_cancel(__u64 handle)
+{
+	struct pending **pp, *p;
+	for(pp = &loop_in_head; (p = *pp); pp = &p->next)
+		if(p->handle == handle)
+		{
+			if(!(*pp = p->next))
+				loop_in_tail = pp;
+			free(p);
+			return 1;
+		}
+	for(pp = &loop_out_head; (p = *pp); pp = &p->next)
+		if(p->handle == handle)
+		{
+			if(!(*pp = p->next))
+				loop_out_tail = pp;
+			free(p->data);
+			free(p);
+			return 1;
+		}
+	return 0;
+}
+
+static void port_stat(__u16 status, __u16 change)
+{
+	struct usb_vhci_ioc_port_stat ps;
+	memset(&ps, 0, sizeof ps);
+	ps.status = status;
+	ps.change = change;
+	ps.index = 1;
+	if(ioctl(vhci_fd, USB_VHCI_HCD_IOCPORTSTAT, &ps) == -1)
+		perror("USB_VHCI_HCD_IOCPORTSTAT");
+}
+
+static void handle_port(const struct usb_vhci_ioc_port_stat *ps)
+{
+	static int connected;
+	if(!(ps->status & USB_PORT_STAT_POWER))
+	{
+		connected = 0;
+		return;
+	}
+	if(!connected)
+	{
+		connected = 1;
+		port_stat(USB_PORT_STAT_CONNECTION | USB_PORT_STAT_HIGH_SPEED, USB_PORT_STAT_C_CONNECTION);
+	}
+	else if(ps->status & USB_PORT_STAT_RESET)
+	{
+		pthread_mutex_lock(&state_lock);
+		dev_address = 0;
+		dev_configured = 0;
+		pthread_mutex_unlock(&state_lock);
+		port_stat(USB_PORT_STAT_ENABLE, USB_PORT_STAT_C_RESET);
+	}
+	else if(ps->flags & USB_VHCI_PORT_STAT_FLAG_RESUMING)
+		port_stat(0, USB_PORT_STAT_C_SUSPEND);
+}
+
+static void handle_control(__u64 handle, const struct usb_vhci_ioc_urb *urb)
+{
+	const struct usb_vhci_ioc_setup_packet *sp = &urb->setup_packet;
+	int len = sp->wLength;
+
+	if((sp->bmRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR)
+	{
+		if(sp->bRequest == REQ_VENDOR_IN && (sp->bmRequestType & USB_DIR_IN))
+			giveback(handle, source_buf, len, 0);
+		else if(sp->bRequest == REQ_VENDOR_OUT && !(sp->bmRequestType & USB_DIR_IN))
+			giveback(handle, NULL, len, 0);
+		else
+			giveback(handle, NULL, 0, -EPIPE);
+		return;
+	}
+	if((sp->bmRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
+	{
+		giveback(handle, NULL, 0, -EPIPE);
+		return;
+	}
+
+	switch(sp->bRequest)
+	{
+	case USB_REQ_GET_DESCRIPTOR:
+		switch(sp->wValue >> 8)
+		{
+		case USB_DT_DEVICE:
+			giveback(handle, (void *)&dev_desc, len < USB_DT_DEVICE_SIZE ? len : USB_DT_DEVICE_SIZE, 0);
+			return;
+		case USB_DT_CONFIG:
+			giveback(handle, conf_desc, len < CONF_DESC_SIZE ? len : CONF_DESC_SIZE, 0);
+			return;
+		}
+		break;
+	case USB_REQ_SET_ADDRESS:
+		pthread_mutex_lock(&state_lock);
+		dev_address = sp->wValue;
+		pthread_mutex_unlock(&state_lock);
+		giveback(handle, NULL, 0, 0);
+		return;
+	case USB_REQ_SET_CONFIGURATION:
+		giveback(handle, NULL, 0, 0);
+		pthread_mutex_lock(&state_lock);
+		dev_configured = sp->wValue == 1;
+		pthread_cond_broadcast(&state_cond);
+		pthread_mutex_unlock(&state_lock);
+		return;
+	case USB_REQ_GET_CONFIGURATION:
+		source_buf[0] = dev_configured;
+		giveback(handle, source_buf, len < 1 ? len : 1, 0);
+		source_buf[0] = 0;
+		return;
+	case USB_REQ_GET_STATUS:
+		giveback(handle, source_buf, len < 2 ? len : 2, 0);
+		return;
+	case USB_REQ_SET_INTERFACE:
+	case USB_REQ_CLEAR_FEATURE:
+	case USB_REQ_SET_FEATURE:
+		giveback(handle, NULL, 0, 0);
+		return;
+	}
+	// everything else (e.g. the device qualifier descriptor) isn't supported
+	giveback(handle, NULL, 0, -EPIPE);
+}
+
+static void handle_iso(__u64 handle, const struct usb_vhci_ioc_urb *urb)
+{
+	struct usb_vhci_ioc_giveback gb;
+	int i;
+	for(i = 0; i < urb->packet_count; i++)
+	{
+		iso_result[i].packet_actual = iso_desc[i].packet_length;
+		iso_result[i].status = 0;
+	}
+	memset(&gb, 0, sizeof gb);
+	gb.handle = handle;
+	gb.buffer = source_buf;
+	gb.iso_packets = iso_result;
+	gb.buffer_actual = urb->buffer_length;
+	gb.packet_count = urb->packet_count;
+	if(ioctl(vhci_fd, USB_VHCI_HCD_IOCGIVEBACK, &gb) == -1 && errno != ECANCELED && errno != ENOENT)
+		perror("USB_VHCI_HCD_IOCGIVEBACK(ISO)");
+}
+
+static void handle_urb(__u64 handle, const struct usb_vhci_ioc_urb *urb, int inline_data)
+{
+	const int in = urb->type == USB_VHCI_URB_TYPE_CONTROL ? urb->setup_packet.bmRequestType & 0x80 : urb->endpoint & 0x80;
+
+	if(!inline_data && ((!in && urb->buffer_length) || urb->type == USB_VHCI_URB_TYPE_ISO))
+	{
+		// the data didn't fit into the work buffers (or the urb was canceled meanwhile)
+		struct usb_vhci_ioc_urb_data ud;
+		memset(&ud, 0, sizeof ud);
+		ud.handle = handle;
+		ud.buffer = work_buf;
+		ud.buffer_length = MAX_BUFFER;
+		ud.iso_packets = iso_desc;
+		ud.packet_count = urb->packet_count;
+		if(ioctl(vhci_fd, USB_VHCI_HCD_IOCFETCHDATA, &ud) == -1 && errno != ENODATA)
+		{
+			if(errno != ECANCELED)
+				giveback(handle, NULL, 0, -EPIPE);
+			return;
+		}
+	}
+
+	if(urb->type == USB_VHCI_URB_TYPE_CONTROL)
+		handle_control(handle, urb);
+	else if(urb->type == USB_VHCI_URB_TYPE_ISO)
+		handle_iso(handle, urb);
+	else if(urb->endpoint == EP_LOOP_OUT)
+		loop_queue(handle, urb->buffer_length, work_buf);
+	else if(urb->endpoint == EP_LOOP_IN)
+		loop_queue(handle, urb->buffer_length, NULL);
+	else if(in)
+		giveback(handle, source_buf, urb->buffer_length, 0);
+	else
+		giveback(handle, NULL, urb->buffer_length, 0);
+}
+
+static void *device_thread(void *arg)
+{
+	struct usb_vhci_ioc_work_data wd;
+
+	while(!stop_device)
+	{
+		memset(&wd, 0, sizeof wd);
+		wd.work.timeout = 100;
+		wd.buffer = work_buf;
+		wd.buffer_length = MAX_BUFFER;
+		wd.iso_packets = iso_desc;
+		wd.packet_count = MAX_ISO_PACKETS;
+		if(ioctl(vhci_fd, USB_VHCI_HCD_IOCFETCHWORKDATA, &wd) == -1)
+		{
+			if(errno == ETIMEDOUT || errno == ENODATA || errno == EINTR)
+				continue;
+			perror("USB_VHCI_HCD_IOCFETCHWORKDATA");
+			break;
+		}
+		switch(wd.work.type)
+		{
+		case USB_VHCI_WORK_TYPE_PORT_STAT:
+			handle_port(&wd.work.work.port);
+			break;
+		case USB_VHCI_WORK_TYPE_PROCESS_URB:
+			handle_urb(wd.work.handle, &wd.work.work.urb, wd.flags & USB_VHCI_WORK_DATA_FLAG_INLINE);
+			break;
+		case USB_VHCI_WORK_TYPE_CANCEL_URB:
+			// only urbs of the loopback endpoint are kept; all others are given back already
+			if(loop_cancel(wd.work.handle))
+				giveback(wd.work.handle, NULL, 0, -ECONNRESET);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * host side
+ */
+
+struct test
+{
+	const char *name;
+	unsigned char type;     // USBDEVFS_URB_TYPE_*
+	unsigned char endpoint;
+	int size;               // bytes per urb
+	int depth;              // urbs in flight
+	int count;              // urbs to complete in total
+};
+
+static struct test tests[] = {
+	{ "control",   USBDEVFS_URB_TYPE_CONTROL, 0,          64,    1,  20000 },
+	{ "bulk-out",  USBDEVFS_URB_TYPE_BULK,    EP_SINK,    16384, 8,  20000 },
+	{ "bulk-in",   USBDEVFS_URB_TYPE_BULK,    EP_SOURCE,  16384, 8,  20000 },
+	{ "bulk-loop", USBDEVFS_URB_TYPE_BULK,    EP_LOOP_IN, 16384, 8,  10000 },
+	{ "int-in",    USBDEVFS_URB_TYPE_INTERRUPT, EP_INT,   INT_PACKET_SIZE, 4, 20000 },
+	{ "iso-in",    USBDEVFS_URB_TYPE_ISO,     EP_ISO,     8 * ISO_PACKET_SIZE, 8, 2000 }
+};
+#define TEST_COUNT (sizeof tests / sizeof tests[0])
+
+struct slot
+{
+	struct usbdevfs_urb *urb;
+	double submitted;
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+	const double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static struct usbdevfs_urb *alloc_urb(const struct test *t, unsigned char endpoint)
+{
+	const int packets = t->type == USBDEVFS_URB_TYPE_ISO ? t->size / ISO_PACKET_SIZE : 0;
+	const int setup = t->type == USBDEVFS_URB_TYPE_CONTROL ? 8 : 0;
+	struct usbdevfs_urb *urb;
+	int i;
+
+	urb = calloc(1, sizeof *urb + packets * sizeof(struct usbdevfs_iso_packet_desc));
+	if(!urb || !(urb->buffer = calloc(1, setup + t->size))) die("calloc");
+	urb->type = t->type;
+	urb->endpoint = endpoint;
+	urb->buffer_length = setup + t->size;
+	if(setup)
+	{
+		struct usb_ctrlrequest *cmd = urb->buffer;
+		cmd->bRequestType = USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE;
+		cmd->bRequest = REQ_VENDOR_IN;
+		cmd->wLength = t->size; // (little endian hosts only)
+	}
+	if(packets)
+	{
+		urb->flags = USBDEVFS_URB_ISO_ASAP;
+		urb->number_of_packets = packets;
+		for(i = 0; i < packets; i++)
+			urb->iso_frame_desc[i].length = ISO_PACKET_SIZE;
+	}
+	return urb;
+}
+
+static void submit(int fd, struct slot *s)
+{
+	s->submitted = now_us();
+	if(ioctl(fd, USBDEVFS_SUBMITURB, s->urb) == -1) die("USBDEVFS_SUBMITURB");
+}
+
+// The loopback test keeps an OUT urb in flight for every IN urb; only the IN urbs are measured,
+// so the latency covers the whole round trip.
+static void run_test(int fd, const struct test *t)
+{
+	const int loop = t->endpoint == EP_LOOP_IN;
+	struct slot *slots, *out_slots = NULL, *s;
+	struct usbdevfs_urb *urb;
+	double *lat, start, elapsed;
+	int i, submitted, done = 0, errors = 0, out_inflight = 0;
+	long long bytes = 0;
+
+	slots = calloc(t->depth, sizeof *slots);
+	lat = calloc(t->count, sizeof *lat);
+	if(!slots || !lat) die("calloc");
+	if(loop && !(out_slots = calloc(t->depth, sizeof *out_slots))) die("calloc");
+
+	for(i = 0; i < t->depth; i++)
+	{
+		slots[i].urb = alloc_urb(t, t->endpoint);
+		slots[i].urb->usercontext = &slots[i];
+		if(loop)
+		{
+			out_slots[i].urb = alloc_urb(t, EP_LOOP_OUT);
+			out_slots[i].urb->usercontext = &out_slots[i];
+		}
+	}
+
+	start = now_us();
+	for(submitted = 0; submitted < t->depth && submitted < t->count; submitted++)
+	{
+		if(loop)
+		{
+			submit(fd, &out_slots[submitted]);
+			out_inflight++;
+		}
+		submit(fd, &slots[submitted]);
+	}
+
+	while(done < t->count)
+	{
+		if(ioctl(fd, USBDEVFS_REAPURB, &urb) == -1)
+		{
+			if(errno == EINTR) continue;
+			die("USBDEVFS_REAPURB");
+		}
+		s = urb->usercontext;
+		if(loop && s >= out_slots && s < out_slots + t->depth)
+		{
+			// the OUT half of a loopback pair; it is resubmitted together with its IN half (the
+			// device gives it back before the IN half gets its data, so it is reaped already then)
+			out_inflight--;
+			if(urb->status) errors++;
+			continue;
+		}
+		lat[done++] = now_us() - s->submitted;
+		if(urb->status) errors++;
+		bytes += urb->actual_length;
+		if(t->type == USBDEVFS_URB_TYPE_ISO)
+			for(i = 0, bytes -= urb->actual_length; i < urb->number_of_packets; i++)
+				bytes += urb->iso_frame_desc[i].actual_length;
+		if(submitted < t->count)
+		{
+			if(loop)
+			{
+				submit(fd, &out_slots[s - slots]);
+				out_inflight++;
+			}
+			submit(fd, s);
+			submitted++;
+		}
+	}
+	// reap the OUT halves which are still outstanding
+	while(out_inflight)
+	{
+		if(ioctl(fd, USBDEVFS_REAPURB, &urb) == -1)
+		{
+			if(errno == EINTR) continue;
+			die("USBDEVFS_REAPURB");
+		}
+		out_inflight--;
+	}
+	elapsed = now_us() - start;
+
+	qsort(lat, t->count, sizeof *lat, cmp_double);
+	printf("%-10s %7d %5d %7d %10.0f %9.2f %8.1f %8.1f %8.1f %8.1f %7d\n",
+		t->name, t->size, t->depth, t->count,
+		t->count / (elapsed / 1e6), bytes / elapsed,
+		lat[t->count / 2], lat[t->count * 9 / 10], lat[t->count * 99 / 100], lat[t->count - 1],
+		errors);
+
+	for(i = 0; i < t->depth; i++)
+	{
+		free(slots[i].urb->buffer);
+		free(slots[i].urb);
+		if(loop)
+		{
+			free(out_slots[i].urb->buffer);
+			free(out_slots[i].urb);
+		}
+	}
+	free(out_slots);
+	free(slots);
+	free(lat);
+}
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+	fprintf(stderr, "usage: %s [-f vhci-device | -u usbfs-device] [-s size] [-d depth] [-n count] [-p usecs] [test ...]\n", prog);
+	fprintf(stderr, "tests:");
+	for(i = 0; i < TEST_COUNT; i++)
+		fprintf(stderr, " %s", tests[i].name);
+	fprintf(stderr, " (default: all)\n"
+		"-s, -d and -n override the defaults of the selected tests; the sizes of int-in\n"
+		"and iso-in are fixed (and control takes at most 65535 bytes).\n"
+		"-u benchmarks an existing device (like the one of usb-vhci-loopback, e.g.\n"
+		"/dev/bus/usb/003/002) instead of emulating one.\n"
+		"-p lets the emulated device busy-poll for work for up to usecs microseconds.\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct usb_vhci_ioc_register reg;
+	pthread_t thread;
+	char path[64];
+	const char *usb_path = NULL;
+	struct usb_vhci_ioc_busy_poll bp;
+	int opt, size = 0, depth = 0, count = 0, usb_fd = -1, any, iface = 0, busy_poll = 0;
+	unsigned int i, j;
+	unsigned char selected[TEST_COUNT];
+	double deadline;
+
+	while((opt = getopt(argc, argv, "f:s:d:n:u:p:h")) != -1)
+	{
+		switch(opt)
+		{
+		case 'f': vhci_path = optarg; break;
+		case 's': size = atoi(optarg); break;
+		case 'd': depth = atoi(optarg); break;
+		case 'n': count = atoi(optarg); break;
+		case 'u': usb_path = optarg; break;
+		case 'p': busy_poll = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(size < 0 || size > MAX_BUFFER - 8 || depth < 0 || count < 0 || busy_poll < 0 || busy_poll > USB_VHCI_BUSY_POLL_MAX)
+		usage(argv[0]);
+	memset(selected, optind == argc, sizeof selected);
+	for(; optind < argc; optind++)
+	{
+		for(i = 0; i < TEST_COUNT && strcmp(argv[optind], tests[i].name); i++)
+			;
+		if(i == TEST_COUNT) usage(argv[0]);
+		selected[i] = 1;
+	}
+	for(i = 0; i < TEST_COUNT; i++)
+	{
+		if(size && tests[i].type != USBDEVFS_URB_TYPE_ISO && tests[i].type != USBDEVFS_URB_TYPE_INTERRUPT &&
+		   (tests[i].type != USBDEVFS_URB_TYPE_CONTROL || size <= 0xffff))
+			tests[i].size = size;
+		if(depth) tests[i].depth = depth;
+		if(count) tests[i].count = count;
+	}
+
+	if(usb_path)
+	{
+		// the device is serviced elsewhere
+		if((usb_fd = open(usb_path, O_RDWR)) == -1) die(usb_path);
+		goto claim;
+	}
+
+	build_conf_desc();
+	work_buf = malloc(MAX_BUFFER);
+	source_buf = calloc(1, MAX_BUFFER);
+	loop_fifo = malloc(LOOP_FIFO_SIZE);
+	if(!work_buf || !source_buf || !loop_fifo) die("malloc");
+	for(j = 0; j < MAX_BUFFER; j++)
+		source_buf[j] = (unsigned char)j;
+	source_buf[0] = source_buf[1] = 0; // (GET_STATUS reads the first two bytes)
+
+	if((vhci_fd = open(vhci_path, O_RDWR)) == -1) die(vhci_path);
+	if(busy_poll)
+	{
+		memset(&bp, 0, sizeof bp);
+		bp.usecs = busy_poll;
+		if(ioctl(vhci_fd, USB_VHCI_HCD_IOCBUSYPOLL, &bp) == -1) die("USB_VHCI_HCD_IOCBUSYPOLL");
+	}
+	memset(&reg, 0, sizeof reg);
+	reg.port_count = 1;
+	if(ioctl(vhci_fd, USB_VHCI_HCD_IOCREGISTER, &reg) == -1) die("USB_VHCI_HCD_IOCREGISTER");
+	busnum = reg.usb_busnum;
+	fprintf(stderr, "registered %s (usb bus %d)\n", reg.bus_id, busnum);
+
+	if(pthread_create(&thread, NULL, device_thread, NULL)) die("pthread_create");
+
+	// wait until the usb core has configured the device, then open it through usbfs
+	deadline = now_us() + 10e6;
+	pthread_mutex_lock(&state_lock);
+	while(!dev_configured && now_us() < deadline)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if(ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+		pthread_cond_timedwait(&state_cond, &state_lock, &ts);
+	}
+	any = dev_configured;
+	snprintf(path, sizeof path, "/dev/bus/usb/%03d/%03d", busnum, dev_address);
+	pthread_mutex_unlock(&state_lock);
+	if(!any)
+	{
+		fprintf(stderr, "the emulated device wasn't configured in time\n");
+		return 1;
+	}
+	while((usb_fd = open(path, O_RDWR)) == -1 && now_us() < deadline)
+		usleep(10000);
+	if(usb_fd == -1) die(path);
+claim:
+	if(ioctl(usb_fd, USBDEVFS_CLAIMINTERFACE, &iface) == -1) die("USBDEVFS_CLAIMINTERFACE");
+
+	printf("%-10s %7s %5s %7s %10s %9s %8s %8s %8s %8s %7s\n",
+		"test", "size", "depth", "count", "ops/s", "MB/s", "p50[us]", "p90[us]", "p99[us]", "max[us]", "errors");
+	for(i = 0; i < TEST_COUNT; i++)
+		if(selected[i])
+			run_test(usb_fd, &tests[i]);
+
+	close(usb_fd);
+	if(!usb_path)
+	{
+		stop_device = 1;
+		pthread_join(thread, NULL);
+		close(vhci_fd);
+	}
+	return 0;
+}
@@ -129,7 +129,7 @@ static void dump_urb(struct urb *urb)
 			}
 		}
 	}
-	else if(debug_output >= 2)
+	else if(debug_output >= 2 && urb->transfer_buffer) // (scatter-gather lists aren't dumped)
 	{
 		vhci_printk(KERN_DEBUG, "data stage (%d/%d bytes %s):\n", urb->actual_length, max, in ? "received" : "transmitted");
 		vhci_printk(KERN_DEBUG, "");
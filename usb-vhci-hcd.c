@@ -22,27 +22,50 @@
 #define DEBUG
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/kernel.h>
 #include <linux/delay.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/idr.h>
 #include <linux/errno.h>
+#include <linux/err.h>
 #include <linux/init.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/wait.h>
 #include <linux/list.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
 #include <linux/platform_device.h>
 #include <linux/usb.h>
 #include <linux/fs.h>
 #include <linux/device.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#ifndef NO_RUNTIME_AUTOSUSPEND
+#	include <linux/pm_runtime.h>
+#endif
 
 #include <asm/atomic.h>
 #include <asm/bitops.h>
 #include <asm/uaccess.h>
+#include <asm/div64.h>
 
 #include "usb-vhci-hcd.h"
 
+#define CREATE_TRACE_POINTS
+#include "usb-vhci-trace.h"
+
+#ifndef NO_TRACE_EVENTS
+// these two are hit in usb-vhci-iocifc only
+EXPORT_TRACEPOINT_SYMBOL_GPL(usb_vhci_urb_fetch_data);
+EXPORT_TRACEPOINT_SYMBOL_GPL(usb_vhci_urb_deposit_data);
+#endif
+
 #define DRIVER_NAME "usb_vhci_hcd"
 #define DRIVER_DESC "USB Virtual Host Controller Interface"
 #define DRIVER_VERSION USB_VHCI_HCD_VERSION " (" USB_VHCI_HCD_DATE ")"
@@ -83,6 +106,46 @@ MODULE_DESCRIPTION(DRIVER_DESC " driver");
 MODULE_AUTHOR("Michael Singer <michael@a-singer.de>");
 MODULE_LICENSE("GPL");
 
+static unsigned int urbp_pool_size = 64;
+module_param(urbp_pool_size, uint, S_IRUGO);
+MODULE_PARM_DESC(urbp_pool_size, "Number of preallocated urb descriptors per controller (default: 64)");
+
+// weights of the transfer types for usb_vhci_inbox_pop (indexed by usb_pipetype); they are only
+// set at load time (and clamped to 1..USB_VHCI_SCHED_WEIGHT_MAX by init), so that the credits of
+// a round can't overflow
+#define USB_VHCI_SCHED_WEIGHT_MAX 1024
+static unsigned int sched_weights[USB_VHCI_PIPE_TYPES] = {
+	[PIPE_ISOCHRONOUS] = 8,
+	[PIPE_INTERRUPT]   = 8,
+	[PIPE_CONTROL]     = 4,
+	[PIPE_BULK]        = 1
+};
+module_param_array(sched_weights, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(sched_weights, "Number of urbs of each transfer type (iso, int, control, bulk) which are handed to user space per scheduling round, while there are urbs of other types waiting (default: 8,8,4,1, max: 1024)");
+
+static unsigned int queue_high = 0;
+module_param(queue_high, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_high, "Default number of urbs in flight per controller at which new urbs are rejected (default: 0, no limit)");
+
+static unsigned int queue_low = 0;
+module_param(queue_low, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_low, "Default number of urbs in flight per controller at which a throttled controller accepts urbs again (default: 0)");
+
+#ifndef NO_RUNTIME_AUTOSUSPEND
+static int autosuspend_delay = -1;
+module_param(autosuspend_delay, int, S_IRUGO);
+MODULE_PARM_DESC(autosuspend_delay, "Milliseconds after which a root hub without connected devices suspends itself (default: -1, the default of usbcore)");
+#endif
+
+static unsigned int capture_snaplen = 64;
+module_param(capture_snaplen, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(capture_snaplen, "Max. number of data bytes of an urb which are recorded by the capture in debugfs (default: 64)");
+
+static struct kmem_cache *urbp_cache;
+
+// directory of the driver in debugfs; every controller has a subdirectory in it
+static struct dentry *debugfs_root;
+
 static inline const char *vhci_dev_name(struct device *dev)
 {
 #ifdef OLD_DEV_BUS_ID
@@ -142,246 +205,1515 @@ EXPORT_SYMBOL_GPL(usb_vhci_maybe_set_status);
 static inline void dump_urb(struct urb *urb) {/* do nothing */}
 #endif
 
-// caller has vhc->lock
-// first port is port# 1 (not 0)
-static void vhci_port_update(struct usb_vhci_hcd *vhc, u8 port)
-{
-	struct usb_vhci_device *vdev = vhcihcd_to_vhcidev(vhc);
-	vhc->port_update |= 1 << port;
-	vdev->ifc->wakeup(vdev);
-}
+// The capture file in debugfs delivers urb events in the binary format of usbmon as a pcap stream
+// (LINKTYPE_USB_LINUX_MMAPPED), which Wireshark and tcpdump read, e.g. from a pipe. Writing a
+// number of bytes to it starts capturing into a ring of that size, writing 0 stops it.
+#define USB_VHCI_CAPTURE_MIN  4096
+#define USB_VHCI_CAPTURE_MAX  (16 << 20)
+#define USB_VHCI_CAPTURE_SNAP 4096 // upper limit for capture_snaplen
 
-// gives the urb back to its original owner/creator.
-// caller owns vhc->lock and has irq disabled.
-void usb_vhci_urb_giveback(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+struct capture_file_hdr
 {
-	struct device *dev;
-	struct usb_hcd *hcd;
-	struct urb *const urb = urbp->urb;
-	struct usb_device *const udev = urb->dev;
-#ifndef OLD_GIVEBACK_MECH
-	int status;
-#endif
-	hcd = vhcihcd_to_usbhcd(vhc);
-	dev = vhcihcd_to_dev(vhc);
-	trace_function(dev);
-#ifndef OLD_GIVEBACK_MECH
-	status = atomic_read(&urbp->status);
-#endif
-	urb->hcpriv = NULL;
-	list_del(&urbp->urbp_list);
-#ifndef OLD_GIVEBACK_MECH
-	usb_hcd_unlink_urb_from_ep(hcd, urb);
-#endif
-	spin_unlock(&vhc->lock);
-	kfree(urbp);
-	dump_urb(urb);
-#ifdef OLD_GIVEBACK_MECH
-	usb_hcd_giveback_urb(hcd, urb);
-#else
-#	ifdef DEBUG
-	if(debug_output) vhci_printk(KERN_DEBUG, "usb_vhci_urb_giveback: status=%d(%s)\n", status, get_status_str(status));
-#	endif
-	usb_hcd_giveback_urb(hcd, urb, status);
-#endif
-	usb_put_dev(udev);
-	spin_lock(&vhc->lock);
-}
-EXPORT_SYMBOL_GPL(usb_vhci_urb_giveback);
+	u32 magic;
+	u16 version_major;
+	u16 version_minor;
+	s32 thiszone;
+	u32 sigfigs;
+	u32 snaplen;
+	u32 network;
+};
 
-#ifdef OLD_GIVEBACK_MECH
-static int vhci_urb_enqueue(struct usb_hcd *hcd, struct usb_host_endpoint *ep, struct urb *urb, gfp_t mem_flags)
-#else
-static int vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flags)
-#endif
+struct capture_pkt_hdr
 {
-	struct usb_vhci_hcd *vhc;
-	struct device *dev;
-	struct usb_vhci_urb_priv *urbp;
-	struct usb_vhci_device *vdev;
-	unsigned long flags;
-#ifndef OLD_GIVEBACK_MECH
-	int retval;
-#endif
+	u32 ts_sec;
+	u32 ts_usec;
+	u32 incl_len;
+	u32 orig_len;
+};
 
-	vhc = usbhcd_to_vhcihcd(hcd);
-	dev = vhcihcd_to_dev(vhc);
-	vdev = vhcihcd_to_vhcidev(vhc);
+// same layout as struct mon_bin_hdr of usbmon
+struct capture_usbmon_hdr
+{
+	u64 id;
+	u8 type;      // 'S' (submission) or 'C' (completion)
+	u8 xfer_type; // usb_pipetype
+	u8 epnum;     // |0x80 for IN
+	u8 devnum;
+	u16 busnum;
+	s8 flag_setup; // 0 if setup is valid
+	s8 flag_data;  // 0 if data follows
+	s64 ts_sec;
+	s32 ts_usec;
+	s32 status;
+	u32 len_urb;
+	u32 len_cap;
+	u8 setup[8];
+	s32 interval;
+	s32 start_frame;
+	u32 xfer_flags;
+	u32 ndesc;
+};
 
-	trace_function(dev);
+static const struct capture_file_hdr capture_file_hdr = {
+	.magic         = 0xa1b2c3d4,
+	.version_major = 2,
+	.version_minor = 4,
+	.snaplen       = sizeof(struct capture_usbmon_hdr) + USB_VHCI_CAPTURE_SNAP,
+	.network       = 220 // LINKTYPE_USB_LINUX_MMAPPED
+};
 
-	if(unlikely(!urb->transfer_buffer && urb->transfer_buffer_length))
-		return -EINVAL;
+// caller has vhc->capture_lock
+static void capture_put(struct usb_vhci_capture *c, const void *src, u32 len)
+{
+	const u32 first = min(len, c->size - c->head);
+	memcpy(c->data + c->head, src, first);
+	memcpy(c->data, src + first, len - first);
+	c->head += len;
+	if(c->head >= c->size)
+		c->head -= c->size;
+	c->used += len;
+}
 
-	urbp = kzalloc(sizeof *urbp, mem_flags);
-	if(unlikely(!urbp))
-		return -ENOMEM;
-	urbp->urb = urb;
-	atomic_set(&urbp->status, urb->status);
+// caller has vhc->capture_lock
+static void capture_get(struct usb_vhci_capture *c, void *dst, u32 len)
+{
+	const u32 first = min(len, c->size - c->tail);
+	memcpy(dst, c->data + c->tail, first);
+	memcpy(dst + first, c->data, len - first);
+	c->tail += len;
+	if(c->tail >= c->size)
+		c->tail -= c->size;
+	c->used -= len;
+}
 
-	vhci_dbg("vhci_urb_enqueue: urb->status = %d(%s)",urb->status,get_status_str(urb->status));
+// Records a submission ('S') or completion ('C') of the urb. Data is recorded for OUT urbs when
+// they are submitted and for IN urbs when they complete, truncated to capture_snaplen bytes.
+// Isochronous packet descriptors and scatter-gather buffers are not recorded.
+// caller has irq disabled
+static void capture_urb(struct usb_vhci_hcd *vhc, struct urb *urb, u8 type, int status)
+{
+	struct
+	{
+		struct capture_pkt_hdr pkt;
+		struct capture_usbmon_hdr mon;
+	} h;
+	struct usb_vhci_capture *c;
+	const int in = usb_pipein(urb->pipe);
+	u32 len, snap;
+	u64 ts;
+
+	memset(&h, 0, sizeof h);
+	ts = ktime_to_ns(ktime_get_real());
+	h.mon.ts_usec = do_div(ts, NSEC_PER_SEC) / NSEC_PER_USEC;
+	h.mon.ts_sec = ts;
+	h.mon.id = (unsigned long)urb;
+	h.mon.type = type;
+	h.mon.xfer_type = usb_pipetype(urb->pipe);
+	h.mon.epnum = usb_pipeendpoint(urb->pipe) | (in ? USB_DIR_IN : 0);
+	h.mon.devnum = usb_pipedevice(urb->pipe);
+	h.mon.busnum = urb_to_usbhcd(urb)->self.busnum;
+	h.mon.status = status;
+	h.mon.interval = urb->interval;
+	h.mon.start_frame = urb->start_frame;
+	h.mon.xfer_flags = urb->transfer_flags;
+	h.mon.flag_setup = '-';
+	if(type == 'S' && usb_pipecontrol(urb->pipe) && urb->setup_packet)
+	{
+		h.mon.flag_setup = 0;
+		memcpy(h.mon.setup, urb->setup_packet, sizeof h.mon.setup);
+	}
+	len = (type == 'S') ? urb->transfer_buffer_length : urb->actual_length;
+	h.mon.len_urb = len;
+	h.mon.flag_data = in ? '<' : '>';
+	if((type == 'S') != in && !usb_pipeisoc(urb->pipe) && urb->transfer_buffer)
+	{
+		h.mon.flag_data = 0;
+		snap = min_t(unsigned int, capture_snaplen, USB_VHCI_CAPTURE_SNAP);
+		h.mon.len_cap = min(len, snap);
+	}
+	h.pkt.ts_sec = h.mon.ts_sec;
+	h.pkt.ts_usec = h.mon.ts_usec;
+	h.pkt.incl_len = sizeof h.mon + h.mon.len_cap;
+	h.pkt.orig_len = sizeof h.mon + (h.mon.flag_data ? 0 : len);
 
-	spin_lock_irqsave(&vhc->lock, flags);
-#ifndef OLD_GIVEBACK_MECH
-	retval = usb_hcd_link_urb_to_ep(hcd, urb);
-	if(unlikely(retval))
+	spin_lock(&vhc->capture_lock);
+	if(likely(c = vhc->capture))
 	{
-		kfree(urbp);
-		spin_unlock_irqrestore(&vhc->lock, flags);
-		return retval;
+		if(likely(c->size - c->used >= sizeof h + h.mon.len_cap))
+		{
+			capture_put(c, &h, sizeof h);
+			capture_put(c, urb->transfer_buffer, h.mon.len_cap);
+		}
+		else
+		{
+			usb_vhci_stat_inc(vhc, capture_drops);
+			c = NULL;
+		}
 	}
-#endif
-	usb_get_dev(urb->dev);
-	list_add_tail(&urbp->urbp_list, &vhc->urbp_list_inbox);
-	urb->hcpriv = urbp;
-	spin_unlock_irqrestore(&vhc->lock, flags);
-	vdev->ifc->wakeup(vdev);
-	return 0;
+	spin_unlock(&vhc->capture_lock);
+	if(c)
+		wake_up_interruptible(&vhc->capture_wait);
 }
 
-#ifdef OLD_GIVEBACK_MECH
-static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb)
-#else
-static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
-#endif
+// costs nothing but a test while capturing is off
+// caller has irq disabled
+static inline void capture_urb_event(struct usb_vhci_hcd *vhc, struct urb *urb, u8 type, int status)
+{
+	if(unlikely(vhc->capture))
+		capture_urb(vhc, urb, type, status);
+}
+
+// wakes up the consumer of the channel
+static void vhci_wakeup(struct usb_vhci_hcd *vhc, u8 chan)
 {
-	struct usb_vhci_hcd *vhc;
-	struct device *dev;
 	struct usb_vhci_device *vdev;
+	if(chan)
+		wake_up_interruptible(&vhc->chans[chan].wait);
+	else
+	{
+		vdev = vhcihcd_to_vhcidev(vhc);
+		vdev->ifc->wakeup(vdev);
+	}
+}
+
+// caller has vhc->lock
+// first port is port# 1 (not 0)
+// (everybody who changes the port, calls this afterwards)
+static void vhci_port_update(struct usb_vhci_hcd *vhc, u8 port)
+{
+	const u8 chan = vhc->ports[port - 1].channel;
+	if(vhc->ports[port - 1].port_change)
+		__set_bit(port, vhc->port_changed);
+	else
+		__clear_bit(port, vhc->port_changed);
+	if(!__test_and_set_bit(port, vhc->port_update))
+		atomic_inc(&vhc->chans[chan].work_pending);
+	vhci_wakeup(vhc, chan);
+}
+
+// Takes a zeroed urb descriptor for the urb from the pool (or from the allocator, if the pool is
+// empty) and puts it into vhc->urbp_list_all. Returns NULL if there is no memory.
+static inline struct usb_vhci_urb_priv *urbp_pool_get(struct usb_vhci_hcd *vhc, struct urb *urb, gfp_t mem_flags)
+{
+	struct usb_vhci_urb_priv *urbp = NULL;
 	unsigned long flags;
-	struct usb_vhci_urb_priv *entry, *urbp = NULL;
-#ifndef OLD_GIVEBACK_MECH
-	int retval;
-#endif
+	spin_lock_irqsave(&vhc->urbp_free_lock, flags);
+	if(likely(!list_empty(&vhc->urbp_free)))
+	{
+		urbp = list_entry(vhc->urbp_free.next, struct usb_vhci_urb_priv, urbp_list);
+		list_del(&urbp->urbp_list);
+		vhc->urbp_free_count--;
+		memset(urbp, 0, sizeof *urbp);
+		urbp->urb = urb;
+		list_add_tail(&urbp->all_list, &vhc->urbp_list_all);
+	}
+	spin_unlock_irqrestore(&vhc->urbp_free_lock, flags);
+	if(likely(urbp))
+		return urbp;
 
-	vhc = usbhcd_to_vhcihcd(hcd);
-	dev = vhcihcd_to_dev(vhc);
-	vdev = vhcihcd_to_vhcidev(vhc);
+	// the pool is exhausted
+	urbp = kmem_cache_alloc_node(urbp_cache, mem_flags | __GFP_ZERO, dev_to_node(vhcihcd_to_dev(vhc)));
+	if(unlikely(!urbp))
+		return NULL;
+	urbp->urb = urb;
+	spin_lock_irqsave(&vhc->urbp_free_lock, flags);
+	list_add_tail(&urbp->all_list, &vhc->urbp_list_all);
+	spin_unlock_irqrestore(&vhc->urbp_free_lock, flags);
+	return urbp;
+}
 
-	trace_function(dev);
+// position of a listing in vhc->urbp_list_all (see urb_snapshot)
+struct urb_cursor
+{
+	struct list_head list;  // entry in vhc->urb_cursors
+	struct list_head *next; // the entry which is visited next
+	u8 done;                // set when the end of the list was reached
+};
 
-	spin_lock_irqsave(&vhc->lock, flags);
-#ifndef OLD_GIVEBACK_MECH
-	retval = usb_hcd_check_unlink_urb(hcd, urb, status);
-	if(retval)
+// Takes the urb descriptor (which came from urbp_pool_get) out of vhc->urbp_list_all and puts it
+// back into the pool; returns 0 if the pool is full (the caller has to free it with kmem_cache_free
+// then). Cursors which would visit it next move on to the urb behind it.
+static inline int urbp_pool_put(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	struct urb_cursor *cur;
+	unsigned long flags;
+	int ret = 0;
+	spin_lock_irqsave(&vhc->urbp_free_lock, flags);
+	if(unlikely(!list_empty(&vhc->urb_cursors)))
+		list_for_each_entry(cur, &vhc->urb_cursors, list)
+			if(cur->next == &urbp->all_list)
+				cur->next = urbp->all_list.next;
+	list_del(&urbp->all_list);
+	if(likely(vhc->urbp_free_count < urbp_pool_size))
 	{
-		spin_unlock_irqrestore(&vhc->lock, flags);
-		return retval;
+		list_add(&urbp->urbp_list, &vhc->urbp_free);
+		vhc->urbp_free_count++;
+		ret = 1;
 	}
-#endif
+	spin_unlock_irqrestore(&vhc->urbp_free_lock, flags);
+	return ret;
+}
 
-	// search the queue of unprocessed urbs (inbox)
-	list_for_each_entry(entry, &vhc->urbp_list_inbox, urbp_list)
+// Removes the urb from the list it is in and from the hash, so that it can't be found by its handle anymore.
+// caller has vhc->lock
+void usb_vhci_urb_detach(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	struct usb_vhci_ep *const vep = urbp->vep;
+	if(urbp->state == USB_VHCI_URB_STATE_INBOX || urbp->state == USB_VHCI_URB_STATE_FETCHED)
 	{
-		if(entry->urb == urb)
-		{
-			urbp = entry;
-			break;
-		}
+		// the urb is in one of the lists of its endpoint
+		spin_lock(&vep->lock);
+		if(urbp->state == USB_VHCI_URB_STATE_INBOX && !list_empty(&urbp->urbp_list))
+			// it is still in the inbox (and not taken out by usb_vhci_inbox_pop)
+			atomic_dec(&vhc->chans[vep->chan].work_pending);
+		list_del_init(&urbp->urbp_list);
+		if(urbp->state == USB_VHCI_URB_STATE_INBOX && list_empty(&vep->urbp_list_inbox))
+			list_del_init(&vep->ep_ready);
+		spin_unlock(&vep->lock);
 	}
-
-	// if found in inbox
-	if(urbp)
-		usb_vhci_urb_giveback(vhc, urbp);
-	else // if not found...
+	else
 	{
-		// ...then check if the urb is on a vacation through user space
-		list_for_each_entry(entry, &vhc->urbp_list_fetched, urbp_list)
-		{
-			if(entry->urb == urb)
-			{
-				// move it into the cancel list
-				list_move_tail(&entry->urbp_list, &vhc->urbp_list_cancel);
-				vdev->ifc->wakeup(vdev);
-				break;
-			}
-		}
+		if(urbp->state == USB_VHCI_URB_STATE_CANCEL)
+			atomic_dec(&vhc->chans[urbp->chan].work_pending);
+		list_del_init(&urbp->urbp_list);
 	}
+	if(!hlist_unhashed(&urbp->urbp_hash))
+		hlist_del_init(&urbp->urbp_hash);
+}
+EXPORT_SYMBOL_GPL(usb_vhci_urb_detach);
 
-	spin_unlock_irqrestore(&vhc->lock, flags);
-	return 0;
+static inline u64 latency_now(void)
+{
+	return ktime_to_ns(ktime_get());
 }
 
-/*
-static void vhci_timer(unsigned long _vhc)
+// counts the latency in the bucket of the histogram to which it belongs
+// caller has irq disabled (so that the cpu can't change)
+static inline void latency_add(unsigned long *hist, u64 ns)
 {
-	struct usb_vhci_hcd *vhc = (struct usb_vhci_hcd *)_vhc;
+	int bucket;
+	do_div(ns, NSEC_PER_USEC);
+	bucket = fls64(ns);
+	if(unlikely(bucket >= USB_VHCI_LAT_BUCKETS))
+		bucket = USB_VHCI_LAT_BUCKETS - 1;
+	hist[bucket]++;
 }
-*/
 
-static int vhci_hub_status(struct usb_hcd *hcd, char *buf)
+// Applies the watermarks (see usb_vhci_hcd.queue_high) before an urb is accepted. Returns nonzero
+// if the controller is throttled. (Races with queue_release only shift the watermarks by a few urbs.)
+static inline int queue_throttled(struct usb_vhci_hcd *vhc)
 {
-	struct usb_vhci_hcd *vhc;
-	struct device *dev;
-	unsigned long flags;
-	u8 port;
-	int changed = 0;
-	int idx, rel_bit, abs_bit;
+	const unsigned int high = ACCESS_ONCE(vhc->queue_high);
+	if(likely(!high))
+		return 0;
+	if(!vhc->throttled && atomic_read(&vhc->in_flight) >= high)
+		vhc->throttled = 1;
+	return vhc->throttled;
+}
 
-	vhc = usbhcd_to_vhcihcd(hcd);
-	dev = vhcihcd_to_dev(vhc);
+// counts an urb which is given back
+static inline void queue_release(struct usb_vhci_hcd *vhc)
+{
+	const unsigned int in_flight = atomic_dec_return(&vhc->in_flight);
+	if(unlikely(vhc->throttled) &&
+	   in_flight <= ACCESS_ONCE(vhc->queue_low) && in_flight < ACCESS_ONCE(vhc->queue_high))
+		vhc->throttled = 0;
+}
 
-	trace_function(dev);
+// Does the part of giving back the urb which needs vhc->lock: the urb gets detached (if it isn't
+// already) and unlinked from its endpoint. Then it is put into the list done, which is private to
+// the caller. The caller gives back all urbs of this list with usb_vhci_urb_giveback_list after it
+// released vhc->lock, so that the lock doesn't have to be dropped and re-taken for every single urb.
+// Nobody else can reach the urb in the meantime, so the caller may still fill in its results.
+// caller has vhc->lock
+void usb_vhci_urb_retire(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp, struct list_head *done)
+{
+	struct urb *const urb = urbp->urb;
+	trace_function(vhcihcd_to_dev(vhc));
+	urb->hcpriv = NULL;
+	usb_vhci_urb_detach(vhc, urbp);
+#ifndef OLD_GIVEBACK_MECH
+	usb_hcd_unlink_urb_from_ep(urb_to_usbhcd(urb), urb);
+#endif
+	// urbp_list is free for our own use now
+	list_add_tail(&urbp->urbp_list, done);
+}
+EXPORT_SYMBOL_GPL(usb_vhci_urb_retire);
 
-	memset(buf, 0, 1 + vhc->port_count / 8);
+// Gives all urbs in the list done (which were collected by usb_vhci_urb_retire) back to their
+// original owners/creators. The list is empty afterwards.
+// caller must not hold vhc->lock
+void usb_vhci_urb_giveback_list(struct usb_vhci_hcd *vhc, struct list_head *done)
+{
+	struct usb_vhci_urb_priv *urbp;
+	struct usb_hcd *hcd;
+	struct urb *urb;
+	struct usb_device *udev;
+	unsigned long flags;
+#ifndef OLD_GIVEBACK_MECH
+	int status;
+#endif
 
-	spin_lock_irqsave(&vhc->lock, flags);
-	if(!test_bit(HCD_FLAG_HW_ACCESSIBLE, &hcd->flags))
+	while(!list_empty(done))
 	{
-		spin_unlock_irqrestore(&vhc->lock, flags);
-		return 0;
+		urbp = list_entry(done->next, struct usb_vhci_urb_priv, urbp_list);
+		list_del(&urbp->urbp_list);
+		urb = urbp->urb;
+		udev = urb->dev;
+		hcd = urb_to_usbhcd(urb);
+#ifndef OLD_GIVEBACK_MECH
+		status = atomic_read(&urbp->status);
+#endif
+		// completion handlers expect to be called with irqs disabled (and the per cpu counters
+		// need them disabled, too), but there is no need to keep them disabled for the whole batch
+		local_irq_save(flags);
+		trace_usb_vhci_urb_giveback(urb, urbp->handle, atomic_read(&urbp->status));
+		capture_urb_event(vhc, urb, 'C', atomic_read(&urbp->status));
+		usb_vhci_stat_inc(vhc, completed[usb_pipetype(urb->pipe)]);
+		usb_vhci_stat_add(vhc, urbs[urbp->state], -1);
+		if(urbp->t_fetch)
+			latency_add(per_cpu_ptr(vhc->latency, smp_processor_id())->service[usb_pipetype(urb->pipe)],
+				latency_now() - urbp->t_fetch);
+		if(usb_vhci_urb_dir_in(urb))
+			usb_vhci_stat_add(vhc, bytes_in, urb->actual_length);
+		else
+			usb_vhci_stat_add(vhc, bytes_out, urb->actual_length);
+		// urbp must not be touched anymore after this
+		if(unlikely(!urbp_pool_put(vhc, urbp)))
+			kmem_cache_free(urbp_cache, urbp);
+		// (before the completion handler runs, because it might submit the urb again)
+		queue_release(vhc);
+		dump_urb(urb);
+#ifdef OLD_GIVEBACK_MECH
+		usb_hcd_giveback_urb(hcd, urb);
+#else
+#	ifdef DEBUG
+		if(debug_output) vhci_printk(KERN_DEBUG, "usb_vhci_urb_giveback: status=%d(%s)\n", status, get_status_str(status));
+#	endif
+		usb_hcd_giveback_urb(hcd, urb, status);
+#endif
+		local_irq_restore(flags);
+		usb_put_dev(udev);
 	}
+}
+EXPORT_SYMBOL_GPL(usb_vhci_urb_giveback_list);
+
+// gives the urb back to its original owner/creator.
+// Prefer usb_vhci_urb_retire and usb_vhci_urb_giveback_list if more than one urb is done; this
+// one drops vhc->lock for every urb.
+// caller owns vhc->lock and has irq disabled.
+void usb_vhci_urb_giveback(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	LIST_HEAD(done);
+	usb_vhci_urb_retire(vhc, urbp, &done);
+	spin_unlock(&vhc->lock);
+	usb_vhci_urb_giveback_list(vhc, &done);
+	spin_lock(&vhc->lock);
+}
+EXPORT_SYMBOL_GPL(usb_vhci_urb_giveback);
+
+static inline struct hlist_head *urbp_hash_bucket(struct usb_vhci_hcd *vhc, u64 handle)
+{
+	// handles are assigned sequentially, so the lower bits are distributed evenly
+	return &vhc->urbp_hash[(unsigned long)handle & (USB_VHCI_URBP_HASH_SIZE - 1)];
+}
+
+// assigns a new handle to the urb and makes it findable by usb_vhci_urbp_from_handle.
+// caller has vhc->lock
+static inline u64 urbp_hash_add(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	if(unlikely(!++vhc->handle_seq))
+		++vhc->handle_seq; // zero is never a valid handle
+	urbp->handle = vhc->handle_seq;
+	hlist_add_head(&urbp->urbp_hash, urbp_hash_bucket(vhc, urbp->handle));
+	return urbp->handle;
+}
+
+// Takes the next urb out of the inbox of an endpoint of the channel with the given transfer type.
+// The endpoints are served round-robin. Returns NULL if all of their inboxes are empty.
+// caller has vhc->lock
+static struct usb_vhci_urb_priv *inbox_pop_type(struct usb_vhci_hcd *vhc, struct usb_vhci_chan *ch, int type)
+{
+	struct list_head *const ready = &ch->ep_ready[type];
+	struct usb_vhci_urb_priv *urbp;
+	struct usb_vhci_ep *vep;
 
-	for(port = 0; port < vhc->port_count; port++)
+	while(!list_empty(ready))
 	{
-		if(vhc->ports[port].port_change)
+		vep = list_entry(ready->next, struct usb_vhci_ep, ep_ready);
+		spin_lock(&vep->lock);
+		urbp = NULL;
+		if(likely(!list_empty(&vep->urbp_list_inbox)))
 		{
-			abs_bit = port + 1;
-			idx     = abs_bit / (sizeof *buf * 8);
-			rel_bit = abs_bit % (sizeof *buf * 8);
-			buf[idx] |= (1 << rel_bit);
-			changed = 1;
+			urbp = list_entry(vep->urbp_list_inbox.next, struct usb_vhci_urb_priv, urbp_list);
+			list_del_init(&urbp->urbp_list);
+		}
+		if(list_empty(&vep->urbp_list_inbox))
+			list_del_init(&vep->ep_ready);
+		else
+			// give the other endpoints a chance
+			list_move_tail(&vep->ep_ready, ready);
+		spin_unlock(&vep->lock);
+		if(likely(urbp))
+		{
+			atomic_dec(&ch->work_pending);
+			return urbp;
 		}
-#ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "port %d status 0x%04x has changes at 0x%04x\n", (int)(port + 1), (int)vhc->ports[port].port_status, (int)vhc->ports[port].port_change);
-#endif
 	}
+	return NULL;
+}
 
-	if(vhc->rh_state == USB_VHCI_RH_SUSPENDED && changed)
-		usb_hcd_resume_root_hub(hcd);
+// Takes the next urb out of the inbox of an endpoint of the channel. Isochronous, interrupt and
+// control urbs are preferred to bulk urbs (in this order): In every scheduling round each transfer
+// type may hand out as many urbs as its weight (see sched_weights) allows. A round ends if every
+// type which has some urbs waiting has used up its credit, so that bulk can't starve.
+// Returns NULL if all inboxes of the channel are empty. The urb isn't in any list afterwards, and
+// it belongs to the channel from now on.
+// caller has vhc->lock
+struct usb_vhci_urb_priv *usb_vhci_inbox_pop(struct usb_vhci_hcd *vhc, u8 chan)
+{
+	static const u8 order[USB_VHCI_PIPE_TYPES] = { PIPE_ISOCHRONOUS, PIPE_INTERRUPT, PIPE_CONTROL, PIPE_BULK };
+	struct usb_vhci_chan *const ch = &vhc->chans[chan];
+	struct usb_vhci_urb_priv *urbp;
+	int round, i, type;
 
-	spin_unlock_irqrestore(&vhc->lock, flags);
-	return changed;
+	for(round = 0; round < 2; round++)
+	{
+		for(i = 0; i < USB_VHCI_PIPE_TYPES; i++)
+		{
+			type = order[i];
+			if(!ch->sched_credit[type] || list_empty(&ch->ep_ready[type]))
+				continue;
+			if(likely((urbp = inbox_pop_type(vhc, ch, type))))
+			{
+				ch->sched_credit[type]--;
+				urbp->chan = chan;
+				return urbp;
+			}
+		}
+		// start the next round (every type gets at least one urb per round)
+		for(type = 0; type < USB_VHCI_PIPE_TYPES; type++)
+			ch->sched_credit[type] = sched_weights[type];
+	}
+	return NULL;
 }
+EXPORT_SYMBOL_GPL(usb_vhci_inbox_pop);
 
+// Takes the next urb out of the inbox of the endpoint of prev (which came from usb_vhci_inbox_pop or
+// from this function), if it is a bulk OUT urb with the same transfer flags and with at most max_len
+// bytes, so that user space can get both of them as one work item. Returns NULL otherwise.
 // caller has vhc->lock
-// called in vhci_hub_control only
-static inline void hub_descriptor(const struct usb_vhci_hcd *vhc, char *buf, u16 len)
+struct usb_vhci_urb_priv *usb_vhci_inbox_pop_next(struct usb_vhci_hcd *vhc, const struct usb_vhci_urb_priv *prev, u32 max_len)
 {
-	struct usb_hub_descriptor desc;
-	int portArrLen = vhc->port_count / 8 + 1; // length of one port bit-array in bytes
-	u16 l = USB_DT_HUB_NONVAR_SIZE + 2 * portArrLen; // length of our hub descriptor
-	memset(&desc, 0, USB_DT_HUB_NONVAR_SIZE);
+	struct usb_vhci_ep *const vep = prev->vep;
+	struct usb_vhci_urb_priv *urbp = NULL;
+	const struct urb *urb;
 
-	if(likely(len > USB_DT_HUB_NONVAR_SIZE))
+	spin_lock(&vep->lock);
+	if(!list_empty(&vep->urbp_list_inbox))
 	{
-		if(unlikely(len < l)) l = len;
-		if(likely(l > USB_DT_HUB_NONVAR_SIZE))
+		urbp = list_entry(vep->urbp_list_inbox.next, struct usb_vhci_urb_priv, urbp_list);
+		urb = urbp->urb;
+		// (invalid urbs are left for the usual checks)
+		if(usb_pipebulk(urb->pipe) && usb_pipeout(urb->pipe) &&
+			!((urb->transfer_flags ^ prev->urb->transfer_flags) & URB_ZERO_PACKET) &&
+			urb->transfer_buffer_length <= max_len &&
+			(!urb->transfer_buffer_length || usb_vhci_urb_has_buffer(urb)))
 		{
-			memset(buf + USB_DT_HUB_NONVAR_SIZE, 0, l - USB_DT_HUB_NONVAR_SIZE);
-			if(likely(l > USB_DT_HUB_NONVAR_SIZE + portArrLen))
-				memset(buf + USB_DT_HUB_NONVAR_SIZE + portArrLen, 0xff, l - (USB_DT_HUB_NONVAR_SIZE + portArrLen));
+			list_del_init(&urbp->urbp_list);
+			atomic_dec(&vhc->chans[vep->chan].work_pending);
+			if(list_empty(&vep->urbp_list_inbox))
+				list_del_init(&vep->ep_ready);
+			urbp->chan = prev->chan;
 		}
+		else
+			urbp = NULL;
 	}
-	else l = len;
+	spin_unlock(&vep->lock);
+	return urbp;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_inbox_pop_next);
 
-	desc.bDescLength = l;
+// Puts the urb (which came from usb_vhci_inbox_pop) into the fetched list of its endpoint and
+// assigns a handle to it, which is returned.
+// caller has vhc->lock
+u64 usb_vhci_urb_fetched(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	struct usb_vhci_ep *const vep = urbp->vep;
+	u64 handle = urbp_hash_add(vhc, urbp);
+	urbp->t_fetch = latency_now();
+	latency_add(per_cpu_ptr(vhc->latency, smp_processor_id())->wait[usb_pipetype(urbp->urb->pipe)],
+		urbp->t_fetch - urbp->t_inbox);
+	spin_lock(&vep->lock);
+	list_add_tail(&urbp->urbp_list, &vep->urbp_list_fetched);
+	usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_FETCHED);
+	spin_unlock(&vep->lock);
+	usb_vhci_stat_inc(vhc, fetched[usb_pipetype(urbp->urb->pipe)]);
+	trace_usb_vhci_urb_fetch(urbp->urb, handle, atomic_read(&urbp->status));
+	return handle;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_urb_fetched);
+
+// caller has vhc->lock
+struct usb_vhci_urb_priv *usb_vhci_urbp_from_handle(struct usb_vhci_hcd *vhc, u64 handle)
+{
+	struct usb_vhci_urb_priv *entry;
+	struct hlist_node *pos;
+	hlist_for_each_entry(entry, pos, urbp_hash_bucket(vhc, handle), urbp_hash)
+		if(entry->handle == handle)
+			return entry;
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_urbp_from_handle);
+
+// Parks a fetched interrupt IN urb for which user space has no data (NAK). It can't be found by
+// its handle anymore; usb_vhci_unpark puts it back into the inbox.
+// caller has vhc->lock
+void usb_vhci_urb_park(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	usb_vhci_urb_detach(vhc, urbp);
+	urbp->t_fetch = 0;
+	urbp->deposited = 0;
+	list_add_tail(&urbp->urbp_list, &vhc->urbp_list_parked);
+	usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_PARKED);
+	usb_vhci_stat_inc(vhc, naks);
+}
+EXPORT_SYMBOL_GPL(usb_vhci_urb_park);
+
+// Puts the parked urbs of the endpoint back into its inbox, because user space has data for it
+// now. They were queued before everything which is in the inbox, so they go to its head (in their
+// original order). Returns the number of urbs which were unparked.
+// (The address is not unique if the controller has a USB 3.0 root hub, but unparking an urb of
+// the other bus does no harm: user space just sees it again.)
+// caller has vhc->lock
+unsigned int usb_vhci_unpark(struct usb_vhci_hcd *vhc, u8 address, u8 endpoint)
+{
+	struct usb_vhci_urb_priv *urbp, *tmp;
+	struct usb_vhci_ep *vep;
+	unsigned int count = 0, n;
+	LIST_HEAD(batch);
+
+	// (the matching urbs may belong to more than one endpoint, so they are collected per endpoint)
+	for(;;)
+	{
+		vep = NULL;
+		n = 0;
+		list_for_each_entry_safe(urbp, tmp, &vhc->urbp_list_parked, urbp_list)
+		{
+			if(usb_pipedevice(urbp->urb->pipe) != address || usb_pipeendpoint(urbp->urb->pipe) != (endpoint & 0x0f))
+				continue;
+			if(!vep)
+				vep = urbp->vep;
+			else if(urbp->vep != vep)
+				continue;
+			list_move_tail(&urbp->urbp_list, &batch);
+			usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_INBOX);
+			urbp->t_inbox = latency_now();
+			n++;
+		}
+		if(!vep)
+			break;
+		spin_lock(&vep->lock);
+		list_splice_init(&batch, &vep->urbp_list_inbox);
+		atomic_add(n, &vhc->chans[vep->chan].work_pending);
+		spin_unlock(&vep->lock);
+		if(list_empty(&vep->ep_ready))
+			list_add_tail(&vep->ep_ready, &vhc->chans[vep->chan].ep_ready[PIPE_INTERRUPT]);
+		vhci_wakeup(vhc, vep->chan);
+		count += n;
+	}
+	return count;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_unpark);
+
+// returns the number of microframes which have passed since the controller was started
+u64 usb_vhci_uframe_now(struct usb_vhci_hcd *vhc)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), vhc->frame_base));
+	do_div(ns, NSEC_PER_MSEC / 8);
+	return ns;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_uframe_now);
+
+u16 usb_vhci_frame_number(struct usb_vhci_hcd *vhc)
+{
+	return (u16)(usb_vhci_uframe_now(vhc) >> 3) & USB_VHCI_FRAME_MASK;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_frame_number);
+
+// returns the first microframe at or after uframe which belongs to the reservation of the endpoint
+// caller has vhc->lock
+static inline u64 sched_next(const struct usb_vhci_ep *vep, u64 uframe)
+{
+	if(!vep->sched_period)
+		return uframe;
+	return uframe + (((u64)vep->sched_phase - uframe) & (vep->sched_period - 1));
+}
+
+// Reserves the bus time of the periodic endpoint in the schedule, like the hardware would do it:
+// one transaction (or up to three for high bandwidth endpoints) of the maximum packet size per
+// period. Of all phases the one is chosen whose busiest slot is the least loaded, so that the
+// endpoints are spread evenly over the (micro)frames. Returns -ENOSPC if the busiest slot can't
+// take the endpoint anymore.
+// caller has vhc->lock
+static int sched_reserve(struct usb_vhci_hcd *vhc, struct usb_vhci_ep *vep, struct urb *urb)
+{
+	const enum usb_device_speed speed = urb->dev->speed;
+	const int hs = speed == USB_SPEED_HIGH;
+	const unsigned int slots = hs ? USB_VHCI_SCHED_UFRAMES : USB_VHCI_SCHED_FRAMES;
+	u32 *const sched = hs ? vhc->sched_hs : vhc->sched_fs;
+	unsigned int maxp, mult, period, phase, best = 0, i;
+	u32 ns, load, best_load = ~0U;
+
+	if(vep->scheduled)
+		return 0;
+	if(!hs && speed != USB_SPEED_FULL && speed != USB_SPEED_LOW)
+	{
+		// (the periodic bandwidth of the USB 3.0 root hub isn't accounted)
+		vep->scheduled = 1;
+		return 0;
+	}
+
+	maxp = le16_to_cpu(vep->hep->desc.wMaxPacketSize);
+	mult = hs ? 1 + ((maxp >> 11) & 3) : 1;
+	maxp &= 0x07ff;
+	ns = mult * usb_calc_bus_time(speed, usb_pipein(urb->pipe), usb_pipeisoc(urb->pipe), maxp);
+
+	// the interval is given in frames for low and full speed and in microframes for high speed,
+	// just like the slots of the schedule; a period which isn't a power of two is rounded down
+	period = min_t(unsigned int, rounddown_pow_of_two(max(urb->interval, 1)), slots);
+	for(phase = 0; phase < period; phase++)
+	{
+		for(load = 0, i = phase; i < slots; i += period)
+			load = max(load, sched[i]);
+		if(load < best_load)
+		{
+			best_load = load;
+			best = phase;
+		}
+	}
+	if(best_load + ns > (hs ? USB_VHCI_SCHED_HS_BUDGET : USB_VHCI_SCHED_FS_BUDGET))
+		return -ENOSPC;
+	for(i = best; i < slots; i += period)
+		sched[i] += ns;
+
+	vep->scheduled = 1;
+	vep->sched_hs = hs;
+	vep->sched_period = hs ? period : period << 3;
+	vep->sched_phase = hs ? best : best << 3;
+	vep->bw_ns = ns;
+	return 0;
+}
+
+// gives the bus time of the endpoint back to the schedule
+// caller has vhc->lock
+static void sched_release(struct usb_vhci_hcd *vhc, struct usb_vhci_ep *vep)
+{
+	const unsigned int shift = vep->sched_hs ? 0 : 3;
+	const unsigned int slots = vep->sched_hs ? USB_VHCI_SCHED_UFRAMES : USB_VHCI_SCHED_FRAMES;
+	u32 *const sched = vep->sched_hs ? vhc->sched_hs : vhc->sched_fs;
+	unsigned int i;
+
+	if(!vep->sched_period)
+		return;
+	for(i = vep->sched_phase >> shift; i < slots; i += vep->sched_period >> shift)
+		sched[i] -= vep->bw_ns;
+	vep->sched_period = 0;
+	vep->bw_ns = 0;
+}
+
+// Returns the microframe in which the urb is scheduled: the start of an isochronous urb, the next
+// microframe of the reservation of an interrupt endpoint, or the current microframe for all others.
+// caller has vhc->lock
+u64 usb_vhci_urb_uframe(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	if(usb_pipeisoc(urbp->urb->pipe))
+		return urbp->due_uframe;
+	if(usb_pipeint(urbp->urb->pipe))
+		return sched_next(urbp->vep, usb_vhci_uframe_now(vhc));
+	return usb_vhci_uframe_now(vhc);
+}
+EXPORT_SYMBOL_GPL(usb_vhci_urb_uframe);
+
+// Determines the microframe in which the isochronous urb starts and updates urb->start_frame.
+// Returns non-zero, if the start frame lies in the future (the urb has to be held back then).
+// caller has vhc->lock and vep->lock
+static int iso_schedule(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	struct urb *const urb = urbp->urb;
+	struct usb_vhci_ep *const vep = urbp->vep;
+	const u64 now = usb_vhci_uframe_now(vhc);
+	unsigned int period;
+	u64 start;
+	u16 delta;
+
+	// the interval of low and full speed endpoints is given in frames, for all others in microframes
+	period = urb->interval;
+	if(urb->dev->speed == USB_SPEED_LOW || urb->dev->speed == USB_SPEED_FULL)
+		period <<= 3;
+	if(unlikely(!period))
+		period = 8;
+
+	// the urb starts in a microframe of the reservation of its endpoint
+	if(urb->transfer_flags & URB_ISO_ASAP)
+		// continue the stream of the endpoint seamlessly, unless it has run dry
+		start = (vep->next_uframe > now) ? vep->next_uframe : sched_next(vep, now);
+	else
+	{
+		// start_frame wraps around; if it lies more than half of the range ahead, then it is
+		// considered to be in the past already
+		delta = (urb->start_frame - (u16)(now >> 3)) & USB_VHCI_FRAME_MASK;
+		if(delta < (USB_VHCI_FRAME_MASK + 1) / 2)
+			start = (((now >> 3) + delta) << 3) + (vep->sched_phase & 7);
+		else
+			start = sched_next(vep, now);
+	}
+
+	urb->start_frame = (int)(start >> 3) & USB_VHCI_FRAME_MASK;
+	urbp->due_uframe = start;
+	vep->next_uframe = start + (u64)urb->number_of_packets * period;
+	return (start >> 3) > (now >> 3);
+}
+
+// Puts the isochronous urb into the list of held urbs and makes sure that the timer is running.
+// caller has vhc->lock
+static void iso_hold(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	struct usb_vhci_urb_priv *entry;
+
+	usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_HELD);
+	// urbs are usually submitted in the order of their start frames, so search from the tail
+	list_for_each_entry_reverse(entry, &vhc->urbp_list_iso_hold, urbp_list)
+		if(entry->due_uframe <= urbp->due_uframe)
+			break;
+	list_add(&urbp->urbp_list, &entry->urbp_list);
+
+	// An armed timer expires for the urb which was at the head before; if this one is due earlier,
+	// then the timer has to be moved forward.
+	if(!vhc->iso_timer_armed || vhc->urbp_list_iso_hold.next == &urbp->urbp_list)
+	{
+		// the timer expires at frame boundaries
+		vhc->iso_timer_armed = 1;
+		hrtimer_start(&vhc->iso_timer,
+			ktime_add_ns(vhc->frame_base, (urbp->due_uframe >> 3) * NSEC_PER_MSEC),
+			HRTIMER_MODE_ABS);
+	}
+}
+
+// Expires at the frame in which the first held isochronous urb is due; moves the urbs, whose frame
+// has come, into the inbox of their endpoint.
+static enum hrtimer_restart vhci_iso_timer(struct hrtimer *timer)
+{
+	struct usb_vhci_hcd *vhc = container_of(timer, struct usb_vhci_hcd, iso_timer);
+	struct usb_vhci_urb_priv *urbp;
+	struct usb_vhci_ep *vep;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned long flags;
+	u64 frame;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	frame = usb_vhci_uframe_now(vhc) >> 3;
+	while(!list_empty(&vhc->urbp_list_iso_hold))
+	{
+		urbp = list_entry(vhc->urbp_list_iso_hold.next, struct usb_vhci_urb_priv, urbp_list);
+		if((urbp->due_uframe >> 3) > frame)
+			break;
+		vep = urbp->vep;
+		spin_lock(&vep->lock);
+		list_move_tail(&urbp->urbp_list, &vep->urbp_list_inbox);
+		usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_INBOX);
+		urbp->t_inbox = latency_now();
+		atomic_inc(&vhc->chans[vep->chan].work_pending);
+		spin_unlock(&vep->lock);
+		if(list_empty(&vep->ep_ready))
+			list_add_tail(&vep->ep_ready, &vhc->chans[vep->chan].ep_ready[PIPE_ISOCHRONOUS]);
+		vhci_wakeup(vhc, vep->chan);
+	}
+	// iso_hold may have started the timer again while we were waiting for the lock; then it is
+	// queued already and must not be restarted.
+	if(!hrtimer_is_queued(timer))
+	{
+		if(list_empty(&vhc->urbp_list_iso_hold))
+			vhc->iso_timer_armed = 0;
+		else
+		{
+			// the held urbs are sorted by their due frames, so the head is due first
+			urbp = list_entry(vhc->urbp_list_iso_hold.next, struct usb_vhci_urb_priv, urbp_list);
+			hrtimer_set_expires(timer,
+				ktime_add_ns(vhc->frame_base, (urbp->due_uframe >> 3) * NSEC_PER_MSEC));
+			ret = HRTIMER_RESTART;
+		}
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return ret;
+}
+
+// returns 0 for the USB 2.0 root hub and 1 for the USB 3.0 root hub
+static inline int rh_index(const struct usb_vhci_hcd *vhc, const struct usb_hcd *hcd)
+{
+	return hcd == vhc->ss_hcd;
+}
+
+// returns the index of the first port of the root hub within vhc->ports
+static inline u8 rh_first_port(const struct usb_vhci_hcd *vhc, const struct usb_hcd *hcd)
+{
+	return rh_index(vhc, hcd) ? vhc->rh_port_count : 0;
+}
+
+// returns the port of the controller behind which the device is, or 0 for the root hubs
+static u8 dev_root_port(struct usb_vhci_hcd *vhc, struct usb_hcd *hcd, struct usb_device *udev)
+{
+	if(!udev->parent)
+		return 0;
+	while(udev->parent->parent)
+		udev = udev->parent;
+	return rh_first_port(vhc, hcd) + udev->portnum;
+}
+
+// returns the private data of the endpoint; allocates it, if it doesn't exist yet
+static struct usb_vhci_ep *get_vhci_ep(struct usb_vhci_hcd *vhc, struct usb_hcd *hcd, struct urb *urb, struct usb_host_endpoint *hep, gfp_t mem_flags)
+{
+	struct usb_vhci_ep *vep, *new_vep;
+	unsigned long flags;
+
+	vep = hep->hcpriv;
+	if(likely(vep))
+		return vep;
+
+	new_vep = kzalloc_node(sizeof *new_vep, mem_flags, dev_to_node(vhcihcd_to_dev(vhc)));
+	if(unlikely(!new_vep))
+		return NULL;
+	spin_lock_init(&new_vep->lock);
+	INIT_LIST_HEAD(&new_vep->urbp_list_inbox);
+	INIT_LIST_HEAD(&new_vep->urbp_list_fetched);
+	INIT_LIST_HEAD(&new_vep->ep_ready);
+	INIT_LIST_HEAD(&new_vep->posted);
+	new_vep->hep = hep;
+	new_vep->address = usb_pipedevice(urb->pipe);
+	new_vep->type = usb_pipetype(urb->pipe);
+	new_vep->root_port = dev_root_port(vhc, hcd, urb->dev);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	// somebody else might have been faster
+	if(likely(!(vep = hep->hcpriv)))
+	{
+		vep = new_vep;
+		new_vep = NULL;
+		if(vep->root_port && vep->root_port <= vhc->port_count)
+			vep->chan = vhc->ports[vep->root_port - 1].channel;
+		list_add_tail(&vep->ep_list, &vhc->ep_list);
+		hep->hcpriv = vep;
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	kfree(new_vep);
+	return vep;
+}
+
+// If urb is a GET_DESCRIPTOR request for a descriptor which user space preloaded into the cache of
+// the port (see usb_vhci_set_desc_cache), then the entry of the cache is returned, else NULL.
+// Only devices which are directly attached to a root port have a cache.
+// caller has vhc->lock
+static const struct usb_vhci_desc_hdr *desc_cache_find(struct usb_vhci_hcd *vhc, struct usb_hcd *hcd, struct urb *urb)
+{
+	const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urb->setup_packet;
+	const struct usb_vhci_desc_hdr *hdr;
+	struct usb_vhci_port *p;
+	u16 value, windex;
+	u32 pos;
+
+	if(unlikely(rh_first_port(vhc, hcd) + urb->dev->portnum > vhc->port_count))
+		return NULL;
+	value = le16_to_cpu(cmd->wValue);
+	windex = le16_to_cpu(cmd->wIndex);
+	p = &vhc->ports[rh_first_port(vhc, hcd) + urb->dev->portnum - 1];
+	for(pos = 0; pos < p->desc_cache_len; pos += sizeof *hdr + ALIGN(hdr->length, 4))
+	{
+		hdr = p->desc_cache + pos;
+		if(hdr->value == value && hdr->index == windex)
+			return hdr;
+	}
+	return NULL;
+}
+
+// Returns 1, if the urb can be answered from the cache of its port (see desc_cache_find). Nothing
+// is changed in the urb yet, because enqueuing it may still fail (see desc_cache_answer).
+static int desc_cache_lookup(struct usb_vhci_hcd *vhc, struct usb_hcd *hcd, struct urb *urb)
+{
+	const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urb->setup_packet;
+	unsigned long flags;
+	int found;
+
+	if(likely(usb_pipeendpoint(urb->pipe) || !cmd || !urb->transfer_buffer))
+		return 0;
+#ifndef NO_URB_SG
+	if(urb->num_sgs)
+		return 0;
+#endif
+	if(cmd->bRequestType != (USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE) ||
+		cmd->bRequest != USB_REQ_GET_DESCRIPTOR)
+		return 0;
+	if(!urb->dev->parent || urb->dev->parent->parent || !urb->dev->portnum)
+		return 0;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	found = desc_cache_find(vhc, hcd, urb) != NULL;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return found;
+}
+
+// Copies the descriptor from the cache into the transfer buffer of the urb (which passed
+// desc_cache_lookup and which is linked now) and stores the status the urb has to be given back
+// with in *status. Returns 0, if the descriptor was dropped from the cache meanwhile.
+// caller has vhc->lock
+static int desc_cache_answer(struct usb_vhci_hcd *vhc, struct usb_hcd *hcd, struct urb *urb, int *status)
+{
+	const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urb->setup_packet;
+	const struct usb_vhci_desc_hdr *hdr = desc_cache_find(vhc, hcd, urb);
+	u32 len;
+
+	if(unlikely(!hdr))
+		return 0;
+	len = min_t(u32, hdr->length, urb->transfer_buffer_length);
+	len = min_t(u32, len, le16_to_cpu(cmd->wLength));
+	memcpy(urb->transfer_buffer, hdr + 1, len);
+	urb->actual_length = len;
+	*status = ((urb->transfer_flags & URB_SHORT_NOT_OK) && len < urb->transfer_buffer_length) ? -EREMOTEIO : 0;
+	return 1;
+}
+
+// Answers the urbs at the head of the inbox of the bulk IN endpoint with the data which user space
+// posted for it (see usb_vhci_post_in), as long as user space doesn't have any urbs of the endpoint,
+// so that the urbs still complete in order. The answered urbs are retired into done.
+// caller has vhc->lock
+static void posted_drain(struct usb_vhci_hcd *vhc, struct usb_vhci_ep *vep, struct list_head *done)
+{
+	struct usb_vhci_urb_priv *urbp, *tmp;
+	struct usb_vhci_posted *p;
+	struct urb *urb;
+	LIST_HEAD(answered);
+	u32 len;
+
+	spin_lock(&vep->lock);
+	while(!list_empty(&vep->posted) && !list_empty(&vep->urbp_list_inbox) && list_empty(&vep->urbp_list_fetched))
+	{
+		urbp = list_entry(vep->urbp_list_inbox.next, struct usb_vhci_urb_priv, urbp_list);
+		urb = urbp->urb;
+		// (user space takes care of the others)
+		if(unlikely(!urb->transfer_buffer))
+			break;
+#ifndef NO_URB_SG
+		if(unlikely(urb->num_sgs))
+			break;
+#endif
+		p = list_entry(vep->posted.next, struct usb_vhci_posted, list);
+		len = min_t(u32, p->length - p->offset, urb->transfer_buffer_length);
+		memcpy(urb->transfer_buffer, p->data + p->offset, len);
+		urb->actual_length = len;
+		usb_vhci_maybe_set_status(urbp, ((urb->transfer_flags & URB_SHORT_NOT_OK) && len < urb->transfer_buffer_length) ? -EREMOTEIO : 0);
+		if((p->offset += len) == p->length)
+		{
+			list_del(&p->list);
+			vep->posted_count--;
+			kfree(p);
+		}
+		// take it out of the inbox like usb_vhci_inbox_pop does
+		list_move_tail(&urbp->urbp_list, &answered);
+		atomic_dec(&vhc->chans[vep->chan].work_pending);
+		if(list_empty(&vep->urbp_list_inbox))
+			list_del_init(&vep->ep_ready);
+		usb_vhci_stat_inc(vhc, posted_hits);
+	}
+	spin_unlock(&vep->lock);
+	list_for_each_entry_safe(urbp, tmp, &answered, urbp_list)
+	{
+		list_del_init(&urbp->urbp_list);
+		usb_vhci_urb_retire(vhc, urbp, done);
+	}
+}
+
+// drops the data which user space posted for the endpoint
+static void posted_free(struct usb_vhci_ep *vep)
+{
+	struct usb_vhci_posted *p, *tmp;
+	list_for_each_entry_safe(p, tmp, &vep->posted, list)
+		kfree(p);
+	INIT_LIST_HEAD(&vep->posted);
+	vep->posted_count = 0;
+}
+
+#ifdef OLD_GIVEBACK_MECH
+static int vhci_urb_enqueue(struct usb_hcd *hcd, struct usb_host_endpoint *ep, struct urb *urb, gfp_t mem_flags)
+#else
+static int vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flags)
+#endif
+{
+	struct usb_vhci_hcd *vhc;
+	struct device *dev;
+	struct usb_vhci_urb_priv *urbp;
+	struct usb_vhci_ep *vep;
+	unsigned long flags;
+	int locked, iso, cached, posted, unanswered, retval, cached_status = 0;
+	u8 chan;
+	LIST_HEAD(done);
+#ifndef OLD_GIVEBACK_MECH
+	struct usb_host_endpoint *const ep = urb->ep;
+#endif
+
+	vhc = usbhcd_to_vhcihcd(hcd);
+	dev = vhcihcd_to_dev(vhc);
+
+	trace_function(dev);
+
+	if(unlikely(!usb_vhci_urb_has_buffer(urb) && urb->transfer_buffer_length))
+		return -EINVAL;
+
+	// the controller is going away (an urb which slips in anyway is flushed by usbcore when the
+	// device gets disconnected; vhci_urb_dequeue gives back urbs from the inbox right away)
+	if(unlikely(ACCESS_ONCE(vhc->dying)))
+		return -ESHUTDOWN;
+
+	// Control urbs are never rejected, so that the devices stay manageable. -ENOMEM is the error
+	// class drivers are prepared to retry after a while.
+	if(unlikely(!usb_pipecontrol(urb->pipe) && queue_throttled(vhc)))
+	{
+		local_irq_save(flags);
+		usb_vhci_stat_inc(vhc, rejected);
+		local_irq_restore(flags);
+		return -ENOMEM;
+	}
+
+	// during enumeration most control urbs just ask for descriptors which never change
+	cached = usb_pipecontrol(urb->pipe) && desc_cache_lookup(vhc, hcd, urb);
+
+	vep = get_vhci_ep(vhc, hcd, urb, ep, mem_flags);
+	if(unlikely(!vep))
+		return -ENOMEM;
+
+	// admission control: the first urb of a periodic endpoint reserves its bus time (-ENOSPC is
+	// what drivers get from real controllers whose periodic schedule is full)
+	if(unlikely(!ACCESS_ONCE(vep->scheduled)) && (usb_pipeisoc(urb->pipe) || usb_pipeint(urb->pipe)))
+	{
+		spin_lock_irqsave(&vhc->lock, flags);
+		retval = sched_reserve(vhc, vep, urb);
+		if(unlikely(retval))
+			usb_vhci_stat_inc(vhc, bw_rejected);
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		if(unlikely(retval))
+			return retval;
+	}
+
+	urbp = urbp_pool_get(vhc, urb, mem_flags);
+	if(unlikely(!urbp))
+		return -ENOMEM;
+	urbp->vep = vep;
+	atomic_set(&urbp->status, urb->status);
+
+	vhci_dbg("vhci_urb_enqueue: urb->status = %d(%s)",urb->status,get_status_str(urb->status));
+
+	// only the lock of the endpoint is needed here, so that different endpoints don't contend;
+	// isochronous urbs have to be scheduled, which needs vhc->lock too (as does giving back an
+	// answered urb before vhci_urb_dequeue can get hold of it, and putting an idle endpoint onto
+	// ep_ready: the urb has to be counted in work_pending only once its endpoint can be found there)
+	iso = usb_pipeisoc(urb->pipe);
+	// (if user space posts data right after this check, then it answers the urb from the inbox)
+	posted = usb_pipebulk(urb->pipe) && usb_pipein(urb->pipe) && !list_empty(&vep->posted);
+	locked = iso || cached || posted || list_empty(&vep->urbp_list_inbox);
+relock:
+	if(locked)
+	{
+		spin_lock_irqsave(&vhc->lock, flags);
+		spin_lock(&vep->lock);
+	}
+	else
+	{
+		spin_lock_irqsave(&vep->lock, flags);
+		if(unlikely(list_empty(&vep->urbp_list_inbox)))
+		{
+			// the endpoint has become idle meanwhile
+			spin_unlock_irqrestore(&vep->lock, flags);
+			locked = 1;
+			goto relock;
+		}
+	}
+	// hcpriv has to be valid as soon as the urb is linked, because vhci_urb_dequeue relies on it
+	urb->hcpriv = urbp;
+#ifndef OLD_GIVEBACK_MECH
+	retval = usb_hcd_link_urb_to_ep(hcd, urb);
+	if(unlikely(retval))
+	{
+		urb->hcpriv = NULL;
+		if(locked)
+		{
+			spin_unlock(&vep->lock);
+			spin_unlock_irqrestore(&vhc->lock, flags);
+		}
+		else
+			spin_unlock_irqrestore(&vep->lock, flags);
+		if(!urbp_pool_put(vhc, urbp))
+			kmem_cache_free(urbp_cache, urbp);
+		return retval;
+	}
+#endif
+	usb_get_dev(urb->dev);
+	atomic_inc(&vhc->in_flight);
+	usb_vhci_stat_inc(vhc, enqueued[usb_pipetype(urb->pipe)]);
+	// (every urb starts in the inbox state)
+	usb_vhci_stat_inc(vhc, urbs[USB_VHCI_URB_STATE_INBOX]);
+	trace_usb_vhci_urb_enqueue(urb, 0, urb->status);
+	capture_urb_event(vhc, urb, 'S', -EINPROGRESS);
+	// (the descriptor is copied only now, so that a urb which is rejected above stays untouched)
+	if(unlikely(cached) && desc_cache_answer(vhc, hcd, urb, &cached_status))
+	{
+		// user space never sees this urb; it isn't in any list, so detaching it does nothing
+		spin_unlock(&vep->lock);
+		INIT_LIST_HEAD(&urbp->urbp_list);
+		usb_vhci_maybe_set_status(urbp, cached_status);
+		usb_vhci_stat_inc(vhc, desc_cache_hits);
+		usb_vhci_urb_retire(vhc, urbp, &done);
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		usb_vhci_urb_giveback_list(vhc, &done);
+		return 0;
+	}
+	if(iso && iso_schedule(vhc, urbp))
+	{
+		// user space gets it when its frame has come
+		spin_unlock(&vep->lock);
+		iso_hold(vhc, urbp);
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		return 0;
+	}
+	urbp->t_inbox = latency_now();
+	list_add_tail(&urbp->urbp_list, &vep->urbp_list_inbox);
+	// (vep->chan changes only while vep->lock is held)
+	chan = vep->chan;
+	if(!locked)
+	{
+		// the inbox wasn't empty, so the endpoint is in ep_ready already (or the one who filled
+		// the inbox puts it there before it releases vhc->lock, which fetchers need)
+		atomic_inc(&vhc->chans[chan].work_pending);
+		spin_unlock_irqrestore(&vep->lock, flags);
+		vhci_wakeup(vhc, chan);
+		return 0;
+	}
+	spin_unlock(&vep->lock);
+	if(list_empty(&vep->ep_ready))
+		list_add_tail(&vep->ep_ready, &vhc->chans[chan].ep_ready[usb_pipetype(urb->pipe)]);
+	atomic_inc(&vhc->chans[chan].work_pending);
+	if(unlikely(posted))
+	{
+		posted_drain(vhc, vep, &done);
+		// user space only has to know about the urb if the posted data didn't suffice
+		// (urb->hcpriv is cleared as soon as the urb is retired)
+		unanswered = urb->hcpriv != NULL;
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		usb_vhci_urb_giveback_list(vhc, &done);
+		if(unanswered)
+			vhci_wakeup(vhc, chan);
+		return 0;
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	vhci_wakeup(vhc, chan);
+	return 0;
+}
+
+#ifdef OLD_GIVEBACK_MECH
+static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb)
+#else
+static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
+#endif
+{
+	struct usb_vhci_hcd *vhc;
+	struct device *dev;
+	unsigned long flags;
+	struct usb_vhci_urb_priv *urbp;
+	struct usb_vhci_ep *vep;
+#ifndef OLD_GIVEBACK_MECH
+	int retval;
+#endif
+
+	vhc = usbhcd_to_vhcihcd(hcd);
+	dev = vhcihcd_to_dev(vhc);
+
+	trace_function(dev);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+#ifndef OLD_GIVEBACK_MECH
+	retval = usb_hcd_check_unlink_urb(hcd, urb, status);
+	if(retval)
+	{
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		return retval;
+	}
+#endif
+
+	if(unlikely(!(urbp = urb->hcpriv)))
+	{
+		// the urb is being given back already
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		return 0;
+	}
+	usb_vhci_stat_inc(vhc, dequeued[usb_pipetype(urb->pipe)]);
+#ifdef OLD_GIVEBACK_MECH
+	trace_usb_vhci_urb_dequeue(urb, urbp->handle, urb->status);
+#else
+	trace_usb_vhci_urb_dequeue(urb, urbp->handle, status);
+#endif
+	// The state of the urb tells where it is, so it can be found without searching the queues of its
+	// endpoint. (vhc->lock protects the state; all transitions happen while it is held.)
+	switch(urbp->state)
+	{
+	case USB_VHCI_URB_STATE_HELD:
+		// user space hasn't seen the urb yet
+	case USB_VHCI_URB_STATE_PARKED:
+		// user space has forgotten about the urb
+	case USB_VHCI_URB_STATE_INBOX:
+		// it is still in the queue of unprocessed urbs; detaching takes it out of there
+		usb_vhci_urb_giveback(vhc, urbp);
+		break;
+
+	case USB_VHCI_URB_STATE_FETCHED:
+		// the urb is on a vacation through user space, so it has to be canceled there (by the
+		// channel which has fetched it)
+		vep = urbp->vep;
+		spin_lock(&vep->lock);
+		list_move_tail(&urbp->urbp_list, &vhc->chans[urbp->chan].urbp_list_cancel);
+		usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_CANCEL);
+		spin_unlock(&vep->lock);
+		atomic_inc(&vhc->chans[urbp->chan].work_pending);
+		vhci_wakeup(vhc, urbp->chan);
+		break;
+
+	default:
+		// it is being canceled already
+		break;
+	}
+
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return 0;
+}
+
+// iterates over the changed ports (see usb_vhci_hcd.port_changed) of the root hub whose ports follow
+// behind port# first; port is the port# within the controller
+// caller has vhc->lock
+#define for_each_changed_port(port, vhc, first) \
+	for((port) = find_next_bit((vhc)->port_changed, (first) + (vhc)->rh_port_count + 1, (first) + 1); \
+	    (port) <= (first) + (vhc)->rh_port_count; \
+	    (port) = find_next_bit((vhc)->port_changed, (first) + (vhc)->rh_port_count + 1, (port) + 1))
+
+static int vhci_hub_status(struct usb_hcd *hcd, char *buf)
+{
+	struct usb_vhci_hcd *vhc;
+	struct device *dev;
+	unsigned long flags, port;
+	u8 first;
+	int changed = 0;
+	int idx, rel_bit, abs_bit;
+
+	vhc = usbhcd_to_vhcihcd(hcd);
+	dev = vhcihcd_to_dev(vhc);
+
+	trace_function(dev);
+
+	memset(buf, 0, 1 + vhc->rh_port_count / 8);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	if(!test_bit(HCD_FLAG_HW_ACCESSIBLE, &hcd->flags))
+	{
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		return 0;
+	}
+
+	// only the ports which have changes are visited (port is the port# within the controller)
+	first = rh_first_port(vhc, hcd);
+	for_each_changed_port(port, vhc, first)
+	{
+		abs_bit = port - first;
+		idx     = abs_bit / (sizeof *buf * 8);
+		rel_bit = abs_bit % (sizeof *buf * 8);
+		buf[idx] |= (1 << rel_bit);
+		changed = 1;
+#ifdef DEBUG
+		if(debug_output) dev_dbg(dev, "port %d status 0x%04x has changes at 0x%04x\n", (int)port, (int)vhc->ports[port - 1].port_status, (int)vhc->ports[port - 1].port_change);
+#endif
+	}
+
+	if(vhc->rh_state[rh_index(vhc, hcd)] == USB_VHCI_RH_SUSPENDED && changed)
+		usb_hcd_resume_root_hub(hcd);
+
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return changed;
+}
+
+// caller has vhc->lock
+// called in vhci_hub_control only
+static inline void hub_descriptor(const struct usb_vhci_hcd *vhc, char *buf, u16 len)
+{
+	struct usb_hub_descriptor desc;
+	int portArrLen = vhc->rh_port_count / 8 + 1; // length of one port bit-array in bytes
+	u16 l = USB_DT_HUB_NONVAR_SIZE + 2 * portArrLen; // length of our hub descriptor
+	memset(&desc, 0, USB_DT_HUB_NONVAR_SIZE);
+
+	if(likely(len > USB_DT_HUB_NONVAR_SIZE))
+	{
+		if(unlikely(len < l)) l = len;
+		if(likely(l > USB_DT_HUB_NONVAR_SIZE))
+		{
+			memset(buf + USB_DT_HUB_NONVAR_SIZE, 0, l - USB_DT_HUB_NONVAR_SIZE);
+			if(likely(l > USB_DT_HUB_NONVAR_SIZE + portArrLen))
+				memset(buf + USB_DT_HUB_NONVAR_SIZE + portArrLen, 0xff, l - (USB_DT_HUB_NONVAR_SIZE + portArrLen));
+		}
+	}
+	else l = len;
+
+	desc.bDescLength = l;
 	desc.bDescriptorType = 0x29;
-	desc.bNbrPorts = vhc->port_count;
+	desc.bNbrPorts = vhc->rh_port_count;
 	desc.wHubCharacteristics = __constant_cpu_to_le16(0x0009); // Per port power and overcurrent
 	memcpy(buf, &desc, l);
 }
 
+#ifndef NO_SHARED_HCD
+// caller has vhc->lock
+// called in vhci_hub_control only
+static inline void ss_hub_descriptor(const struct usb_vhci_hcd *vhc, char *buf, u16 len)
+{
+	// (see USB 3.0 spec section 10.13.2.1)
+	u8 desc[12];
+	memset(desc, 0, sizeof desc);
+	desc[0] = sizeof desc;         // bDescLength
+	desc[1] = USB_DT_SS_HUB;       // bDescriptorType
+	desc[2] = vhc->rh_port_count;  // bNbrPorts
+	desc[3] = 0x09;                // wHubCharacteristics: Per port power and overcurrent
+	// bPwrOn2PwrGood, bHubContrCurrent, bHubHdrDecLat and wHubDelay are zero for virtual ports
+	// and all bits of DeviceRemovable are cleared, because all devices are removable
+	if(len > sizeof desc) len = sizeof desc;
+	memcpy(buf, desc, len);
+}
+
+// The ports of the USB 3.0 root hub use the bits of USB 2.0 ports internally (and in user space),
+// so that they can share the state machine with all other ports. This function translates
+// them to the wPortStatus and wPortChange fields of a USB 3.0 hub (see USB 3.0 spec section
+// 10.14.2.6).
+// caller has vhc->lock
+// called in vhci_hub_control only
+static inline u32 ss_port_status(const struct usb_vhci_port *port)
+{
+	const u16 s = port->port_status, c = port->port_change;
+	u16 status, change;
+
+	status = s & (USB_PORT_STAT_CONNECTION |
+	              USB_PORT_STAT_ENABLE |
+	              USB_PORT_STAT_OVERCURRENT |
+	              USB_PORT_STAT_RESET);
+	if(!(s & USB_PORT_STAT_POWER))
+		status |= USB_SS_PORT_LS_SS_DISABLED;
+	else if(!(s & USB_PORT_STAT_CONNECTION))
+		status |= USB_SS_PORT_STAT_POWER | USB_SS_PORT_LS_RX_DETECT;
+	else if(s & USB_PORT_STAT_SUSPEND)
+		status |= USB_SS_PORT_STAT_POWER | USB_SS_PORT_LS_U3;
+	else
+		status |= USB_SS_PORT_STAT_POWER | USB_SS_PORT_LS_U0;
+	// the speed bits stay zero, which means 5 Gbit/s
+
+	change = c & (USB_PORT_STAT_C_CONNECTION |
+	              USB_PORT_STAT_C_OVERCURRENT |
+	              USB_PORT_STAT_C_RESET);
+	if(c & USB_PORT_STAT_C_SUSPEND)
+		change |= USB_PORT_STAT_C_LINK_STATE;
+	return status | ((u32)change << 16);
+}
+#endif
+
+// caller has vhc->lock
+// called in vhci_hub_control only
+static void port_suspend(struct usb_vhci_hcd *vhc, u8 index)
+{
+	struct usb_vhci_port *const p = &vhc->ports[index - 1];
+	// USB 2.0 spec section 11.24.2.7.1.3:
+	//  "This bit can be set only if the port’s PORT_ENABLE bit is set and the hub receives
+	//  a SetPortFeature(PORT_SUSPEND) request."
+	// The spec also says that the suspend bit has to be cleared whenever the enable bit is cleared.
+	// (see also section 11.5)
+	if((p->port_status & USB_PORT_STAT_ENABLE) && !(p->port_status & USB_PORT_STAT_SUSPEND))
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "Port %d suspended\n", (int)index);
+#endif
+		p->port_status |= USB_PORT_STAT_SUSPEND;
+		vhci_port_update(vhc, index);
+	}
+}
+
+// caller has vhc->lock
+// called in vhci_hub_control only
+static void port_resume(struct usb_vhci_hcd *vhc, u8 index)
+{
+	struct usb_vhci_port *const p = &vhc->ports[index - 1];
+	// (see USB 2.0 spec section 11.5 and 11.24.2.7.1.3)
+	if(p->port_status & USB_PORT_STAT_SUSPEND)
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "Port %d resuming\n", (int)index);
+#endif
+		p->port_flags |= USB_VHCI_PORT_STAT_FLAG_RESUMING;
+		vhci_port_update(vhc, index);
+	}
+}
+
+// caller has vhc->lock
+// called in vhci_hub_control only
+static void port_disable(struct usb_vhci_hcd *vhc, u8 index)
+{
+	struct usb_vhci_port *const p = &vhc->ports[index - 1];
+	// (see USB 2.0 spec section 11.5.1.4 and 11.24.2.7.{1,2}.2)
+	if(p->port_status & USB_PORT_STAT_ENABLE)
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "Port %d disabled\n", (int)index);
+#endif
+		// clear enable and suspend bits (see section 11.24.2.7.1.{2,3})
+		p->port_status &= ~(USB_PORT_STAT_ENABLE | USB_PORT_STAT_SUSPEND);
+		// i'm not quite sure if the suspend change bit should be cleared too (see section 11.24.2.7.2.{2,3})
+		p->port_change &= ~(USB_PORT_STAT_C_ENABLE | USB_PORT_STAT_C_SUSPEND);
+		// clear resuming flag
+		p->port_flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
+		// TODO: maybe we should clear the low/high speed bits here (section 11.24.2.7.1.{7,8})
+		vhci_port_update(vhc, index);
+	}
+}
+
+// caller has vhc->lock
+// called in vhci_hub_control only
+static void port_reset(struct usb_vhci_hcd *vhc, u8 index)
+{
+	struct usb_vhci_port *const p = &vhc->ports[index - 1];
+	// (see USB 2.0 spec section 11.24.2.7.1.5)
+	// initiate reset only if there is a device plugged into the port and if there isn't already a reset pending
+	if((p->port_status & USB_PORT_STAT_CONNECTION) && !(p->port_status & USB_PORT_STAT_RESET))
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "Port %d resetting\n", (int)index);
+#endif
+
+		// keep the state of these bits and clear all others
+		p->port_status &= USB_PORT_STAT_POWER
+		                | USB_PORT_STAT_CONNECTION
+		                | USB_PORT_STAT_LOW_SPEED
+		                | USB_PORT_STAT_HIGH_SPEED
+		                | USB_PORT_STAT_OVERCURRENT;
+
+		p->port_status |= USB_PORT_STAT_RESET; // reset initiated
+
+		// clear resuming flag
+		p->port_flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
+
+		vhci_port_update(vhc, index);
+	}
+#ifdef DEBUG
+	else if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "Port %d reset not possible because of port_state=%04x\n", (int)index, (int)p->port_status);
+#endif
+}
+
 static int vhci_hub_control(struct usb_hcd *hcd,
                             u16 typeReq,
                             u16 wValue,
@@ -395,7 +1727,9 @@ static int vhci_hub_control(struct usb_hcd *hcd,
 	unsigned long flags;
 	u16 *ps, *pc;
 	u8 *pf;
-	u8 port, has_changes = 0;
+	u8 first, index, ss, has_changes = 0;
+	u16 rel_index;
+	u32 stat;
 
 	vhc = usbhcd_to_vhcihcd(hcd);
 	dev = vhcihcd_to_dev(vhc);
@@ -407,6 +1741,13 @@ static int vhci_hub_control(struct usb_hcd *hcd,
 
 	spin_lock_irqsave(&vhc->lock, flags);
 
+	// wIndex is the port# within the root hub; index is the port# within the controller. USB 3.0
+	// hubs use the high byte of wIndex in some requests for additional parameters.
+	ss = rh_index(vhc, hcd);
+	first = rh_first_port(vhc, hcd);
+	rel_index = ss ? (wIndex & 0xff) : wIndex;
+	index = (rel_index && rel_index <= vhc->rh_port_count) ? first + rel_index : 0;
+
 	switch(typeReq)
 	{
 	case ClearHubFeature:
@@ -421,30 +1762,22 @@ static int vhci_hub_control(struct usb_hcd *hcd,
 #ifdef DEBUG
 		if(debug_output) dev_dbg(dev, "%s: ClearPortFeature [wValue=0x%04x, wIndex=%d]\n", __FUNCTION__, (int)wValue, (int)wIndex);
 #endif
-		if(unlikely(!wIndex || wIndex > vhc->port_count || wLength))
+		if(unlikely(!index || wLength))
 			goto err;
-		ps = &vhc->ports[wIndex - 1].port_status;
-		pc = &vhc->ports[wIndex - 1].port_change;
-		pf = &vhc->ports[wIndex - 1].port_flags;
+		ps = &vhc->ports[index - 1].port_status;
+		pc = &vhc->ports[index - 1].port_change;
+		pf = &vhc->ports[index - 1].port_flags;
 		switch(wValue)
 		{
 		case USB_PORT_FEAT_SUSPEND:
-			// (see USB 2.0 spec section 11.5 and 11.24.2.7.1.3)
-			if(*ps & USB_PORT_STAT_SUSPEND)
-			{
-#ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d resuming\n", (int)wIndex);
-#endif
-				*pf |= USB_VHCI_PORT_STAT_FLAG_RESUMING;
-				vhci_port_update(vhc, wIndex);
-			}
+			port_resume(vhc, index);
 			break;
 		case USB_PORT_FEAT_POWER:
 			// (see USB 2.0 spec section 11.11 and 11.24.2.7.1.6)
 			if(*ps & USB_PORT_STAT_POWER)
 			{
 #ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d power-off\n", (int)wIndex);
+				if(debug_output) dev_dbg(dev, "Port %d power-off\n", (int)index);
 #endif
 				// clear all status bits except overcurrent (see USB 2.0 spec section 11.24.2.7.1)
 				*ps &= USB_PORT_STAT_OVERCURRENT;
@@ -452,25 +1785,11 @@ static int vhci_hub_control(struct usb_hcd *hcd,
 				*pc &= USB_PORT_STAT_C_OVERCURRENT;
 				// clear resuming flag
 				*pf &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
-				vhci_port_update(vhc, wIndex);
+				vhci_port_update(vhc, index);
 			}
 			break;
 		case USB_PORT_FEAT_ENABLE:
-			// (see USB 2.0 spec section 11.5.1.4 and 11.24.2.7.{1,2}.2)
-			if(*ps & USB_PORT_STAT_ENABLE)
-			{
-#ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d disabled\n", (int)wIndex);
-#endif
-				// clear enable and suspend bits (see section 11.24.2.7.1.{2,3})
-				*ps &= ~(USB_PORT_STAT_ENABLE | USB_PORT_STAT_SUSPEND);
-				// i'm not quite sure if the suspend change bit should be cleared too (see section 11.24.2.7.2.{2,3})
-				*pc &= ~(USB_PORT_STAT_C_ENABLE | USB_PORT_STAT_C_SUSPEND);
-				// clear resuming flag
-				*pf &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
-				// TODO: maybe we should clear the low/high speed bits here (section 11.24.2.7.1.{7,8})
-				vhci_port_update(vhc, wIndex);
-			}
+			port_disable(vhc, index);
 			break;
 		case USB_PORT_FEAT_CONNECTION:
 		case USB_PORT_FEAT_OVER_CURRENT:
@@ -487,9 +1806,27 @@ static int vhci_hub_control(struct usb_hcd *hcd,
 			if(*pc & (1 << (wValue - 16)))
 			{
 				*pc &= ~(1 << (wValue - 16));
-				vhci_port_update(vhc, wIndex);
+				vhci_port_update(vhc, index);
+			}
+			break;
+#ifndef NO_SHARED_HCD
+		case USB_PORT_FEAT_C_PORT_LINK_STATE:
+			// (see ss_port_status)
+			if(unlikely(!ss))
+				goto err;
+			if(*pc & USB_PORT_STAT_C_SUSPEND)
+			{
+				*pc &= ~USB_PORT_STAT_C_SUSPEND;
+				vhci_port_update(vhc, index);
 			}
 			break;
+		case USB_PORT_FEAT_C_BH_PORT_RESET:
+		case USB_PORT_FEAT_C_PORT_CONFIG_ERROR:
+			// warm resets complete like normal ones and there are no link errors
+			if(unlikely(!ss))
+				goto err;
+			break; // no-op
+#endif
 		//case USB_PORT_FEAT_TEST:
 		default:
 			goto err;
@@ -501,6 +1838,13 @@ static int vhci_hub_control(struct usb_hcd *hcd,
 #endif
 		if(unlikely(wIndex))
 			goto err;
+#ifndef NO_SHARED_HCD
+		if(ss)
+		{
+			ss_hub_descriptor(vhc, buf, wLength);
+			break;
+		}
+#endif
 		hub_descriptor(vhc, buf, wLength);
 		break;
 	case GetHubStatus:
@@ -515,79 +1859,48 @@ static int vhci_hub_control(struct usb_hcd *hcd,
 #ifdef DEBUG
 		if(debug_output) dev_dbg(dev, "%s: GetPortStatus [wIndex=%d]\n", __FUNCTION__, (int)wIndex);
 #endif
-		if(unlikely(wValue || !wIndex || wIndex > vhc->port_count || wLength != 4))
+		if(unlikely(wValue || !index || wLength != 4))
 			goto err;
 #ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "%s: ==> [port_status=0x%04x] [port_change=0x%04x]\n", __FUNCTION__, (int)vhc->ports[wIndex - 1].port_status, (int)vhc->ports[wIndex - 1].port_change);
+		if(debug_output) dev_dbg(dev, "%s: ==> [port_status=0x%04x] [port_change=0x%04x]\n", __FUNCTION__, (int)vhc->ports[index - 1].port_status, (int)vhc->ports[index - 1].port_change);
 #endif
-		buf[0] = (u8)vhc->ports[wIndex - 1].port_status;
-		buf[1] = (u8)(vhc->ports[wIndex - 1].port_status >> 8);
-		buf[2] = (u8)vhc->ports[wIndex - 1].port_change;
-		buf[3] = (u8)(vhc->ports[wIndex - 1].port_change >> 8);
+		stat = vhc->ports[index - 1].port_status | ((u32)vhc->ports[index - 1].port_change << 16);
+#ifndef NO_SHARED_HCD
+		if(ss)
+			stat = ss_port_status(&vhc->ports[index - 1]);
+#endif
+		buf[0] = (u8)stat;
+		buf[1] = (u8)(stat >> 8);
+		buf[2] = (u8)(stat >> 16);
+		buf[3] = (u8)(stat >> 24);
 		break;
 	case SetPortFeature:
 #ifdef DEBUG
 		if(debug_output) dev_dbg(dev, "%s: SetPortFeature [wValue=0x%04x, wIndex=%d]\n", __FUNCTION__, (int)wValue, (int)wIndex);
 #endif
-		if(unlikely(!wIndex || wIndex > vhc->port_count || wLength))
+		if(unlikely(!index || wLength))
 			goto err;
-		ps = &vhc->ports[wIndex - 1].port_status;
-		pc = &vhc->ports[wIndex - 1].port_change;
-		pf = &vhc->ports[wIndex - 1].port_flags;
+		ps = &vhc->ports[index - 1].port_status;
+		pc = &vhc->ports[index - 1].port_change;
+		pf = &vhc->ports[index - 1].port_flags;
 		switch(wValue)
 		{
 		case USB_PORT_FEAT_SUSPEND:
-			// USB 2.0 spec section 11.24.2.7.1.3:
-			//  "This bit can be set only if the port’s PORT_ENABLE bit is set and the hub receives
-			//  a SetPortFeature(PORT_SUSPEND) request."
-			// The spec also says that the suspend bit has to be cleared whenever the enable bit is cleared.
-			// (see also section 11.5)
-			if((*ps & USB_PORT_STAT_ENABLE) && !(*ps & USB_PORT_STAT_SUSPEND))
-			{
-#ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d suspended\n", (int)wIndex);
-#endif
-				*ps |= USB_PORT_STAT_SUSPEND;
-				vhci_port_update(vhc, wIndex);
-			}
+			port_suspend(vhc, index);
 			break;
 		case USB_PORT_FEAT_POWER:
 			// (see USB 2.0 spec section 11.11 and 11.24.2.7.1.6)
 			if(!(*ps & USB_PORT_STAT_POWER))
 			{
 #ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d power-on\n", (int)wIndex);
+				if(debug_output) dev_dbg(dev, "Port %d power-on\n", (int)index);
 #endif
 				*ps |= USB_PORT_STAT_POWER;
-				vhci_port_update(vhc, wIndex);
+				vhci_port_update(vhc, index);
 			}
 			break;
 		case USB_PORT_FEAT_RESET:
-			// (see USB 2.0 spec section 11.24.2.7.1.5)
-			// initiate reset only if there is a device plugged into the port and if there isn't already a reset pending
-			if((*ps & USB_PORT_STAT_CONNECTION) && !(*ps & USB_PORT_STAT_RESET))
-			{
-#ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "Port %d resetting\n", (int)wIndex);
-#endif
-
-				// keep the state of these bits and clear all others
-				*ps &= USB_PORT_STAT_POWER
-				     | USB_PORT_STAT_CONNECTION
-				     | USB_PORT_STAT_LOW_SPEED
-				     | USB_PORT_STAT_HIGH_SPEED
-				     | USB_PORT_STAT_OVERCURRENT;
-
-				*ps |= USB_PORT_STAT_RESET; // reset initiated
-
-				// clear resuming flag
-				*pf &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
-
-				vhci_port_update(vhc, wIndex);
-			}
-#ifdef DEBUG
-			else if(debug_output) dev_dbg(dev, "Port %d reset not possible because of port_state=%04x\n", (int)wIndex, (int)*ps);
-#endif
+			port_reset(vhc, index);
 			break;
 		case USB_PORT_FEAT_CONNECTION:
 		case USB_PORT_FEAT_OVER_CURRENT:
@@ -603,15 +1916,48 @@ static int vhci_hub_control(struct usb_hcd *hcd,
 			if(!(*pc & (1 << (wValue - 16))))
 			{
 				*pc |= 1 << (wValue - 16);
-				vhci_port_update(vhc, wIndex);
+				vhci_port_update(vhc, index);
+			}
+			break;
+#ifndef NO_SHARED_HCD
+		case USB_PORT_FEAT_LINK_STATE:
+			// (see USB 3.0 spec section 10.14.2.10)
+			if(unlikely(!ss))
+				goto err;
+			switch((wIndex >> 8) << 5)
+			{
+			case USB_SS_PORT_LS_U3:          port_suspend(vhc, index); break;
+			case USB_SS_PORT_LS_U0:          port_resume(vhc, index);  break;
+			case USB_SS_PORT_LS_SS_DISABLED: port_disable(vhc, index); break;
+			default:                         break; // no-op
 			}
 			break;
+		case USB_PORT_FEAT_BH_PORT_RESET:
+			if(unlikely(!ss))
+				goto err;
+			port_reset(vhc, index);
+			break;
+		case USB_PORT_FEAT_U1_TIMEOUT:
+		case USB_PORT_FEAT_U2_TIMEOUT:
+		case USB_PORT_FEAT_REMOTE_WAKE_MASK:
+			// virtual links don't have low power states
+			if(unlikely(!ss))
+				goto err;
+			break; // no-op
+#endif
 		//case USB_PORT_FEAT_ENABLE: // port can't be enabled without reseting (USB 2.0 spec section 11.24.2.7.1.2)
 		//case USB_PORT_FEAT_TEST:
 		default:
 			goto err;
 		}
 		break;
+#if !defined(NO_SHARED_HCD) && defined(SetHubDepth)
+	case SetHubDepth:
+		// root hubs are always at depth 0
+		if(unlikely(!ss || wValue || wIndex || wLength))
+			goto err;
+		break;
+#endif
 	default:
 #ifdef DEBUG
 		if(debug_output) dev_dbg(dev, "%s: +++UNHANDLED_REQUEST+++ [req=0x%04x, v=0x%04x, i=0x%04x, l=%d]\n", __FUNCTION__, (int)typeReq, (int)wValue, (int)wIndex, (int)wLength);
@@ -624,9 +1970,7 @@ err:
 		retval = -EPIPE;
 	}
 
-	for(port = 0; port < vhc->port_count; port++)
-		if(vhc->ports[port].port_change)
-			has_changes = 1;
+	has_changes = find_next_bit(vhc->port_changed, first + vhc->rh_port_count + 1, first + 1) <= first + vhc->rh_port_count;
 
 	spin_unlock_irqrestore(&vhc->lock, flags);
 
@@ -640,7 +1984,7 @@ static int vhci_bus_suspend(struct usb_hcd *hcd)
 	struct usb_vhci_hcd *vhc;
 	struct device *dev;
 	unsigned long flags;
-	u8 port;
+	u8 port, first;
 
 	vhc = usbhcd_to_vhcihcd(hcd);
 	dev = vhcihcd_to_dev(vhc);
@@ -650,7 +1994,8 @@ static int vhci_bus_suspend(struct usb_hcd *hcd)
 	spin_lock_irqsave(&vhc->lock, flags);
 
 	// suspend ports
-	for(port = 0; port < vhc->port_count; port++)
+	first = rh_first_port(vhc, hcd);
+	for(port = first; port < first + vhc->rh_port_count; port++)
 	{
 		if((vhc->ports[port].port_status & USB_PORT_STAT_ENABLE) &&
 			!(vhc->ports[port].port_status & USB_PORT_STAT_SUSPEND))
@@ -664,7 +2009,7 @@ static int vhci_bus_suspend(struct usb_hcd *hcd)
 
 	// TODO: somehow we have to suppress the resuming of ports while the bus is suspended
 
-	vhc->rh_state = USB_VHCI_RH_SUSPENDED;
+	vhc->rh_state[rh_index(vhc, hcd)] = USB_VHCI_RH_SUSPENDED;
 	hcd->state = HC_STATE_SUSPENDED;
 
 	spin_unlock_irqrestore(&vhc->lock, flags);
@@ -692,7 +2037,7 @@ static int vhci_bus_resume(struct usb_hcd *hcd)
 	}
 	else
 	{
-		vhc->rh_state = USB_VHCI_RH_RUNNING;
+		vhc->rh_state[rh_index(vhc, hcd)] = USB_VHCI_RH_RUNNING;
 		//set_link_state(vhc);
 		hcd->state = HC_STATE_RUNNING;
 	}
@@ -701,20 +2046,119 @@ static int vhci_bus_resume(struct usb_hcd *hcd)
 	return rc;
 }
 
-static inline ssize_t show_urb(char *buf, size_t size, struct urb *urb)
+// Lets the root hub suspend itself while nothing is connected to it. A suspended controller doesn't
+// cost anything (the hub status is only looked at when user space changes a port, and the
+// iso timer only runs while there are isochronous urbs). The next PORTSTAT resumes the root hub
+// (see vhci_hub_status).
+// called in vhci_hcd_probe only
+static void vhci_enable_autosuspend(struct usb_hcd *hcd)
+{
+#ifndef NO_RUNTIME_AUTOSUSPEND
+	struct usb_device *const rhdev = hcd->self.root_hub;
+	if(autosuspend_delay >= 0)
+		pm_runtime_set_autosuspend_delay(&rhdev->dev, autosuspend_delay);
+	usb_enable_autosuspend(rhdev);
+#endif
+}
+
+// what the listings of the urbs show about an urb; it is copied while the locks are held, so that
+// the printing can happen without them
+struct urb_snap
+{
+	const void *urb; // (only for identifying it; it may be gone already)
+	u64 handle;
+	unsigned int pipe;
+	u32 actual_length;
+	u32 transfer_buffer_length;
+	enum usb_device_speed speed;
+	enum usb_vhci_urb_state state;
+};
+
+// The listings walk vhc->urbp_list_all in chunks of this many urbs; the lock is dropped between two
+// chunks, and a cursor tells where the next one starts.
+#define URB_SNAP_CHUNK 16
+
+static const char *const urb_state_name[USB_VHCI_URB_STATES] = {
+	[USB_VHCI_URB_STATE_INBOX]     = "inbox",
+	[USB_VHCI_URB_STATE_FETCHED]   = "fetched",
+	[USB_VHCI_URB_STATE_CANCEL]    = "cancel",
+	[USB_VHCI_URB_STATE_CANCELING] = "canceling",
+	[USB_VHCI_URB_STATE_HELD]      = "held",
+	[USB_VHCI_URB_STATE_PARKED]    = "parked"
+};
+
+// puts the cursor in front of the first urb of the controller
+static void urb_cursor_start(struct usb_vhci_hcd *vhc, struct urb_cursor *cur)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&vhc->urbp_free_lock, flags);
+	cur->next = vhc->urbp_list_all.next;
+	cur->done = 0;
+	list_add(&cur->list, &vhc->urb_cursors);
+	spin_unlock_irqrestore(&vhc->urbp_free_lock, flags);
+}
+
+static void urb_cursor_stop(struct usb_vhci_hcd *vhc, struct urb_cursor *cur)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&vhc->urbp_free_lock, flags);
+	list_del(&cur->list);
+	spin_unlock_irqrestore(&vhc->urbp_free_lock, flags);
+}
+
+// Visits the next (up to) URB_SNAP_CHUNK urbs behind the cursor and copies those, which are in the
+// states selected by mask (bit n for state n), into snap. Returns the number of urbs copied; the
+// cursor is done, when it has reached the end. Only urbp_free_lock is held, which the urbs can't be
+// given back without (see urbp_pool_put); their states may change meanwhile, so a urb may show up
+// in a state which it has just left.
+static unsigned int urb_snapshot(struct usb_vhci_hcd *vhc, struct urb_cursor *cur, unsigned int mask, struct urb_snap *snap)
+{
+	struct usb_vhci_urb_priv *urbp;
+	struct list_head *pos;
+	unsigned long flags;
+	unsigned int count = 0, visited;
+	enum usb_vhci_urb_state state;
+
+	spin_lock_irqsave(&vhc->urbp_free_lock, flags);
+	for(pos = cur->next, visited = 0; pos != &vhc->urbp_list_all && visited < URB_SNAP_CHUNK; pos = pos->next, visited++)
+	{
+		urbp = list_entry(pos, struct usb_vhci_urb_priv, all_list);
+		state = ACCESS_ONCE(urbp->state);
+		if(!(mask & (1 << state)))
+			continue;
+		snap[count].urb = urbp->urb;
+		snap[count].handle = urbp->handle;
+		snap[count].pipe = urbp->urb->pipe;
+		snap[count].actual_length = urbp->urb->actual_length;
+		snap[count].transfer_buffer_length = urbp->urb->transfer_buffer_length;
+		snap[count].speed = urbp->urb->dev->speed;
+		snap[count].state = state;
+		count++;
+	}
+	cur->next = pos;
+	cur->done = pos == &vhc->urbp_list_all;
+	spin_unlock_irqrestore(&vhc->urbp_free_lock, flags);
+	return count;
+}
+
+// prints one urb (without a newline)
+static inline ssize_t show_urb(char *buf, size_t size, const struct urb_snap *urb)
 {
 	int ep = usb_pipeendpoint(urb->pipe);
 
-	return snprintf(buf, size,
-		"urb/%p %s ep%d%s%s len %d/%d\n",
-		urb,
+	return scnprintf(buf, size,
+		"urb/%p %s ep%d%s%s len %d/%d",
+		urb->urb,
 		({
 			char *s;
-			switch(urb->dev->speed)
+			switch(urb->speed)
 			{
 			case USB_SPEED_LOW:  s = "ls"; break;
 			case USB_SPEED_FULL: s = "fs"; break;
 			case USB_SPEED_HIGH: s = "hs"; break;
+#ifndef NO_SHARED_HCD
+			case USB_SPEED_SUPER: s = "ss"; break;
+#endif
 			default:             s = "?";  break;
 			};
 			s;
@@ -739,15 +2183,25 @@ static DEVICE_ATTR(urbs_inbox,     S_IRUSR, show_urbs, NULL);
 static DEVICE_ATTR(urbs_fetched,   S_IRUSR, show_urbs, NULL);
 static DEVICE_ATTR(urbs_cancel,    S_IRUSR, show_urbs, NULL);
 static DEVICE_ATTR(urbs_canceling, S_IRUSR, show_urbs, NULL);
-
+static ssize_t show_urb_counts(struct device *dev, struct device_attribute *attr, char *buf);
+static DEVICE_ATTR(urb_counts,     S_IRUGO, show_urb_counts, NULL);
+static ssize_t show_stats(struct device *dev, struct device_attribute *attr, char *buf);
+static DEVICE_ATTR(stats,          S_IRUGO, show_stats, NULL);
+static ssize_t show_queue_mark(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t store_queue_mark(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static DEVICE_ATTR(queue_high,     S_IRUGO | S_IWUSR, show_queue_mark, store_queue_mark);
+static DEVICE_ATTR(queue_low,      S_IRUGO | S_IWUSR, show_queue_mark, store_queue_mark);
+
+// The listing ends with "...", if it doesn't fit into the page; the urbs file in debugfs has no
+// such limit.
 static ssize_t show_urbs(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct usb_vhci_hcd *vhc;
 	struct platform_device *pdev;
-	struct usb_vhci_urb_priv *urbp;
+	struct urb_snap snap[URB_SNAP_CHUNK];
+	struct urb_cursor cur;
+	unsigned int mask, i, n;
 	size_t size = 0;
-	unsigned long flags;
-	struct list_head *list;
 
 	pdev = to_platform_device(dev);
 	vhc = pdev_to_vhcihcd(pdev);
@@ -755,43 +2209,525 @@ static ssize_t show_urbs(struct device *dev, struct device_attribute *attr, char
 	trace_function(dev);
 
 	if(attr == &dev_attr_urbs_inbox)
-		list = &vhc->urbp_list_inbox;
+		mask = 1 << USB_VHCI_URB_STATE_INBOX;
 	else if(attr == &dev_attr_urbs_fetched)
-		list = &vhc->urbp_list_fetched;
+		mask = 1 << USB_VHCI_URB_STATE_FETCHED;
 	else if(attr == &dev_attr_urbs_cancel)
-		list = &vhc->urbp_list_cancel;
+		mask = 1 << USB_VHCI_URB_STATE_CANCEL;
 	else if(attr == &dev_attr_urbs_canceling)
-		list = &vhc->urbp_list_canceling;
+		mask = 1 << USB_VHCI_URB_STATE_CANCELING;
 	else
 	{
 		dev_err(dev, "unreachable code reached... wtf?\n");
 		return -EINVAL;
 	}
 
-	spin_lock_irqsave(&vhc->lock, flags);
-	list_for_each_entry(urbp, list, urbp_list)
+	urb_cursor_start(vhc, &cur);
+	do
 	{
-		size_t temp;
+		n = urb_snapshot(vhc, &cur, mask, snap);
+		for(i = 0; i < n; i++)
+		{
+			// (a line is less than 96 bytes long)
+			if(unlikely(PAGE_SIZE - size < 96 + 4))
+			{
+				size += scnprintf(buf + size, PAGE_SIZE - size, "...\n");
+				goto out;
+			}
+			size += show_urb(buf + size, PAGE_SIZE - size, &snap[i]);
+			size += scnprintf(buf + size, PAGE_SIZE - size, "\n");
+		}
+	} while(!cur.done);
+out:
+	urb_cursor_stop(vhc, &cur);
+	return size;
+}
+
+// caller has vhc->lock
+// counts the entries of the list
+static unsigned int list_count(const struct list_head *list)
+{
+	const struct list_head *pos;
+	unsigned int n = 0;
+	list_for_each(pos, list)
+		n++;
+	return n;
+}
 
-		temp = PAGE_SIZE - size;
-		if(unlikely(temp <= 0)) break;
+// Counts the urbs in each state (indexed by enum usb_vhci_urb_state) by summing the per cpu counters
+// (see usb_vhci_urb_set_state); no lock is taken and no list is walked. The counters of different
+// cpus aren't read at the same time, so a sum may be off for a moment (or even negative, which is
+// reported as 0). Urbs which are about to be given back still count in their last state.
+static void urb_counts(struct usb_vhci_hcd *vhc, unsigned int counts[USB_VHCI_URB_STATES])
+{
+	long sum;
+	int cpu, i;
 
-		temp = show_urb(buf, temp, urbp->urb);
-		buf += temp;
-		size += temp;
+	for(i = 0; i < USB_VHCI_URB_STATES; i++)
+	{
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += ACCESS_ONCE(per_cpu_ptr(vhc->stats, cpu)->urbs[i]);
+		counts[i] = (sum > 0) ? sum : 0;
+	}
+}
+
+// prints the number of urbs in each state, which is much cheaper than listing them
+static ssize_t show_urb_counts(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_vhci_hcd *vhc = pdev_to_vhcihcd(to_platform_device(dev));
+	unsigned int counts[USB_VHCI_URB_STATES];
+	size_t size = 0;
+	int i;
+
+	trace_function(dev);
+
+	urb_counts(vhc, counts);
+	for(i = 0; i < USB_VHCI_URB_STATES; i++)
+		size += scnprintf(buf + size, PAGE_SIZE - size, "%s %u\n", urb_state_name[i], counts[i]);
+	return size;
+}
+
+static ssize_t show_queue_mark(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_vhci_hcd *vhc = pdev_to_vhcihcd(to_platform_device(dev));
+	return sprintf(buf, "%u\n", (attr == &dev_attr_queue_high) ? vhc->queue_high : vhc->queue_low);
+}
+
+static ssize_t store_queue_mark(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_vhci_hcd *vhc = pdev_to_vhcihcd(to_platform_device(dev));
+	unsigned long val;
+	char *end;
+
+	val = simple_strtoul(buf, &end, 10);
+	if(unlikely(end == buf || (*end && *end != '\n') || val > INT_MAX))
+		return -EINVAL;
+	if(attr == &dev_attr_queue_high)
+	{
+		vhc->queue_high = val;
+		if(!val)
+			vhc->throttled = 0;
+	}
+	else
+		vhc->queue_low = val;
+	return count;
+}
+
+// prints the sums of the per cpu counters and the current number of urbs in each queue
+static ssize_t show_stats(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	static const char *const type_name[USB_VHCI_PIPE_TYPES] = { "iso", "int", "control", "bulk" };
+	struct usb_vhci_hcd *vhc;
+	struct usb_vhci_stats sum, *st;
+	unsigned int counts[USB_VHCI_URB_STATES];
+	size_t size = 0;
+	int cpu, t;
+
+	vhc = pdev_to_vhcihcd(to_platform_device(dev));
+
+	trace_function(dev);
+
+	memset(&sum, 0, sizeof sum);
+	for_each_possible_cpu(cpu)
+	{
+		st = per_cpu_ptr(vhc->stats, cpu);
+		for(t = 0; t < USB_VHCI_PIPE_TYPES; t++)
+		{
+			sum.enqueued[t]  += st->enqueued[t];
+			sum.fetched[t]   += st->fetched[t];
+			sum.completed[t] += st->completed[t];
+			sum.dequeued[t]  += st->dequeued[t];
+		}
+		sum.cancel_races += st->cancel_races;
+		sum.invalid      += st->invalid;
+		sum.naks         += st->naks;
+		sum.rejected     += st->rejected;
+		sum.desc_cache_hits += st->desc_cache_hits;
+		sum.posted_hits  += st->posted_hits;
+		sum.bw_rejected  += st->bw_rejected;
+		sum.capture_drops += st->capture_drops;
+		sum.busy_polls   += st->busy_polls;
+		sum.busy_poll_hits += st->busy_poll_hits;
+		sum.busy_poll_ns += st->busy_poll_ns;
+		sum.bytes_in     += st->bytes_in;
+		sum.bytes_out    += st->bytes_out;
 	}
-	spin_unlock_irqrestore(&vhc->lock, flags);
 
+	urb_counts(vhc, counts);
+
+	for(t = 0; t < USB_VHCI_PIPE_TYPES; t++)
+		size += scnprintf(buf + size, PAGE_SIZE - size,
+			"enqueued_%s %lu\nfetched_%s %lu\ncompleted_%s %lu\ndequeued_%s %lu\n",
+			type_name[t], sum.enqueued[t], type_name[t], sum.fetched[t],
+			type_name[t], sum.completed[t], type_name[t], sum.dequeued[t]);
+	size += scnprintf(buf + size, PAGE_SIZE - size,
+		"bytes_in %llu\nbytes_out %llu\ncancel_races %lu\ninvalid %lu\nnaks %lu\n"
+		"queued_held %u\nqueued_inbox %u\nqueued_fetched %u\nqueued_cancel %u\nqueued_canceling %u\n"
+		"queued_parked %u\nbusy_polls %lu\nbusy_poll_hits %lu\nbusy_poll_ns %llu\n"
+		"in_flight %d\nthrottled %u\nrejected %lu\ndesc_cache_hits %lu\nposted_hits %lu\n"
+		"capture_drops %lu\nbw_rejected %lu\n",
+		(unsigned long long)sum.bytes_in, (unsigned long long)sum.bytes_out, sum.cancel_races, sum.invalid,
+		sum.naks, counts[USB_VHCI_URB_STATE_HELD], counts[USB_VHCI_URB_STATE_INBOX],
+		counts[USB_VHCI_URB_STATE_FETCHED], counts[USB_VHCI_URB_STATE_CANCEL],
+		counts[USB_VHCI_URB_STATE_CANCELING], counts[USB_VHCI_URB_STATE_PARKED],
+		sum.busy_polls, sum.busy_poll_hits, (unsigned long long)sum.busy_poll_ns,
+		atomic_read(&vhc->in_flight), vhc->throttled, sum.rejected, sum.desc_cache_hits,
+		sum.posted_hits, sum.capture_drops, sum.bw_rejected);
 	return size;
 }
 
+// Prints the latency histograms: one line per histogram, one column per bucket. The first line
+// holds the upper bounds of the buckets in microseconds.
+static int latency_show(struct seq_file *m, void *v)
+{
+	static const char *const type_name[USB_VHCI_PIPE_TYPES] = { "iso", "int", "control", "bulk" };
+	struct usb_vhci_hcd *vhc = m->private;
+	struct usb_vhci_latency *lat;
+	unsigned long sum;
+	int cpu, t, b, service;
+
+	seq_puts(m, "usecs");
+	for(b = 0; b < USB_VHCI_LAT_BUCKETS - 1; b++)
+		seq_printf(m, " %lu", 1ul << b);
+	seq_puts(m, " inf\n");
+
+	for(service = 0; service < 2; service++)
+		for(t = 0; t < USB_VHCI_PIPE_TYPES; t++)
+		{
+			seq_printf(m, "%s_%s", service ? "service" : "wait", type_name[t]);
+			for(b = 0; b < USB_VHCI_LAT_BUCKETS; b++)
+			{
+				sum = 0;
+				for_each_possible_cpu(cpu)
+				{
+					lat = per_cpu_ptr(vhc->latency, cpu);
+					sum += service ? lat->service[t][b] : lat->wait[t][b];
+				}
+				seq_printf(m, " %lu", sum);
+			}
+			seq_putc(m, '\n');
+		}
+	return 0;
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, latency_show, inode->i_private);
+}
+
+// Writing anything resets the histograms. This is only best-effort: the service histograms are
+// updated without vhc->lock (see usb_vhci_urb_giveback_list), so a latency which is counted on
+// another cpu at the same time may survive the reset.
+static ssize_t latency_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct usb_vhci_hcd *vhc = ((struct seq_file *)file->private_data)->private;
+	unsigned long flags;
+	int cpu;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(vhc->latency, cpu), 0, sizeof(struct usb_vhci_latency));
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return count;
+}
+
+static const struct file_operations latency_fops = {
+	.owner   = THIS_MODULE,
+	.open    = latency_open,
+	.read    = seq_read,
+	.write   = latency_write,
+	.llseek  = seq_lseek,
+	.release = single_release
+};
+
+// iterator of the urbs file in debugfs; it copies the urbs in chunks (see urb_snapshot)
+struct urbs_seq
+{
+	struct usb_vhci_hcd *vhc;
+	struct urb_cursor cur;
+	loff_t base;        // position of snap[0]
+	unsigned int count; // number of valid entries in snap
+	struct urb_snap snap[URB_SNAP_CHUNK];
+};
+
+static void *urbs_seq_at(struct urbs_seq *s, loff_t pos)
+{
+	if(unlikely(pos < s->base))
+	{
+		// seeking backwards starts over
+		urb_cursor_stop(s->vhc, &s->cur);
+		urb_cursor_start(s->vhc, &s->cur);
+		s->base = 0;
+		s->count = 0;
+	}
+	while(pos >= s->base + s->count)
+	{
+		if(s->cur.done)
+			return NULL;
+		s->base += s->count;
+		s->count = urb_snapshot(s->vhc, &s->cur, ~0u, s->snap);
+	}
+	return &s->snap[pos - s->base];
+}
+
+static void *urbs_seq_start(struct seq_file *m, loff_t *pos)
+{
+	return urbs_seq_at(m->private, *pos);
+}
+
+static void *urbs_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	return urbs_seq_at(m->private, ++*pos);
+}
+
+static void urbs_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+// prints one urb per line: like the urbs_* files in sysfs, plus its state and its handle
+static int urbs_seq_show(struct seq_file *m, void *v)
+{
+	const struct urb_snap *s = v;
+	char line[96];
+
+	show_urb(line, sizeof line, s);
+	seq_printf(m, "%s %s %llu\n", line, urb_state_name[s->state], (unsigned long long)s->handle);
+	return 0;
+}
+
+static const struct seq_operations urbs_seq_ops = {
+	.start = urbs_seq_start,
+	.next  = urbs_seq_next,
+	.stop  = urbs_seq_stop,
+	.show  = urbs_seq_show
+};
+
+static int urbs_open(struct inode *inode, struct file *file)
+{
+	struct urbs_seq *s;
+	int ret = seq_open_private(file, &urbs_seq_ops, sizeof(struct urbs_seq));
+	if(unlikely(ret))
+		return ret;
+	s = ((struct seq_file *)file->private_data)->private;
+	s->vhc = inode->i_private;
+	urb_cursor_start(s->vhc, &s->cur);
+	return 0;
+}
+
+static int urbs_release(struct inode *inode, struct file *file)
+{
+	struct urbs_seq *s = ((struct seq_file *)file->private_data)->private;
+	urb_cursor_stop(s->vhc, &s->cur);
+	return seq_release_private(inode, file);
+}
+
+static const struct file_operations urbs_fops = {
+	.owner   = THIS_MODULE,
+	.open    = urbs_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = urbs_release
+};
+
+// Starts capturing into a new ring of size bytes (which replaces the old one), or stops capturing
+// if size is zero.
+static int capture_setup(struct usb_vhci_hcd *vhc, unsigned long size)
+{
+	struct usb_vhci_capture *c = NULL, *old;
+	unsigned long flags;
+
+	if(unlikely(size && (size < USB_VHCI_CAPTURE_MIN || size > USB_VHCI_CAPTURE_MAX)))
+		return -EINVAL;
+	if(size)
+	{
+		c = vmalloc(sizeof *c + size);
+		if(unlikely(!c))
+			return -ENOMEM;
+		c->size = size;
+		c->head = c->tail = c->used = 0;
+	}
+
+	spin_lock_irqsave(&vhc->capture_lock, flags);
+	old = vhc->capture;
+	vhc->capture = c;
+	spin_unlock_irqrestore(&vhc->capture_lock, flags);
+	// readers of the old ring see the end of it
+	wake_up_interruptible(&vhc->capture_wait);
+	vfree(old);
+	return 0;
+}
+
+static int capture_readable(struct usb_vhci_hcd *vhc)
+{
+	unsigned long flags;
+	int ret;
+	spin_lock_irqsave(&vhc->capture_lock, flags);
+	ret = !vhc->capture || vhc->capture->used;
+	spin_unlock_irqrestore(&vhc->capture_lock, flags);
+	return ret;
+}
+
+static int capture_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return nonseekable_open(inode, file);
+}
+
+// Every reader gets the pcap file header first, followed by the packets. Packets which were read are
+// gone, so there should be only one reader at a time. Reading returns 0 (end of file) while
+// capturing is off; it blocks until there are packets otherwise.
+static ssize_t capture_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct usb_vhci_hcd *vhc = file->private_data;
+	unsigned long flags;
+	ssize_t ret;
+	void *bounce;
+	u32 n = 0;
+
+	if(*ppos < sizeof capture_file_hdr)
+	{
+		n = min_t(size_t, count, sizeof capture_file_hdr - *ppos);
+		if(unlikely(copy_to_user(buf, (const u8 *)&capture_file_hdr + *ppos, n)))
+			return -EFAULT;
+		*ppos += n;
+		return n;
+	}
+	if(unlikely(!count))
+		return 0;
+
+	count = min_t(size_t, count, PAGE_SIZE);
+	bounce = kmalloc(count, GFP_KERNEL);
+	if(unlikely(!bounce))
+		return -ENOMEM;
+	for(;;)
+	{
+		spin_lock_irqsave(&vhc->capture_lock, flags);
+		if(vhc->capture)
+		{
+			n = min_t(u32, count, vhc->capture->used);
+			capture_get(vhc->capture, bounce, n);
+		}
+		spin_unlock_irqrestore(&vhc->capture_lock, flags);
+		if(n || !vhc->capture)
+			break;
+		if(file->f_flags & O_NONBLOCK)
+		{
+			ret = -EAGAIN;
+			goto end;
+		}
+		if(wait_event_interruptible(vhc->capture_wait, capture_readable(vhc)))
+		{
+			ret = -ERESTARTSYS;
+			goto end;
+		}
+	}
+	if(unlikely(copy_to_user(buf, bounce, n)))
+	{
+		ret = -EFAULT;
+		goto end;
+	}
+	*ppos += n;
+	ret = n;
+end:
+	kfree(bounce);
+	return ret;
+}
+
+// takes the size of the ring in bytes (0 stops capturing)
+static ssize_t capture_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct usb_vhci_hcd *vhc = file->private_data;
+	unsigned long val;
+	char tmp[16], *end;
+	int ret;
+
+	if(unlikely(!count || count >= sizeof tmp))
+		return -EINVAL;
+	if(unlikely(copy_from_user(tmp, buf, count)))
+		return -EFAULT;
+	tmp[count] = 0;
+	val = simple_strtoul(tmp, &end, 10);
+	if(unlikely(end == tmp || (*end && *end != '\n')))
+		return -EINVAL;
+	ret = capture_setup(vhc, val);
+	return ret ? ret : count;
+}
+
+static const struct file_operations capture_fops = {
+	.owner   = THIS_MODULE,
+	.open    = capture_open,
+	.read    = capture_read,
+	.write   = capture_write,
+	.llseek  = no_llseek
+};
+
+// debugfs_create_* return NULL or an error pointer (depending on the kernel version) on failure
+static inline struct dentry *debugfs_check(struct dentry *dentry)
+{
+	return IS_ERR(dentry) ? NULL : dentry;
+}
+
+// debugfs is for diagnostics only, so the controller works without it
+static void vhci_debugfs_create(struct usb_vhci_hcd *vhc)
+{
+	struct device *dev = vhcihcd_to_dev(vhc);
+
+	vhc->debugfs_dir = NULL;
+	vhc->debugfs_latency = NULL;
+	vhc->debugfs_capture = NULL;
+	vhc->debugfs_urbs = NULL;
+	vhc->capture = NULL;
+	spin_lock_init(&vhc->capture_lock);
+	init_waitqueue_head(&vhc->capture_wait);
+	if(!debugfs_root)
+		return;
+	vhc->debugfs_dir = debugfs_check(debugfs_create_dir(vhci_dev_name(dev), debugfs_root));
+	if(unlikely(!vhc->debugfs_dir))
+	{
+		dev_warn(dev, "failed to create debugfs directory\n");
+		return;
+	}
+	vhc->debugfs_latency = debugfs_check(debugfs_create_file("latency", S_IRUSR | S_IWUSR, vhc->debugfs_dir, vhc, &latency_fops));
+	vhc->debugfs_capture = debugfs_check(debugfs_create_file("capture", S_IRUSR | S_IWUSR, vhc->debugfs_dir, vhc, &capture_fops));
+	vhc->debugfs_urbs = debugfs_check(debugfs_create_file("urbs", S_IRUSR, vhc->debugfs_dir, vhc, &urbs_fops));
+}
+
+static void vhci_debugfs_remove(struct usb_vhci_hcd *vhc)
+{
+	debugfs_remove(vhc->debugfs_urbs);
+	debugfs_remove(vhc->debugfs_capture);
+	debugfs_remove(vhc->debugfs_latency);
+	debugfs_remove(vhc->debugfs_dir);
+	vhc->debugfs_urbs = NULL;
+	vhc->debugfs_capture = NULL;
+	vhc->debugfs_latency = NULL;
+	vhc->debugfs_dir = NULL;
+	capture_setup(vhc, 0);
+}
+
+// frees all urb descriptors in the pool
+static void urbp_pool_destroy(struct usb_vhci_hcd *vhc)
+{
+	struct usb_vhci_urb_priv *urbp;
+	while(!list_empty(&vhc->urbp_free))
+	{
+		urbp = list_entry(vhc->urbp_free.next, struct usb_vhci_urb_priv, urbp_list);
+		list_del(&urbp->urbp_list);
+		kmem_cache_free(urbp_cache, urbp);
+	}
+	vhc->urbp_free_count = 0;
+}
+
 static int vhci_start(struct usb_hcd *hcd)
 {
 	struct usb_vhci_hcd *vhc;
 	int retval;
 	struct usb_vhci_port *ports;
+	struct usb_vhci_chan *chans;
 	struct usb_vhci_device *vdev;
 	struct device *dev;
+	int i, j, all_ports;
 
 	dev = usbhcd_to_dev(hcd);
 
@@ -800,26 +2736,110 @@ static int vhci_start(struct usb_hcd *hcd)
 	vhc = usbhcd_to_vhcihcd(hcd);
 	vdev = vhcihcd_to_vhcidev(vhc);
 
-	ports = kzalloc(vdev->port_count * sizeof(struct usb_vhci_port), GFP_KERNEL);
+#ifndef NO_SHARED_HCD
+	// the USB 3.0 root hub uses everything of the primary hcd, which was started already
+	if(!usb_hcd_is_primary_hcd(hcd))
+	{
+		vhc->rh_state[1] = USB_VHCI_RH_RUNNING;
+		hcd->power_budget = 900; // (see vhci_start for the primary hcd)
+		hcd->state = HC_STATE_RUNNING;
+		hcd->uses_new_polling = 1;
+#ifndef NO_URB_SG
+		hcd->self.sg_tablesize = ~0;
+#endif
+		return 0;
+	}
+#endif
+
+	all_ports = vdev->port_count;
+	if(vdev->flags & USB_VHCI_DEV_FLAG_SUPERSPEED)
+		all_ports *= 2;
+
+	// (the node is NUMA_NO_NODE, unless the controller was registered with
+	// USB_VHCI_DEV_FLAG_LOCAL_NODE)
+	ports = kzalloc_node(all_ports * sizeof(struct usb_vhci_port), GFP_KERNEL, dev_to_node(dev));
 	if(unlikely(ports == NULL)) return -ENOMEM;
+	chans = kzalloc_node((all_ports + 1) * sizeof(struct usb_vhci_chan), GFP_KERNEL, dev_to_node(dev));
+	if(unlikely(chans == NULL))
+	{
+		kfree(ports);
+		return -ENOMEM;
+	}
+	vhc->stats = alloc_percpu(struct usb_vhci_stats);
+	if(unlikely(vhc->stats == NULL))
+	{
+		kfree(chans);
+		kfree(ports);
+		return -ENOMEM;
+	}
+	vhc->latency = alloc_percpu(struct usb_vhci_latency);
+	if(unlikely(vhc->latency == NULL))
+	{
+		free_percpu(vhc->stats);
+		vhc->stats = NULL;
+		kfree(chans);
+		kfree(ports);
+		return -ENOMEM;
+	}
 
 	spin_lock_init(&vhc->lock);
-	//init_timer(&vhc->timer);
-	//vhc->timer.function = vhci_timer;
-	//vhc->timer.data = (unsigned long)vhc;
+	vhc->frame_base = ktime_get();
+	hrtimer_init(&vhc->iso_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	vhc->iso_timer.function = vhci_iso_timer;
+	vhc->iso_timer_armed = 0;
+	INIT_LIST_HEAD(&vhc->urbp_list_iso_hold);
+	INIT_LIST_HEAD(&vhc->urbp_list_parked);
+	atomic_set(&vhc->in_flight, 0);
+	vhc->queue_high = queue_high;
+	vhc->queue_low = queue_low;
+	vhc->throttled = 0;
 	vhc->ports = ports;
-	vhc->port_count = vdev->port_count;
-	vhc->port_update = 0;
-	atomic_set(&vhc->frame_num, 0);
-	INIT_LIST_HEAD(&vhc->urbp_list_inbox);
-	INIT_LIST_HEAD(&vhc->urbp_list_fetched);
-	INIT_LIST_HEAD(&vhc->urbp_list_cancel);
+	vhc->port_count = all_ports;
+	vhc->rh_port_count = vdev->port_count;
+	vhc->ss_hcd = NULL; // (gets set in vhci_hcd_probe)
+	bitmap_zero(vhc->port_update, USB_VHCI_MAX_ALL_PORTS + 1);
+	bitmap_zero(vhc->port_changed, USB_VHCI_MAX_ALL_PORTS + 1);
+	for(i = 0; i <= all_ports; i++)
+	{
+		atomic_set(&chans[i].work_pending, 0);
+		for(j = 0; j < USB_VHCI_PIPE_TYPES; j++)
+		{
+			INIT_LIST_HEAD(&chans[i].ep_ready[j]);
+			chans[i].sched_credit[j] = 0;
+		}
+		INIT_LIST_HEAD(&chans[i].urbp_list_cancel);
+		init_waitqueue_head(&chans[i].wait);
+	}
+	vhc->chans = chans;
+	INIT_LIST_HEAD(&vhc->ep_list);
 	INIT_LIST_HEAD(&vhc->urbp_list_canceling);
-	vhc->rh_state = USB_VHCI_RH_RUNNING;
+	for(i = 0; i < USB_VHCI_URBP_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&vhc->urbp_hash[i]);
+	vhc->handle_seq = 0;
+	spin_lock_init(&vhc->urbp_free_lock);
+	INIT_LIST_HEAD(&vhc->urbp_free);
+	vhc->urbp_free_count = 0;
+	INIT_LIST_HEAD(&vhc->urbp_list_all);
+	INIT_LIST_HEAD(&vhc->urb_cursors);
+	for(i = 0; i < urbp_pool_size; i++)
+	{
+		struct usb_vhci_urb_priv *urbp = kmem_cache_alloc_node(urbp_cache, GFP_KERNEL, dev_to_node(dev));
+		// the pool is only an optimization, so we don't care if it stays smaller
+		if(unlikely(!urbp)) break;
+		// (nobody else knows about the controller yet)
+		list_add(&urbp->urbp_list, &vhc->urbp_free);
+		vhc->urbp_free_count++;
+	}
+	vhc->rh_state[0] = USB_VHCI_RH_RUNNING;
+	vhc->rh_state[1] = USB_VHCI_RH_RESET;
 
 	hcd->power_budget = 500; // NOTE: practically we have unlimited power because this is a virtual device with... err... virtual power!
 	hcd->state = HC_STATE_RUNNING;
 	hcd->uses_new_polling = 1;
+#ifndef NO_URB_SG
+	// the data is copied from and to user space anyway, so any scatter-gather list is fine
+	hcd->self.sg_tablesize = ~0;
+#endif
 #ifndef NO_HAS_TT_FLAG
 	hcd->has_tt = 1;
 #endif
@@ -832,9 +2852,30 @@ static int vhci_start(struct usb_hcd *hcd)
 	if(unlikely(retval != 0)) goto rem_file_fetched;
 	retval = device_create_file(dev, &dev_attr_urbs_canceling);
 	if(unlikely(retval != 0)) goto rem_file_cancel;
-
+	retval = device_create_file(dev, &dev_attr_stats);
+	if(unlikely(retval != 0)) goto rem_file_canceling;
+	retval = device_create_file(dev, &dev_attr_queue_high);
+	if(unlikely(retval != 0)) goto rem_file_stats;
+	retval = device_create_file(dev, &dev_attr_queue_low);
+	if(unlikely(retval != 0)) goto rem_file_queue_high;
+	retval = device_create_file(dev, &dev_attr_urb_counts);
+	if(unlikely(retval != 0)) goto rem_file_queue_low;
+
+	vhci_debugfs_create(vhc);
 	return 0;
 
+rem_file_queue_low:
+	device_remove_file(dev, &dev_attr_queue_low);
+
+rem_file_queue_high:
+	device_remove_file(dev, &dev_attr_queue_high);
+
+rem_file_stats:
+	device_remove_file(dev, &dev_attr_stats);
+
+rem_file_canceling:
+	device_remove_file(dev, &dev_attr_urbs_canceling);
+
 rem_file_cancel:
 	device_remove_file(dev, &dev_attr_urbs_cancel);
 
@@ -845,16 +2886,26 @@ rem_file_inbox:
 	device_remove_file(dev, &dev_attr_urbs_inbox);
 
 kfree_port_arr:
+	urbp_pool_destroy(vhc);
+	free_percpu(vhc->latency);
+	vhc->latency = NULL;
+	free_percpu(vhc->stats);
+	vhc->stats = NULL;
+	kfree(chans);
+	vhc->chans = NULL;
 	kfree(ports);
 	vhc->ports = NULL;
 	vhc->port_count = 0;
+	vhc->rh_port_count = 0;
 	return retval;
 }
 
 static void vhci_stop(struct usb_hcd *hcd)
 {
 	struct usb_vhci_hcd *vhc;
+	struct usb_vhci_device *vdev;
 	struct device *dev;
+	int i;
 
 	dev = usbhcd_to_dev(hcd);
 
@@ -862,42 +2913,150 @@ static void vhci_stop(struct usb_hcd *hcd)
 
 	vhc = usbhcd_to_vhcihcd(hcd);
 
+#ifndef NO_SHARED_HCD
+	// the primary hcd cleans up everything, when it is stopped after the USB 3.0 root hub
+	if(!usb_hcd_is_primary_hcd(hcd))
+	{
+		vhc->rh_state[1] = USB_VHCI_RH_RESET;
+		return;
+	}
+#endif
+
+	vdev = vhcihcd_to_vhcidev(vhc);
+	if(vdev->ifc->stop)
+		vdev->ifc->stop(vdev);
+
+	vhci_debugfs_remove(vhc);
+	device_remove_file(dev, &dev_attr_urb_counts);
+	device_remove_file(dev, &dev_attr_queue_low);
+	device_remove_file(dev, &dev_attr_queue_high);
+	device_remove_file(dev, &dev_attr_stats);
 	device_remove_file(dev, &dev_attr_urbs_canceling);
 	device_remove_file(dev, &dev_attr_urbs_cancel);
 	device_remove_file(dev, &dev_attr_urbs_fetched);
 	device_remove_file(dev, &dev_attr_urbs_inbox);
 
+	hrtimer_cancel(&vhc->iso_timer);
+	urbp_pool_destroy(vhc);
+
+	// usbcore has disabled all endpoints already; this is just for safety
+	while(!list_empty(&vhc->ep_list))
+	{
+		struct usb_vhci_ep *vep = list_entry(vhc->ep_list.next, struct usb_vhci_ep, ep_list);
+		list_del(&vep->ep_list);
+		vep->hep->hcpriv = NULL;
+		posted_free(vep);
+		kfree(vep);
+	}
+
 	if(likely(vhc->ports))
 	{
+		for(i = 0; i < vhc->port_count; i++)
+			kfree(vhc->ports[i].desc_cache);
 		kfree(vhc->ports);
 		vhc->ports = NULL;
+		kfree(vhc->chans);
+		vhc->chans = NULL;
 		vhc->port_count = 0;
+		vhc->rh_port_count = 0;
+	}
+
+	free_percpu(vhc->latency);
+	vhc->latency = NULL;
+	free_percpu(vhc->stats);
+	vhc->stats = NULL;
+
+	vhc->rh_state[0] = USB_VHCI_RH_RESET;
+	dev_info(dev, "stopped\n");
+}
+
+// usbcore guarantees that there are no urbs for this endpoint any longer
+static void vhci_endpoint_disable(struct usb_hcd *hcd, struct usb_host_endpoint *hep)
+{
+	struct usb_vhci_hcd *vhc;
+	struct usb_vhci_ep *vep;
+	unsigned long flags;
+
+	vhc = usbhcd_to_vhcihcd(hcd);
+
+	trace_function(usbhcd_to_dev(hcd));
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	vep = hep->hcpriv;
+	if(likely(vep))
+	{
+		list_del(&vep->ep_list);
+		list_del_init(&vep->ep_ready);
+		sched_release(vhc, vep);
+		hep->hcpriv = NULL;
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	if(likely(vep))
+		posted_free(vep);
+	kfree(vep);
+}
+
+static int vhci_get_frame(struct usb_hcd *hcd)
+{
+	struct usb_vhci_hcd *vhc;
+	vhc = usbhcd_to_vhcihcd(hcd);
+	trace_function(usbhcd_to_dev(hcd));
+	return usb_vhci_frame_number(vhc);
+}
+
+#ifndef NO_SHARED_HCD
+// the primary hcd of a SuperSpeed controller is its USB 2.0 root hub
+static int vhci_reset(struct usb_hcd *hcd)
+{
+	trace_function(usbhcd_to_dev(hcd));
+	if(usb_hcd_is_primary_hcd(hcd))
+	{
+		hcd->speed = HCD_USB2;
+		hcd->self.root_hub->speed = USB_SPEED_HIGH;
 	}
+	return 0;
+}
+#endif
+
+static const struct hc_driver vhci_hcd = {
+	.description      = driver_name,
+	.product_desc     = "VHCI Host Controller",
+	.hcd_priv_size    = sizeof(struct usb_vhci_hcd),
+
+	.flags            = HCD_USB2,
+
+	.start            = vhci_start,
+	.stop             = vhci_stop,
+
+	.urb_enqueue      = vhci_urb_enqueue,
+	.urb_dequeue      = vhci_urb_dequeue,
+	.endpoint_disable = vhci_endpoint_disable,
 
-	vhc->rh_state = USB_VHCI_RH_RESET;
-	dev_info(dev, "stopped\n");
-}
+	.get_frame_number = vhci_get_frame,
 
-static int vhci_get_frame(struct usb_hcd *hcd)
-{
-	struct usb_vhci_hcd *vhc;
-	vhc = usbhcd_to_vhcihcd(hcd);
-	trace_function(usbhcd_to_dev(hcd));
-	return atomic_read(&vhc->frame_num);
-}
+	.hub_status_data  = vhci_hub_status,
+	.hub_control      = vhci_hub_control,
+	.bus_suspend      = vhci_bus_suspend,
+	.bus_resume       = vhci_bus_resume
+};
 
-static const struct hc_driver vhci_hcd = {
+#ifndef NO_SHARED_HCD
+// for controllers with USB_VHCI_DEV_FLAG_SUPERSPEED: a USB 2.0 root hub (the primary hcd) and a
+// USB 3.0 root hub (the shared hcd)
+static const struct hc_driver vhci_ss_hcd = {
 	.description      = driver_name,
 	.product_desc     = "VHCI Host Controller",
 	.hcd_priv_size    = sizeof(struct usb_vhci_hcd),
 
-	.flags            = HCD_USB2,
+	.flags            = HCD_USB3 | HCD_SHARED,
 
+	.reset            = vhci_reset,
 	.start            = vhci_start,
 	.stop             = vhci_stop,
 
 	.urb_enqueue      = vhci_urb_enqueue,
 	.urb_dequeue      = vhci_urb_dequeue,
+	.endpoint_disable = vhci_endpoint_disable,
 
 	.get_frame_number = vhci_get_frame,
 
@@ -906,12 +3065,19 @@ static const struct hc_driver vhci_hcd = {
 	.bus_suspend      = vhci_bus_suspend,
 	.bus_resume       = vhci_bus_resume
 };
+#endif
 
 static int vhci_hcd_probe(struct platform_device *pdev)
 {
+	const struct hc_driver *driver = &vhci_hcd;
 	struct usb_hcd *hcd;
 	struct usb_vhci_device *vdev;
 	int retval;
+#ifndef NO_SHARED_HCD
+	struct usb_hcd *ss_hcd;
+	struct usb_vhci_hcd *vhc;
+	unsigned long flags;
+#endif
 
 	vdev = pdev_to_vhcidev(pdev);
 
@@ -921,23 +3087,141 @@ static int vhci_hcd_probe(struct platform_device *pdev)
 	dev_info(&pdev->dev, DRIVER_DESC " -- Version " DRIVER_VERSION "\n");
 	dev_info(&pdev->dev, "--> Backend: %s\n", vdev->ifc->ifc_desc);
 
-	hcd = usb_create_hcd(&vhci_hcd, &pdev->dev, vhci_dev_name(&pdev->dev));
+#ifndef NO_SHARED_HCD
+	if(vdev->flags & USB_VHCI_DEV_FLAG_SUPERSPEED)
+		driver = &vhci_ss_hcd;
+#endif
+
+	hcd = usb_create_hcd(driver, &pdev->dev, vhci_dev_name(&pdev->dev));
 	if(unlikely(!hcd)) return -ENOMEM;
 	vdev->vhc = usbhcd_to_vhcihcd(hcd);
 
 	retval = usb_add_hcd(hcd, 0, 0); // calls vhci_start
-	if(unlikely(retval)) usb_put_hcd(hcd);
+	if(unlikely(retval)) goto put_hcd;
+	vhci_enable_autosuspend(hcd);
+
+#ifndef NO_SHARED_HCD
+	if(vdev->flags & USB_VHCI_DEV_FLAG_SUPERSPEED)
+	{
+		vhc = vdev->vhc;
+		ss_hcd = usb_create_shared_hcd(driver, &pdev->dev, vhci_dev_name(&pdev->dev), hcd);
+		if(unlikely(!ss_hcd))
+		{
+			retval = -ENOMEM;
+			goto remove_hcd;
+		}
+		// the ports of the USB 3.0 root hub belong to it from now on
+		spin_lock_irqsave(&vhc->lock, flags);
+		vhc->ss_hcd = ss_hcd;
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		retval = usb_add_hcd(ss_hcd, 0, 0); // calls vhci_start
+		if(unlikely(retval))
+		{
+			spin_lock_irqsave(&vhc->lock, flags);
+			vhc->ss_hcd = NULL;
+			spin_unlock_irqrestore(&vhc->lock, flags);
+			usb_put_hcd(ss_hcd);
+			goto remove_hcd;
+		}
+		vhci_enable_autosuspend(ss_hcd);
+	}
+#endif
 
+	return 0;
+
+#ifndef NO_SHARED_HCD
+remove_hcd:
+	usb_remove_hcd(hcd);
+#endif
+
+put_hcd:
+	usb_put_hcd(hcd);
+	vdev->vhc = NULL;
 	return retval;
 }
 
-static int vhci_hcd_remove(struct platform_device *pdev)
+// Retires all urbs in the list with -ESHUTDOWN and moves them to done as a whole. This is what
+// usb_vhci_urb_retire does, but the urbs are taken out of the queues by the caller, so they don't
+// have to be detached one by one.
+// caller has vhc->lock
+static void abort_list(struct usb_vhci_hcd *vhc, struct list_head *list, struct list_head *done)
+{
+	struct usb_vhci_urb_priv *urbp;
+	struct urb *urb;
+
+	list_for_each_entry(urbp, list, urbp_list)
+	{
+		urb = urbp->urb;
+		usb_vhci_maybe_set_status(urbp, -ESHUTDOWN);
+		urb->hcpriv = NULL;
+		if(!hlist_unhashed(&urbp->urbp_hash))
+			hlist_del_init(&urbp->urbp_hash);
+#ifndef OLD_GIVEBACK_MECH
+		usb_hcd_unlink_urb_from_ep(urb_to_usbhcd(urb), urb);
+#endif
+	}
+	list_splice_tail_init(list, done);
+}
+
+// marks all devices below the root hub as gone, so that their drivers stop submitting urbs
+static inline void abort_rh(struct usb_hcd *hcd)
+{
+	if(hcd && hcd->rh_registered && hcd->self.root_hub)
+		usb_set_device_state(hcd->self.root_hub, USB_STATE_NOTATTACHED);
+}
+
+// Takes every urb off the controller at once and gives them all back with -ESHUTDOWN. Afterwards
+// vhci_urb_enqueue rejects new urbs, so that the devices can be disconnected without waiting for
+// user space (which is gone). Doing this more than once does no harm.
+static void vhci_abort(struct usb_vhci_hcd *vhc)
 {
 	unsigned long flags;
+	struct usb_vhci_ep *vep;
+	int i, type;
+	LIST_HEAD(done);
+
+	trace_function(vhcihcd_to_dev(vhc));
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	vhc->dying = 1;
+	abort_list(vhc, &vhc->urbp_list_iso_hold, &done);
+	abort_list(vhc, &vhc->urbp_list_parked, &done);
+	abort_list(vhc, &vhc->urbp_list_canceling, &done);
+	for(i = 0; i <= vhc->port_count; i++)
+	{
+		abort_list(vhc, &vhc->chans[i].urbp_list_cancel, &done);
+		// the inboxes are emptied below, so there is nothing left to schedule
+		for(type = 0; type < USB_VHCI_PIPE_TYPES; type++)
+			while(!list_empty(&vhc->chans[i].ep_ready[type]))
+				list_del_init(vhc->chans[i].ep_ready[type].next);
+		atomic_set(&vhc->chans[i].work_pending, 0);
+	}
+	list_for_each_entry(vep, &vhc->ep_list, ep_list)
+	{
+		spin_lock(&vep->lock);
+		abort_list(vhc, &vep->urbp_list_inbox, &done);
+		abort_list(vhc, &vep->urbp_list_fetched, &done);
+		spin_unlock(&vep->lock);
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	usb_vhci_urb_giveback_list(vhc, &done);
+
+	// all ports go down together, instead of one after another while usbcore walks through them
+	abort_rh(vhcihcd_to_usbhcd(vhc));
+#ifndef NO_SHARED_HCD
+	abort_rh(vhc->ss_hcd);
+#endif
+}
+
+static int vhci_hcd_remove(struct platform_device *pdev)
+{
 	struct usb_hcd *hcd;
 	struct usb_vhci_hcd *vhc;
-	struct usb_vhci_urb_priv *urbp;
 	struct usb_vhci_device *vdev;
+#ifndef NO_SHARED_HCD
+	unsigned long flags;
+	struct usb_hcd *ss_hcd;
+#endif
 
 	vdev = pdev_to_vhcidev(pdev);
 	vhc = vhcidev_to_vhcihcd(vdev);
@@ -945,32 +3229,20 @@ static int vhci_hcd_remove(struct platform_device *pdev)
 
 	trace_function(vhcihcd_to_dev(vhc));
 
-	spin_lock_irqsave(&vhc->lock, flags);
-	while(!list_empty(&vhc->urbp_list_inbox))
-	{
-		urbp = list_entry(vhc->urbp_list_inbox.next, struct usb_vhci_urb_priv, urbp_list);
-		usb_vhci_maybe_set_status(urbp, -ESHUTDOWN);
-		usb_vhci_urb_giveback(vhc, urbp);
-	}
-	while(!list_empty(&vhc->urbp_list_fetched))
-	{
-		urbp = list_entry(vhc->urbp_list_fetched.next, struct usb_vhci_urb_priv, urbp_list);
-		usb_vhci_maybe_set_status(urbp, -ESHUTDOWN);
-		usb_vhci_urb_giveback(vhc, urbp);
-	}
-	while(!list_empty(&vhc->urbp_list_cancel))
-	{
-		urbp = list_entry(vhc->urbp_list_cancel.next, struct usb_vhci_urb_priv, urbp_list);
-		usb_vhci_maybe_set_status(urbp, -ESHUTDOWN);
-		usb_vhci_urb_giveback(vhc, urbp);
-	}
-	while(!list_empty(&vhc->urbp_list_canceling))
+	vhci_abort(vhc);
+
+#ifndef NO_SHARED_HCD
+	// the USB 3.0 root hub has to go first
+	ss_hcd = vhc->ss_hcd;
+	if(ss_hcd)
 	{
-		urbp = list_entry(vhc->urbp_list_canceling.next, struct usb_vhci_urb_priv, urbp_list);
-		usb_vhci_maybe_set_status(urbp, -ESHUTDOWN);
-		usb_vhci_urb_giveback(vhc, urbp);
+		usb_remove_hcd(ss_hcd); // calls vhci_stop
+		spin_lock_irqsave(&vhc->lock, flags);
+		vhc->ss_hcd = NULL;
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		usb_put_hcd(ss_hcd);
 	}
-	spin_unlock_irqrestore(&vhc->lock, flags);
+#endif
 
 	usb_remove_hcd(hcd); // calls vhci_stop
 	usb_put_hcd(hcd);
@@ -996,13 +3268,17 @@ static int vhci_hcd_suspend(struct platform_device *pdev, pm_message_t state)
 
 	trace_function(vhcihcd_to_dev(vhc));
 
-	if(unlikely(vhc->rh_state == USB_VHCI_RH_RUNNING))
+	if(unlikely(vhc->rh_state[0] == USB_VHCI_RH_RUNNING || vhc->rh_state[1] == USB_VHCI_RH_RUNNING))
 	{
 		dev_warn(&pdev->dev, "Root hub isn't suspended! You have to suspend the root hub before you suspend the host controller device.\n");
 		rc = -EBUSY;
 	}
 	else
+	{
 		clear_bit(HCD_FLAG_HW_ACCESSIBLE, &hcd->flags);
+		if(vhc->ss_hcd)
+			clear_bit(HCD_FLAG_HW_ACCESSIBLE, &vhc->ss_hcd->flags);
+	}
 
 	return rc;
 }
@@ -1018,7 +3294,11 @@ static int vhci_hcd_resume(struct platform_device *pdev)
 	trace_function(vhcihcd_to_dev(vhc));
 
 	set_bit(HCD_FLAG_HW_ACCESSIBLE, &hcd->flags);
+	if(vhc->ss_hcd)
+		set_bit(HCD_FLAG_HW_ACCESSIBLE, &vhc->ss_hcd->flags);
 	usb_hcd_poll_rh_status(hcd);
+	if(vhc->ss_hcd)
+		usb_hcd_poll_rh_status(vhc->ss_hcd);
 	return 0;
 }
 
@@ -1033,53 +3313,83 @@ static struct platform_driver vhci_hcd_driver = {
 	}
 };
 
-// Callback function for driver_for_each_device(..) in usb_vhci_hcd_register(...).
-// Data points to the device-id we're looking for.
-// This funktion returns an error (-EINVAL), if the device has the given id assigned to it.
-// (Enumeration stops/finishes on errors.)
-static int device_enum(struct device *dev, void *data)
+// the ids of the platform devices are allocated from dev_ida (protected by dev_id_lock)
+#define USB_VHCI_MAX_DEV_ID 10000
+static DEFINE_IDA(dev_ida);
+static DEFINE_MUTEX(dev_id_lock);
+
+// returns a free device-id or a negative error code
+static int dev_id_alloc(void)
 {
-	struct platform_device *pdev;
-	pdev = to_platform_device(dev);
-	return unlikely(*((const int *)data) == pdev->id) ? -EINVAL : 0;
+	int retval, id;
+	mutex_lock(&dev_id_lock);
+	do
+	{
+		if(unlikely(!ida_pre_get(&dev_ida, GFP_KERNEL)))
+		{
+			retval = -ENOMEM;
+			goto unlock;
+		}
+		retval = ida_get_new(&dev_ida, &id);
+	} while(retval == -EAGAIN);
+	if(unlikely(retval))
+		goto unlock;
+	if(unlikely(id >= USB_VHCI_MAX_DEV_ID))
+	{
+		ida_remove(&dev_ida, id);
+		vhci_printk(KERN_ERR, "there are too many devices!\n");
+		retval = -EBUSY;
+		goto unlock;
+	}
+	retval = id;
+unlock:
+	mutex_unlock(&dev_id_lock);
+	return retval;
 }
 
-static DEFINE_MUTEX(dev_enum_lock);
+static void dev_id_free(int id)
+{
+	mutex_lock(&dev_id_lock);
+	ida_remove(&dev_ida, id);
+	mutex_unlock(&dev_id_lock);
+}
 
-int usb_vhci_hcd_register(const struct usb_vhci_ifc *ifc, void *context, u8 port_count, struct usb_vhci_device **vdev_ret)
+// port_count is the number of ports per root hub
+int usb_vhci_hcd_register(const struct usb_vhci_ifc *ifc, void *context, u8 port_count, u8 flags, struct usb_vhci_device **vdev_ret)
 {
 	int retval, i;
 	struct platform_device *pdev;
 	struct usb_vhci_device vdev, *vdev_ptr;
 
-	if(unlikely(port_count > 31))
+	if(unlikely(port_count > USB_VHCI_MAX_PORTS || (flags & ~(USB_VHCI_DEV_FLAG_SUPERSPEED | USB_VHCI_DEV_FLAG_LOCAL_NODE))))
 		return -EINVAL;
-
-	// search for free device-id
-	mutex_lock(&dev_enum_lock);
-	for(i = 0; i < 10000; i++)
-	{
-		retval = driver_for_each_device(&vhci_hcd_driver.driver, NULL, &i, device_enum);
-		if(unlikely(!retval)) break;
-	}
-	if(unlikely(i >= 10000))
+	if(flags & USB_VHCI_DEV_FLAG_SUPERSPEED)
 	{
-		mutex_unlock(&dev_enum_lock);
-		vhci_printk(KERN_ERR, "there are too many devices!\n");
-		return -EBUSY;
+#ifdef NO_SHARED_HCD
+		return -EOPNOTSUPP;
+#else
+		if(unlikely(2 * port_count > USB_VHCI_MAX_ALL_PORTS))
+			return -EINVAL;
+#endif
 	}
 
+	i = dev_id_alloc();
+	if(unlikely(i < 0))
+		return i;
+
 	vhci_dbg("allocate platform_device %s.%d\n", driver_name, i);
 	pdev = platform_device_alloc(driver_name, i);
 	if(unlikely(!pdev))
 	{
-		mutex_unlock(&dev_enum_lock);
-		return -ENOMEM;
+		retval = -ENOMEM;
+		goto id_free;
 	}
+	// vhci_start allocates everything on the node of the device
+	if(flags & USB_VHCI_DEV_FLAG_LOCAL_NODE)
+		set_dev_node(&pdev->dev, numa_node_id());
 
 	if(!try_module_get(ifc->owner))
 	{
-		mutex_unlock(&dev_enum_lock);
 		vhci_printk(KERN_ERR, "ifc module died\n");
 		retval = -ENODEV;
 		goto pdev_put;
@@ -1089,14 +3399,12 @@ int usb_vhci_hcd_register(const struct usb_vhci_ifc *ifc, void *context, u8 port
 	vdev.pdev = pdev;
 	vdev.vhc = NULL;
 	vdev.port_count = port_count;
+	vdev.flags = flags;
 
 	vhci_dbg("install usb_vhci_device structure within pdev->dev.platform_data\n");
 	retval = platform_device_add_data(pdev, &vdev, sizeof vdev + ifc->ifc_priv_size);
 	if(unlikely(retval < 0))
-	{
-		mutex_unlock(&dev_enum_lock);
 		goto mod_put;
-	}
 	vdev_ptr = pdev_to_vhcidev(pdev);
 
 	if(ifc->init)
@@ -1104,15 +3412,11 @@ int usb_vhci_hcd_register(const struct usb_vhci_ifc *ifc, void *context, u8 port
 		vhci_dbg("call ifc->init\n");
 		retval = ifc->init(context, vhcidev_to_ifc(vdev_ptr));
 		if(unlikely(retval < 0))
-		{
-			mutex_unlock(&dev_enum_lock);
 			goto mod_put;
-		}
 	}
 
 	vhci_dbg("add platform_device %s.%d\n", pdev->name, pdev->id);
 	retval = platform_device_add(pdev); // calls vhci_hcd_probe
-	mutex_unlock(&dev_enum_lock);
 	if(unlikely(retval < 0))
 	{
 		vhci_printk(KERN_ERR, "add platform_device %s.%d failed\n", pdev->name, pdev->id);
@@ -1133,21 +3437,37 @@ mod_put:
 
 pdev_put:
 	platform_device_put(pdev);
+
+id_free:
+	dev_id_free(i);
 	return retval;
 }
 EXPORT_SYMBOL_GPL(usb_vhci_hcd_register);
 
+// Gives back all urbs of the controller and disconnects its devices right away. An interface calls
+// this for all of its controllers before it unregisters them, so that the controllers which are
+// unregistered last don't keep their devices busy for all this time. (usb_vhci_hcd_unregister
+// does the same anyway.)
+void usb_vhci_hcd_abort(struct usb_vhci_device *vdev)
+{
+	vhci_abort(vhcidev_to_vhcihcd(vdev));
+}
+EXPORT_SYMBOL_GPL(usb_vhci_hcd_abort);
+
 int usb_vhci_hcd_unregister(struct usb_vhci_device *vdev)
 {
 	struct platform_device *pdev;
 	struct device *dev;
 	struct module *ifc_owner = vdev->ifc->owner; // we need a copy, because vdev gets destroyed on platform_device_unregister
+	int id;
 
 	pdev = vhcidev_to_pdev(vdev);
 	dev = &pdev->dev;
+	id = pdev->id;
 
 	vhci_dbg("unregister platform_device %s\n", vhci_dev_name(dev));
 	platform_device_unregister(pdev); // calls vhci_hcd_remove which calls ifc->destroy
+	dev_id_free(id);
 
 	module_put(ifc_owner);
 	module_put(THIS_MODULE);
@@ -1155,24 +3475,27 @@ int usb_vhci_hcd_unregister(struct usb_vhci_device *vdev)
 }
 EXPORT_SYMBOL_GPL(usb_vhci_hcd_unregister);
 
+// returns nonzero if channel 0 has some work
+// doesn't need vhc->lock
 int usb_vhci_hcd_has_work(struct usb_vhci_hcd *vhc)
 {
-	unsigned long flags;
-	int y = 0;
-	spin_lock_irqsave(&vhc->lock, flags);
-	if(vhc->port_update ||
-	   !list_empty(&vhc->urbp_list_cancel) ||
-	   !list_empty(&vhc->urbp_list_inbox))
-		y = 1;
-	spin_unlock_irqrestore(&vhc->lock, flags);
-	return y;
+	return usb_vhci_chan_has_work(vhc, 0);
 }
 EXPORT_SYMBOL_GPL(usb_vhci_hcd_has_work);
 
-int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u8 index)
+// doesn't need vhc->lock
+int usb_vhci_chan_has_work(struct usb_vhci_hcd *vhc, u8 chan)
+{
+	return atomic_read(&vhc->chans[chan].work_pending) > 0;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_chan_has_work);
+
+// Applies a change of a port which was reported by user space. Returns the error code for user
+// space; the root hub needs to be polled afterwards if it succeeds.
+// caller has vhc->lock
+static int apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u8 index)
 {
 	struct device *dev;
-	unsigned long flags;
 	u16 overcurrent;
 
 	dev = vhcihcd_to_dev(vhc);
@@ -1188,12 +3511,12 @@ int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u
 	            change != (USB_PORT_STAT_C_RESET | USB_PORT_STAT_C_ENABLE)))
 		return -EINVAL;
 
-	spin_lock_irqsave(&vhc->lock, flags);
 	if(unlikely(!(vhc->ports[index - 1].port_status & USB_PORT_STAT_POWER)))
-	{
-		spin_unlock_irqrestore(&vhc->lock, flags);
 		return -EPROTO;
-	}
+
+	// all devices at ports of the USB 3.0 root hub are SuperSpeed devices
+	if(usb_vhci_port_is_ss(vhc, index))
+		status &= ~(USB_PORT_STAT_LOW_SPEED | USB_PORT_STAT_HIGH_SPEED);
 
 #ifdef DEBUG
 	if(debug_output) dev_dbg(dev, "performing PORT_STAT [port=%d ~status=0x%04x ~change=0x%04x]\n", (int)index, (int)status, (int)change);
@@ -1210,7 +3533,13 @@ int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u
 				((status & USB_PORT_STAT_HIGH_SPEED) ? USB_PORT_STAT_HIGH_SPEED : 0)) |
 				overcurrent;
 		else
+		{
 			vhc->ports[index - 1].port_status = USB_PORT_STAT_POWER | overcurrent;
+			// the next device at this port has other descriptors
+			kfree(vhc->ports[index - 1].desc_cache);
+			vhc->ports[index - 1].desc_cache = NULL;
+			vhc->ports[index - 1].desc_cache_len = 0;
+		}
 		vhc->ports[index - 1].port_flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
 		break;
 
@@ -1218,10 +3547,7 @@ int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u
 		if(unlikely(!(vhc->ports[index - 1].port_status & USB_PORT_STAT_CONNECTION) ||
 			(vhc->ports[index - 1].port_status & USB_PORT_STAT_RESET) ||
 			(status & USB_PORT_STAT_ENABLE)))
-		{
-			spin_unlock_irqrestore(&vhc->lock, flags);
 			return -EPROTO;
-		}
 		vhc->ports[index - 1].port_change |= USB_PORT_STAT_C_ENABLE;
 		vhc->ports[index - 1].port_status &= ~USB_PORT_STAT_ENABLE;
 		vhc->ports[index - 1].port_flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
@@ -1233,10 +3559,7 @@ int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u
 			!(vhc->ports[index - 1].port_status & USB_PORT_STAT_ENABLE) ||
 			(vhc->ports[index - 1].port_status & USB_PORT_STAT_RESET) ||
 			(status & USB_PORT_STAT_SUSPEND)))
-		{
-			spin_unlock_irqrestore(&vhc->lock, flags);
 			return -EPROTO;
-		}
 		vhc->ports[index - 1].port_flags &= ~USB_VHCI_PORT_STAT_FLAG_RESUMING;
 		vhc->ports[index - 1].port_change |= USB_PORT_STAT_C_SUSPEND;
 		vhc->ports[index - 1].port_status &= ~USB_PORT_STAT_SUSPEND;
@@ -1252,17 +3575,11 @@ int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u
 		if(unlikely(!(vhc->ports[index - 1].port_status & USB_PORT_STAT_CONNECTION) ||
 			!(vhc->ports[index - 1].port_status & USB_PORT_STAT_RESET) ||
 			(status & USB_PORT_STAT_RESET)))
-		{
-			spin_unlock_irqrestore(&vhc->lock, flags);
 			return -EPROTO;
-		}
 		if(change & USB_PORT_STAT_C_ENABLE)
 		{
 			if(status & USB_PORT_STAT_ENABLE)
-			{
-				spin_unlock_irqrestore(&vhc->lock, flags);
 				return -EPROTO;
-			}
 			vhc->ports[index - 1].port_change |= USB_PORT_STAT_C_ENABLE;
 		}
 		else
@@ -1272,14 +3589,256 @@ int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u
 		break;
 	}
 
+	// USB 3.0 hubs don't have the enable change bit (they report a disabled port by its link state)
+	if(usb_vhci_port_is_ss(vhc, index))
+		vhc->ports[index - 1].port_change &= ~USB_PORT_STAT_C_ENABLE;
+
+	trace_usb_vhci_port_stat(vhc, index);
 	vhci_port_update(vhc, index);
+	return 0;
+}
+
+int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u8 index)
+{
+	struct usb_hcd *hcd = NULL;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	ret = apply_port_stat(vhc, status, change, index);
+	if(likely(!ret))
+		hcd = usb_vhci_port_to_usbhcd(vhc, index);
 	spin_unlock_irqrestore(&vhc->lock, flags);
 
-	usb_hcd_poll_rh_status(vhcihcd_to_usbhcd(vhc));
-	return 0;
+	if(likely(hcd))
+		usb_hcd_poll_rh_status(hcd);
+	return ret;
 }
 EXPORT_SYMBOL_GPL(usb_vhci_apply_port_stat);
 
+// Applies count port changes under one hold of vhc->lock, so that the root hubs see all of them
+// at once, and polls each affected root hub only once afterwards. The result of each change is
+// stored in its result field. Returns the number of changes which succeeded.
+int usb_vhci_apply_port_stats(struct usb_vhci_hcd *vhc, struct usb_vhci_port_stat *stats, unsigned int count)
+{
+	struct usb_hcd *hs_hcd = NULL, *ss_hcd = NULL;
+	unsigned long flags;
+	unsigned int i;
+	int ok = 0;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	for(i = 0; i < count; i++)
+	{
+		stats[i].result = apply_port_stat(vhc, stats[i].status, stats[i].change, stats[i].index);
+		if(likely(!stats[i].result))
+		{
+			ok++;
+			if(usb_vhci_port_is_ss(vhc, stats[i].index))
+				ss_hcd = usb_vhci_port_to_usbhcd(vhc, stats[i].index);
+			else
+				hs_hcd = usb_vhci_port_to_usbhcd(vhc, stats[i].index);
+		}
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	if(hs_hcd)
+		usb_hcd_poll_rh_status(hs_hcd);
+	if(ss_hcd)
+		usb_hcd_poll_rh_status(ss_hcd);
+	return ok;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_apply_port_stats);
+
+// Replaces the descriptor cache of the port with data (length bytes of records; see struct
+// usb_vhci_desc_hdr). The controller owns data afterwards, even if this fails. A length of zero
+// drops the cache.
+int usb_vhci_set_desc_cache(struct usb_vhci_hcd *vhc, u8 index, void *data, u32 length)
+{
+	const struct usb_vhci_desc_hdr *hdr;
+	unsigned long flags;
+	void *old;
+	u32 pos;
+
+	if(unlikely(!index || index > vhc->port_count))
+		goto invalid;
+
+	for(pos = 0; pos < length; pos += sizeof *hdr + ALIGN(hdr->length, 4))
+	{
+		if(unlikely(length - pos < sizeof *hdr))
+			goto invalid;
+		hdr = data + pos;
+		if(unlikely(hdr->reserved || !hdr->length || length - pos - sizeof *hdr < ALIGN(hdr->length, 4)))
+			goto invalid;
+	}
+
+	if(!length)
+	{
+		kfree(data);
+		data = NULL;
+	}
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	old = vhc->ports[index - 1].desc_cache;
+	vhc->ports[index - 1].desc_cache = data;
+	vhc->ports[index - 1].desc_cache_len = length;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	kfree(old);
+	return 0;
+
+invalid:
+	kfree(data);
+	return -EINVAL;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_set_desc_cache);
+
+// Posts the chunk p for the bulk IN endpoint of the device with the given address and answers the
+// urbs which are waiting in its inbox with it (see posted_drain). If port isn't zero, only devices
+// behind that port are considered. (Like in usb_vhci_unpark the address is not unique if the
+// controller has a USB 3.0 root hub; the first matching endpoint gets the data then.)
+// The controller owns p afterwards, even if this fails.
+int usb_vhci_post_in(struct usb_vhci_hcd *vhc, u8 port, u8 address, u8 endpoint, struct usb_vhci_posted *p)
+{
+	struct usb_vhci_ep *vep;
+	unsigned long flags;
+	LIST_HEAD(done);
+	int ret = -ENOENT;
+
+	p->offset = 0;
+	spin_lock_irqsave(&vhc->lock, flags);
+	list_for_each_entry(vep, &vhc->ep_list, ep_list)
+	{
+		if(vep->type != PIPE_BULK || vep->address != address ||
+			vep->hep->desc.bEndpointAddress != (USB_DIR_IN | (endpoint & 0x0f)) ||
+			(port && vep->root_port != port))
+			continue;
+		spin_lock(&vep->lock);
+		if(unlikely(vep->posted_count >= USB_VHCI_POST_IN_QUEUE_MAX))
+			ret = -EAGAIN;
+		else
+		{
+			list_add_tail(&p->list, &vep->posted);
+			vep->posted_count++;
+			p = NULL;
+			ret = 0;
+		}
+		spin_unlock(&vep->lock);
+		if(!ret)
+			posted_drain(vhc, vep, &done);
+		break;
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	usb_vhci_urb_giveback_list(vhc, &done);
+	kfree(p);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_post_in);
+
+// Moves the work of the endpoint (the urbs in its inbox) to another channel.
+// caller has vhc->lock
+static void move_ep_chan(struct usb_vhci_hcd *vhc, struct usb_vhci_ep *vep, u8 chan)
+{
+	unsigned int n;
+	spin_lock(&vep->lock);
+	n = list_count(&vep->urbp_list_inbox);
+	atomic_sub(n, &vhc->chans[vep->chan].work_pending);
+	atomic_add(n, &vhc->chans[chan].work_pending);
+	vep->chan = chan;
+	spin_unlock(&vep->lock);
+	if(!list_empty(&vep->ep_ready))
+		list_move_tail(&vep->ep_ready, &vhc->chans[chan].ep_ready[vep->type]);
+}
+
+// Moves the pending report of the port (if any) to another channel.
+// caller has vhc->lock
+static void move_port_chan(struct usb_vhci_hcd *vhc, u8 index, u8 chan)
+{
+	if(test_bit(index, vhc->port_update))
+	{
+		atomic_dec(&vhc->chans[vhc->ports[index - 1].channel].work_pending);
+		atomic_inc(&vhc->chans[chan].work_pending);
+	}
+	vhc->ports[index - 1].channel = chan;
+}
+
+// Routes the work of port# index (and of all devices behind it) to the channel with the same
+// number, starting with the urbs which are in the inboxes already. Urbs which were fetched already
+// stay with the channel which fetched them. Returns -EBUSY if the port is bound already.
+int usb_vhci_bind_port(struct usb_vhci_hcd *vhc, u8 index)
+{
+	struct usb_vhci_ep *vep;
+	unsigned long flags;
+
+	if(unlikely(!index || index > vhc->port_count))
+		return -EINVAL;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	if(unlikely(vhc->ports[index - 1].channel))
+	{
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		return -EBUSY;
+	}
+	list_for_each_entry(vep, &vhc->ep_list, ep_list)
+		if(vep->root_port == index)
+			move_ep_chan(vhc, vep, index);
+	move_port_chan(vhc, index, index);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	if(usb_vhci_chan_has_work(vhc, index))
+		vhci_wakeup(vhc, index);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_bind_port);
+
+// Routes the work of port# index back to channel 0. The urbs which were fetched through the channel
+// of the port can't be completed anymore, so they are given back with -ESHUTDOWN.
+void usb_vhci_unbind_port(struct usb_vhci_hcd *vhc, u8 index)
+{
+	struct usb_vhci_urb_priv *urbp, *tmp;
+	struct usb_vhci_chan *const ch = &vhc->chans[index];
+	struct usb_vhci_ep *vep;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	if(unlikely(!index || index > vhc->port_count || vhc->ports[index - 1].channel != index))
+	{
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		return;
+	}
+	list_for_each_entry(vep, &vhc->ep_list, ep_list)
+	{
+		if(vep->chan == index)
+			move_ep_chan(vhc, vep, 0);
+		// The fetched lists are only modified while vhc->lock is held, so we don't need vep->lock for
+		// looking at them.
+		list_for_each_entry_safe(urbp, tmp, &vep->urbp_list_fetched, urbp_list)
+		{
+			if(urbp->chan != index)
+				continue;
+			usb_vhci_maybe_set_status(urbp, -ESHUTDOWN);
+			usb_vhci_urb_retire(vhc, urbp, &done);
+		}
+	}
+	while(!list_empty(&ch->urbp_list_cancel))
+	{
+		urbp = list_entry(ch->urbp_list_cancel.next, struct usb_vhci_urb_priv, urbp_list);
+		usb_vhci_maybe_set_status(urbp, -ESHUTDOWN);
+		usb_vhci_urb_retire(vhc, urbp, &done);
+	}
+	list_for_each_entry_safe(urbp, tmp, &vhc->urbp_list_canceling, urbp_list)
+	{
+		if(urbp->chan != index)
+			continue;
+		usb_vhci_maybe_set_status(urbp, -ESHUTDOWN);
+		usb_vhci_urb_retire(vhc, urbp, &done);
+	}
+	move_port_chan(vhc, index, 0);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	usb_vhci_urb_giveback_list(vhc, &done);
+	if(usb_vhci_hcd_has_work(vhc))
+		vhci_wakeup(vhc, 0);
+}
+EXPORT_SYMBOL_GPL(usb_vhci_unbind_port);
+
 #ifdef DEBUG
 static ssize_t show_debug_output(struct device_driver *drv, char *buf)
 {
@@ -1314,12 +3873,25 @@ static DRIVER_ATTR(debug_output, S_IRUSR | S_IWUSR, show_debug_output, store_deb
 
 static int __init init(void)
 {
-	int retval;
+	int retval, i;
 
 	if(usb_disabled()) return -ENODEV;
 
 	vhci_printk(KERN_INFO, DRIVER_DESC " -- Version " DRIVER_VERSION "\n");
 
+	for(i = 0; i < USB_VHCI_PIPE_TYPES; i++)
+		sched_weights[i] = clamp_t(unsigned int, sched_weights[i], 1, USB_VHCI_SCHED_WEIGHT_MAX);
+
+	urbp_cache = KMEM_CACHE(usb_vhci_urb_priv, 0);
+	if(unlikely(!urbp_cache))
+	{
+		vhci_printk(KERN_ERR, "creating slab cache failed\n");
+		return -ENOMEM;
+	}
+
+	// (not fatal; the controllers work without debugfs)
+	debugfs_root = debugfs_check(debugfs_create_dir(driver_name, NULL));
+
 #ifdef DEBUG
 	vhci_printk(KERN_DEBUG, "register platform_driver %s\n", driver_name);
 #endif
@@ -1327,6 +3899,8 @@ static int __init init(void)
 	if(unlikely(retval < 0))
 	{
 		vhci_printk(KERN_ERR, "register platform_driver failed\n");
+		debugfs_remove(debugfs_root);
+		kmem_cache_destroy(urbp_cache);
 		return retval;
 	}
 
@@ -1350,6 +3924,9 @@ static void __exit cleanup(void)
 #endif
 	vhci_dbg("unregister platform_driver %s\n", driver_name);
 	platform_driver_unregister(&vhci_hcd_driver);
+	debugfs_remove(debugfs_root);
+	kmem_cache_destroy(urbp_cache);
+	ida_destroy(&dev_ida);
 	vhci_dbg("gone\n");
 }
 module_exit(cleanup);
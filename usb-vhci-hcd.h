@@ -27,6 +27,9 @@
 #include <linux/timer.h>
 #include <linux/wait.h>
 #include <linux/list.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
 #include <linux/platform_device.h>
 #include <linux/usb.h>
 #include <linux/device.h>
@@ -52,11 +55,72 @@
 #	include "usb-vhci.config.h"
 #endif
 
+// The hub driver refuses hubs with more than USB_MAXCHILDREN ports, and bNbrPorts of the hub
+// descriptor can't describe more than 255 anyway.
+#if USB_MAXCHILDREN > 255
+#	define USB_VHCI_MAX_PORTS 255
+#else
+#	define USB_VHCI_MAX_PORTS USB_MAXCHILDREN
+#endif
+
+// A SuperSpeed controller has two root hubs (a USB 2.0 and a USB 3.0 one) with USB_VHCI_MAX_PORTS
+// ports each. Their ports share one index space, which is limited by the u8 port index.
+#if 2 * USB_VHCI_MAX_PORTS > 255
+#	define USB_VHCI_MAX_ALL_PORTS 255
+#else
+#	define USB_VHCI_MAX_ALL_PORTS (2 * USB_VHCI_MAX_PORTS)
+#endif
+
+// the shared hcd api was added in linux 2.6.39; SuperSpeed root hubs can't be emulated without it
+// (some of these defines showed up in later kernel versions than the shared hcd api)
+#ifndef NO_SHARED_HCD
+#	ifndef USB_DT_SS_HUB
+#		define USB_DT_SS_HUB (USB_TYPE_CLASS | 0x0a)
+#	endif
+#	ifndef USB_SS_PORT_STAT_POWER
+#		define USB_SS_PORT_STAT_POWER 0x0200
+#	endif
+#	ifndef USB_PORT_STAT_C_LINK_STATE
+#		define USB_PORT_STAT_C_LINK_STATE 0x0040
+#	endif
+#	ifndef USB_SS_PORT_LS_U0
+#		define USB_SS_PORT_LS_U0 0x0000
+#		define USB_SS_PORT_LS_U3 0x0060
+#		define USB_SS_PORT_LS_SS_DISABLED 0x0080
+#		define USB_SS_PORT_LS_RX_DETECT 0x00a0
+#	endif
+#	ifndef USB_PORT_FEAT_LINK_STATE
+#		define USB_PORT_FEAT_LINK_STATE (5)
+#	endif
+#	ifndef USB_PORT_FEAT_U1_TIMEOUT
+#		define USB_PORT_FEAT_U1_TIMEOUT (23)
+#		define USB_PORT_FEAT_U2_TIMEOUT (24)
+#	endif
+#	ifndef USB_PORT_FEAT_C_PORT_LINK_STATE
+#		define USB_PORT_FEAT_C_PORT_LINK_STATE (25)
+#		define USB_PORT_FEAT_C_PORT_CONFIG_ERROR (26)
+#	endif
+#	ifndef USB_PORT_FEAT_REMOTE_WAKE_MASK
+#		define USB_PORT_FEAT_REMOTE_WAKE_MASK (27)
+#	endif
+#	ifndef USB_PORT_FEAT_BH_PORT_RESET
+#		define USB_PORT_FEAT_BH_PORT_RESET (28)
+#		define USB_PORT_FEAT_C_BH_PORT_RESET (29)
+#	endif
+#endif
+
 struct usb_vhci_port
 {
 	u16 port_status;
 	u16 port_change;
 	u8 port_flags;
+	// channel which gets the work of this port: its own (the index of the port), if the port is
+	// bound (see usb_vhci_bind_port), else 0; protected by vhc->lock
+	u8 channel;
+	// descriptors of the device at this port (records of struct usb_vhci_desc_record); NULL if
+	// user space didn't preload any; protected by vhc->lock
+	void *desc_cache;
+	u32 desc_cache_len;
 };
 
 enum usb_vhci_rh_state
@@ -78,6 +142,9 @@ struct usb_vhci_ifc
 	int (*init)(void *context, void *ifc_priv);
 	void (*destroy)(void *ifc_priv);
 	void (*wakeup)(struct usb_vhci_device *vdev);
+	// (optional) called when the controller stops, before its queues are freed; there are no urbs
+	// left at this point, and the backend must not access the controller anymore afterwards
+	void (*stop)(struct usb_vhci_device *vdev);
 };
 
 struct usb_vhci_device
@@ -86,47 +153,283 @@ struct usb_vhci_device
 	struct platform_device *pdev;
 	struct usb_vhci_hcd *vhc;
 
-	u8 port_count;
+	u8 port_count; // per root hub
+	u8 flags;
+#define USB_VHCI_DEV_FLAG_SUPERSPEED 0x01 // the controller has a USB 3.0 root hub too
+#define USB_VHCI_DEV_FLAG_LOCAL_NODE 0x02 // the memory of the controller is allocated on the NUMA node of the registering CPU
 
 	// private data for backend drivers
 	unsigned long ifc_priv[0] __attribute__((aligned(sizeof(unsigned long))));
 };
 
+// The state tells which list an urb is in, so that it can be found without searching. It only
+// changes while vhc->lock is held (see usb_vhci_urb_set_state).
+enum usb_vhci_urb_state
+{
+	USB_VHCI_URB_STATE_INBOX     = 0, // vep->urbp_list_inbox (or just popped from there)
+	USB_VHCI_URB_STATE_FETCHED   = 1, // vep->urbp_list_fetched
+	USB_VHCI_URB_STATE_CANCEL    = 2, // vhc->chans[chan].urbp_list_cancel
+	USB_VHCI_URB_STATE_CANCELING = 3, // vhc->urbp_list_canceling
+	USB_VHCI_URB_STATE_HELD      = 4, // vhc->urbp_list_iso_hold: isochronous urb which waits for its start frame
+	USB_VHCI_URB_STATE_PARKED    = 5  // vhc->urbp_list_parked: interrupt IN urb which user space answered with a NAK
+} __attribute__((packed));
+#define USB_VHCI_URB_STATES 6
+
+// private data of an endpoint (usb_host_endpoint.hcpriv)
+struct usb_vhci_ep
+{
+	// protects the lists of this endpoint; if vhc->lock is needed too, then it has to be taken first
+	spinlock_t lock;
+
+	// urbs which are waiting to get fetched by user space are in this list
+	struct list_head urbp_list_inbox;
+
+	// urbs which were fetched by user space but not already given back are in this list
+	struct list_head urbp_list_fetched;
+
+	struct list_head ep_ready; // entry in vhc->chans[chan].ep_ready[type] while the inbox isn't empty (protected by vhc->lock)
+	struct list_head ep_list;  // entry in vhc->ep_list (protected by vhc->lock)
+	struct usb_host_endpoint *hep;
+	u8 type;      // usb_pipetype of the endpoint
+	u8 root_port; // port of the controller behind which the device is (0 for the root hubs)
+	u8 chan;      // channel whose inbox counter covers this endpoint (changed while vhc->lock and
+	              // the lock of the endpoint are held, so either of them is enough for reading it)
+
+	// isochronous endpoints only: microframe in which the next urb with URB_ISO_ASAP starts
+	// (protected by vhc->lock)
+	u64 next_uframe;
+
+	// bulk IN endpoints only: data which user space posted ahead of the urbs (see
+	// usb_vhci_post_in); protected by vep->lock, but only consumed while vhc->lock is held, too
+	struct list_head posted;
+	unsigned int posted_count;
+	u8 address; // address of the device (at the time the endpoint was set up)
+
+	// interrupt and isochronous endpoints only: the reservation in the periodic schedule (see
+	// sched_reserve); period and phase are given in microframes, period is zero if the endpoint
+	// isn't in any schedule (protected by vhc->lock)
+	u8 scheduled; // the first urb of the endpoint has made the reservation
+	u8 sched_hs;  // in vhc->sched_hs (else vhc->sched_fs)
+	u16 sched_period;
+	u16 sched_phase;
+	u32 bw_ns;    // bus time per slot
+};
+
+// a chunk of data which user space posted for a bulk IN endpoint (entry in vep->posted)
+struct usb_vhci_posted
+{
+	struct list_head list;
+	u32 length; // number of bytes in data
+	u32 offset; // number of bytes which were handed out to urbs already
+	u8 data[0];
+};
+
 struct usb_vhci_urb_priv
 {
 	struct urb *urb;
+	struct usb_vhci_ep *vep;
 	struct list_head urbp_list;
+	struct list_head all_list;   // entry in vhc->urbp_list_all (from enqueuing until it is given back)
+	struct hlist_node urbp_hash; // entry in vhc->urbp_hash (only after it was fetched)
+	u64 handle;                  // identifies the urb in user space (0 until it was fetched)
 	atomic_t status;
+	enum usb_vhci_urb_state state; // tells which of the urbp_list_* lists the urb is in
+	u8 pinned;                     // set while the transfer buffer is accessed without
+	                               // vhc->lock; the urb must not be given back meanwhile
+	u64 due_uframe;                // isochronous urbs only: microframe in which the urb starts
+	u32 deposited;                 // IN urbs only: end of the data which user space has written
+	                               // into the buffer with USB_VHCI_HCD_IOCDEPOSITDATA
+	u64 t_inbox;                   // time (in ns) when the urb was put into the inbox
+	u64 t_fetch;                   // time (in ns) when user space fetched the urb (0 until then)
+	u8 chan;                       // channel which fetched the urb; its cancelation goes there and
+	                               // only there it may be given back
+};
+
+// number of pipe types (PIPE_ISOCHRONOUS, PIPE_INTERRUPT, PIPE_CONTROL, PIPE_BULK)
+#define USB_VHCI_PIPE_TYPES 4
+
+// performance counters of one cpu; the arrays are indexed by the pipe type (PIPE_ISOCHRONOUS,
+// PIPE_INTERRUPT, PIPE_CONTROL, PIPE_BULK)
+struct usb_vhci_stats
+{
+	unsigned long enqueued[USB_VHCI_PIPE_TYPES];  // urbs accepted by vhci_urb_enqueue
+	unsigned long fetched[USB_VHCI_PIPE_TYPES];   // urbs passed on to user space
+	unsigned long completed[USB_VHCI_PIPE_TYPES]; // urbs given back to their creator (including errors)
+	unsigned long dequeued[USB_VHCI_PIPE_TYPES];  // urbs canceled by their creator
+	unsigned long cancel_races; // user space referred to an urb which was canceled meanwhile
+	unsigned long invalid;      // urbs thrown away by the backend because they were invalid
+	unsigned long naks;         // interrupt IN urbs parked because user space had no data
+	unsigned long rejected;     // urbs rejected by vhci_urb_enqueue while the controller was throttled
+	unsigned long desc_cache_hits; // control urbs answered from the descriptor cache of their port
+	unsigned long posted_hits;  // bulk IN urbs answered from data which user space posted ahead
+	unsigned long bw_rejected;  // periodic urbs rejected, because the schedule had no room for their endpoint
+	unsigned long capture_drops; // urb events which didn't fit into the capture ring
+	unsigned long busy_polls;   // times a file spun for work before going to sleep
+	unsigned long busy_poll_hits; // ... and found some
+	u64 busy_poll_ns;           // time spent spinning
+	u64 bytes_in;               // actual_length of completed IN urbs
+	u64 bytes_out;              // actual_length of completed OUT urbs
+	long urbs[USB_VHCI_URB_STATES]; // urbs in each state (an urb may leave a state on another cpu
+	                               // than it entered it, so only the sum over all cpus makes sense)
+};
+
+// The counters are per cpu, so updating them doesn't need a shared cache line. The caller must
+// have irq disabled (which is the case while vhc->lock or vep->lock is held), so that it can't
+// be moved to another cpu meanwhile.
+#define usb_vhci_stat_add(vhc, field, n) (per_cpu_ptr((vhc)->stats, smp_processor_id())->field += (n))
+#define usb_vhci_stat_inc(vhc, field) usb_vhci_stat_add(vhc, field, 1)
+
+// Bucket n of the latency histograms counts latencies of at least 2^(n-1) and less than 2^n
+// microseconds (bucket 0: less than one microsecond). The last bucket takes everything above.
+#define USB_VHCI_LAT_BUCKETS 24
+
+// ring buffer of the urb capture (see the capture file in debugfs); it holds a pcap stream without
+// its file header, so it can be passed on to readers as it is
+struct usb_vhci_capture
+{
+	u32 size; // size of data
+	u32 head; // position in data where the next packet is written
+	u32 tail; // position in data where the reader continues
+	u32 used; // number of bytes between tail and head
+	u8 data[0];
+};
+
+// latency histograms of one cpu; indexed by the pipe type like the counters above
+struct usb_vhci_latency
+{
+	unsigned long wait[USB_VHCI_PIPE_TYPES][USB_VHCI_LAT_BUCKETS];    // inbox -> fetched by user space
+	unsigned long service[USB_VHCI_PIPE_TYPES][USB_VHCI_LAT_BUCKETS]; // fetched by user space -> given back
+};
+
+// frame numbers wrap around after 11 bits, like the SOF frame number on a real bus
+#define USB_VHCI_FRAME_MASK 0x7ff
+
+// The periodic schedule covers this many frames; endpoints with a longer period reserve their bus
+// time as if they had this period. High speed endpoints are scheduled in microframes, low and full
+// speed endpoints in frames. The budgets are the parts of a (micro)frame which may be reserved for
+// periodic transfers (80% of 125 us, 90% of 1 ms).
+#define USB_VHCI_SCHED_FRAMES    32
+#define USB_VHCI_SCHED_UFRAMES   (USB_VHCI_SCHED_FRAMES * 8)
+#define USB_VHCI_SCHED_HS_BUDGET 100000 // ns
+#define USB_VHCI_SCHED_FS_BUDGET 900000 // ns
+
+// number of buckets in the handle hash table (must be a power of two)
+#define USB_VHCI_URBP_HASH_SIZE 256
+
+// The work of a controller is divided into channels, so that different consumers can take care of
+// different devices. Channel 0 gets all the work which isn't routed anywhere else. Channel n gets
+// the work of port# n (and of the devices behind it) while that port is bound to it.
+struct usb_vhci_chan
+{
+	// number of pending work items (urbs in the inboxes of the endpoints of the channel, urbs in its
+	// cancel list and bits of its ports set in port_update); allows checking for work without
+	// taking the lock
+	atomic_t work_pending;
+
+	// endpoints which have urbs in their inbox are in these lists (one for each transfer type, indexed
+	// by usb_pipetype); see usb_vhci_inbox_pop
+	struct list_head ep_ready[USB_VHCI_PIPE_TYPES];
+	unsigned int sched_credit[USB_VHCI_PIPE_TYPES]; // urbs each type may still hand out in this round
+
+	// urbs which were fetched through this channel and not already given back, and which should be
+	// canceled are in this list
+	struct list_head urbp_list_cancel;
+
+	// consumers of bound channels wait here (channel 0 uses the wakeup callback of the interface)
+	wait_queue_head_t wait;
 };
 
 struct usb_vhci_hcd
 {
 	struct usb_vhci_port *ports;
-	u32 port_update;
+	// bit n is set, if port# n has to be reported to user space (bit 0 is unused)
+	DECLARE_BITMAP(port_update, USB_VHCI_MAX_ALL_PORTS + 1);
+	// bit n is set, if port_change of port# n isn't zero (bit 0 is unused); kept in step by
+	// vhci_port_update, so that the root hubs find their changed ports without looking at every port
+	DECLARE_BITMAP(port_changed, USB_VHCI_MAX_ALL_PORTS + 1);
+
+	// port_count + 1 channels; protected by vhc->lock (except for work_pending and wait)
+	struct usb_vhci_chan *chans;
 
 	spinlock_t lock;
 
-	atomic_t frame_num;
-	enum usb_vhci_rh_state rh_state;
+	// state of the USB 2.0 root hub (index 0) and the USB 3.0 root hub (index 1)
+	enum usb_vhci_rh_state rh_state[2];
 
-	// TODO: implement timer for incrementing frame_num every millisecond
-	//struct timer_list timer;
+	// The shared hcd of the USB 3.0 root hub (NULL, if the controller has no SuperSpeed ports). Its
+	// ports follow the ports of the USB 2.0 root hub, so port# n of the USB 3.0 root hub is port#
+	// rh_port_count + n of this controller.
+	struct usb_hcd *ss_hcd;
 
-	// urbs which are waiting to get fetched by user space are in this list
-	struct list_head urbp_list_inbox;
+	// The frame counter is derived from the time which has passed since frame_base, so it doesn't
+	// need a timer for counting. iso_timer only ticks once per frame as long as there are urbs in
+	// urbp_list_iso_hold.
+	ktime_t frame_base;
+	struct hrtimer iso_timer;
+	u8 iso_timer_armed; // protected by vhc->lock
 
-	// urbs which were fetched by user space but not already given back are in this list
-	struct list_head urbp_list_fetched;
+	// periodic schedule: bus time in ns which the interrupt and isochronous endpoints have reserved
+	// in each microframe (high speed) or frame (low and full speed); protected by vhc->lock
+	u32 sched_hs[USB_VHCI_SCHED_UFRAMES];
+	u32 sched_fs[USB_VHCI_SCHED_FRAMES];
 
-	// urbs which were fetched by user space and not already given back, and which should be
-	// canceled are in this list
-	struct list_head urbp_list_cancel;
+	// isochronous urbs which wait for their start frame are in this list (sorted by due_uframe);
+	// the timer moves them into the inbox of their endpoint when their frame has come
+	struct list_head urbp_list_iso_hold;
+
+	// interrupt IN urbs which user space answered with a NAK are in this list, until user space
+	// has data for their endpoint (see usb_vhci_unpark)
+	struct list_head urbp_list_parked;
+
+	// all endpoints which have private data (struct usb_vhci_ep) are in this list
+	struct list_head ep_list;
 
 	// urbs which were fetched by user space and not already given back, and for which the
 	// user space already knows about the cancelation state are in this list
 	struct list_head urbp_list_canceling;
 
-	u8 port_count;
+	// all urbs which are in one of the lists fetched, cancel or canceling are hashed by their handle
+	struct hlist_head urbp_hash[USB_VHCI_URBP_HASH_SIZE];
+	u64 handle_seq; // last handle which was assigned
+
+	// Backpressure: if user space lags behind, vhci_urb_enqueue rejects urbs (except for control
+	// urbs) from the moment queue_high urbs are in flight until their number has dropped to
+	// queue_low again. queue_high is zero if there is no limit.
+	atomic_t in_flight;       // urbs which were enqueued and which are not given back yet
+	unsigned int queue_high;  // set by the sysfs attribute with the same name
+	unsigned int queue_low;   // (effectively at most queue_high - 1)
+	u8 throttled;
+
+	u8 dying; // set by vhci_abort; vhci_urb_enqueue rejects all urbs from then on
+
+	// preallocated urb private data, so that enqueuing urbs usually doesn't need the allocator
+	spinlock_t urbp_free_lock; // protects the pool, urbp_list_all and urb_cursors; nests inside of all other locks
+	struct list_head urbp_free;
+	unsigned int urbp_free_count;
+
+	// all urbs of the controller in the order in which they were enqueued, whatever their state is, so
+	// that the listings can walk them in small chunks (see urb_snapshot); the cursors of the listings
+	// which are in progress are in urb_cursors
+	struct list_head urbp_list_all;
+	struct list_head urb_cursors;
+
+	struct usb_vhci_stats *stats; // (allocated by alloc_percpu)
+	struct usb_vhci_latency *latency; // (allocated by alloc_percpu; per cpu, updated with irqs disabled)
+
+	// directory of this controller in debugfs (NULL, if debugfs isn't available)
+	struct dentry *debugfs_dir;
+	struct dentry *debugfs_latency;
+	struct dentry *debugfs_capture;
+	struct dentry *debugfs_urbs;
+
+	// NULL while capturing is off; urb events are dropped when the ring is full (instead of
+	// overwriting old ones), so that the stream stays consistent for the reader
+	struct usb_vhci_capture *capture;
+	spinlock_t capture_lock; // protects capture and the ring; nests inside of all other locks
+	wait_queue_head_t capture_wait;
+
+	u8 port_count;    // number of ports of both root hubs together
+	u8 rh_port_count; // number of ports per root hub
 };
 
 static inline struct usb_vhci_device *pdev_to_vhcidev(struct platform_device *pdev)
@@ -166,9 +469,74 @@ static inline struct usb_hcd *vhcidev_to_usbhcd(struct usb_vhci_device *vdev)
 
 static inline struct usb_vhci_hcd *usbhcd_to_vhcihcd(struct usb_hcd *hcd)
 {
+#ifndef NO_SHARED_HCD
+	// the USB 3.0 root hub uses the private data of the primary hcd
+	if(!usb_hcd_is_primary_hcd(hcd))
+		hcd = hcd->primary_hcd;
+#endif
 	return (struct usb_vhci_hcd *)&hcd->hcd_priv;
 }
 
+// returns 1 if the urb has a data buffer (a linear one or a scatter-gather list)
+static inline int usb_vhci_urb_has_buffer(const struct urb *urb)
+{
+#ifndef NO_URB_SG
+	if(urb->num_sgs)
+		return 1;
+#endif
+	return urb->transfer_buffer != NULL;
+}
+
+// returns the direction of the data stage (the pipe of control urbs doesn't tell it)
+static inline int usb_vhci_urb_dir_in(const struct urb *urb)
+{
+	// (invalid control urbs without setup packet are given back with -EPIPE)
+	if(unlikely(usb_pipecontrol(urb->pipe) && urb->setup_packet))
+	{
+		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urb->setup_packet;
+		return cmd->bRequestType & 0x80;
+	}
+	else
+		return usb_pipein(urb->pipe);
+}
+
+// header of one record in the descriptor cache of a port (same layout as struct
+// usb_vhci_desc_record in usb-vhci.h); the descriptor follows, padded to a multiple of four
+struct usb_vhci_desc_hdr
+{
+	u16 value;
+	u16 index;
+	u16 length;
+	u16 reserved;
+};
+
+// one port change for usb_vhci_apply_port_stats (see usb_vhci_apply_port_stat)
+struct usb_vhci_port_stat
+{
+	u16 status;
+	u16 change;
+	u8 index;
+	int result; // [out] 0 or the error code of this change
+};
+
+// returns the hcd of the root hub which the urb belongs to
+static inline struct usb_hcd *urb_to_usbhcd(struct urb *urb)
+{
+	return container_of(urb->dev->bus, struct usb_hcd, self);
+}
+
+// returns 1 for the ports of the USB 3.0 root hub
+static inline int usb_vhci_port_is_ss(const struct usb_vhci_hcd *vhc, u8 index)
+{
+	return vhc->ss_hcd && index > vhc->rh_port_count;
+}
+
+// returns the hcd of the root hub which the port belongs to
+static inline struct usb_hcd *usb_vhci_port_to_usbhcd(struct usb_vhci_hcd *vhc, u8 index)
+{
+	return usb_vhci_port_is_ss(vhc, index) ? vhc->ss_hcd : vhcihcd_to_usbhcd(vhc);
+}
+
 static inline struct device *usbhcd_to_dev(struct usb_hcd *hcd)
 {
 	return hcd->self.controller;
@@ -204,14 +572,43 @@ static inline struct usb_hcd *pdev_to_usbhcd(struct platform_device *pdev)
 	return vhcidev_to_usbhcd(pdev_to_vhcidev(pdev));
 }
 
+// Moves the urb into another state and keeps the counters of the states in step. (The caller
+// moves it into the list which belongs to the new state.)
+// caller has vhc->lock
+static inline void usb_vhci_urb_set_state(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp, enum usb_vhci_urb_state state)
+{
+	usb_vhci_stat_add(vhc, urbs[urbp->state], -1);
+	usb_vhci_stat_inc(vhc, urbs[state]);
+	urbp->state = state;
+}
+
 const char *usb_vhci_dev_name(struct usb_vhci_device *vdev);
 int usb_vhci_dev_id(struct usb_vhci_device *vdev);
 int usb_vhci_dev_busnum(struct usb_vhci_device *vdev);
 void usb_vhci_maybe_set_status(struct usb_vhci_urb_priv *urbp, int status);
 void usb_vhci_urb_giveback(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp);
-int usb_vhci_hcd_register(const struct usb_vhci_ifc *ifc, void *context, u8 port_count, struct usb_vhci_device **vdev_ret);
+void usb_vhci_urb_retire(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp, struct list_head *done);
+void usb_vhci_urb_giveback_list(struct usb_vhci_hcd *vhc, struct list_head *done);
+struct usb_vhci_urb_priv *usb_vhci_inbox_pop(struct usb_vhci_hcd *vhc, u8 chan);
+struct usb_vhci_urb_priv *usb_vhci_inbox_pop_next(struct usb_vhci_hcd *vhc, const struct usb_vhci_urb_priv *prev, u32 max_len);
+u64 usb_vhci_urb_fetched(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp);
+void usb_vhci_urb_detach(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp);
+void usb_vhci_urb_park(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp);
+unsigned int usb_vhci_unpark(struct usb_vhci_hcd *vhc, u8 address, u8 endpoint);
+struct usb_vhci_urb_priv *usb_vhci_urbp_from_handle(struct usb_vhci_hcd *vhc, u64 handle);
+int usb_vhci_hcd_register(const struct usb_vhci_ifc *ifc, void *context, u8 port_count, u8 flags, struct usb_vhci_device **vdev_ret);
 int usb_vhci_hcd_unregister(struct usb_vhci_device *vdev);
+void usb_vhci_hcd_abort(struct usb_vhci_device *vdev);
 int usb_vhci_hcd_has_work(struct usb_vhci_hcd *vhc);
+int usb_vhci_chan_has_work(struct usb_vhci_hcd *vhc, u8 chan);
+int usb_vhci_bind_port(struct usb_vhci_hcd *vhc, u8 index);
+void usb_vhci_unbind_port(struct usb_vhci_hcd *vhc, u8 index);
+u64 usb_vhci_uframe_now(struct usb_vhci_hcd *vhc);
+u16 usb_vhci_frame_number(struct usb_vhci_hcd *vhc);
+u64 usb_vhci_urb_uframe(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp);
 int usb_vhci_apply_port_stat(struct usb_vhci_hcd *vhc, u16 status, u16 change, u8 index);
+int usb_vhci_apply_port_stats(struct usb_vhci_hcd *vhc, struct usb_vhci_port_stat *stats, unsigned int count);
+int usb_vhci_set_desc_cache(struct usb_vhci_hcd *vhc, u8 index, void *data, u32 length);
+int usb_vhci_post_in(struct usb_vhci_hcd *vhc, u8 port, u8 address, u8 endpoint, struct usb_vhci_posted *p);
 
 #endif
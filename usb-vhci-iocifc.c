@@ -27,15 +27,27 @@
 #include <linux/delay.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/errno.h>
 #include <linux/init.h>
 #include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
 #include <linux/list.h>
 #include <linux/platform_device.h>
 #include <linux/usb.h>
 #include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/scatterlist.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/anon_inodes.h>
 
 #include "usb-vhci-hcd.h"
+#include "usb-vhci-trace.h"
 
 #include <asm/atomic.h>
 #include <asm/bitops.h>
@@ -81,11 +93,60 @@ MODULE_DESCRIPTION(DRIVER_DESC " driver");
 MODULE_AUTHOR("Michael Singer <michael@a-singer.de>");
 MODULE_LICENSE("GPL");
 
+struct giveback_req;
+
+// private data of an open file (file->private_data); a file can own many controllers
+// A channel (see USB_VHCI_HCD_IOCOPENCHANNEL) is a file of its own, too. It has exactly one
+// controller (the one of its port) and gets only the work of its port.
+struct vhci_file
+{
+	struct mutex reg_mutex;        // serializes USB_VHCI_HCD_IOCREGISTER
+	wait_queue_head_t work_event;  // shared by all controllers of the file
+	wait_queue_head_t *work_wq;    // where readers wait: work_event or the queue of the channel
+
+	u8 chan;                       // channel of the file (the index of its port); 0 for the main file
+	u8 chan_controller;            // channels: index of the controller within the parent
+	struct file *parent;           // channels: the main file (a reference is held)
+
+	// Controllers are only added (under reg_mutex) and are never removed before the file is
+	// released, so readers don't need a lock: hcd_count is updated after vdevs.
+	unsigned int hcd_count;
+	unsigned int fetch_rr;         // controller which is asked for work first (round-robin)
+	struct usb_vhci_device *vdevs[USB_VHCI_MAX_CONTROLLERS];
+
+	// ring buffer mode (see USB_VHCI_HCD_IOCRINGSETUP)
+	struct mutex ring_mutex; // serializes setup, producing work and consuming givebacks
+	void *ring_mem;          // memory which gets mapped into user space (NULL if not set up)
+	unsigned long ring_size;
+	struct usb_vhci_ring_header *work_hdr, *gb_hdr;
+	struct usb_vhci_ioc_work *work_ring;
+	struct usb_vhci_ioc_ring_giveback *gb_ring;
+	u32 work_entries, gb_entries;
+	u32 work_head, gb_tail;  // our own copies of the indices we own (user space may scribble on the shared ones)
+	struct giveback_req *ring_reqs; // USB_VHCI_GIVEBACK_MULTI_MAX elements
+
+	// splice (see device_splice_read and device_splice_write)
+	struct mutex splice_rd_mutex;  // protects splice_pending*
+	void *splice_pending;          // stream bytes the pipe didn't take (STREAM_SPLICE_PAGES pages)
+	size_t splice_pending_len;
+	struct mutex splice_wr_mutex;  // protects splice_gb*
+	struct usb_vhci_stream_giveback splice_gb; // giveback record which is being received
+	u32 splice_gb_pos;             // number of its bytes received so far
+	int splice_gb_error;           // its data couldn't be deposited
+	long splice_gb_pkt_len;        // size of its iso packets
+	struct usb_vhci_ioc_iso_packet_giveback *splice_gb_iso; // receives its iso packets
+	u32 splice_gb_iso_size;        // number of elements splice_gb_iso has room for
+
+	unsigned int busy_poll;        // microseconds wait_for_work spins before it sleeps (see USB_VHCI_HCD_IOCBUSYPOLL)
+};
+
 struct vhci_ifc_priv
 {
-	struct file *file;
-	wait_queue_head_t work_event;
+	struct vhci_file *vf;
+	u8 index;                // index of the controller within vf
 	u8 port_sched_offset;
+	u8 coalesce_out;         // USB_VHCI_REGISTER_FLAG_COALESCE_OUT (set before the controller is visible)
+	u8 nak;                  // USB_VHCI_REGISTER_FLAG_NAK (likewise)
 
 #ifdef DEBUG
 	u16 debug_magic;
@@ -102,19 +163,70 @@ static inline struct vhci_ifc_priv *vhcihcd_to_ifcp(struct usb_vhci_hcd *vhc)
 	return vhcidev_to_ifcp(vhcihcd_to_vhcidev(vhc));
 }
 
-static inline struct usb_vhci_device *file_to_vhcidev(struct file *file)
+static inline unsigned int vf_hcd_count(struct vhci_file *vf)
+{
+	unsigned int count = ACCESS_ONCE(vf->hcd_count);
+	// pairs with the smp_wmb in ioc_register
+	smp_rmb();
+	return count;
+}
+
+// returns NULL if there is no controller with this index (a channel knows its own one only, but
+// by the index it has in the main file)
+static inline struct usb_vhci_hcd *vf_to_vhcihcd(struct vhci_file *vf, unsigned int index)
+{
+	if(vf->chan)
+	{
+		if(unlikely(index != vf->chan_controller))
+			return NULL;
+		index = 0;
+	}
+	if(unlikely(index >= vf_hcd_count(vf)))
+		return NULL;
+	return vhcidev_to_vhcihcd(vf->vdevs[index]);
+}
+
+// returns nonzero if the file may change port# index
+static inline int vf_owns_port(struct vhci_file *vf, u8 index)
+{
+	return !vf->chan || index == vf->chan;
+}
+
+// looks up the urb like usb_vhci_urbp_from_handle, but only finds urbs which were fetched through
+// the channel of the file
+// caller has vhc->lock
+static inline struct usb_vhci_urb_priv *vf_urbp_from_handle(struct vhci_file *vf, struct usb_vhci_hcd *vhc, u64 handle)
+{
+	struct usb_vhci_urb_priv *urbp = usb_vhci_urbp_from_handle(vhc, handle);
+	if(unlikely(urbp && urbp->chan != vf->chan))
+		return NULL;
+	return urbp;
+}
+
+// the handles of the hcd are unique per controller only, so we put the index of the controller into
+// the upper bits
+static inline u64 hcd_to_file_handle(struct vhci_ifc_priv *ifcp, u64 handle)
 {
-	return (struct usb_vhci_device *)file->private_data;
+	return handle | ((u64)ifcp->index << USB_VHCI_HANDLE_CONTROLLER_SHIFT);
 }
 
-static inline struct usb_vhci_hcd *file_to_vhcihcd(struct file *file)
+// Returns the controller to which the handle belongs and strips its index from *handle.
+// Returns NULL if there is no such controller.
+static inline struct usb_vhci_hcd *file_handle_to_vhcihcd(struct vhci_file *vf, u64 *handle)
 {
-	return vhcidev_to_vhcihcd(file_to_vhcidev(file));
+	const unsigned int index = USB_VHCI_HANDLE_CONTROLLER(*handle);
+	*handle &= ((u64)1 << USB_VHCI_HANDLE_CONTROLLER_SHIFT) - 1;
+	return vf_to_vhcihcd(vf, index);
 }
 
-static inline struct vhci_ifc_priv *file_to_ifcp(struct file *file)
+// doesn't need any lock
+static int vf_has_work(struct vhci_file *vf)
 {
-	return vhcidev_to_ifcp(file_to_vhcidev(file));
+	unsigned int i, count = vf_hcd_count(vf);
+	for(i = 0; i < count; i++)
+		if(usb_vhci_chan_has_work(vhcidev_to_vhcihcd(vf->vdevs[i]), vf->chan))
+			return 1;
+	return 0;
 }
 
 static int init_ifc_priv(void *context, void *ifc_priv)
@@ -128,9 +240,12 @@ static int init_ifc_priv(void *context, void *ifc_priv)
 		vhci_printk(KERN_WARNING, "init_ifc_priv _maybe_ called twice\n");
 #endif
 
-	ifcp->file = context;
-	init_waitqueue_head(&ifcp->work_event);
+	// called by ioc_register (which holds reg_mutex), so hcd_count is the index of the new controller
+	ifcp->vf = context;
+	ifcp->index = ifcp->vf->hcd_count;
 	ifcp->port_sched_offset = 0;
+	ifcp->coalesce_out = 0;
+	ifcp->nak = 0;
 
 #ifdef DEBUG
 	ifcp->debug_magic = 0x55aa;
@@ -139,9 +254,9 @@ static int init_ifc_priv(void *context, void *ifc_priv)
 	return 0;
 }
 
-#ifdef DEBUG
 static void destroy_ifc_priv(void *ifc_priv)
 {
+#ifdef DEBUG
 	struct vhci_ifc_priv *ifcp = ifc_priv;
 
 	if(ifcp->debug_magic == 0xaa55)
@@ -150,12 +265,12 @@ static void destroy_ifc_priv(void *ifc_priv)
 		vhci_printk(KERN_WARNING, "destroy_ifc_priv called, but ifc_priv was not initialized\n");
 
 	ifcp->debug_magic = 0xaa55;
-}
 #endif
+}
 
 static void trigger_work_event(struct usb_vhci_device *vdev)
 {
-	wake_up_interruptible(&vhcidev_to_ifcp(vdev)->work_event);
+	wake_up_interruptible(&vhcidev_to_ifcp(vdev)->vf->work_event);
 }
 
 static struct usb_vhci_ifc vhci_ioc_ifc = {
@@ -163,16 +278,43 @@ static struct usb_vhci_ifc vhci_ioc_ifc = {
 	.owner         = THIS_MODULE,
 	.ifc_priv_size = sizeof(struct vhci_ifc_priv),
 
-#ifdef DEBUG
+	.init    = init_ifc_priv,
 	.destroy = destroy_ifc_priv,
-#endif
-
-	.init   = init_ifc_priv,
-	.wakeup = trigger_work_event
+	.wakeup  = trigger_work_event
 };
 
+// allocates the private data of a file (of the main file or of a channel)
+static struct vhci_file *vf_alloc(void)
+{
+	struct vhci_file *vf;
+
+	vf = kzalloc(sizeof *vf, GFP_KERNEL);
+	if(unlikely(!vf))
+		return NULL;
+	mutex_init(&vf->reg_mutex);
+	init_waitqueue_head(&vf->work_event);
+	vf->work_wq = &vf->work_event;
+	mutex_init(&vf->ring_mutex);
+	mutex_init(&vf->splice_rd_mutex);
+	mutex_init(&vf->splice_wr_mutex);
+	return vf;
+}
+
+// frees what vf_alloc and the ioctls have allocated
+static void vf_free(struct vhci_file *vf)
+{
+	// the rings can't be mapped any longer, because the file is being released
+	vfree(vf->ring_mem);
+	kfree(vf->ring_reqs);
+	vfree(vf->splice_pending);
+	kfree(vf->splice_gb_iso);
+	kfree(vf);
+}
+
 static int device_open(struct inode *inode, struct file *file)
 {
+	struct vhci_file *vf;
+
 	vhci_dbg("%s(inode=%p, file=%p)\n", __FUNCTION__, inode, file);
 
 	if(unlikely(file->private_data != NULL))
@@ -181,33 +323,69 @@ static int device_open(struct inode *inode, struct file *file)
 		return -EINVAL;
 	}
 
+	vf = vf_alloc();
+	if(unlikely(!vf))
+		return -ENOMEM;
+	file->private_data = vf;
+
 	try_module_get(THIS_MODULE);
 	return 0;
 }
 
 // called in device_ioctl only
-static int ioc_register(struct file *file, struct usb_vhci_ioc_register __user *arg)
+// ex is nonzero for USB_VHCI_HCD_IOCREGISTEREX; USB_VHCI_HCD_IOCREGISTER doesn't look at the bytes
+// which were padding in older versions of the struct.
+static int ioc_register(struct vhci_file *vf, struct usb_vhci_ioc_register __user *arg, int ex)
 {
 	const char *dname;
 	int retval, i, usbbusnum;
 	struct usb_vhci_device *vdev;
-	u8 pc;
+	u8 pc, index, reserved, rflags = 0, flags = 0;
 
-	vhci_dbg("cmd=USB_VHCI_HCD_IOCREGISTER\n");
+	vhci_dbg("cmd=USB_VHCI_HCD_IOCREGISTER%s\n", ex ? "EX" : "");
 
-	if(unlikely(file->private_data))
+	__get_user(pc, &arg->port_count);
+	if(ex)
 	{
-		vhci_printk(KERN_ERR, "file->private_data != NULL (USB_VHCI_HCD_IOCREGISTER already done?)\n");
-		return -EPROTO;
+		__get_user(rflags, &arg->flags);
+		__get_user(reserved, &arg->reserved);
+		if(unlikely(reserved || (rflags & ~(USB_VHCI_REGISTER_FLAG_SUPERSPEED | USB_VHCI_REGISTER_FLAG_LOCAL_NODE |
+		                                    USB_VHCI_REGISTER_FLAG_COALESCE_OUT | USB_VHCI_REGISTER_FLAG_NAK))))
+			return -EINVAL;
 	}
+	if(rflags & USB_VHCI_REGISTER_FLAG_SUPERSPEED)
+		flags |= USB_VHCI_DEV_FLAG_SUPERSPEED;
+	if(rflags & USB_VHCI_REGISTER_FLAG_LOCAL_NODE)
+		flags |= USB_VHCI_DEV_FLAG_LOCAL_NODE;
 
-	__get_user(pc, &arg->port_count);
-	retval = usb_vhci_hcd_register(&vhci_ioc_ifc, file, pc, &vdev);
-	if(unlikely(retval < 0)) return retval;
-	file->private_data = vdev;
-
-	// copy id to user space
+	mutex_lock(&vf->reg_mutex);
+	if(unlikely(vf->hcd_count >= USB_VHCI_MAX_CONTROLLERS))
+	{
+		mutex_unlock(&vf->reg_mutex);
+		vhci_printk(KERN_ERR, "too many controllers for this file\n");
+		return -ENOSPC;
+	}
+	index = vf->hcd_count;
+	retval = usb_vhci_hcd_register(&vhci_ioc_ifc, vf, pc, flags, &vdev); // calls init_ifc_priv
+	if(unlikely(retval < 0))
+	{
+		mutex_unlock(&vf->reg_mutex);
+		return retval;
+	}
+	// (groups and NAKs are explicit opt-ins of USB_VHCI_HCD_IOCREGISTEREX; rflags is zero otherwise)
+	vhcidev_to_ifcp(vdev)->coalesce_out = !!(rflags & USB_VHCI_REGISTER_FLAG_COALESCE_OUT);
+	vhcidev_to_ifcp(vdev)->nak = !!(rflags & USB_VHCI_REGISTER_FLAG_NAK);
+	vf->vdevs[index] = vdev;
+	// the controller has to be visible before the new count
+	smp_wmb();
+	vf->hcd_count = index + 1;
+	mutex_unlock(&vf->reg_mutex);
+	// user space may already get work from this controller now
+	wake_up_interruptible(&vf->work_event);
+
+	// copy id and index to user space
 	__put_user(usb_vhci_dev_id(vdev), &arg->id);
+	__put_user(index, &arg->controller);
 
 	// copy bus-id to user space
 	dname = usb_vhci_dev_name(vdev);
@@ -230,55 +408,320 @@ static int ioc_register(struct file *file, struct usb_vhci_ioc_register __user *
 
 static int device_release(struct inode *inode, struct file *file)
 {
-	struct usb_vhci_device *vdev;
+	struct vhci_file *vf;
 
 	vhci_dbg("%s(inode=%p, file=%p)\n", __FUNCTION__, inode, file);
 
-	vdev = file->private_data;
+	vf = file->private_data;
 	file->private_data = NULL;
 
-	if(likely(vdev))
-		usb_vhci_hcd_unregister(vdev);
-	else
-		vhci_dbg("was not configured\n");
+	if(likely(vf))
+	{
+		unsigned int i;
+		if(!vf->hcd_count)
+			vhci_dbg("was not configured\n");
+		// all controllers drop their urbs and devices at once, before the first one is removed
+		for(i = 0; i < vf->hcd_count; i++)
+			usb_vhci_hcd_abort(vf->vdevs[i]);
+		while(vf->hcd_count)
+			usb_vhci_hcd_unregister(vf->vdevs[--vf->hcd_count]);
+		vf_free(vf);
+	}
 
 	module_put(THIS_MODULE);
 	return 0;
 }
 
-static ssize_t device_read(struct file *file,
-                           char __user *buffer,
-                           size_t length,
-                           loff_t *offset)
+// The main file owns the controller, so it must not go away before the channel does. (The
+// channel holds a reference to it.)
+static int channel_release(struct inode *inode, struct file *file)
 {
-	vhci_dbg("%s(file=%p)\n", __FUNCTION__, file);
-	return -ENODEV;
+	struct vhci_file *vf = file->private_data;
+	struct file *parent = vf->parent;
+
+	vhci_dbg("%s(inode=%p, file=%p)\n", __FUNCTION__, inode, file);
+
+	file->private_data = NULL;
+	usb_vhci_unbind_port(vhcidev_to_vhcihcd(vf->vdevs[0]), vf->chan);
+	vf_free(vf);
+	fput(parent);
+	return 0;
 }
 
-static ssize_t device_write(struct file *file,
-                            const char __user *buffer,
-                            size_t length,
-                            loff_t *offset)
+static struct file_operations channel_fops;
+
+// called in device_ioctl only
+static int ioc_open_channel(struct file *file, struct vhci_file *vf, struct usb_vhci_ioc_channel __user *arg)
+{
+	struct usb_vhci_hcd *vhc;
+	struct vhci_file *cvf;
+	u8 controller, index;
+	u16 reserved;
+	int fd, ret;
+
+	__get_user(controller, &arg->controller);
+	__get_user(index, &arg->index);
+	__get_user(reserved, &arg->reserved);
+	if(unlikely(!(vhc = vf_to_vhcihcd(vf, controller))))
+		return -ENODEV;
+	if(unlikely(reserved || !index || index > vhc->port_count))
+		return -EINVAL;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCOPENCHANNEL [port=%d]\n", (int)index);
+#endif
+
+	cvf = vf_alloc();
+	if(unlikely(!cvf))
+		return -ENOMEM;
+	cvf->chan = index;
+	cvf->chan_controller = controller;
+	cvf->work_wq = &vhc->chans[index].wait;
+	cvf->parent = file;
+	cvf->vdevs[0] = vf->vdevs[controller];
+	cvf->hcd_count = 1;
+
+	ret = usb_vhci_bind_port(vhc, index);
+	if(unlikely(ret))
+		goto free_vf;
+	// the channel must not outlive the controller, which belongs to the main file
+	get_file(file);
+	fd = anon_inode_getfd("usb-vhci-channel", &channel_fops, cvf, O_RDWR | O_CLOEXEC);
+	if(unlikely(fd < 0))
+	{
+		ret = fd;
+		goto put_parent;
+	}
+	__put_user(fd, &arg->fd);
+	return 0;
+
+put_parent:
+	fput(file);
+	usb_vhci_unbind_port(vhc, index);
+free_vf:
+	vf_free(cvf);
+	return ret;
+}
+
+// readable means that one of the controllers has some work to fetch; givebacks can always be
+// written
+static unsigned int device_poll(struct file *file, poll_table *wait)
+{
+	struct vhci_file *vf = file->private_data;
+
+	if(unlikely(!vf_hcd_count(vf)))
+		return POLLERR;
+
+	poll_wait(file, vf->work_wq, wait);
+	if(vf_has_work(vf))
+		return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+	return POLLOUT | POLLWRNORM;
+}
+
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
 {
+	struct vhci_file *vf = file->private_data;
+	int ret;
+
 	vhci_dbg("%s(file=%p)\n", __FUNCTION__, file);
-	return -ENODEV;
+
+	mutex_lock(&vf->ring_mutex);
+	if(unlikely(!vf->ring_mem))
+		ret = -EPROTO;
+	else if(unlikely(vma->vm_pgoff || vma->vm_end - vma->vm_start > vf->ring_size))
+		ret = -EINVAL;
+	else
+		ret = remap_vmalloc_range(vma, vf->ring_mem, 0);
+	mutex_unlock(&vf->ring_mutex);
+	return ret;
 }
 
 // called in device_ioctl only
-static int ioc_port_stat(struct usb_vhci_device *vdev, struct usb_vhci_ioc_port_stat __user *arg)
+// ex is nonzero for USB_VHCI_HCD_IOCPORTSTATEX; USB_VHCI_HCD_IOCPORTSTAT doesn't look at the bytes
+// which were reserved in older versions of the struct, so it always addresses controller 0.
+static int ioc_port_stat(struct vhci_file *vf, struct usb_vhci_ioc_port_stat __user *arg, int ex)
 {
+	struct usb_vhci_hcd *vhc;
 	u16 status, change;
-	u8 index;
+	u8 index, controller = 0, reserved;
+
+	__get_user(status, &arg->status);
+	__get_user(change, &arg->change);
+	__get_user(index, &arg->index);
+	if(ex)
+	{
+		__get_user(controller, &arg->controller);
+		__get_user(reserved, &arg->reserved);
+		if(unlikely(reserved))
+			return -EINVAL;
+	}
+	if(unlikely(!(vhc = vf_to_vhcihcd(vf, controller))))
+		return -ENODEV;
+	if(unlikely(!vf_owns_port(vf, index)))
+		return -EPERM;
 
 #ifdef DEBUG
-	if(debug_output) dev_dbg(vhcidev_to_dev(vdev), "cmd=USB_VHCI_HCD_IOCPORTSTAT\n");
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCPORTSTAT\n");
 #endif
 
-	__get_user(status, &arg->status);
-	__get_user(change, &arg->change);
+	return usb_vhci_apply_port_stat(vhc, status, change, index);
+}
+
+// Consecutive changes for the same controller are applied as one batch. The result of each change
+// is written to results (if not NULL).
+// called in ioc_port_stat_multi{,32} only
+static int ioc_port_stat_multi_common(struct vhci_file *vf, const struct usb_vhci_ioc_port_stat __user *stats, __s32 __user *results, u32 count)
+{
+	struct usb_vhci_ioc_port_stat *buf;
+	struct usb_vhci_port_stat *reqs;
+	struct usb_vhci_hcd *vhc;
+	u32 i, j;
+	int ret = 0;
+
+	if(unlikely(!stats || !count || count > USB_VHCI_PORT_STAT_MULTI_MAX))
+		return -EINVAL;
+	if(unlikely(results && !access_ok(VERIFY_WRITE, results, count * sizeof *results)))
+		return -EFAULT;
+
+	buf = kmalloc(count * sizeof *buf, GFP_KERNEL);
+	reqs = kmalloc(count * sizeof *reqs, GFP_KERNEL);
+	if(unlikely(!buf || !reqs))
+	{
+		ret = -ENOMEM;
+		goto end;
+	}
+	if(unlikely(copy_from_user(buf, stats, count * sizeof *buf)))
+	{
+		ret = -EFAULT;
+		goto end;
+	}
+	for(i = 0; i < count; i++)
+	{
+		if(unlikely(!vf_owns_port(vf, buf[i].index)))
+		{
+			ret = -EPERM;
+			goto end;
+		}
+		reqs[i].status = buf[i].status;
+		reqs[i].change = buf[i].change;
+		reqs[i].index = buf[i].index;
+	}
+
+	for(i = 0; i < count; i = j)
+	{
+		for(j = i + 1; j < count && buf[j].controller == buf[i].controller; j++);
+		if(unlikely(!(vhc = vf_to_vhcihcd(vf, buf[i].controller))))
+		{
+			for(; i < j; i++)
+				reqs[i].result = -ENODEV;
+			continue;
+		}
+#ifdef DEBUG
+		if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCPORTSTATMULTI [count=%u]\n", j - i);
+#endif
+		usb_vhci_apply_port_stats(vhc, reqs + i, j - i);
+	}
+
+	if(results)
+		for(i = 0; i < count; i++)
+			__put_user(reqs[i].result, &results[i]);
+
+end:
+	kfree(reqs);
+	kfree(buf);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_port_stat_multi(struct vhci_file *vf, const struct usb_vhci_ioc_port_stat_multi __user *arg)
+{
+	const struct usb_vhci_ioc_port_stat __user *stats;
+	__s32 __user *results;
+	u32 count;
+
+	__get_user(stats, &arg->stats);
+	__get_user(results, &arg->results);
+	__get_user(count, &arg->count);
+	return ioc_port_stat_multi_common(vf, stats, results, count);
+}
+
+#ifdef CONFIG_COMPAT
+// called in device_ioctl only
+static int ioc_port_stat_multi32(struct vhci_file *vf, const struct usb_vhci_ioc_port_stat_multi32 __user *arg)
+{
+	u32 stats32, results32, count;
+
+	__get_user(stats32, &arg->stats);
+	__get_user(results32, &arg->results);
+	__get_user(count, &arg->count);
+	return ioc_port_stat_multi_common(vf, compat_ptr(stats32), results32 ? compat_ptr(results32) : NULL, count);
+}
+#endif
+
+// called in ioc_desc_cache{,32} only
+static int ioc_desc_cache_common(struct vhci_file *vf, const void __user *data, u32 length, u8 controller, u8 index, u16 reserved)
+{
+	struct usb_vhci_hcd *vhc;
+	void *buf = NULL;
+
+	if(unlikely(!(vhc = vf_to_vhcihcd(vf, controller))))
+		return -ENODEV;
+	if(unlikely(!vf_owns_port(vf, index)))
+		return -EPERM;
+	if(unlikely(reserved || length > USB_VHCI_DESC_CACHE_MAX || (length && !data)))
+		return -EINVAL;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCDESCCACHE [port=%d length=%u]\n", (int)index, length);
+#endif
+
+	if(length)
+	{
+		buf = kmalloc(length, GFP_KERNEL);
+		if(unlikely(!buf))
+			return -ENOMEM;
+		if(unlikely(copy_from_user(buf, data, length)))
+		{
+			kfree(buf);
+			return -EFAULT;
+		}
+	}
+	// (takes buf, even if it fails)
+	return usb_vhci_set_desc_cache(vhc, index, buf, length);
+}
+
+// called in device_ioctl only
+static int ioc_desc_cache(struct vhci_file *vf, const struct usb_vhci_ioc_desc_cache __user *arg)
+{
+	const void __user *data;
+	u32 length;
+	u16 reserved;
+	u8 controller, index;
+
+	__get_user(data, &arg->data);
+	__get_user(length, &arg->length);
+	__get_user(controller, &arg->controller);
+	__get_user(index, &arg->index);
+	__get_user(reserved, &arg->reserved);
+	return ioc_desc_cache_common(vf, data, length, controller, index, reserved);
+}
+
+#ifdef CONFIG_COMPAT
+// called in device_ioctl only
+static int ioc_desc_cache32(struct vhci_file *vf, const struct usb_vhci_ioc_desc_cache32 __user *arg)
+{
+	u32 data32, length;
+	u16 reserved;
+	u8 controller, index;
+
+	__get_user(data32, &arg->data);
+	__get_user(length, &arg->length);
+	__get_user(controller, &arg->controller);
 	__get_user(index, &arg->index);
-	return usb_vhci_apply_port_stat(vhcidev_to_vhcihcd(vdev), status, change, index);
+	__get_user(reserved, &arg->reserved);
+	return ioc_desc_cache_common(vf, compat_ptr(data32), length, controller, index, reserved);
 }
+#endif
 
 static inline u8 conv_urb_type(u8 type)
 {
@@ -304,104 +747,235 @@ static inline u16 conv_urb_flags(unsigned int flags)
 static inline void dump_urb(struct urb *urb) {/* do nothing */}
 #endif
 
-// called in device_ioctl only
-static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __user *arg, s16 timeout)
+// Spins for up to usecs microseconds until one of the controllers of the file has some work to do.
+// Returns nonzero if there is some. The time is accounted in the stats of the first controller.
+// called in wait_for_work only
+static int busy_poll_for_work(struct vhci_file *vf, unsigned int usecs)
 {
-#ifdef DEBUG
-	struct device *dev = vhcihcd_to_dev(vhc);
-#endif
-	struct usb_vhci_urb_priv *urbp;
-	struct vhci_ifc_priv *ifcp;
-	struct usb_vhci_port port_stat;
-	struct usb_vhci_ioc_urb urb;
-	u64 handle;
+	struct usb_vhci_hcd *vhc;
 	unsigned long flags;
-	long wret;
-	u8 _port, port;
+	u64 start, end, now;
+	int found;
 
-#ifdef DEBUG
-	// Floods the logs
-	//if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK\n");
-#endif
+	start = now = ktime_to_ns(ktime_get());
+	end = start + (u64)usecs * NSEC_PER_USEC;
+	while(!(found = vf_has_work(vf)))
+	{
+		if(need_resched() || signal_pending(current))
+			break;
+		if((now = ktime_to_ns(ktime_get())) >= end)
+			break;
+		cpu_relax();
+	}
+	if(found)
+		now = ktime_to_ns(ktime_get());
 
-	ifcp = vhcihcd_to_ifcp(vhc);
+	if(likely(vf_hcd_count(vf)))
+	{
+		vhc = vhcidev_to_vhcihcd(vf->vdevs[0]);
+		local_irq_save(flags);
+		usb_vhci_stat_inc(vhc, busy_polls);
+		if(found)
+			usb_vhci_stat_inc(vhc, busy_poll_hits);
+		usb_vhci_stat_add(vhc, busy_poll_ns, now - start);
+		local_irq_restore(flags);
+	}
+	return found;
+}
+
+// Waits until one of the controllers of the file has some work to do (or until timeout_ns
+// nanoseconds have passed; a negative timeout waits forever). The timeout is backed by a high
+// resolution timer, so it isn't rounded up to jiffies.
+// The waiters are exclusive, so that every wakeup wakes only one of the threads which are waiting
+// for work (poll waiters are always woken). A thread which got some work passes the wakeup on by
+// calling pass_work_event, if there is still work left.
+// called in wait_for_work and in ioc_fetch_work only
+static int wait_for_work_ns(struct vhci_file *vf, s64 timeout_ns)
+{
+	ktime_t expires;
+	unsigned int usecs;
+	int ret = 0, timed_out = 0;
+	DEFINE_WAIT(wait);
+
+	if(!timeout_ns)
+		return vf_has_work(vf) ? 0 : -ETIMEDOUT;
+
+	if(vf_has_work(vf))
+		return 0;
+	usecs = ACCESS_ONCE(vf->busy_poll);
+	if(usecs && busy_poll_for_work(vf, usecs))
+		return 0;
 
-	if(timeout)
+	expires = ktime_get();
+	if(timeout_ns > 0 && timeout_ns < KTIME_MAX - ktime_to_ns(expires))
+		expires = ktime_add_ns(expires, timeout_ns);
+	else
+		timeout_ns = -1; // (that's forever, too)
+	for(;;)
 	{
-		if(timeout > 1000)
-			timeout = 1000;
-		if(timeout > 0)
-			wret = wait_event_interruptible_timeout(ifcp->work_event, usb_vhci_hcd_has_work(vhc), msecs_to_jiffies(timeout));
-		else
-			wret = wait_event_interruptible(ifcp->work_event, usb_vhci_hcd_has_work(vhc));
-		if(unlikely(wret < 0))
+		prepare_to_wait_exclusive(vf->work_wq, &wait, TASK_INTERRUPTIBLE);
+		if(vf_has_work(vf))
+			break;
+		if(unlikely(signal_pending(current)))
+		{
+			ret = -EINTR;
+			break;
+		}
+		if(timed_out)
 		{
-			if(likely(wret == -ERESTARTSYS))
-				return -EINTR;
-			return wret;
+			ret = -ETIMEDOUT;
+			break;
 		}
-		else if(!wret)
-			return -ETIMEDOUT;
+		if(timeout_ns < 0)
+			schedule();
+		else
+			timed_out = !schedule_hrtimeout_range(&expires, current->timer_slack_ns, HRTIMER_MODE_ABS);
 	}
-	else
+	finish_wait(vf->work_wq, &wait);
+	return ret;
+}
+
+// converts a timeout of the ioctl interface (in milliseconds, max. 1000) for wait_for_work_ns
+static inline s64 timeout_to_ns(s16 timeout)
+{
+	if(timeout < 0)
+		return -1;
+	if(timeout > 1000)
+		timeout = 1000;
+	return (s64)timeout * NSEC_PER_MSEC;
+}
+
+// like wait_for_work_ns, but with a timeout in milliseconds (see timeout_to_ns)
+// called in ioc_fetch_work_{multi,data}_common, in ioc_ring_enter and in stream_read only
+static inline int wait_for_work(struct vhci_file *vf, s16 timeout)
+{
+	return wait_for_work_ns(vf, timeout_to_ns(timeout));
+}
+
+// wakes up the next waiter if there is still work left
+// caller must not hold vhc->lock
+static inline void pass_work_event(struct vhci_file *vf)
+{
+	if(waitqueue_active(vf->work_wq) && vf_has_work(vf))
+		wake_up_interruptible(vf->work_wq);
+}
+
+// returns the next port# (starting at start) which has to be reported through channel 0, or
+// vhc->port_count + 1 if there is none
+// caller has vhc->lock
+static inline unsigned long next_port_update(struct usb_vhci_hcd *vhc, unsigned long start)
+{
+	unsigned long bit = find_next_bit(vhc->port_update, vhc->port_count + 1, start);
+	while(bit <= vhc->port_count && vhc->ports[bit - 1].channel)
+		bit = find_next_bit(vhc->port_update, vhc->port_count + 1, bit + 1);
+	return bit;
+}
+
+// Takes the bulk OUT urbs which follow urbp in the inbox of its endpoint, too, and turns the work
+// item into a group (see USB_VHCI_WORK_TYPE_PROCESS_URBS). The urbs get consecutive handles.
+// called in fetch_one_work only
+// caller has vhc->lock
+static void fetch_group(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp, struct usb_vhci_ioc_work *work)
+{
+	struct usb_vhci_ioc_urb *const urb = &work->work.urb;
+	struct usb_vhci_urb_priv *next;
+	u32 count = 1, total = urb->buffer_length;
+
+	// (the handles of a group must not wrap around)
+	if(unlikely(vhc->handle_seq + USB_VHCI_URB_GROUP_MAX < vhc->handle_seq))
+		return;
+	while(count < USB_VHCI_URB_GROUP_MAX && total < USB_VHCI_URB_GROUP_MAX_LENGTH &&
+		(next = usb_vhci_inbox_pop_next(vhc, urbp, USB_VHCI_URB_GROUP_MAX_LENGTH - total)))
+	{
+		usb_vhci_urb_fetched(vhc, next);
+		total += next->urb->transfer_buffer_length;
+		count++;
+		urbp = next;
+	}
+	if(count > 1)
 	{
-		if(!usb_vhci_hcd_has_work(vhc))
-			return -ETIMEDOUT;
+		work->type = USB_VHCI_WORK_TYPE_PROCESS_URBS;
+		urb->buffer_length = total;
+		urb->packet_count = count;
 	}
+}
 
-	spin_lock_irqsave(&vhc->lock, flags);
-	if(!list_empty(&vhc->urbp_list_cancel))
+// Takes the next work item off the queues and describes it in *work. Canceled urbs are reported
+// first, then changed ports, then new urbs. Returns -ENODATA if there is nothing to do. Invalid
+// urbs are rejected by putting them into the list done (see usb_vhci_urb_retire).
+// Only the work of the channel chan is looked at.
+// caller has vhc->lock and has irq disabled
+static int fetch_one_work(struct usb_vhci_hcd *vhc, u8 chan, struct usb_vhci_ioc_work *work, struct list_head *done)
+{
+	struct usb_vhci_chan *const ch = &vhc->chans[chan];
+#ifdef DEBUG
+	struct device *dev = vhcihcd_to_dev(vhc);
+#endif
+	struct usb_vhci_urb_priv *urbp;
+	struct vhci_ifc_priv *ifcp;
+	struct usb_vhci_ioc_urb *urb;
+	unsigned long bit;
+	u64 uframe;
+	u8 port;
+
+	ifcp = vhcihcd_to_ifcp(vhc);
+	memset(work, 0, sizeof *work);
+	work->controller = ifcp->index;
+
+	if(!list_empty(&ch->urbp_list_cancel))
 	{
-		urbp = list_entry(vhc->urbp_list_cancel.next, struct usb_vhci_urb_priv, urbp_list);
+		urbp = list_entry(ch->urbp_list_cancel.next, struct usb_vhci_urb_priv, urbp_list);
 #ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=CANCEL_URB handle=0x%016llx]\n", (u64)(unsigned long)urbp->urb);
+		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=CANCEL_URB handle=0x%016llx]\n", urbp->handle);
 #endif
-		handle = (u64)(unsigned long)urbp->urb;
 		list_move_tail(&urbp->urbp_list, &vhc->urbp_list_canceling);
-		spin_unlock_irqrestore(&vhc->lock, flags);
-		__put_user(USB_VHCI_WORK_TYPE_CANCEL_URB, &arg->type);
-		__put_user(handle, &arg->handle);
+		usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_CANCELING);
+		atomic_dec(&ch->work_pending);
+		work->type = USB_VHCI_WORK_TYPE_CANCEL_URB;
+		work->handle = hcd_to_file_handle(ifcp, urbp->handle);
 		return 0;
 	}
 
-	if(vhc->port_update)
+	if(ifcp->port_sched_offset >= vhc->port_count)
+		ifcp->port_sched_offset = 0;
+	// The search starts behind the port which was reported last, so that every port has its chance
+	// to be reported to user space, even if the hcd is under heavy load. A channel has only one port.
+	if(chan)
+		bit = test_bit(chan, vhc->port_update) ? chan : vhc->port_count + 1;
+	else
 	{
-		if(ifcp->port_sched_offset >= vhc->port_count)
-			ifcp->port_sched_offset = 0;
-		for(_port = 0; _port < vhc->port_count; _port++)
-		{
-			// The port which will be checked first, is rotated by port_sched_offset, so that every port
-			// has its chance to be reported to user space, even if the hcd is under heavy load.
-			port = (_port + ifcp->port_sched_offset) % vhc->port_count;
-			if(vhc->port_update & (1 << (port + 1)))
-			{
-				vhc->port_update &= ~(1 << (port + 1));
-				ifcp->port_sched_offset = port + 1;
-				port_stat = vhc->ports[port];
-				spin_unlock_irqrestore(&vhc->lock, flags);
+		bit = next_port_update(vhc, ifcp->port_sched_offset + 1);
+		if(bit > vhc->port_count)
+			bit = next_port_update(vhc, 1);
+	}
+	if(bit <= vhc->port_count)
+	{
+		port = bit - 1;
+		__clear_bit(bit, vhc->port_update);
+		atomic_dec(&ch->work_pending);
+		if(!chan)
+			ifcp->port_sched_offset = port + 1;
 #ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=PORT_STAT port=%d status=0x%04x change=0x%04x]\n", (int)(port + 1), (int)port_stat.port_status, (int)port_stat.port_change);
+		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=PORT_STAT port=%d status=0x%04x change=0x%04x]\n", (int)(port + 1), (int)vhc->ports[port].port_status, (int)vhc->ports[port].port_change);
 #endif
-				__put_user(USB_VHCI_WORK_TYPE_PORT_STAT, &arg->type);
-				__put_user(port + 1, &arg->work.port.index);
-				__put_user(port_stat.port_status, &arg->work.port.status);
-				__put_user(port_stat.port_change, &arg->work.port.change);
-				__put_user(port_stat.port_flags, &arg->work.port.flags);
-				return 0;
-			}
-		}
+		work->type = USB_VHCI_WORK_TYPE_PORT_STAT;
+		work->work.port.index = port + 1;
+		work->work.port.status = vhc->ports[port].port_status;
+		work->work.port.change = vhc->ports[port].port_change;
+		work->work.port.flags = vhc->ports[port].port_flags;
+		if(usb_vhci_port_is_ss(vhc, port + 1))
+			work->work.port.flags |= USB_VHCI_PORT_STAT_FLAG_SUPERSPEED;
+		return 0;
 	}
 
+	urb = &work->work.urb;
 repeat:
-	if(!list_empty(&vhc->urbp_list_inbox))
-	{
-		urbp = list_entry(vhc->urbp_list_inbox.next, struct usb_vhci_urb_priv, urbp_list);
-		handle = (u64)(unsigned long)urbp->urb;
-		memset(&urb, 0, sizeof urb);
-		urb.address = usb_pipedevice(urbp->urb->pipe);
-		urb.endpoint = usb_pipeendpoint(urbp->urb->pipe) | (usb_pipein(urbp->urb->pipe) ? 0x80 : 0x00);
-		urb.type = conv_urb_type(usb_pipetype(urbp->urb->pipe));
-		urb.flags = conv_urb_flags(urbp->urb->transfer_flags);
+	if((urbp = usb_vhci_inbox_pop(vhc, chan)))
+	{
+		urb->address = usb_pipedevice(urbp->urb->pipe);
+		urb->endpoint = usb_pipeendpoint(urbp->urb->pipe) | (usb_pipein(urbp->urb->pipe) ? 0x80 : 0x00);
+		urb->type = conv_urb_type(usb_pipetype(urbp->urb->pipe));
+		urb->flags = conv_urb_flags(urbp->urb->transfer_flags);
 		if(usb_pipecontrol(urbp->urb->pipe))
 		{
 			const struct usb_ctrlrequest *cmd;
@@ -416,155 +990,382 @@ repeat:
 				goto invalid_urb;
 			if(cmd->bRequestType & 0x80)
 			{
-				if(unlikely(!wLength || !urbp->urb->transfer_buffer))
+				if(unlikely(!wLength || !usb_vhci_urb_has_buffer(urbp->urb)))
 					goto invalid_urb;
 			}
 			else
 			{
-				if(unlikely(wLength && !urbp->urb->transfer_buffer))
+				if(unlikely(wLength && !usb_vhci_urb_has_buffer(urbp->urb)))
 					goto invalid_urb;
 			}
-			urb.buffer_length = wLength;
-			urb.setup_packet.bmRequestType = cmd->bRequestType;
-			urb.setup_packet.bRequest = cmd->bRequest;
-			urb.setup_packet.wValue = wValue;
-			urb.setup_packet.wIndex = wIndex;
-			urb.setup_packet.wLength = wLength;
+			urb->buffer_length = wLength;
+			urb->setup_packet.bmRequestType = cmd->bRequestType;
+			urb->setup_packet.bRequest = cmd->bRequest;
+			urb->setup_packet.wValue = wValue;
+			urb->setup_packet.wIndex = wIndex;
+			urb->setup_packet.wLength = wLength;
 		}
 		else
 		{
 			if(usb_pipein(urbp->urb->pipe))
 			{
-				if(unlikely(!urbp->urb->transfer_buffer_length || !urbp->urb->transfer_buffer))
+				if(unlikely(!urbp->urb->transfer_buffer_length || !usb_vhci_urb_has_buffer(urbp->urb)))
 					goto invalid_urb;
 			}
 			else
 			{
-				if(unlikely(urbp->urb->transfer_buffer_length && !urbp->urb->transfer_buffer))
+				if(unlikely(urbp->urb->transfer_buffer_length && !usb_vhci_urb_has_buffer(urbp->urb)))
 					goto invalid_urb;
 			}
-			urb.buffer_length = urbp->urb->transfer_buffer_length;
+			urb->buffer_length = urbp->urb->transfer_buffer_length;
 		}
-		urb.interval = urbp->urb->interval;
-		urb.packet_count = urbp->urb->number_of_packets;
+		urb->interval = urbp->urb->interval;
+		urb->packet_count = urbp->urb->number_of_packets;
+		uframe = usb_vhci_urb_uframe(vhc, urbp);
+		if(usb_pipeisoc(urbp->urb->pipe))
+			urb->frame = urbp->urb->start_frame;
+		else
+			urb->frame = (u16)(uframe >> 3) & USB_VHCI_FRAME_MASK;
+		urb->uframe = (u8)uframe & 7;
+		work->type = USB_VHCI_WORK_TYPE_PROCESS_URB;
+		work->handle = hcd_to_file_handle(ifcp, usb_vhci_urb_fetched(vhc, urbp));
+		if(ifcp->coalesce_out && usb_pipebulk(urbp->urb->pipe) && usb_pipeout(urbp->urb->pipe))
+			fetch_group(vhc, urbp, work);
 
 #ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=PROCESS_URB handle=0x%016llx]\n", handle);
+		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=PROCESS_URB handle=0x%016llx]\n", work->handle);
 #endif
 		dump_urb(urbp->urb);
-		list_move_tail(&urbp->urbp_list, &vhc->urbp_list_fetched);
-		spin_unlock_irqrestore(&vhc->lock, flags);
-
-		__put_user(USB_VHCI_WORK_TYPE_PROCESS_URB, &arg->type);
-		__put_user(handle, &arg->handle);
-		if(unlikely(__copy_to_user(&arg->work.urb, &urb, sizeof urb)))
-			return -EFAULT;
 		return 0;
 
 	invalid_urb:
 		// reject invalid urbs immediately
 #ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK  <<< THROWING AWAY INVALID URB >>>  [handle=0x%016llx]\n", handle);
+		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK  <<< THROWING AWAY INVALID URB >>>  [urb=%p]\n", urbp->urb);
 #endif
+		usb_vhci_stat_inc(vhc, invalid);
 		usb_vhci_maybe_set_status(urbp, -EPIPE);
-		usb_vhci_urb_giveback(vhc, urbp);
+		usb_vhci_urb_retire(vhc, urbp, done);
+		memset(urb, 0, sizeof *urb);
 		goto repeat;
 	}
 
-	spin_unlock_irqrestore(&vhc->lock, flags);
 	return -ENODATA;
 }
 
-// caller has lock
-static inline struct usb_vhci_urb_priv *urbp_from_handle(struct usb_vhci_hcd *vhc, const void *handle)
+// Fetches up to count work items from the controllers of the file and stores the i-th one in
+// works[(start + i) & mask]. The controllers are served round-robin and the lock of each of them
+// is taken only once. Returns the number of fetched work items.
+// caller must not hold any vhc->lock
+static u32 fetch_works(struct vhci_file *vf, struct usb_vhci_ioc_work *works, u32 mask, u32 start, u32 count)
 {
-	struct usb_vhci_urb_priv *entry;
-	list_for_each_entry(entry, &vhc->urbp_list_fetched, urbp_list)
-		if(entry->urb == handle)
-			return entry;
-	return NULL;
-}
+	struct usb_vhci_hcd *vhc;
+	unsigned long flags;
+	unsigned int i, index, hcd_count, first;
+	LIST_HEAD(done);
+	u32 n = 0;
 
-// caller has lock
-static inline struct usb_vhci_urb_priv *urbp_from_handle_in_cancel(struct usb_vhci_hcd *vhc, const void *handle)
-{
-	struct usb_vhci_urb_priv *entry;
-	list_for_each_entry(entry, &vhc->urbp_list_cancel, urbp_list)
-		if(entry->urb == handle)
-			return entry;
-	return NULL;
+	hcd_count = vf_hcd_count(vf);
+	first = ACCESS_ONCE(vf->fetch_rr);
+	for(i = 0; i < hcd_count && n < count; i++)
+	{
+		index = (first + i) % hcd_count;
+		vhc = vhcidev_to_vhcihcd(vf->vdevs[index]);
+		if(!usb_vhci_chan_has_work(vhc, vf->chan))
+			continue;
+		spin_lock_irqsave(&vhc->lock, flags);
+		while(n < count && !fetch_one_work(vhc, vf->chan, &works[(start + n) & mask], &done))
+			n++;
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		if(unlikely(!list_empty(&done)))
+			usb_vhci_urb_giveback_list(vhc, &done);
+		// the next call starts with the next controller (races between threads don't matter here)
+		vf->fetch_rr = index + 1;
+	}
+	return n;
 }
 
-// caller has lock
-static inline struct usb_vhci_urb_priv *urbp_from_handle_in_canceling(struct usb_vhci_hcd *vhc, const void *handle)
+// called in device_ioctl only
+static int ioc_fetch_work(struct vhci_file *vf, struct usb_vhci_ioc_work __user *arg, s64 timeout_ns)
 {
-	struct usb_vhci_urb_priv *entry;
-	list_for_each_entry(entry, &vhc->urbp_list_canceling, urbp_list)
-		if(entry->urb == handle)
-			return entry;
-	return NULL;
+	struct usb_vhci_ioc_work work;
+	int ret;
+
+#ifdef DEBUG
+	// Floods the logs
+	//vhci_dbg("cmd=USB_VHCI_HCD_IOCFETCHWORK\n");
+#endif
+
+	if((ret = wait_for_work_ns(vf, timeout_ns)))
+		return ret;
+
+	if(unlikely(!fetch_works(vf, &work, 0, 0, 1)))
+		return -ENODATA;
+	pass_work_event(vf);
+
+	// don't touch arg->timeout, because user space may want to reuse it
+	__put_user(work.type, &arg->type);
+	__put_user(work.controller, &arg->controller);
+	__put_user(work.handle, &arg->handle);
+	if(unlikely(__copy_to_user(&arg->work, &work.work, sizeof work.work)))
+		return -EFAULT;
+	return 0;
 }
 
-// caller has lock
-static inline int is_urb_dir_in(const struct urb *urb)
+// called in ioc_fetch_work_multi{,32} only
+static int ioc_fetch_work_multi_common(struct vhci_file *vf, struct usb_vhci_ioc_work __user *works, u32 count, s16 timeout, __u32 __user *fetched)
 {
-	if(unlikely(usb_pipecontrol(urb->pipe)))
+	struct usb_vhci_ioc_work *buf;
+	u32 n;
+	int ret;
+
+	if(unlikely(!count || !works))
+		return -EINVAL;
+	if(count > USB_VHCI_WORK_MULTI_MAX)
+		count = USB_VHCI_WORK_MULTI_MAX;
+	if(unlikely(!access_ok(VERIFY_WRITE, works, count * sizeof *works)))
+		return -EFAULT;
+
+	if((ret = wait_for_work(vf, timeout)))
+		return ret;
+
+	buf = kmalloc(count * sizeof *buf, GFP_KERNEL);
+	if(unlikely(!buf))
+		return -ENOMEM;
+
+	// collect as many work items as possible
+	n = fetch_works(vf, buf, ~0U, 0, count);
+	if(likely(n))
+		pass_work_event(vf);
+
+	if(unlikely(!n))
+		ret = -ENODATA;
+	else if(unlikely(__copy_to_user(works, buf, n * sizeof *buf)))
+		ret = -EFAULT;
+	else
+		__put_user(n, fetched);
+	kfree(buf);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_fetch_work_multi(struct vhci_file *vf, struct usb_vhci_ioc_work_multi __user *arg)
+{
+	struct usb_vhci_ioc_work __user *works;
+	u32 count;
+	s16 timeout;
+
+	__get_user(works, &arg->works);
+	__get_user(count, &arg->count);
+	__get_user(timeout, &arg->timeout);
+	return ioc_fetch_work_multi_common(vf, works, count, timeout, &arg->fetched);
+}
+
+// Copies the first len bytes of the data of the urb to user space. The data is either in the linear
+// transfer_buffer or in the scatter-gather list of the urb. Returns 0 or -EFAULT.
+// caller must not hold vhc->lock; the urb has to be pinned or detached
+static int urb_data_to_user(struct urb *urb, void __user *ubuf, int len)
+{
+#ifndef NO_URB_SG
+	if(urb->num_sgs)
 	{
-		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urb->setup_packet;
-		return cmd->bRequestType & 0x80;
+		struct sg_mapping_iter miter;
+		size_t n;
+		int ret = 0;
+		// no SG_MITER_ATOMIC, because copy_to_user might sleep
+		sg_miter_start(&miter, urb->sg, urb->num_sgs, SG_MITER_FROM_SG);
+		while(len > 0 && sg_miter_next(&miter))
+		{
+			n = min_t(size_t, miter.length, len);
+			if(unlikely(copy_to_user(ubuf, miter.addr, n)))
+			{
+				ret = -EFAULT;
+				break;
+			}
+			ubuf += n;
+			len -= n;
+		}
+		sg_miter_stop(&miter);
+		return ret;
 	}
-	else
-		return usb_pipein(urb->pipe);
+#endif
+	return unlikely(copy_to_user(ubuf, urb->transfer_buffer, len)) ? -EFAULT : 0;
 }
 
-// -ECANCELED doesn't report an error, but it indicates that the urb was in the "cancel"
-// list or in the "canceling" list.
-// If this function reports an error (other than -ENOENT), then the urb will be given back to its creator anyway,
-// if its handle was found. (If its handle wasn't found, then -ENOENT is returned.)
-// called in ioc_giveback{,32} only
-static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int status, int act, int iso_count, int err_count, const void __user *buf, const struct usb_vhci_ioc_iso_packet_giveback __user *iso)
+// Copies len bytes from user space into the data of the urb, starting at offset (see
+// urb_data_to_user).
+// caller must not hold vhc->lock; the urb has to be pinned or detached
+static int urb_data_from_user(struct urb *urb, int offset, const void __user *ubuf, int len)
+{
+#ifndef NO_URB_SG
+	if(urb->num_sgs)
+	{
+		struct sg_mapping_iter miter;
+		size_t n;
+		int ret = 0;
+		sg_miter_start(&miter, urb->sg, urb->num_sgs, SG_MITER_TO_SG);
+		while(len > 0 && sg_miter_next(&miter))
+		{
+			if(offset >= miter.length)
+			{
+				offset -= miter.length;
+				continue;
+			}
+			n = min_t(size_t, miter.length - offset, len);
+			if(unlikely(copy_from_user(miter.addr + offset, ubuf, n)))
+			{
+				ret = -EFAULT;
+				break;
+			}
+			offset = 0;
+			ubuf += n;
+			len -= n;
+		}
+		sg_miter_stop(&miter);
+		return ret;
+	}
+#endif
+	return unlikely(copy_from_user(urb->transfer_buffer + offset, ubuf, len)) ? -EFAULT : 0;
+}
+
+// number of iso packet descriptors which are converted on the stack at once, so that
+// user space is accessed by one copy per batch instead of two accesses per packet
+#define ISO_BATCH 32
+
+// Copies offset and length of the iso packet descriptors of the urb to user space.
+// Returns 0 or -EFAULT.
+// caller must not hold vhc->lock; the urb has to be pinned; access_ok was checked already
+static int iso_desc_to_user(const struct urb *urb, struct usb_vhci_ioc_iso_packet_data __user *iso, int count)
+{
+	struct usb_vhci_ioc_iso_packet_data buf[ISO_BATCH];
+	int i, j, n;
+
+	for(i = 0; i < count; i += n)
+	{
+		n = min(count - i, ISO_BATCH);
+		for(j = 0; j < n; j++)
+		{
+			buf[j].offset = urb->iso_frame_desc[i + j].offset;
+			buf[j].packet_length = urb->iso_frame_desc[i + j].length;
+		}
+		if(unlikely(__copy_to_user(iso + i, buf, n * sizeof *buf)))
+			return -EFAULT;
+	}
+	return 0;
+}
+
+// Copies the results of the iso packets from user space into the urb. Every packet_actual is
+// checked against the length of its packet before anything of its batch is stored in the urb.
+// Returns 0, -EFAULT or -EINVAL.
+// caller must not hold vhc->lock; the urb has to be detached; access_ok was checked already
+static int iso_results_from_user(struct urb *urb, const struct usb_vhci_ioc_iso_packet_giveback __user *iso, int count)
+{
+	struct usb_vhci_ioc_iso_packet_giveback buf[ISO_BATCH];
+	int i, j, n;
+
+	for(i = 0; i < count; i += n)
+	{
+		n = min(count - i, ISO_BATCH);
+		if(unlikely(__copy_from_user(buf, iso + i, n * sizeof *buf)))
+			return -EFAULT;
+		for(j = 0; j < n; j++)
+			if(unlikely(buf[j].packet_actual > urb->iso_frame_desc[i + j].length))
+				return -EINVAL;
+		for(j = 0; j < n; j++)
+		{
+			urb->iso_frame_desc[i + j].status = buf[j].status;
+			urb->iso_frame_desc[i + j].actual_length = buf[j].packet_actual;
+		}
+	}
+	return 0;
+}
+
+// describes one giveback request after it was read from user space
+struct giveback_req
+{
+	u64 handle;
+	const void __user *buf;
+	const struct usb_vhci_ioc_iso_packet_giveback __user *iso;
+	int status, act, iso_count, err_count;
+	struct usb_vhci_urb_priv *urbp; // set by giveback_detach
+	int result;
+};
+
+// Looks up the urb and removes it from its list and from the hash, so that nobody else can find it
+// until it is given back.
+// Sets req->result to -ENOENT if the handle wasn't found, to -EBUSY if the urb is pinned (in both
+// cases req->urbp is NULL), to -ECANCELED if the urb was in the "cancel" list or in the "canceling"
+// list and to 0 otherwise. A NAK for an interrupt IN urb parks it (if the controller was registered
+// with USB_VHCI_REGISTER_FLAG_NAK); then req->urbp is NULL, too.
+// Urbs which were fetched through another channel aren't found.
+// caller has vhc->lock
+static void giveback_detach(struct vhci_file *vf, struct usb_vhci_hcd *vhc, struct giveback_req *req)
 {
 	struct usb_vhci_urb_priv *urbp;
-	unsigned long flags;
-	int retval = 0, is_in, is_iso, i;
 #ifdef DEBUG
 	struct device *dev = vhcihcd_to_dev(vhc);
 #endif
 
-	// TODO: do we really need to disable interrupts for accessing the urb lists?
-	spin_lock_irqsave(&vhc->lock, flags);
-
-	if(unlikely(!(urbp = urbp_from_handle(vhc, handle))))
+	req->result = 0;
+	if(unlikely(!(req->urbp = urbp = vf_urbp_from_handle(vf, vhc, req->handle))))
 	{
-		// if not found, check the cancel{,ing} list
-		if(likely((urbp = urbp_from_handle_in_canceling(vhc, handle)) ||
-			(urbp = urbp_from_handle_in_cancel(vhc, handle))))
-		{
 #ifdef DEBUG
-			if(debug_output) dev_dbg(dev, "GIVEBACK: urb was canceled\n");
+		if(debug_output) dev_dbg(dev, "GIVEBACK: handle not found\n");
 #endif
-			retval = -ECANCELED;
-		}
-		else
-		{
+		req->result = -ENOENT;
+		return;
+	}
+
+	// somebody is copying data from this urb without holding the lock (see ioc_fetch_work_data_common)
+	if(unlikely(urbp->pinned))
+	{
 #ifdef DEBUG
-			if(debug_output) dev_dbg(dev, "GIVEBACK: handle not found\n");
+		if(debug_output) dev_dbg(dev, "GIVEBACK: urb is busy\n");
 #endif
-			spin_unlock_irqrestore(&vhc->lock, flags);
-			return -ENOENT;
-		}
+		req->urbp = NULL;
+		req->result = -EBUSY;
+		return;
 	}
 
-	// remove urb from list before we release the spinlock
-	list_del(&urbp->urbp_list);
+	// if not fetched, then it is in the cancel{,ing} list
+	if(unlikely(urbp->state != USB_VHCI_URB_STATE_FETCHED))
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(dev, "GIVEBACK: urb was canceled\n");
+#endif
+		usb_vhci_stat_inc(vhc, cancel_races);
+		req->result = -ECANCELED;
+	}
+	else if(req->status == USB_VHCI_STATUS_NAK && vhcihcd_to_ifcp(vhc)->nak &&
+	        usb_pipeint(urbp->urb->pipe) && usb_pipein(urbp->urb->pipe))
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(dev, "GIVEBACK: NAK (urb is parked)\n");
+#endif
+		usb_vhci_urb_park(vhc, urbp);
+		req->urbp = NULL;
+		return;
+	}
 
-	spin_unlock_irqrestore(&vhc->lock, flags);
+	// remove urb from list and hash before we release the spinlock
+	usb_vhci_urb_detach(vhc, urbp);
+}
 
-	// usb_vhci_urb_giveback() (called below) will fail if we don't re-initialize
-	// the list entry, because it calls list_del(), too!
-	INIT_LIST_HEAD(&urbp->urbp_list);
+// Copies the data from user space into the detached urb and sets its status.
+// -ECANCELED doesn't report an error, but it indicates that the urb was in the "cancel"
+// list or in the "canceling" list.
+// If this function reports an error, then the urb has to be given back to its creator anyway.
+// caller must not hold vhc->lock
+static void giveback_fill(struct usb_vhci_hcd *vhc, struct giveback_req *req)
+{
+	struct usb_vhci_urb_priv *urbp = req->urbp;
+	const int act = req->act, iso_count = req->iso_count;
+	int retval = req->result, is_in, is_iso;
+#ifdef DEBUG
+	struct device *dev = vhcihcd_to_dev(vhc);
+#endif
 
-	is_in = is_urb_dir_in(urbp->urb);
+	is_in = usb_vhci_urb_dir_in(urbp->urb);
 	is_iso = usb_pipeisoc(urbp->urb->pipe);
 
 	if(likely(is_iso))
@@ -585,7 +1386,7 @@ static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int
 			retval = -EINVAL;
 			goto done_with_errors;
 		}
-		if(unlikely(iso_count && !iso))
+		if(unlikely(iso_count && !req->iso))
 		{
 #ifdef DEBUG
 			if(debug_output) dev_dbg(dev, "GIVEBACK(ISO): invalid: iso_packets must not be zero\n");
@@ -595,7 +1396,7 @@ static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int
 		}
 		if(likely(iso_count))
 		{
-			if(!access_ok(VERIFY_READ, (void *)iso, iso_count * sizeof(struct usb_vhci_ioc_iso_packet_giveback)))
+			if(!access_ok(VERIFY_READ, (void *)req->iso, iso_count * sizeof(struct usb_vhci_ioc_iso_packet_giveback)))
 			{
 				retval = -EFAULT;
 				goto done_with_errors;
@@ -610,17 +1411,21 @@ static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int
 		retval = is_in ? -ENOBUFS : -EINVAL;
 		goto done_with_errors;
 	}
-	if(is_in)
+	if(is_in && !req->buf)
 	{
-		if(unlikely(act && !buf))
+		// the data has to be in the urb already (see ioc_deposit_data_common)
+		if(unlikely(act > urbp->deposited))
 		{
 #ifdef DEBUG
-			if(debug_output) dev_dbg(dev, "GIVEBACK: buf must not be zero\n");
+			if(debug_output) dev_dbg(dev, "GIVEBACK: buf must not be zero, unless the data was deposited\n");
 #endif
 			retval = -EINVAL;
 			goto done_with_errors;
 		}
-		if(unlikely(copy_from_user(urbp->urb->transfer_buffer, buf, act)))
+	}
+	else if(is_in)
+	{
+		if(unlikely(urb_data_from_user(urbp->urb, 0, req->buf, act)))
 		{
 #ifdef DEBUG
 			if(debug_output) dev_dbg(dev, "GIVEBACK: copy_from_user(buf) failed\n");
@@ -629,7 +1434,7 @@ static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int
 			goto done_with_errors;
 		}
 	}
-	else if(unlikely(buf))
+	else if(unlikely(req->buf))
 	{
 #ifdef DEBUG
 		if(debug_output) dev_dbg(dev, "GIVEBACK: invalid: buf should be NULL\n");
@@ -640,47 +1445,122 @@ static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int
 	}
 	if(likely(is_iso && iso_count))
 	{
-		for(i = 0; i < iso_count; i++)
+		if(unlikely((retval = iso_results_from_user(urbp->urb, req->iso, iso_count))))
 		{
-			__get_user(urbp->urb->iso_frame_desc[i].status, &iso[i].status);
-			__get_user(urbp->urb->iso_frame_desc[i].actual_length, &iso[i].packet_actual);
+#ifdef DEBUG
+			if(debug_output) dev_dbg(dev, "GIVEBACK(ISO): invalid iso_packets\n");
+#endif
+			goto done_with_errors;
 		}
 	}
 	urbp->urb->actual_length = act;
-	urbp->urb->error_count = err_count;
+	urbp->urb->error_count = req->err_count;
 
 	// now we are done with this urb and it can return to its creator
-	usb_vhci_maybe_set_status(urbp, status);
-	spin_lock_irqsave(&vhc->lock, flags);
-	usb_vhci_urb_giveback(vhc, urbp);
-	spin_unlock_irqrestore(&vhc->lock, flags);
+	usb_vhci_maybe_set_status(urbp, req->status);
 #ifdef DEBUG
 	if(debug_output) dev_dbg(dev, "GIVEBACK: done\n");
 #endif
-	return retval;
+	req->result = retval;
+	return;
 
 done_with_errors:
-	spin_lock_irqsave(&vhc->lock, flags);
-	usb_vhci_urb_giveback(vhc, urbp);
-	spin_unlock_irqrestore(&vhc->lock, flags);
 #ifdef DEBUG
 	if(debug_output) dev_dbg(dev, "GIVEBACK: done (with errors)\n");
 #endif
-	return retval;
+	req->result = retval;
+}
+
+// If this function reports an error (other than -ENOENT or -EBUSY), then the urb will be given back to its creator
+// anyway, if its handle was found. (If its handle wasn't found, then -ENOENT is returned. If the urb is pinned,
+// then -EBUSY is returned and the user may try again.)
+// called in ioc_giveback{,32} only
+static int ioc_giveback_common(struct vhci_file *vf, struct giveback_req *req)
+{
+	struct usb_vhci_hcd *vhc;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	if(unlikely(!(vhc = file_handle_to_vhcihcd(vf, &req->handle))))
+		return -ENOENT;
+
+	// TODO: do we really need to disable interrupts for accessing the urb lists?
+	spin_lock_irqsave(&vhc->lock, flags);
+	giveback_detach(vf, vhc, req);
+	if(likely(req->urbp))
+		usb_vhci_urb_retire(vhc, req->urbp, &done);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	if(unlikely(!req->urbp))
+		return req->result;
+
+	// the urb doesn't belong to anybody else anymore, so it can be filled without holding the lock
+	giveback_fill(vhc, req);
+	usb_vhci_urb_giveback_list(vhc, &done);
+	return req->result;
+}
+
+// Processes count giveback requests which all belong to the same controller: all urbs are
+// retired under one lock hold and given back to their creators without holding the lock.
+// called in ioc_giveback_multi_common only
+static void giveback_batch(struct vhci_file *vf, struct giveback_req *reqs, u32 count)
+{
+	struct usb_vhci_hcd *vhc = NULL;
+	unsigned long flags;
+	LIST_HEAD(done);
+	u32 i;
+
+	for(i = 0; i < count; i++)
+		vhc = file_handle_to_vhcihcd(vf, &reqs[i].handle);
+	if(unlikely(!vhc))
+	{
+		for(i = 0; i < count; i++)
+			reqs[i].result = -ENOENT;
+		return;
+	}
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	for(i = 0; i < count; i++)
+	{
+		giveback_detach(vf, vhc, &reqs[i]);
+		if(likely(reqs[i].urbp))
+			usb_vhci_urb_retire(vhc, reqs[i].urbp, &done);
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	for(i = 0; i < count; i++)
+		if(likely(reqs[i].urbp))
+			giveback_fill(vhc, &reqs[i]);
+
+	usb_vhci_urb_giveback_list(vhc, &done);
+}
+
+// Processes count giveback requests. Consecutive requests for the same controller are processed
+// as one batch. The result of each request is written to results (if not NULL).
+// called in ioc_giveback_multi{,32}, in ring_giveback and in device_write only
+static int ioc_giveback_multi_common(struct vhci_file *vf, struct giveback_req *reqs, u32 count, __s32 __user *results)
+{
+	u32 i, j;
+
+	for(i = 0; i < count; i = j)
+	{
+		const u8 controller = USB_VHCI_HANDLE_CONTROLLER(reqs[i].handle);
+		for(j = i + 1; j < count && USB_VHCI_HANDLE_CONTROLLER(reqs[j].handle) == controller; j++);
+		giveback_batch(vf, reqs + i, j - i);
+	}
+
+	if(results)
+		for(i = 0; i < count; i++)
+			__put_user(reqs[i].result, &results[i]);
+	return 0;
 }
 
 // called in device_ioctl only
-static int ioc_giveback(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback __user *arg)
+static int ioc_giveback(struct vhci_file *vf, const struct usb_vhci_ioc_giveback __user *arg)
 {
-	const struct usb_vhci_ioc_iso_packet_giveback __user *iso;
-	const void *handle;
-	const void __user *buf;
+	struct giveback_req req;
 	u64 handle64;
-	int status, act, iso_count, err_count;
 
-#ifdef DEBUG
-	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK\n");
-#endif
+	vhci_dbg("cmd=USB_VHCI_HCD_IOCGIVEBACK\n");
 
 	if(sizeof(void *) > 4)
 		__get_user(handle64, &arg->handle);
@@ -691,60 +1571,243 @@ static int ioc_giveback(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_give
 		__get_user(handle2, (u32 __user *)&arg->handle + 1);
 		*((u32 *)&handle64) = handle1;
 		*((u32 *)&handle64 + 1) = handle2;
-		if(handle64 >> 32)
-			return -EINVAL;
 	}
-	__get_user(status, &arg->status);
-	__get_user(act, &arg->buffer_actual);
-	__get_user(iso_count, &arg->packet_count);
-	__get_user(err_count, &arg->error_count);
-	__get_user(buf, &arg->buffer);
-	__get_user(iso, &arg->iso_packets);
-	handle = (const void *)(unsigned long)handle64;
-	if(unlikely(!handle))
+	__get_user(req.status, &arg->status);
+	__get_user(req.act, &arg->buffer_actual);
+	__get_user(req.iso_count, &arg->packet_count);
+	__get_user(req.err_count, &arg->error_count);
+	__get_user(req.buf, &arg->buffer);
+	__get_user(req.iso, &arg->iso_packets);
+	if(unlikely(!handle64))
 		return -EINVAL;
-	return ioc_giveback_common(vhc, handle, status, act, iso_count, err_count, buf, iso);
+	req.handle = handle64;
+	return ioc_giveback_common(vf, &req);
 }
 
-// called in ioc_fetch_data{,32} only
-static int ioc_fetch_data_common(struct usb_vhci_hcd *vhc, const void *handle, void __user *user_buf, int user_len, struct usb_vhci_ioc_iso_packet_data __user *iso, int iso_count)
+// called in device_ioctl only
+static int ioc_giveback_multi(struct vhci_file *vf, const struct usb_vhci_ioc_giveback_multi __user *arg)
 {
-	struct usb_vhci_urb_priv *urbp;
-	unsigned long flags;
-	int tb_len, is_in, is_iso, i, ret = -ENOMEM;
-	void *user_buf_tmp = NULL;
-	struct usb_vhci_ioc_iso_packet_data *iso_tmp = NULL;
+	const struct usb_vhci_ioc_giveback __user *gbs;
+	struct usb_vhci_ioc_giveback gb;
+	struct giveback_req *reqs;
+	__s32 __user *results;
+	u32 count, i;
+	int ret;
+
+	vhci_dbg("cmd=USB_VHCI_HCD_IOCGIVEBACKMULTI\n");
+
+	__get_user(gbs, &arg->givebacks);
+	__get_user(results, &arg->results);
+	__get_user(count, &arg->count);
+	if(unlikely(!gbs || !count || count > USB_VHCI_GIVEBACK_MULTI_MAX))
+		return -EINVAL;
+	if(unlikely(!access_ok(VERIFY_READ, gbs, count * sizeof *gbs)))
+		return -EFAULT;
+	if(unlikely(results && !access_ok(VERIFY_WRITE, results, count * sizeof *results)))
+		return -EFAULT;
 
-	if(likely(user_len))
+	reqs = kmalloc(count * sizeof *reqs, GFP_KERNEL);
+	if(unlikely(!reqs))
+		return -ENOMEM;
+	for(i = 0; i < count; i++)
 	{
-		user_buf_tmp = kmalloc(user_len, GFP_KERNEL);
-		if(unlikely(!user_buf_tmp))
+		if(unlikely(__copy_from_user(&gb, &gbs[i], sizeof gb)))
+		{
+			ret = -EFAULT;
 			goto end;
-	}
-	if(likely(iso_count))
-	{
-		iso_tmp = kmalloc(iso_count * sizeof *iso_tmp, GFP_KERNEL);
-		if(unlikely(!iso_tmp))
+		}
+		if(unlikely(!gb.handle))
+		{
+			ret = -EINVAL;
 			goto end;
+		}
+		reqs[i].handle = gb.handle;
+		reqs[i].buf = gb.buffer;
+		reqs[i].iso = gb.iso_packets;
+		reqs[i].status = gb.status;
+		reqs[i].act = gb.buffer_actual;
+		reqs[i].iso_count = gb.packet_count;
+		reqs[i].err_count = gb.error_count;
 	}
-	ret = 0;
+	ret = ioc_giveback_multi_common(vf, reqs, count, results);
+end:
+	kfree(reqs);
+	return ret;
+}
+
+// Copies the data of the count urbs of a group, which start with handle, one after another into
+// user_buf and describes where the data of each of them is in iso (see
+// USB_VHCI_WORK_TYPE_PROCESS_URBS).
+// called in ioc_fetch_data_common only
+static int fetch_group_data(struct vhci_file *vf, struct usb_vhci_hcd *vhc, u64 handle, void __user *user_buf, int user_len, struct usb_vhci_ioc_iso_packet_data __user *iso, int count)
+{
+	struct usb_vhci_urb_priv *urbps[USB_VHCI_URB_GROUP_MAX], *urbp;
+	struct usb_vhci_ioc_iso_packet_data desc[USB_VHCI_URB_GROUP_MAX];
+	struct usb_vhci_ep *vep = NULL;
+	unsigned long flags;
+	u32 pos = 0;
+	int i, ret = 0;
+
+	if(unlikely(count < 0 || count > USB_VHCI_URB_GROUP_MAX || !iso))
+		return -EINVAL;
+	if(unlikely(!access_ok(VERIFY_WRITE, iso, count * sizeof *iso)))
+		return -EFAULT;
 
 	spin_lock_irqsave(&vhc->lock, flags);
-	if(unlikely(!(urbp = urbp_from_handle(vhc, handle))))
+	for(i = 0; i < count; i++)
 	{
-		// if not found, check the cancel{,ing} list
-		if(likely((urbp = urbp_from_handle_in_cancel(vhc, handle)) ||
-			(urbp = urbp_from_handle_in_canceling(vhc, handle))))
+		urbps[i] = NULL;
+		desc[i].offset = USB_VHCI_URB_GROUP_GONE;
+		desc[i].packet_length = 0;
+		// the urbs which were given back already or which were canceled meanwhile are just skipped
+		if(!(urbp = vf_urbp_from_handle(vf, vhc, handle + i)))
+			continue;
+		if(unlikely(urbp->pinned))
+		{
+			ret = -EBUSY;
+			goto end_unlock;
+		}
+		if(!vep)
+			vep = urbp->vep;
+		// (the handles belong to another endpoint, if user space counted wrong)
+		if(unlikely(urbp->vep != vep || !usb_pipebulk(urbp->urb->pipe) || !usb_pipeout(urbp->urb->pipe)))
 		{
-			// we can give the urb back to its creator now, because the user space is informed about
-			// its cancelation
-			usb_vhci_urb_giveback(vhc, urbp);
-			ret = -ECANCELED;
+			ret = -EINVAL;
 			goto end_unlock;
 		}
+		if(urbp->state != USB_VHCI_URB_STATE_FETCHED)
+			continue;
+		urbps[i] = urbp;
+		desc[i].offset = pos;
+		desc[i].packet_length = urbp->urb->transfer_buffer_length;
+		pos += desc[i].packet_length;
+	}
+	if(unlikely(!vep))
+	{
+		ret = -ENOENT;
+		goto end_unlock;
+	}
+	if(unlikely(pos && (!user_buf || user_len < 0 || pos > (u32)user_len)))
+	{
+		ret = -EINVAL;
+		goto end_unlock;
+	}
+	// the urbs must not be given back while we copy their data
+	for(i = 0; i < count; i++)
+		if(urbps[i])
+			urbps[i]->pinned = 1;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	for(i = 0; i < count && !ret; i++)
+		if(urbps[i] && desc[i].packet_length)
+			ret = urb_data_to_user(urbps[i]->urb, user_buf + desc[i].offset, desc[i].packet_length);
+	if(likely(!ret) && unlikely(__copy_to_user(iso, desc, count * sizeof *desc)))
+		ret = -EFAULT;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	for(i = 0; i < count; i++)
+		if(urbps[i])
+		{
+			urbps[i]->pinned = 0;
+			trace_usb_vhci_urb_fetch_data(urbps[i]->urb, urbps[i]->handle, ret);
+		}
+end_unlock:
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return ret;
+}
+
+// called in ioc_giveback_group{,32} only
+static int ioc_giveback_group_common(struct vhci_file *vf, u64 handle, const struct usb_vhci_ioc_group_result __user *results, __s32 __user *errors, u32 count, u32 reserved)
+{
+	struct usb_vhci_ioc_group_result res[USB_VHCI_URB_GROUP_MAX];
+	struct giveback_req *reqs;
+	u32 i;
+	int ret;
+
+	vhci_dbg("cmd=USB_VHCI_HCD_IOCGIVEBACKGROUP\n");
+
+	if(unlikely(!handle || !results || !count || count > USB_VHCI_URB_GROUP_MAX || reserved))
+		return -EINVAL;
+	if(unlikely(errors && !access_ok(VERIFY_WRITE, errors, count * sizeof *errors)))
+		return -EFAULT;
+	if(unlikely(copy_from_user(res, results, count * sizeof *res)))
+		return -EFAULT;
+
+	reqs = kmalloc(count * sizeof *reqs, GFP_KERNEL);
+	if(unlikely(!reqs))
+		return -ENOMEM;
+	for(i = 0; i < count; i++)
+	{
+		// (OUT urbs don't take data, and act is checked against the length of each urb)
+		reqs[i].handle = handle + i;
+		reqs[i].buf = NULL;
+		reqs[i].iso = NULL;
+		reqs[i].status = res[i].status;
+		reqs[i].act = res[i].buffer_actual > INT_MAX ? INT_MAX : res[i].buffer_actual;
+		reqs[i].iso_count = 0;
+		reqs[i].err_count = 0;
+	}
+	ret = ioc_giveback_multi_common(vf, reqs, count, errors);
+	kfree(reqs);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_giveback_group(struct vhci_file *vf, const struct usb_vhci_ioc_giveback_group __user *arg)
+{
+	const struct usb_vhci_ioc_group_result __user *results;
+	__s32 __user *errors;
+	u64 handle64;
+	u32 count, reserved;
+
+	// (__get_user can't do 64 bit values on some 32 bit archs)
+	if(unlikely(__copy_from_user(&handle64, &arg->handle, sizeof handle64)))
+		return -EFAULT;
+	__get_user(results, &arg->results);
+	__get_user(errors, &arg->errors);
+	__get_user(count, &arg->count);
+	__get_user(reserved, &arg->reserved);
+	return ioc_giveback_group_common(vf, handle64, results, errors, count, reserved);
+}
+
+// called in ioc_fetch_data{,32} only
+static int ioc_fetch_data_common(struct vhci_file *vf, u64 handle, void __user *user_buf, int user_len, struct usb_vhci_ioc_iso_packet_data __user *iso, int iso_count)
+{
+	struct usb_vhci_urb_priv *urbp;
+	struct usb_vhci_hcd *vhc;
+	unsigned long flags;
+	LIST_HEAD(done);
+	int tb_len, is_in, is_iso, ret = 0;
+
+	if(unlikely(!(vhc = file_handle_to_vhcihcd(vf, &handle))))
+		return -ENOENT;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	if(unlikely(!(urbp = vf_urbp_from_handle(vf, vhc, handle))))
+	{
 		ret = -ENOENT;
 		goto end_unlock;
 	}
+	if(unlikely(urbp->pinned))
+	{
+		ret = -EBUSY;
+		goto end_unlock;
+	}
+	if(iso_count && usb_pipebulk(urbp->urb->pipe))
+	{
+		// the data of a group of urbs (see USB_VHCI_WORK_TYPE_PROCESS_URBS)
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		return fetch_group_data(vf, vhc, handle, user_buf, user_len, iso, iso_count);
+	}
+	if(unlikely(urbp->state != USB_VHCI_URB_STATE_FETCHED))
+	{
+		// the urb is in the cancel{,ing} list; we can give it back to its creator now, because the
+		// user space is informed about its cancelation
+		usb_vhci_stat_inc(vhc, cancel_races);
+		usb_vhci_urb_retire(vhc, urbp, &done);
+		ret = -ECANCELED;
+		goto end_unlock;
+	}
 
 	tb_len = urbp->urb->transfer_buffer_length;
 	if(unlikely(usb_pipecontrol(urbp->urb->pipe)))
@@ -753,7 +1816,7 @@ static int ioc_fetch_data_common(struct usb_vhci_hcd *vhc, const void *handle, v
 		tb_len = le16_to_cpu(cmd->wLength);
 	}
 
-	is_in = is_urb_dir_in(urbp->urb);
+	is_in = usb_vhci_urb_dir_in(urbp->urb);
 	is_iso = usb_pipeisoc(urbp->urb->pipe);
 
 	if(likely(is_iso))
@@ -763,21 +1826,13 @@ static int ioc_fetch_data_common(struct usb_vhci_hcd *vhc, const void *handle, v
 			ret = -EINVAL;
 			goto end_unlock;
 		}
-		if(likely(iso_count))
+		if(unlikely(iso_count && !iso))
 		{
-			if(unlikely(!iso))
-			{
-				ret = -EINVAL;
-				goto end_unlock;
-			}
-			for(i = 0; i < iso_count; i++)
-			{
-				iso_tmp[i].offset = urbp->urb->iso_frame_desc[i].offset;
-				iso_tmp[i].packet_length = urbp->urb->iso_frame_desc[i].length;
-			}
+			ret = -EINVAL;
+			goto end_unlock;
 		}
 	}
-	else if(unlikely(is_in || !tb_len || !urbp->urb->transfer_buffer))
+	else if(unlikely(is_in || !tb_len || !usb_vhci_urb_has_buffer(urbp->urb)))
 	{
 		ret = -ENODATA;
 		goto end_unlock;
@@ -790,53 +1845,49 @@ static int ioc_fetch_data_common(struct usb_vhci_hcd *vhc, const void *handle, v
 			ret = -EINVAL;
 			goto end_unlock;
 		}
-		memcpy(user_buf_tmp, urbp->urb->transfer_buffer, tb_len);
 	}
 
-	// we have copied all data into our private buffers, so we can release the spinlock
+	// The urb must not be given back while we copy its data, so we pin it. Now we can release the
+	// spinlock and copy directly from the urb to the user-mode buffers.
+	urbp->pinned = 1;
 	spin_unlock_irqrestore(&vhc->lock, flags);
 
-	// since we do not hold the spinlock any longer, we can now safely write the user-mode buffers
-
 	if(likely(is_iso && iso_count))
 	{
-		if(unlikely(copy_to_user(iso, iso_tmp, iso_count * sizeof *iso_tmp)))
+		if(unlikely(!access_ok(VERIFY_WRITE, iso, iso_count * sizeof *iso)))
 		{
 			ret = -EFAULT;
-			goto end;
+			goto end_unpin;
 		}
+		if(unlikely((ret = iso_desc_to_user(urbp->urb, iso, iso_count))))
+			goto end_unpin;
 	}
 
 	if(likely(!is_in && tb_len))
 	{
-		if(unlikely(copy_to_user(user_buf, user_buf_tmp, tb_len)))
-		{
-			ret = -EFAULT;
-			goto end;
-		}
+		ret = urb_data_to_user(urbp->urb, user_buf, tb_len);
 	}
 
-	goto end;
+end_unpin:
+	spin_lock_irqsave(&vhc->lock, flags);
+	urbp->pinned = 0;
+	trace_usb_vhci_urb_fetch_data(urbp->urb, urbp->handle, ret);
 end_unlock:
 	spin_unlock_irqrestore(&vhc->lock, flags);
-end:
-	kfree(user_buf_tmp);
-	kfree(iso_tmp);
+	if(unlikely(!list_empty(&done)))
+		usb_vhci_urb_giveback_list(vhc, &done);
 	return ret;
 }
 
 // called in device_ioctl only
-static int ioc_fetch_data(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_urb_data __user *arg)
+static int ioc_fetch_data(struct vhci_file *vf, struct usb_vhci_ioc_urb_data __user *arg)
 {
 	struct usb_vhci_ioc_iso_packet_data __user *iso;
-	const void *handle;
 	void __user *user_buf;
 	u64 handle64;
 	int user_len, iso_count;
 
-#ifdef DEBUG
-	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCFETCHDATA\n");
-#endif
+	vhci_dbg("cmd=USB_VHCI_HCD_IOCFETCHDATA\n");
 
 	if(sizeof(void *) > 4)
 		__get_user(handle64, &arg->handle);
@@ -847,74 +1898,1108 @@ static int ioc_fetch_data(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_urb_data
 		__get_user(handle2, (u32 __user *)&arg->handle + 1);
 		*((u32 *)&handle64) = handle1;
 		*((u32 *)&handle64 + 1) = handle2;
-		if(handle64 >> 32)
-			return -EINVAL;
 	}
 	__get_user(user_len, &arg->buffer_length);
 	__get_user(iso_count, &arg->packet_count);
 	__get_user(user_buf, &arg->buffer);
 	__get_user(iso, &arg->iso_packets);
-	handle = (const void *)(unsigned long)handle64;
-	if(unlikely(!handle))
+	if(unlikely(!handle64))
 		return -EINVAL;
-	return ioc_fetch_data_common(vhc, handle, user_buf, user_len, iso, iso_count);
+	return ioc_fetch_data_common(vf, handle64, user_buf, user_len, iso, iso_count);
 }
 
-#ifdef CONFIG_COMPAT
-// called in device_ioctl only
-static int ioc_giveback32(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback32 __user *arg)
+// Copies data from user space into the buffer of a fetched IN urb, while the urb stays fetched. A
+// GIVEBACK without buffer completes the urb afterwards.
+// called in ioc_deposit_data{,32} only
+static int ioc_deposit_data_common(struct vhci_file *vf, u64 handle, const void __user *user_buf, int offset, int len)
 {
-	const struct usb_vhci_ioc_iso_packet_giveback __user *iso;
-	const void __user *buf;
-	const void *handle;
+	struct usb_vhci_urb_priv *urbp;
+	struct usb_vhci_hcd *vhc;
+	unsigned long flags;
+	LIST_HEAD(done);
+	int tb_len, ret;
+
+	if(unlikely(!(vhc = file_handle_to_vhcihcd(vf, &handle))))
+		return -ENOENT;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	if(unlikely(!(urbp = vf_urbp_from_handle(vf, vhc, handle))))
+	{
+		ret = -ENOENT;
+		goto end_unlock;
+	}
+	if(unlikely(urbp->pinned))
+	{
+		ret = -EBUSY;
+		goto end_unlock;
+	}
+	if(unlikely(urbp->state != USB_VHCI_URB_STATE_FETCHED))
+	{
+		// (see ioc_fetch_data_common)
+		usb_vhci_stat_inc(vhc, cancel_races);
+		usb_vhci_urb_retire(vhc, urbp, &done);
+		ret = -ECANCELED;
+		goto end_unlock;
+	}
+
+	tb_len = urbp->urb->transfer_buffer_length;
+	if(unlikely(usb_pipecontrol(urbp->urb->pipe)))
+	{
+		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urbp->urb->setup_packet;
+		tb_len = le16_to_cpu(cmd->wLength);
+	}
+
+	if(unlikely(!usb_vhci_urb_dir_in(urbp->urb) ||
+	            offset < 0 || len < 0 || offset > tb_len || len > tb_len - offset ||
+	            (len && !user_buf)))
+	{
+		ret = -EINVAL;
+		goto end_unlock;
+	}
+	if(unlikely(!len))
+	{
+		ret = 0;
+		goto end_unlock;
+	}
+
+	// (see ioc_fetch_data_common)
+	urbp->pinned = 1;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	ret = urb_data_from_user(urbp->urb, offset, user_buf, len);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	urbp->pinned = 0;
+	if(likely(!ret) && offset + len > urbp->deposited)
+		urbp->deposited = offset + len;
+	trace_usb_vhci_urb_deposit_data(urbp->urb, urbp->handle, ret);
+end_unlock:
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	if(unlikely(!list_empty(&done)))
+		usb_vhci_urb_giveback_list(vhc, &done);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_busy_poll(struct vhci_file *vf, struct usb_vhci_ioc_busy_poll __user *arg)
+{
+	u32 usecs;
+
+	__get_user(usecs, &arg->usecs);
+	if(unlikely(usecs > USB_VHCI_BUSY_POLL_MAX))
+		return -EINVAL;
+	vf->busy_poll = usecs;
+	return 0;
+}
+
+// called in device_ioctl only
+static int ioc_in_ready(struct vhci_file *vf, struct usb_vhci_ioc_in_ready __user *arg)
+{
+	struct usb_vhci_hcd *vhc;
+	unsigned long flags;
+	u8 controller, address, endpoint;
+
+	__get_user(controller, &arg->controller);
+	__get_user(address, &arg->address);
+	__get_user(endpoint, &arg->endpoint);
+	if(unlikely(!(vhc = vf_to_vhcihcd(vf, controller))))
+		return -ENODEV;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCINREADY [address=%hhu endpoint=%hhu]\n", address, endpoint);
+#endif
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	usb_vhci_unpark(vhc, address, endpoint);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return 0;
+}
+
+// called in ioc_post_in{,32} only
+static int ioc_post_in_common(struct vhci_file *vf, const void __user *data, u32 length, u8 controller, u8 address, u8 endpoint, u8 reserved)
+{
+	struct usb_vhci_hcd *vhc;
+	struct usb_vhci_posted *p;
+
+	if(unlikely(!(vhc = vf_to_vhcihcd(vf, controller))))
+		return -ENODEV;
+	if(unlikely(reserved || !length || length > USB_VHCI_POST_IN_MAX || !data))
+		return -EINVAL;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCPOSTIN [address=%hhu endpoint=%hhu length=%u]\n", address, endpoint, length);
+#endif
+
+	p = kmalloc_node(sizeof *p + length, GFP_KERNEL, dev_to_node(vhcihcd_to_dev(vhc)));
+	if(unlikely(!p))
+		return -ENOMEM;
+	if(unlikely(copy_from_user(p->data, data, length)))
+	{
+		kfree(p);
+		return -EFAULT;
+	}
+	p->length = length;
+	// (takes p, even if it fails; a channel may only post for the devices behind its port)
+	return usb_vhci_post_in(vhc, vf->chan, address, endpoint, p);
+}
+
+// called in device_ioctl only
+static int ioc_post_in(struct vhci_file *vf, const struct usb_vhci_ioc_post_in __user *arg)
+{
+	const void __user *data;
+	u32 length;
+	u8 controller, address, endpoint, reserved;
+
+	__get_user(data, &arg->data);
+	__get_user(length, &arg->length);
+	__get_user(controller, &arg->controller);
+	__get_user(address, &arg->address);
+	__get_user(endpoint, &arg->endpoint);
+	__get_user(reserved, &arg->reserved);
+	return ioc_post_in_common(vf, data, length, controller, address, endpoint, reserved);
+}
+
+#ifdef CONFIG_COMPAT
+// called in device_ioctl only
+static int ioc_post_in32(struct vhci_file *vf, const struct usb_vhci_ioc_post_in32 __user *arg)
+{
+	u32 data32, length;
+	u8 controller, address, endpoint, reserved;
+
+	__get_user(data32, &arg->data);
+	__get_user(length, &arg->length);
+	__get_user(controller, &arg->controller);
+	__get_user(address, &arg->address);
+	__get_user(endpoint, &arg->endpoint);
+	__get_user(reserved, &arg->reserved);
+	return ioc_post_in_common(vf, compat_ptr(data32), length, controller, address, endpoint, reserved);
+}
+#endif
+
+// called in device_ioctl only
+static int ioc_deposit_data(struct vhci_file *vf, struct usb_vhci_ioc_deposit __user *arg)
+{
+	const void __user *user_buf;
 	u64 handle64;
-	int status, act, iso_count, err_count;
-	u32 buf32, iso32;
+	int offset, len;
+
+	//vhci_dbg("cmd=USB_VHCI_HCD_IOCDEPOSITDATA\n");
+
+	if(sizeof(void *) > 4)
+		__get_user(handle64, &arg->handle);
+	else
+	{
+		u32 handle1, handle2;
+		__get_user(handle1, (u32 __user *)&arg->handle);
+		__get_user(handle2, (u32 __user *)&arg->handle + 1);
+		*((u32 *)&handle64) = handle1;
+		*((u32 *)&handle64 + 1) = handle2;
+	}
+	__get_user(user_buf, &arg->buffer);
+	__get_user(offset, &arg->offset);
+	__get_user(len, &arg->length);
+	if(unlikely(!handle64))
+		return -EINVAL;
+	return ioc_deposit_data_common(vf, handle64, user_buf, offset, len);
+}
+
+// Copies the data of the urb of a PROCESS_URB work item (for OUT urbs) and its iso packet
+// descriptors into the buffers of the user, if they fit. Returns USB_VHCI_WORK_DATA_FLAG_INLINE in
+// this case and 0 otherwise (then the user has to use FETCHDATA).
+// called in ioc_fetch_work_data_common and in device_read only
+static __u32 work_data_to_user(struct vhci_file *vf, const struct usb_vhci_ioc_work *work, void __user *user_buf, int user_len, struct usb_vhci_ioc_iso_packet_data __user *iso, int iso_count)
+{
+	struct usb_vhci_urb_priv *urbp = NULL;
+	struct usb_vhci_hcd *vhc = NULL;
+	unsigned long flags;
+	int tb_len = 0, is_iso = 0, pkt_count = 0;
+	__u32 data_flags = USB_VHCI_WORK_DATA_FLAG_INLINE;
+	u64 handle;
+
+	if(unlikely(work->type != USB_VHCI_WORK_TYPE_PROCESS_URB))
+		return 0;
+	handle = work->handle;
+	if(unlikely(!(vhc = file_handle_to_vhcihcd(vf, &handle))))
+		return 0;
+
+	// the lock was released after the urb was fetched, so it might have been canceled meanwhile
+	spin_lock_irqsave(&vhc->lock, flags);
+	urbp = vf_urbp_from_handle(vf, vhc, handle);
+	if(unlikely(urbp && (urbp->pinned || urbp->state != USB_VHCI_URB_STATE_FETCHED)))
+		// user space has to use FETCHDATA, which tells the details
+		urbp = NULL;
+	if(likely(urbp))
+	{
+		is_iso = usb_pipeisoc(urbp->urb->pipe);
+		pkt_count = is_iso ? urbp->urb->number_of_packets : 0;
+		tb_len = usb_vhci_urb_dir_in(urbp->urb) ? 0 : work->work.urb.buffer_length;
+		if((!tb_len && !is_iso) ||
+		   (tb_len && (!user_buf || user_len < tb_len)) ||
+		   (pkt_count && (!iso || iso_count < pkt_count)))
+			// nothing to copy, or it doesn't fit
+			urbp = NULL;
+		else
+			// the urb must not be given back while we copy its data, so we pin it
+			urbp->pinned = 1;
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	if(!urbp)
+		return 0;
+
+	// since the urb is pinned, we can safely access it without holding the spinlock
+	if(likely(pkt_count))
+	{
+		if(unlikely(!access_ok(VERIFY_WRITE, iso, pkt_count * sizeof *iso) ||
+		            iso_desc_to_user(urbp->urb, iso, pkt_count)))
+			data_flags = 0;
+	}
+	if(likely(data_flags && tb_len))
+	{
+		// if this fails, then the user still can use FETCHDATA
+		if(unlikely(urb_data_to_user(urbp->urb, user_buf, tb_len)))
+			data_flags = 0;
+	}
+	spin_lock_irqsave(&vhc->lock, flags);
+	urbp->pinned = 0;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return data_flags;
+}
+
+// Fetches the next work item like ioc_fetch_work does. If it is a PROCESS_URB work, then the data of
+// the urb (for OUT urbs) and its iso packet descriptors are copied into the buffers of the user, too,
+// if they fit. In this case *flags_arg receives USB_VHCI_WORK_DATA_FLAG_INLINE, otherwise the user
+// has to use FETCHDATA.
+// called in ioc_fetch_work_data{,32} only
+static int ioc_fetch_work_data_common(struct vhci_file *vf, struct usb_vhci_ioc_work __user *arg, s16 timeout, void __user *user_buf, int user_len, struct usb_vhci_ioc_iso_packet_data __user *iso, int iso_count, __u32 __user *flags_arg)
+{
+	struct usb_vhci_ioc_work work;
+	__u32 data_flags;
+	int ret;
+
+	if((ret = wait_for_work(vf, timeout)))
+		return ret;
+
+	if(unlikely(!fetch_works(vf, &work, 0, 0, 1)))
+		return -ENODATA;
+	pass_work_event(vf);
+
+	data_flags = work_data_to_user(vf, &work, user_buf, user_len, iso, iso_count);
+
+	// don't touch arg->timeout, because user space may want to reuse it
+	__put_user(work.type, &arg->type);
+	__put_user(work.controller, &arg->controller);
+	__put_user(work.handle, &arg->handle);
+	__put_user(data_flags, flags_arg);
+	if(unlikely(__copy_to_user(&arg->work, &work.work, sizeof work.work)))
+		return -EFAULT;
+	return 0;
+}
+
+// called in device_ioctl only
+static int ioc_fetch_work_data(struct vhci_file *vf, struct usb_vhci_ioc_work_data __user *arg)
+{
+	struct usb_vhci_ioc_iso_packet_data __user *iso;
+	void __user *user_buf;
+	int user_len, iso_count;
+	s16 timeout;
 
 #ifdef DEBUG
-	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK32\n");
+	// Floods the logs
+	//vhci_dbg("cmd=USB_VHCI_HCD_IOCFETCHWORKDATA\n");
 #endif
 
-	__get_user(handle64, &arg->handle);
-	__get_user(status, &arg->status);
-	__get_user(act, &arg->buffer_actual);
+	__get_user(timeout, &arg->work.timeout);
+	__get_user(user_len, &arg->buffer_length);
 	__get_user(iso_count, &arg->packet_count);
-	__get_user(err_count, &arg->error_count);
+	__get_user(user_buf, &arg->buffer);
+	__get_user(iso, &arg->iso_packets);
+	return ioc_fetch_work_data_common(vf, &arg->work, timeout, user_buf, user_len, iso, iso_count, &arg->flags);
+}
+
+// Stream mode (see struct usb_vhci_stream_work): fetches as many work items as there are record
+// headers room for and puts the data of the urbs behind their headers, as long as the remaining
+// headers still fit.
+// called in device_read and in device_splice_read only
+static ssize_t stream_read(struct vhci_file *vf, char __user *buffer, size_t length, int nonblock)
+{
+	struct usb_vhci_ioc_work *works;
+	struct usb_vhci_stream_work hdr;
+	const struct usb_vhci_ioc_urb *urb;
+	size_t pos = 0, reserved, data_len, pkt_len, rec_len;
+	s16 timeout;
+	u32 count, n, i;
+	ssize_t ret;
+	int is_in;
+
+	if(unlikely(length < sizeof hdr))
+		return -EINVAL;
+	if(unlikely(!access_ok(VERIFY_WRITE, buffer, length)))
+		return -EFAULT;
+
+	count = min_t(size_t, length / sizeof hdr, USB_VHCI_WORK_MULTI_MAX);
+	works = kmalloc(count * sizeof *works, GFP_KERNEL);
+	if(unlikely(!works))
+		return -ENOMEM;
+
+	timeout = nonblock ? 0 : USB_VHCI_TIMEOUT_INFINITE;
+	do
+	{
+		if((ret = wait_for_work(vf, timeout)))
+		{
+			if(ret == -ETIMEDOUT)
+				ret = -EAGAIN;
+			goto end;
+		}
+		// another reader might have been faster
+	} while(unlikely(!(n = fetch_works(vf, works, ~0U, 0, count))) && timeout);
+	if(unlikely(!n))
+	{
+		ret = -EAGAIN;
+		goto end;
+	}
+	pass_work_event(vf);
+
+	// the headers of all fetched work items have to fit in any case
+	reserved = n * sizeof hdr;
+	for(i = 0; i < n; i++)
+	{
+		reserved -= sizeof hdr;
+		memset(&hdr, 0, sizeof hdr);
+		hdr.work = works[i];
+		rec_len = sizeof hdr;
+		if(works[i].type == USB_VHCI_WORK_TYPE_PROCESS_URB)
+		{
+			urb = &works[i].work.urb;
+			is_in = (urb->type == USB_VHCI_URB_TYPE_CONTROL) ?
+				(urb->setup_packet.bmRequestType & 0x80) : (urb->endpoint & 0x80);
+			pkt_len = (urb->type == USB_VHCI_URB_TYPE_ISO) ?
+				urb->packet_count * sizeof(struct usb_vhci_ioc_iso_packet_data) : 0;
+			data_len = is_in ? 0 : urb->buffer_length;
+			if((pkt_len || data_len) &&
+			   USB_VHCI_STREAM_RECORD_LENGTH(sizeof hdr + pkt_len + data_len) <= length - pos - reserved)
+			{
+				hdr.flags = work_data_to_user(vf, &works[i],
+					buffer + pos + sizeof hdr + pkt_len, data_len,
+					(struct usb_vhci_ioc_iso_packet_data __user *)(buffer + pos + sizeof hdr), urb->packet_count);
+				if(likely(hdr.flags))
+					rec_len = USB_VHCI_STREAM_RECORD_LENGTH(sizeof hdr + pkt_len + data_len);
+			}
+		}
+		hdr.length = rec_len;
+		if(unlikely(__copy_to_user(buffer + pos, &hdr, sizeof hdr)))
+		{
+			// (the work items are lost, like with FETCHWORKMULTI)
+			ret = -EFAULT;
+			goto end;
+		}
+		pos += rec_len;
+	}
+	ret = pos;
+end:
+	kfree(works);
+	return ret;
+}
+
+static ssize_t device_read(struct file *file,
+                           char __user *buffer,
+                           size_t length,
+                           loff_t *offset)
+{
+	struct vhci_file *vf = file->private_data;
+
+	//vhci_dbg("%s(file=%p)\n", __FUNCTION__, file);
+
+	if(unlikely(!vf_hcd_count(vf)))
+		return -EPROTO;
+	return stream_read(vf, buffer, length, file->f_flags & O_NONBLOCK);
+}
+
+// Checks the header of a giveback record, except whether the record fits into the buffer. Returns
+// the number of bytes of its iso packets, or -EINVAL.
+// called in device_write and in stream_splice_actor only
+static long stream_giveback_check(const struct usb_vhci_stream_giveback *hdr)
+{
+	size_t pkt_len;
+
+	// (checked step by step, so that nothing can overflow)
+	if(unlikely(!hdr->handle || hdr->packet_count < 0 || hdr->buffer_actual < 0 ||
+	            hdr->length % USB_VHCI_STREAM_ALIGN || hdr->length < sizeof *hdr ||
+	            (size_t)hdr->packet_count > (hdr->length - sizeof *hdr) / sizeof(struct usb_vhci_ioc_iso_packet_giveback)))
+		return -EINVAL;
+	pkt_len = hdr->packet_count * sizeof(struct usb_vhci_ioc_iso_packet_giveback);
+	if(unlikely(hdr->data_length > hdr->length - sizeof *hdr - pkt_len ||
+	            (hdr->data_length && hdr->data_length < (__u32)hdr->buffer_actual)))
+		return -EINVAL;
+	return pkt_len;
+}
+
+// Stream mode (see struct usb_vhci_stream_giveback): the records are collected in batches, which are
+// processed like GIVEBACKMULTI does. The data stays in the buffer of the user, which is read from
+// directly.
+static ssize_t device_write(struct file *file,
+                            const char __user *buffer,
+                            size_t length,
+                            loff_t *offset)
+{
+	struct vhci_file *vf = file->private_data;
+	struct usb_vhci_stream_giveback hdr;
+	struct giveback_req *reqs;
+	size_t pos = 0, done = 0;
+	long pkt_len;
+	u32 n = 0;
+	ssize_t ret = 0;
+
+	//vhci_dbg("%s(file=%p)\n", __FUNCTION__, file);
+
+	if(unlikely(!vf_hcd_count(vf)))
+		return -EPROTO;
+	if(unlikely(!access_ok(VERIFY_READ, buffer, length)))
+		return -EFAULT;
+
+	reqs = kmalloc(USB_VHCI_GIVEBACK_MULTI_MAX * sizeof *reqs, GFP_KERNEL);
+	if(unlikely(!reqs))
+		return -ENOMEM;
+
+	while(pos < length)
+	{
+		if(unlikely(length - pos < sizeof hdr))
+		{
+			ret = -EINVAL;
+			break;
+		}
+		if(unlikely(__copy_from_user(&hdr, buffer + pos, sizeof hdr)))
+		{
+			ret = -EFAULT;
+			break;
+		}
+		if(unlikely(hdr.length > length - pos || (pkt_len = stream_giveback_check(&hdr)) < 0))
+		{
+			ret = -EINVAL;
+			break;
+		}
+		reqs[n].handle = hdr.handle;
+		reqs[n].iso = hdr.packet_count ? (const void __user *)(buffer + pos + sizeof hdr) : NULL;
+		reqs[n].buf = hdr.data_length ? buffer + pos + sizeof hdr + pkt_len : NULL;
+		reqs[n].status = hdr.status;
+		reqs[n].act = hdr.buffer_actual;
+		reqs[n].iso_count = hdr.packet_count;
+		reqs[n].err_count = hdr.error_count;
+		pos += hdr.length;
+		if(++n == USB_VHCI_GIVEBACK_MULTI_MAX)
+		{
+			ioc_giveback_multi_common(vf, reqs, n, NULL);
+			done = pos;
+			n = 0;
+		}
+	}
+	if(n)
+	{
+		ioc_giveback_multi_common(vf, reqs, n, NULL);
+		done = pos;
+	}
+	kfree(reqs);
+	return done ? done : ret;
+}
+
+// number of pages which are put into the pipe by one splice_read (the default size of a pipe)
+#define STREAM_SPLICE_PAGES 16
+
+// the pages of the pipe buffers were allocated by device_splice_read
+static void stream_pipe_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+	put_page(buf->page);
+}
+
+static const struct pipe_buf_operations stream_pipe_buf_ops = {
+	.can_merge = 0,
+	.map       = generic_pipe_buf_map,
+	.unmap     = generic_pipe_buf_unmap,
+	.confirm   = generic_pipe_buf_confirm,
+	.release   = stream_pipe_buf_release,
+	.steal     = generic_pipe_buf_steal,
+	.get       = generic_pipe_buf_get
+};
+
+static void stream_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+// Produces the same stream as read() does into a pipe: the work records are built in fresh pages,
+// so the OUT data is copied from the urbs right into the pipe, which can be spliced on into a
+// socket. Whatever the pipe doesn't take is kept and goes first into the next splice_read, so a
+// file should either be read or spliced from, but not both.
+static ssize_t device_splice_read(struct file *file,
+                                  loff_t *ppos,
+                                  struct pipe_inode_info *pipe,
+                                  size_t len,
+                                  unsigned int flags)
+{
+	struct vhci_file *vf = file->private_data;
+	struct page *pages[STREAM_SPLICE_PAGES];
+	struct partial_page partial[STREAM_SPLICE_PAGES];
+	struct splice_pipe_desc spd = {
+		.pages       = pages,
+		.partial     = partial,
+		.flags       = flags,
+		.ops         = &stream_pipe_buf_ops,
+		.spd_release = stream_spd_release
+	};
+	unsigned int i, nr;
+	size_t filled = 0, consumed;
+	mm_segment_t old_fs;
+	ssize_t ret;
+	void *vaddr;
+	int from_pending;
+
+	//vhci_dbg("%s(file=%p)\n", __FUNCTION__, file);
+
+	if(unlikely(!vf_hcd_count(vf)))
+		return -EPROTO;
+
+	nr = min_t(size_t, DIV_ROUND_UP(len, PAGE_SIZE), STREAM_SPLICE_PAGES);
+	len = min_t(size_t, len, nr * PAGE_SIZE);
+	for(i = 0; i < nr; i++)
+	{
+		if(unlikely(!(pages[i] = alloc_page(GFP_KERNEL))))
+		{
+			ret = -ENOMEM;
+			goto free_pages;
+		}
+	}
+	if(unlikely(!(vaddr = vmap(pages, nr, VM_MAP, PAGE_KERNEL))))
+	{
+		ret = -ENOMEM;
+		goto free_pages;
+	}
+
+	mutex_lock(&vf->splice_rd_mutex);
+	if(unlikely(!vf->splice_pending) && !(vf->splice_pending = vmalloc(STREAM_SPLICE_PAGES * PAGE_SIZE)))
+	{
+		ret = -ENOMEM;
+		goto unlock;
+	}
+	if((from_pending = vf->splice_pending_len != 0))
+	{
+		filled = min(len, vf->splice_pending_len);
+		memcpy(vaddr, vf->splice_pending, filled);
+	}
+	else
+	{
+		// stream_read copies with copy_to_user
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		ret = stream_read(vf, (char __user *)vaddr, len,
+			(flags & SPLICE_F_NONBLOCK) || (file->f_flags & O_NONBLOCK));
+		set_fs(old_fs);
+		if(ret <= 0)
+			goto unlock;
+		filled = ret;
+	}
+
+	spd.nr_pages = DIV_ROUND_UP(filled, PAGE_SIZE);
+	for(i = 0; i < spd.nr_pages; i++)
+	{
+		partial[i].offset = 0;
+		partial[i].len = min_t(size_t, filled - i * PAGE_SIZE, PAGE_SIZE);
+		// the pipe (or stream_spd_release) drops this reference, we drop our own one below
+		get_page(pages[i]);
+	}
+	ret = splice_to_pipe(pipe, &spd);
+	consumed = (ret > 0) ? ret : 0;
+
+	if(from_pending)
+	{
+		vf->splice_pending_len -= consumed;
+		memmove(vf->splice_pending, vf->splice_pending + consumed, vf->splice_pending_len);
+	}
+	else
+	{
+		// the work items are fetched already, so nothing must get lost
+		vf->splice_pending_len = filled - consumed;
+		memcpy(vf->splice_pending, vaddr + consumed, vf->splice_pending_len);
+	}
+
+unlock:
+	mutex_unlock(&vf->splice_rd_mutex);
+	vunmap(vaddr);
+	i = nr;
+free_pages:
+	while(i--)
+		put_page(pages[i]);
+	return ret;
+}
+
+// Finishes the giveback record which was received completely.
+// caller has vf->splice_wr_mutex; called in stream_splice_actor only
+static void stream_splice_giveback(struct vhci_file *vf)
+{
+	struct giveback_req req;
+	mm_segment_t old_fs;
+
+	req.handle = vf->splice_gb.handle;
+	// the data was deposited already (unless that failed, then the giveback fails, too)
+	req.buf = NULL;
+	req.iso = vf->splice_gb.packet_count ? (const void __user *)vf->splice_gb_iso : NULL;
+	req.status = vf->splice_gb.status;
+	req.act = vf->splice_gb.buffer_actual;
+	req.iso_count = vf->splice_gb.packet_count;
+	req.err_count = vf->splice_gb.error_count;
+
+	// giveback_fill copies the iso packets with copy_from_user
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ioc_giveback_common(vf, &req);
+	set_fs(old_fs);
+
+	vf->splice_gb_pos = 0;
+	vf->splice_gb_error = 0;
+}
+
+// Consumes the stream of giveback records piece by piece, as it comes through the pipe. The data of
+// an IN urb is deposited into the urb straight from the pipe buffer (like DEPOSITDATA does), and the
+// urb is given back as soon as the end of its record has arrived.
+// caller has vf->splice_wr_mutex
+static int stream_splice_actor(struct pipe_inode_info *pipe, struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct vhci_file *vf = sd->u.file->private_data;
+	const size_t hdr_len = sizeof vf->splice_gb;
+	size_t left = sd->len, n, off;
+	mm_segment_t old_fs;
+	const u8 *src;
+	void *data;
+	int ret;
+
+	if(unlikely((ret = buf->ops->confirm(pipe, buf))))
+		return ret;
+	data = buf->ops->map(pipe, buf, 0);
+	src = (const u8 *)data + buf->offset;
+
+	while(left)
+	{
+		if(vf->splice_gb_pos < hdr_len)
+		{
+			n = min(left, hdr_len - vf->splice_gb_pos);
+			memcpy((u8 *)&vf->splice_gb + vf->splice_gb_pos, src, n);
+		}
+		else if((off = vf->splice_gb_pos - hdr_len) < vf->splice_gb_pkt_len)
+		{
+			n = min_t(size_t, left, vf->splice_gb_pkt_len - off);
+			memcpy((u8 *)vf->splice_gb_iso + off, src, n);
+		}
+		else if((off -= vf->splice_gb_pkt_len) < vf->splice_gb.data_length)
+		{
+			n = min_t(size_t, left, vf->splice_gb.data_length - off);
+			// bytes behind buffer_actual are ignored
+			if(!vf->splice_gb_error && off < (size_t)vf->splice_gb.buffer_actual)
+			{
+				old_fs = get_fs();
+				set_fs(KERNEL_DS);
+				vf->splice_gb_error = ioc_deposit_data_common(vf, vf->splice_gb.handle, (const void __user *)src,
+					off, min_t(size_t, n, vf->splice_gb.buffer_actual - off));
+				set_fs(old_fs);
+			}
+		}
+		else
+			// padding
+			n = min_t(size_t, left, vf->splice_gb.length - vf->splice_gb_pos);
+
+		src += n;
+		left -= n;
+		vf->splice_gb_pos += n;
+
+		if(vf->splice_gb_pos == hdr_len)
+		{
+			// the header is complete
+			if(unlikely((vf->splice_gb_pkt_len = stream_giveback_check(&vf->splice_gb)) < 0))
+			{
+				// (the record is skipped)
+				vf->splice_gb_pos = 0;
+				ret = -EINVAL;
+				goto end;
+			}
+			if(vf->splice_gb.packet_count > vf->splice_gb_iso_size)
+			{
+				kfree(vf->splice_gb_iso);
+				vf->splice_gb_iso_size = 0;
+				if(unlikely(!(vf->splice_gb_iso = kmalloc(vf->splice_gb_pkt_len, GFP_KERNEL))))
+				{
+					vf->splice_gb_pos = 0;
+					ret = -ENOMEM;
+					goto end;
+				}
+				vf->splice_gb_iso_size = vf->splice_gb.packet_count;
+			}
+		}
+		if(vf->splice_gb_pos == vf->splice_gb.length)
+			stream_splice_giveback(vf);
+	}
+	ret = sd->len;
+end:
+	buf->ops->unmap(pipe, buf, data);
+	// on errors, the bytes in front of the bad header are consumed nevertheless
+	return (ret < 0 && left != sd->len) ? (int)(sd->len - left) : ret;
+}
+
+// Consumes the same stream of giveback records as write() does from a pipe, so that the data of IN
+// urbs can be spliced from a socket into the urbs. A record may be spread over many calls.
+static ssize_t device_splice_write(struct pipe_inode_info *pipe,
+                                   struct file *file,
+                                   loff_t *ppos,
+                                   size_t len,
+                                   unsigned int flags)
+{
+	struct vhci_file *vf = file->private_data;
+	ssize_t ret;
+
+	//vhci_dbg("%s(file=%p)\n", __FUNCTION__, file);
+
+	if(unlikely(!vf_hcd_count(vf)))
+		return -EPROTO;
+
+	mutex_lock(&vf->splice_wr_mutex);
+	ret = splice_from_pipe(pipe, file, ppos, len, flags, stream_splice_actor);
+	mutex_unlock(&vf->splice_wr_mutex);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_ring_setup(struct vhci_file *vf, struct usb_vhci_ioc_ring_setup __user *arg)
+{
+	struct giveback_req *reqs;
+	u32 we, ge, work_off, gb_off;
+	unsigned long size;
+	void *mem;
+
+	vhci_dbg("cmd=USB_VHCI_HCD_IOCRINGSETUP\n");
+
+	__get_user(we, &arg->work_entries);
+	__get_user(ge, &arg->giveback_entries);
+	if(unlikely(!we || !ge || we > USB_VHCI_RING_MAX_ENTRIES || ge > USB_VHCI_RING_MAX_ENTRIES))
+		return -EINVAL;
+	we = roundup_pow_of_two(we);
+	ge = roundup_pow_of_two(ge);
+
+	// every ring starts on its own cache line
+	work_off = 0;
+	gb_off = ALIGN(work_off + sizeof(struct usb_vhci_ring_header) + we * sizeof(struct usb_vhci_ioc_work), 64);
+	size = PAGE_ALIGN(gb_off + sizeof(struct usb_vhci_ring_header) + ge * sizeof(struct usb_vhci_ioc_ring_giveback));
+
+	mem = vmalloc_user(size); // zeroed
+	if(unlikely(!mem))
+		return -ENOMEM;
+	reqs = kmalloc(USB_VHCI_GIVEBACK_MULTI_MAX * sizeof *reqs, GFP_KERNEL);
+	if(unlikely(!reqs))
+	{
+		vfree(mem);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&vf->ring_mutex);
+	if(unlikely(vf->ring_mem))
+	{
+		mutex_unlock(&vf->ring_mutex);
+		kfree(reqs);
+		vfree(mem);
+		return -EBUSY;
+	}
+	vf->ring_mem = mem;
+	vf->ring_size = size;
+	vf->ring_reqs = reqs;
+	vf->work_hdr = mem + work_off;
+	vf->work_ring = (struct usb_vhci_ioc_work *)(vf->work_hdr + 1);
+	vf->work_entries = vf->work_hdr->entries = we;
+	vf->work_head = 0;
+	vf->gb_hdr = mem + gb_off;
+	vf->gb_ring = (struct usb_vhci_ioc_ring_giveback *)(vf->gb_hdr + 1);
+	vf->gb_entries = vf->gb_hdr->entries = ge;
+	vf->gb_tail = 0;
+	mutex_unlock(&vf->ring_mutex);
+
+	__put_user(we, &arg->work_entries);
+	__put_user(ge, &arg->giveback_entries);
+	__put_user(work_off, &arg->work_offset);
+	__put_user(gb_off, &arg->giveback_offset);
+	__put_user((u32)size, &arg->size);
+	return 0;
+}
+
+// Consumes all entries of the giveback ring. The urbs are given back in batches of at most
+// USB_VHCI_GIVEBACK_MULTI_MAX.
+// caller has vf->ring_mutex
+static int ring_giveback(struct vhci_file *vf, u32 *given_back, u32 *failed)
+{
+	struct usb_vhci_ioc_ring_giveback e;
+	struct giveback_req *req;
+	u32 head, tail, n, i;
+
+	tail = vf->gb_tail;
+	head = ACCESS_ONCE(vf->gb_hdr->head);
+	if(unlikely(head - tail > vf->gb_entries))
+		return -EINVAL;
+	// read the head index before the entries
+	smp_rmb();
+
+	while(tail != head)
+	{
+		n = head - tail;
+		if(n > USB_VHCI_GIVEBACK_MULTI_MAX)
+			n = USB_VHCI_GIVEBACK_MULTI_MAX;
+		for(i = 0; i < n; i++)
+		{
+			// user space may modify the entry meanwhile, so we read it only once
+			e = vf->gb_ring[(tail + i) & (vf->gb_entries - 1)];
+			req = &vf->ring_reqs[i];
+			req->handle = e.handle;
+			req->buf = (const void __user *)(unsigned long)e.buffer;
+			req->iso = (const struct usb_vhci_ioc_iso_packet_giveback __user *)(unsigned long)e.iso_packets;
+			req->status = e.status;
+			req->act = e.buffer_actual;
+			req->iso_count = e.packet_count;
+			req->err_count = e.error_count;
+		}
+		ioc_giveback_multi_common(vf, vf->ring_reqs, n, NULL);
+		for(i = 0; i < n; i++)
+			if(vf->ring_reqs[i].result && vf->ring_reqs[i].result != -ECANCELED)
+				(*failed)++;
+		tail += n;
+		*given_back += n;
+
+		// we are done with the entries before we hand them back to user space
+		smp_mb();
+		ACCESS_ONCE(vf->gb_hdr->tail) = vf->gb_tail = tail;
+	}
+	return 0;
+}
+
+// Puts as many work items into the work ring as there are available and as there is space in the ring.
+// Returns the number of produced entries.
+// caller has vf->ring_mutex
+static u32 ring_fetch(struct vhci_file *vf)
+{
+	u32 head, tail, n;
+
+	head = vf->work_head;
+	tail = ACCESS_ONCE(vf->work_hdr->tail);
+	// user space has to be done with the entries before we overwrite them
+	smp_mb();
+	if(unlikely(head - tail > vf->work_entries))
+		// user space messed up the tail index; treat the ring as full
+		return 0;
+
+	// the ring lives in kernel memory, so we can write into it while we hold the spinlocks
+	n = fetch_works(vf, vf->work_ring, vf->work_entries - 1, head, vf->work_entries - (head - tail));
+	if(n)
+	{
+		head += n;
+		// the entries have to be visible before the new head index
+		smp_wmb();
+		ACCESS_ONCE(vf->work_hdr->head) = vf->work_head = head;
+	}
+	return n;
+}
+
+// called in device_ioctl only
+static int ioc_ring_enter(struct vhci_file *vf, struct usb_vhci_ioc_ring_enter __user *arg)
+{
+	u32 flags, given_back = 0, failed = 0, fetched = 0;
+	s16 timeout;
+	int ret = 0;
+
+#ifdef DEBUG
+	// Floods the logs
+	//vhci_dbg("cmd=USB_VHCI_HCD_IOCRINGENTER\n");
+#endif
+
+	__get_user(flags, &arg->flags);
+	__get_user(timeout, &arg->timeout);
+
+	mutex_lock(&vf->ring_mutex);
+	if(unlikely(!vf->ring_mem))
+	{
+		mutex_unlock(&vf->ring_mutex);
+		return -EPROTO;
+	}
+	if(flags & USB_VHCI_RING_ENTER_GIVEBACK)
+		ret = ring_giveback(vf, &given_back, &failed);
+	if(likely(!ret && (flags & USB_VHCI_RING_ENTER_FETCH)))
+		fetched = ring_fetch(vf);
+	mutex_unlock(&vf->ring_mutex);
+
+	if(!ret && !fetched && (flags & (USB_VHCI_RING_ENTER_FETCH | USB_VHCI_RING_ENTER_WAIT)) ==
+	                                 (USB_VHCI_RING_ENTER_FETCH | USB_VHCI_RING_ENTER_WAIT))
+	{
+		// don't hold the mutex while we sleep, so that other threads can give back urbs meanwhile
+		if(!(ret = wait_for_work(vf, timeout)))
+		{
+			mutex_lock(&vf->ring_mutex);
+			fetched = ring_fetch(vf);
+			mutex_unlock(&vf->ring_mutex);
+		}
+	}
+
+	if(fetched)
+		pass_work_event(vf);
+
+	__put_user(given_back, &arg->given_back);
+	__put_user(failed, &arg->failed);
+	__put_user(fetched, &arg->fetched);
+	return ret;
+}
+
+#ifdef CONFIG_COMPAT
+// called in device_ioctl only
+static int ioc_giveback32(struct vhci_file *vf, const struct usb_vhci_ioc_giveback32 __user *arg)
+{
+	struct giveback_req req;
+	u32 buf32, iso32;
+
+	vhci_dbg("cmd=USB_VHCI_HCD_IOCGIVEBACK32\n");
+
+	__get_user(req.handle, &arg->handle);
+	__get_user(req.status, &arg->status);
+	__get_user(req.act, &arg->buffer_actual);
+	__get_user(req.iso_count, &arg->packet_count);
+	__get_user(req.err_count, &arg->error_count);
 	__get_user(buf32, &arg->buffer);
 	__get_user(iso32, &arg->iso_packets);
-	handle = (const void *)(unsigned long)handle64;
-	if(unlikely(!handle))
+	if(unlikely(!req.handle))
 		return -EINVAL;
-	buf = compat_ptr(buf32);
-	iso = compat_ptr(iso32);
-	return ioc_giveback_common(vhc, handle, status, act, iso_count, err_count, buf, iso);
+	req.buf = compat_ptr(buf32);
+	req.iso = compat_ptr(iso32);
+	return ioc_giveback_common(vf, &req);
+}
+
+// called in device_ioctl only
+static int ioc_giveback_group32(struct vhci_file *vf, const struct usb_vhci_ioc_giveback_group32 __user *arg)
+{
+	u64 handle64;
+	u32 results32, errors32, count, reserved;
+
+	if(unlikely(__copy_from_user(&handle64, &arg->handle, sizeof handle64)))
+		return -EFAULT;
+	__get_user(results32, &arg->results);
+	__get_user(errors32, &arg->errors);
+	__get_user(count, &arg->count);
+	__get_user(reserved, &arg->reserved);
+	return ioc_giveback_group_common(vf, handle64, compat_ptr(results32), errors32 ? compat_ptr(errors32) : NULL, count, reserved);
+}
+
+// called in device_ioctl only
+static int ioc_giveback_multi32(struct vhci_file *vf, const struct usb_vhci_ioc_giveback_multi32 __user *arg)
+{
+	const struct usb_vhci_ioc_giveback32 __user *gbs;
+	struct usb_vhci_ioc_giveback32 gb;
+	struct giveback_req *reqs;
+	u32 count, i, gbs32, results32;
+	int ret;
+
+	vhci_dbg("cmd=USB_VHCI_HCD_IOCGIVEBACKMULTI32\n");
+
+	__get_user(gbs32, &arg->givebacks);
+	__get_user(results32, &arg->results);
+	__get_user(count, &arg->count);
+	gbs = compat_ptr(gbs32);
+	if(unlikely(!gbs || !count || count > USB_VHCI_GIVEBACK_MULTI_MAX))
+		return -EINVAL;
+	if(unlikely(!access_ok(VERIFY_READ, gbs, count * sizeof *gbs)))
+		return -EFAULT;
+	if(unlikely(results32 && !access_ok(VERIFY_WRITE, compat_ptr(results32), count * sizeof(__s32))))
+		return -EFAULT;
+
+	reqs = kmalloc(count * sizeof *reqs, GFP_KERNEL);
+	if(unlikely(!reqs))
+		return -ENOMEM;
+	for(i = 0; i < count; i++)
+	{
+		if(unlikely(__copy_from_user(&gb, &gbs[i], sizeof gb)))
+		{
+			ret = -EFAULT;
+			goto end;
+		}
+		if(unlikely(!gb.handle))
+		{
+			ret = -EINVAL;
+			goto end;
+		}
+		reqs[i].handle = gb.handle;
+		reqs[i].buf = compat_ptr(gb.buffer);
+		reqs[i].iso = compat_ptr(gb.iso_packets);
+		reqs[i].status = gb.status;
+		reqs[i].act = gb.buffer_actual;
+		reqs[i].iso_count = gb.packet_count;
+		reqs[i].err_count = gb.error_count;
+	}
+	ret = ioc_giveback_multi_common(vf, reqs, count, results32 ? compat_ptr(results32) : NULL);
+end:
+	kfree(reqs);
+	return ret;
 }
 
 // called in device_ioctl only
-static int ioc_fetch_data32(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_urb_data32 __user *arg)
+static int ioc_fetch_data32(struct vhci_file *vf, struct usb_vhci_ioc_urb_data32 __user *arg)
 {
 	struct usb_vhci_ioc_iso_packet_data __user *iso;
 	void __user *user_buf;
-	const void *handle;
 	u64 handle64;
 	int user_len, iso_count;
 	u32 user_buf32, iso32;
 
-#ifdef DEBUG
-	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCFETCHDATA32\n");
-#endif
+	vhci_dbg("cmd=USB_VHCI_HCD_IOCFETCHDATA32\n");
 
 	__get_user(handle64, &arg->handle);
 	__get_user(user_len, &arg->buffer_length);
 	__get_user(iso_count, &arg->packet_count);
 	__get_user(user_buf32, &arg->buffer);
 	__get_user(iso32, &arg->iso_packets);
-	handle = (const void *)(unsigned long)handle64;
-	if(unlikely(!handle))
+	if(unlikely(!handle64))
 		return -EINVAL;
 	user_buf = compat_ptr(user_buf32);
 	iso = compat_ptr(iso32);
-	return ioc_fetch_data_common(vhc, handle, user_buf, user_len, iso, iso_count);
+	return ioc_fetch_data_common(vf, handle64, user_buf, user_len, iso, iso_count);
+}
+
+// called in device_ioctl only
+static int ioc_deposit_data32(struct vhci_file *vf, struct usb_vhci_ioc_deposit32 __user *arg)
+{
+	u64 handle64;
+	u32 user_buf32;
+	int offset, len;
+
+	__get_user(handle64, &arg->handle);
+	__get_user(user_buf32, &arg->buffer);
+	__get_user(offset, &arg->offset);
+	__get_user(len, &arg->length);
+	if(unlikely(!handle64))
+		return -EINVAL;
+	return ioc_deposit_data_common(vf, handle64, compat_ptr(user_buf32), offset, len);
+}
+
+// called in device_ioctl only
+static int ioc_fetch_work_multi32(struct vhci_file *vf, struct usb_vhci_ioc_work_multi32 __user *arg)
+{
+	u32 works32, count;
+	s16 timeout;
+
+	__get_user(works32, &arg->works);
+	__get_user(count, &arg->count);
+	__get_user(timeout, &arg->timeout);
+	return ioc_fetch_work_multi_common(vf, compat_ptr(works32), count, timeout, &arg->fetched);
+}
+
+// called in device_ioctl only
+static int ioc_fetch_work_data32(struct vhci_file *vf, struct usb_vhci_ioc_work_data32 __user *arg)
+{
+	u32 buf32, iso32;
+	int user_len, iso_count;
+	s16 timeout;
+
+	__get_user(timeout, &arg->work.timeout);
+	__get_user(user_len, &arg->buffer_length);
+	__get_user(iso_count, &arg->packet_count);
+	__get_user(buf32, &arg->buffer);
+	__get_user(iso32, &arg->iso_packets);
+	return ioc_fetch_work_data_common(vf, &arg->work, timeout, compat_ptr(buf32), user_len, compat_ptr(iso32), iso_count, &arg->flags);
 }
 #endif
 
@@ -922,9 +3007,9 @@ static long device_do_ioctl(struct file *file,
                            unsigned int cmd,
                            void __user *arg)
 {
-	struct usb_vhci_device *vdev;
-	struct usb_vhci_hcd *vhc;
+	struct vhci_file *vf;
 	long ret = 0;
+	s64 timeout_ns;
 	s16 timeout;
 
 	// Floods the logs
@@ -938,46 +3023,145 @@ static long device_do_ioctl(struct file *file,
 	if(unlikely((_IOC_DIR(cmd) & _IOC_WRITE) && !access_ok(VERIFY_READ, arg, _IOC_SIZE(cmd))))
 		return -EFAULT;
 
-	if(unlikely(cmd == USB_VHCI_HCD_IOCREGISTER))
-		return ioc_register(file, (struct usb_vhci_ioc_register __user *)arg);
+	vf = file->private_data;
 
-	vdev = file->private_data;
+	if(unlikely(cmd == USB_VHCI_HCD_IOCREGISTER || cmd == USB_VHCI_HCD_IOCREGISTEREX))
+	{
+		// a channel belongs to the controller of its main file
+		if(unlikely(vf->chan))
+			return -EPERM;
+		return ioc_register(vf, (struct usb_vhci_ioc_register __user *)arg, cmd == USB_VHCI_HCD_IOCREGISTEREX);
+	}
+	if(unlikely(cmd == USB_VHCI_HCD_IOCBUSYPOLL))
+		return ioc_busy_poll(vf, (struct usb_vhci_ioc_busy_poll __user *)arg);
 
-	if(unlikely(!vdev))
+	if(unlikely(!vf_hcd_count(vf)))
 		return -EPROTO;
 
-	vhc = vhcidev_to_vhcihcd(vdev);
-
 	switch(__builtin_expect(cmd, USB_VHCI_HCD_IOCFETCHWORK))
 	{
 	case USB_VHCI_HCD_IOCPORTSTAT:
-		ret = ioc_port_stat(vdev, (struct usb_vhci_ioc_port_stat __user *)arg);
+		ret = ioc_port_stat(vf, (struct usb_vhci_ioc_port_stat __user *)arg, 0);
+		break;
+
+	case USB_VHCI_HCD_IOCPORTSTATEX:
+		ret = ioc_port_stat(vf, (struct usb_vhci_ioc_port_stat __user *)arg, 1);
+		break;
+
+	case USB_VHCI_HCD_IOCPORTSTATMULTI:
+		ret = ioc_port_stat_multi(vf, (struct usb_vhci_ioc_port_stat_multi __user *)arg);
 		break;
 
 	case USB_VHCI_HCD_IOCFETCHWORK_RO:
-		ret = ioc_fetch_work(vhc, (struct usb_vhci_ioc_work __user *)arg, 100);
+		ret = ioc_fetch_work(vf, (struct usb_vhci_ioc_work __user *)arg, timeout_to_ns(100));
 		break;
 
 	case USB_VHCI_HCD_IOCFETCHWORK:
 		__get_user(timeout, &((struct usb_vhci_ioc_work __user *)arg)->timeout);
-		ret = ioc_fetch_work(vhc, (struct usb_vhci_ioc_work __user *)arg, timeout);
+		ret = ioc_fetch_work(vf, (struct usb_vhci_ioc_work __user *)arg, timeout_to_ns(timeout));
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHWORKNS:
+		// (__get_user can't do 64 bit values on some 32 bit archs)
+		if(unlikely(__copy_from_user(&timeout_ns, &((struct usb_vhci_ioc_work_ns __user *)arg)->timeout_ns, sizeof timeout_ns)))
+			return -EFAULT;
+		ret = ioc_fetch_work(vf, &((struct usb_vhci_ioc_work_ns __user *)arg)->work, timeout_ns);
 		break;
 
 	case USB_VHCI_HCD_IOCGIVEBACK:
-		ret = ioc_giveback(vhc, (struct usb_vhci_ioc_giveback __user *)arg);
+		ret = ioc_giveback(vf, (struct usb_vhci_ioc_giveback __user *)arg);
 		break;
 
 	case USB_VHCI_HCD_IOCFETCHDATA:
-		ret = ioc_fetch_data(vhc, (struct usb_vhci_ioc_urb_data __user *)arg);
+		ret = ioc_fetch_data(vf, (struct usb_vhci_ioc_urb_data __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHWORKMULTI:
+		ret = ioc_fetch_work_multi(vf, (struct usb_vhci_ioc_work_multi __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACKMULTI:
+		ret = ioc_giveback_multi(vf, (struct usb_vhci_ioc_giveback_multi __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHWORKDATA:
+		ret = ioc_fetch_work_data(vf, (struct usb_vhci_ioc_work_data __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCRINGSETUP:
+		ret = ioc_ring_setup(vf, (struct usb_vhci_ioc_ring_setup __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCRINGENTER:
+		ret = ioc_ring_enter(vf, (struct usb_vhci_ioc_ring_enter __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCDEPOSITDATA:
+		ret = ioc_deposit_data(vf, (struct usb_vhci_ioc_deposit __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCINREADY:
+		ret = ioc_in_ready(vf, (struct usb_vhci_ioc_in_ready __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCDESCCACHE:
+		ret = ioc_desc_cache(vf, (struct usb_vhci_ioc_desc_cache __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCPOSTIN:
+		ret = ioc_post_in(vf, (struct usb_vhci_ioc_post_in __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACKGROUP:
+		ret = ioc_giveback_group(vf, (struct usb_vhci_ioc_giveback_group __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCOPENCHANNEL:
+		if(unlikely(vf->chan))
+			ret = -EPERM;
+		else
+			ret = ioc_open_channel(file, vf, (struct usb_vhci_ioc_channel __user *)arg);
 		break;
 
 #ifdef CONFIG_COMPAT
+	case USB_VHCI_HCD_IOCPORTSTATMULTI32:
+		ret = ioc_port_stat_multi32(vf, (struct usb_vhci_ioc_port_stat_multi32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCDESCCACHE32:
+		ret = ioc_desc_cache32(vf, (struct usb_vhci_ioc_desc_cache32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCPOSTIN32:
+		ret = ioc_post_in32(vf, (struct usb_vhci_ioc_post_in32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACKGROUP32:
+		ret = ioc_giveback_group32(vf, (struct usb_vhci_ioc_giveback_group32 __user *)arg);
+		break;
+
 	case USB_VHCI_HCD_IOCGIVEBACK32:
-		ret = ioc_giveback32(vhc, (struct usb_vhci_ioc_giveback32 __user *)arg);
+		ret = ioc_giveback32(vf, (struct usb_vhci_ioc_giveback32 __user *)arg);
 		break;
 
 	case USB_VHCI_HCD_IOCFETCHDATA32:
-		ret = ioc_fetch_data32(vhc, (struct usb_vhci_ioc_urb_data32 __user *)arg);
+		ret = ioc_fetch_data32(vf, (struct usb_vhci_ioc_urb_data32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHWORKMULTI32:
+		ret = ioc_fetch_work_multi32(vf, (struct usb_vhci_ioc_work_multi32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACKMULTI32:
+		ret = ioc_giveback_multi32(vf, (struct usb_vhci_ioc_giveback_multi32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHWORKDATA32:
+		ret = ioc_fetch_work_data32(vf, (struct usb_vhci_ioc_work_data32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCDEPOSITDATA32:
+		ret = ioc_deposit_data32(vf, (struct usb_vhci_ioc_deposit32 __user *)arg);
 		break;
 #endif
 
@@ -1015,6 +3199,10 @@ static struct file_operations fops = {
 	.llseek         = device_llseek,
 	.read           = device_read,
 	.write          = device_write,
+	.splice_read    = device_splice_read,
+	.splice_write   = device_splice_write,
+	.poll           = device_poll,
+	.mmap           = device_mmap,
 	.unlocked_ioctl = device_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl   = device_ioctl32,
@@ -1023,6 +3211,23 @@ static struct file_operations fops = {
 	.release        = device_release // a.k.a. close
 };
 
+// the files of channels are created by USB_VHCI_HCD_IOCOPENCHANNEL (they can't be opened)
+static struct file_operations channel_fops = {
+	.owner          = THIS_MODULE,
+	.llseek         = device_llseek,
+	.read           = device_read,
+	.write          = device_write,
+	.splice_read    = device_splice_read,
+	.splice_write   = device_splice_write,
+	.poll           = device_poll,
+	.mmap           = device_mmap,
+	.unlocked_ioctl = device_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl   = device_ioctl32,
+#endif
+	.release        = channel_release
+};
+
 #ifdef DEBUG
 static ssize_t show_debug_output(struct device_driver *drv, char *buf)
 {
@@ -1148,10 +3353,18 @@ static int __init init(void)
 #ifdef DEBUG
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCREGISTER     = %08x\n", (unsigned int)USB_VHCI_HCD_IOCREGISTER);
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCPORTSTAT     = %08x\n", (unsigned int)USB_VHCI_HCD_IOCPORTSTAT);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCREGISTEREX   = %08x\n", (unsigned int)USB_VHCI_HCD_IOCREGISTEREX);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCPORTSTATEX   = %08x\n", (unsigned int)USB_VHCI_HCD_IOCPORTSTATEX);
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHWORK_RO = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHWORK_RO);
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHWORK    = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHWORK);
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCGIVEBACK     = %08x\n", (unsigned int)USB_VHCI_HCD_IOCGIVEBACK);
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHDATA    = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHDATA);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHWORKMULTI = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHWORKMULTI);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCGIVEBACKMULTI  = %08x\n", (unsigned int)USB_VHCI_HCD_IOCGIVEBACKMULTI);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHWORKDATA  = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHWORKDATA);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCRINGSETUP      = %08x\n", (unsigned int)USB_VHCI_HCD_IOCRINGSETUP);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCRINGENTER      = %08x\n", (unsigned int)USB_VHCI_HCD_IOCRINGENTER);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCDEPOSITDATA    = %08x\n", (unsigned int)USB_VHCI_HCD_IOCDEPOSITDATA);
 #endif
 
 	return 0;
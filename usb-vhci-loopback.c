@@ -0,0 +1,676 @@
+/*
+ * usb-vhci-loopback.c -- In-kernel loopback device for
+ *                        VHCI USB host controller driver.
+ *
+ * Copyright (C) 2007-2010 Michael Singer <michael@a-singer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// This backend registers controllers whose ports all have a synthetic high speed device plugged in.
+// The urbs are serviced by a work item right in the kernel, so nothing crosses into user space.
+// The device has the same descriptors as the one which test/vhci-bench emulates:
+//   ep 0       control: vendor request 0x01 (IN) returns wLength bytes, 0x02 (OUT) swallows them
+//   ep 0x01    bulk OUT sink
+//   ep 0x81    bulk IN source
+//   ep 0x02    bulk OUT, loopback: the data comes back through ep 0x82
+//   ep 0x82    bulk IN, loopback
+//   ep 0x83    interrupt IN source (64 bytes per packet, every microframe)
+//   ep 0x84    isochronous IN source (1024 bytes per packet, every microframe)
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/errno.h>
+#include <linux/init.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/platform_device.h>
+#include <linux/usb.h>
+#include <linux/scatterlist.h>
+
+#include "usb-vhci-hcd.h"
+
+#include <asm/atomic.h>
+#include <asm/bitops.h>
+
+#define DRIVER_NAME "usb_vhci_loopback"
+#define DRIVER_DESC "In-kernel loopback device for USB VHCI"
+#define DRIVER_VERSION USB_VHCI_HCD_VERSION " (" USB_VHCI_HCD_DATE ")"
+
+#ifdef vhci_printk
+#	undef vhci_printk
+#endif
+#define vhci_printk(level, fmt, args...) \
+	printk(level DRIVER_NAME ": " fmt, ## args)
+
+MODULE_DESCRIPTION(DRIVER_DESC " driver");
+MODULE_AUTHOR("Michael Singer <michael@a-singer.de>");
+MODULE_LICENSE("GPL");
+
+#define LOOP_MAX_CONTROLLERS 16
+
+static unsigned int controllers = 1;
+module_param(controllers, uint, S_IRUGO);
+MODULE_PARM_DESC(controllers, "Number of controllers to create (default: 1, max: 16)");
+
+static unsigned int ports = 1;
+module_param(ports, uint, S_IRUGO);
+MODULE_PARM_DESC(ports, "Number of ports (each with a loopback device) per controller (default: 1)");
+
+static unsigned int fill = 1;
+module_param(fill, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(fill, "Fill the buffers of IN urbs of the sources with a pattern; if 0, they are given back untouched (default: 1)");
+
+static unsigned int fifo_size = 256 * 1024;
+module_param(fifo_size, uint, S_IRUGO);
+MODULE_PARM_DESC(fifo_size, "Size of the loopback buffer of each device in bytes (default: 262144)");
+
+// the work item gives up the cpu after this many work items, and reschedules itself
+#define LOOP_BATCH 256
+
+#define LOOP_EP_SINK     0x01
+#define LOOP_EP_SOURCE   0x81
+#define LOOP_EP_LOOP_OUT 0x02
+#define LOOP_EP_LOOP_IN  0x82
+
+#define LOOP_REQ_VENDOR_IN  0x01
+#define LOOP_REQ_VENDOR_OUT 0x02
+
+static const struct usb_device_descriptor loop_device_desc = {
+	.bLength            = USB_DT_DEVICE_SIZE,
+	.bDescriptorType    = USB_DT_DEVICE,
+	.bcdUSB             = __constant_cpu_to_le16(0x0200),
+	.bDeviceClass       = USB_CLASS_VENDOR_SPEC,
+	.bDeviceSubClass    = 0,
+	.bDeviceProtocol    = 0,
+	.bMaxPacketSize0    = 64,
+	.idVendor           = __constant_cpu_to_le16(0xffff),
+	.idProduct          = __constant_cpu_to_le16(0x0b01),
+	.bcdDevice          = __constant_cpu_to_le16(0x0100),
+	.iManufacturer      = 0,
+	.iProduct           = 0,
+	.iSerialNumber      = 0,
+	.bNumConfigurations = 1
+};
+
+#define LOOP_CONFIG_SIZE (USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE + 6 * USB_DT_ENDPOINT_SIZE)
+
+static const u8 loop_config_desc[LOOP_CONFIG_SIZE] = {
+	// configuration 1 (self powered)
+	USB_DT_CONFIG_SIZE, USB_DT_CONFIG, LOOP_CONFIG_SIZE & 0xff, LOOP_CONFIG_SIZE >> 8, 1, 1, 0, 0xc0, 0,
+	// interface 0
+	USB_DT_INTERFACE_SIZE, USB_DT_INTERFACE, 0, 0, 6, USB_CLASS_VENDOR_SPEC, 0, 0, 0,
+	// endpoints
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, LOOP_EP_SINK,     USB_ENDPOINT_XFER_BULK, 0x00, 0x02, 0,
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, LOOP_EP_SOURCE,   USB_ENDPOINT_XFER_BULK, 0x00, 0x02, 0,
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, LOOP_EP_LOOP_OUT, USB_ENDPOINT_XFER_BULK, 0x00, 0x02, 0,
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, LOOP_EP_LOOP_IN,  USB_ENDPOINT_XFER_BULK, 0x00, 0x02, 0,
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, 0x83, USB_ENDPOINT_XFER_INT,  0x40, 0x00, 1,
+	USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, 0x84, USB_ENDPOINT_XFER_ISOC, 0x00, 0x04, 1
+};
+
+// fetched urbs of the loopback endpoints wait in these entries; they are identified by their
+// handle, so that an urb which was canceled (or given back by vhci_hcd_remove) meanwhile is
+// simply not found anymore
+struct loop_pending
+{
+	struct list_head list;
+	u64 handle;
+};
+
+// everything is protected by vhc->lock
+struct loop_port
+{
+	u8 connected;
+	u8 configuration;
+	u8 *fifo;                // loopback buffer (fifo_size bytes)
+	size_t fifo_head, fifo_fill;
+	struct list_head loop_in;  // IN urbs which wait for data
+	struct list_head loop_out; // OUT urbs which wait for room in the fifo
+};
+
+// private data of a controller (ifc_priv)
+struct loop_priv
+{
+	struct work_struct work;
+	u8 stopped;
+	unsigned int port_count;
+	struct loop_port *ports;
+};
+
+static struct usb_vhci_device *loop_vdevs[LOOP_MAX_CONTROLLERS];
+
+static inline struct loop_priv *vhcidev_to_loopp(struct usb_vhci_device *vdev)
+{
+	return (struct loop_priv *)vhcidev_to_ifc(vdev);
+}
+
+static inline struct usb_vhci_device *loopp_to_vhcidev(struct loop_priv *lp)
+{
+	return ifc_to_vhcidev(lp);
+}
+
+/*
+ * access to the transfer buffers
+ */
+
+// called for every contiguous piece of a transfer buffer
+typedef void (*loop_piece_fn)(void *ctx, u8 *piece, size_t len);
+
+// Walks through the first len bytes of the transfer buffer of the urb. to_urb tells whether fn
+// writes into the pieces.
+// caller has vhc->lock
+static void urb_for_each_piece(struct urb *urb, size_t len, int to_urb, loop_piece_fn fn, void *ctx)
+{
+#ifndef NO_URB_SG
+	if(urb->num_sgs)
+	{
+		struct sg_mapping_iter miter;
+		size_t n;
+		sg_miter_start(&miter, urb->sg, urb->num_sgs,
+			SG_MITER_ATOMIC | (to_urb ? SG_MITER_TO_SG : SG_MITER_FROM_SG));
+		while(len && sg_miter_next(&miter))
+		{
+			n = min_t(size_t, len, miter.length);
+			fn(ctx, miter.addr, n);
+			len -= n;
+		}
+		sg_miter_stop(&miter);
+		return;
+	}
+#endif
+	if(len)
+		fn(ctx, urb->transfer_buffer, len);
+}
+
+static void fill_piece(void *ctx, u8 *piece, size_t len)
+{
+	memset(piece, 0xa5, len);
+}
+
+static void zero_piece(void *ctx, u8 *piece, size_t len)
+{
+	memset(piece, 0, len);
+}
+
+// ctx points to a pointer to the source; it is advanced
+static void copy_piece(void *ctx, u8 *piece, size_t len)
+{
+	const u8 **src = ctx;
+	memcpy(piece, *src, len);
+	*src += len;
+}
+
+static void fifo_put_piece(void *ctx, u8 *piece, size_t len)
+{
+	struct loop_port *port = ctx;
+	size_t pos = (port->fifo_head + port->fifo_fill) % fifo_size, n;
+	while(len)
+	{
+		n = min_t(size_t, len, fifo_size - pos);
+		memcpy(port->fifo + pos, piece, n);
+		piece += n;
+		len -= n;
+		port->fifo_fill += n;
+		pos = 0;
+	}
+}
+
+static void fifo_get_piece(void *ctx, u8 *piece, size_t len)
+{
+	struct loop_port *port = ctx;
+	size_t n;
+	while(len)
+	{
+		n = min_t(size_t, len, fifo_size - port->fifo_head);
+		memcpy(piece, port->fifo + port->fifo_head, n);
+		piece += n;
+		len -= n;
+		port->fifo_fill -= n;
+		port->fifo_head = (port->fifo_head + n) % fifo_size;
+	}
+}
+
+static inline void source_data(struct urb *urb, size_t len)
+{
+	if(fill)
+		urb_for_each_piece(urb, len, 1, fill_piece, NULL);
+}
+
+/*
+ * the device
+ */
+
+// (done is the list of loop_work, which gives the urbs back after it released vhc->lock)
+// caller has vhc->lock
+static void loop_complete(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp, int actual, int status, struct list_head *done)
+{
+	urbp->urb->actual_length = actual;
+	usb_vhci_maybe_set_status(urbp, status);
+	usb_vhci_urb_retire(vhc, urbp, done);
+}
+
+// Returns the urb of the entry, or NULL if it is gone or canceled. In the latter case the entry
+// is freed.
+// caller has vhc->lock
+static struct usb_vhci_urb_priv *loop_pending_urbp(struct usb_vhci_hcd *vhc, struct loop_pending *p)
+{
+	struct usb_vhci_urb_priv *urbp = usb_vhci_urbp_from_handle(vhc, p->handle);
+	if(likely(urbp && urbp->state == USB_VHCI_URB_STATE_FETCHED))
+		return urbp;
+	list_del(&p->list);
+	kfree(p);
+	return NULL;
+}
+
+// Moves data from waiting OUT urbs into the fifo and from the fifo into waiting IN urbs.
+// caller has vhc->lock
+static void loop_service(struct usb_vhci_hcd *vhc, struct loop_port *port, struct list_head *done)
+{
+	struct usb_vhci_urb_priv *urbp;
+	struct loop_pending *p;
+	size_t n;
+
+	for(;;)
+	{
+		if(port->fifo_fill && !list_empty(&port->loop_in))
+		{
+			p = list_entry(port->loop_in.next, struct loop_pending, list);
+			if(unlikely(!(urbp = loop_pending_urbp(vhc, p))))
+				continue;
+			n = min_t(size_t, urbp->urb->transfer_buffer_length, port->fifo_fill);
+			urb_for_each_piece(urbp->urb, n, 1, fifo_get_piece, port);
+		}
+		else if(!list_empty(&port->loop_out))
+		{
+			p = list_entry(port->loop_out.next, struct loop_pending, list);
+			if(unlikely(!(urbp = loop_pending_urbp(vhc, p))))
+				continue;
+			n = urbp->urb->transfer_buffer_length;
+			if(n > fifo_size - port->fifo_fill)
+				break;
+			urb_for_each_piece(urbp->urb, n, 0, fifo_put_piece, port);
+		}
+		else
+			break;
+		list_del(&p->list);
+		kfree(p);
+		loop_complete(vhc, urbp, n, 0, done);
+	}
+}
+
+// returns the number of bytes of the data stage, or a negative error code which stalls the pipe
+// caller has vhc->lock
+static int loop_control(struct loop_port *port, struct urb *urb)
+{
+	const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urb->setup_packet;
+	const u8 *src;
+	u16 wValue, wLength;
+	int len;
+
+	wValue = le16_to_cpu(cmd->wValue);
+	wLength = le16_to_cpu(cmd->wLength);
+
+	// the data stage has to fit into the buffer (all writes below rely on this)
+	if(unlikely(wLength > urb->transfer_buffer_length))
+		return -EPIPE;
+
+	if((cmd->bRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR)
+	{
+		if(cmd->bRequest == LOOP_REQ_VENDOR_IN && (cmd->bRequestType & USB_DIR_IN))
+		{
+			source_data(urb, wLength);
+			return wLength;
+		}
+		if(cmd->bRequest == LOOP_REQ_VENDOR_OUT && !(cmd->bRequestType & USB_DIR_IN))
+			return wLength;
+		return -EPIPE;
+	}
+	if((cmd->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
+		return -EPIPE;
+
+	switch(cmd->bRequest)
+	{
+	case USB_REQ_GET_DESCRIPTOR:
+		switch(wValue >> 8)
+		{
+		case USB_DT_DEVICE:
+			src = (const u8 *)&loop_device_desc;
+			len = min_t(int, wLength, USB_DT_DEVICE_SIZE);
+			break;
+		case USB_DT_CONFIG:
+			src = loop_config_desc;
+			len = min_t(int, wLength, LOOP_CONFIG_SIZE);
+			break;
+		default:
+			// no strings, no device qualifier (a high speed only device)
+			return -EPIPE;
+		}
+		urb_for_each_piece(urb, len, 1, copy_piece, &src);
+		return len;
+	case USB_REQ_GET_STATUS:
+		len = min_t(int, wLength, 2);
+		urb_for_each_piece(urb, len, 1, zero_piece, NULL);
+		if(len && (cmd->bRequestType & USB_RECIP_MASK) == USB_RECIP_DEVICE)
+		{
+			src = (const u8 *)"\x01"; // self powered
+			urb_for_each_piece(urb, 1, 1, copy_piece, &src);
+		}
+		return len;
+	case USB_REQ_GET_CONFIGURATION:
+		len = min_t(int, wLength, 1);
+		src = &port->configuration;
+		urb_for_each_piece(urb, len, 1, copy_piece, &src);
+		return len;
+	case USB_REQ_SET_CONFIGURATION:
+		if(wValue > 1)
+			return -EPIPE;
+		port->configuration = wValue;
+		return 0;
+	case USB_REQ_SET_ADDRESS:
+	case USB_REQ_SET_INTERFACE:
+	case USB_REQ_CLEAR_FEATURE:
+	case USB_REQ_SET_FEATURE:
+		return 0;
+	}
+	return -EPIPE;
+}
+
+// caller has vhc->lock
+static void loop_iso(struct urb *urb)
+{
+	int i, actual = 0;
+	for(i = 0; i < urb->number_of_packets; i++)
+	{
+		urb->iso_frame_desc[i].actual_length = urb->iso_frame_desc[i].length;
+		urb->iso_frame_desc[i].status = 0;
+		actual += urb->iso_frame_desc[i].length;
+	}
+	urb->error_count = 0;
+	if(usb_pipein(urb->pipe))
+		source_data(urb, urb->transfer_buffer_length);
+	urb->actual_length = actual;
+}
+
+// Processes an urb which was just taken out of the inbox.
+// caller has vhc->lock
+static void loop_urb(struct loop_priv *lp, struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp, struct list_head *done)
+{
+	struct urb *const urb = urbp->urb;
+	struct loop_port *port;
+	struct loop_pending *p;
+	u64 handle;
+	int ret;
+
+	handle = usb_vhci_urb_fetched(vhc, urbp);
+
+	// all devices are attached to the root hub directly
+	if(unlikely(urb->dev->portnum < 1 || urb->dev->portnum > lp->port_count))
+	{
+		loop_complete(vhc, urbp, 0, -EPIPE, done);
+		return;
+	}
+	port = &lp->ports[urb->dev->portnum - 1];
+
+	switch(usb_pipetype(urb->pipe))
+	{
+	case PIPE_CONTROL:
+		if(unlikely(!urb->setup_packet))
+		{
+			loop_complete(vhc, urbp, 0, -EPIPE, done);
+			return;
+		}
+		ret = loop_control(port, urb);
+		loop_complete(vhc, urbp, ret < 0 ? 0 : ret, ret < 0 ? ret : 0, done);
+		return;
+
+	case PIPE_ISOCHRONOUS:
+		loop_iso(urb);
+		usb_vhci_maybe_set_status(urbp, 0);
+		usb_vhci_urb_retire(vhc, urbp, done);
+		return;
+
+	case PIPE_BULK:
+		if(usb_pipeendpoint(urb->pipe) == (LOOP_EP_LOOP_OUT & 0x0f))
+		{
+			if(unlikely(!usb_pipein(urb->pipe) && urb->transfer_buffer_length > fifo_size))
+			{
+				// it would never fit
+				loop_complete(vhc, urbp, 0, -EMSGSIZE, done);
+				return;
+			}
+			p = kmalloc(sizeof *p, GFP_ATOMIC);
+			if(unlikely(!p))
+			{
+				loop_complete(vhc, urbp, 0, -ENOMEM, done);
+				return;
+			}
+			p->handle = handle;
+			list_add_tail(&p->list, usb_pipein(urb->pipe) ? &port->loop_in : &port->loop_out);
+			loop_service(vhc, port, done);
+			return;
+		}
+		// fall through (sink and source)
+	default: // PIPE_INTERRUPT
+		if(usb_pipein(urb->pipe))
+			source_data(urb, urb->transfer_buffer_length);
+		loop_complete(vhc, urbp, urb->transfer_buffer_length, 0, done);
+		return;
+	}
+}
+
+// plays the role of the device's side of the port
+// called in loop_work only
+static void loop_port_stat(struct loop_priv *lp, struct usb_vhci_hcd *vhc, u8 index, u16 status, u8 flags)
+{
+	struct loop_port *port = &lp->ports[index - 1];
+
+	if(!(status & USB_PORT_STAT_POWER))
+	{
+		port->connected = 0;
+		return;
+	}
+	if(!port->connected)
+	{
+		port->connected = 1;
+		usb_vhci_apply_port_stat(vhc, USB_PORT_STAT_CONNECTION | USB_PORT_STAT_HIGH_SPEED,
+			USB_PORT_STAT_C_CONNECTION, index);
+	}
+	else if(status & USB_PORT_STAT_RESET)
+		usb_vhci_apply_port_stat(vhc, USB_PORT_STAT_ENABLE, USB_PORT_STAT_C_RESET, index);
+	else if(flags & USB_VHCI_PORT_STAT_FLAG_RESUMING)
+		usb_vhci_apply_port_stat(vhc, 0, USB_PORT_STAT_C_SUSPEND, index);
+}
+
+// does all the work of the controller: cancelations, port changes and urbs
+static void loop_work(struct work_struct *work)
+{
+	struct loop_priv *lp = container_of(work, struct loop_priv, work);
+	struct usb_vhci_hcd *vhc = vhcidev_to_vhcihcd(loopp_to_vhcidev(lp));
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags, bit;
+	unsigned int n;
+	u16 status;
+	u8 port_flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	for(n = 0; n < LOOP_BATCH; n++)
+	{
+		// the loopback never binds any port, so all the work is in channel 0
+		if(!list_empty(&vhc->chans[0].urbp_list_cancel))
+		{
+			// the urb waits in one of the loopback queues; its entry there is dropped lazily
+			urbp = list_entry(vhc->chans[0].urbp_list_cancel.next, struct usb_vhci_urb_priv, urbp_list);
+			loop_complete(vhc, urbp, 0, -ECONNRESET, &done);
+			continue;
+		}
+
+		bit = find_next_bit(vhc->port_update, vhc->port_count + 1, 1);
+		if(bit <= vhc->port_count)
+		{
+			__clear_bit(bit, vhc->port_update);
+			atomic_dec(&vhc->chans[0].work_pending);
+			status = vhc->ports[bit - 1].port_status;
+			port_flags = vhc->ports[bit - 1].port_flags;
+			spin_unlock_irqrestore(&vhc->lock, flags);
+			usb_vhci_urb_giveback_list(vhc, &done);
+			loop_port_stat(lp, vhc, bit, status, port_flags);
+			spin_lock_irqsave(&vhc->lock, flags);
+			continue;
+		}
+
+		if(!(urbp = usb_vhci_inbox_pop(vhc, 0)))
+			break;
+		loop_urb(lp, vhc, urbp, &done);
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	usb_vhci_urb_giveback_list(vhc, &done);
+
+	// let others have the cpu, if there is still work
+	if(n == LOOP_BATCH)
+		schedule_work(&lp->work);
+}
+
+/*
+ * backend callbacks
+ */
+
+// context is the number of ports
+static int loop_init(void *context, void *ifc_priv)
+{
+	struct loop_priv *lp = ifc_priv;
+	unsigned int i;
+
+	INIT_WORK(&lp->work, loop_work);
+	lp->stopped = 0;
+	lp->port_count = (unsigned long)context;
+	lp->ports = kzalloc(lp->port_count * sizeof *lp->ports, GFP_KERNEL);
+	if(unlikely(!lp->ports))
+		return -ENOMEM;
+	for(i = 0; i < lp->port_count; i++)
+	{
+		INIT_LIST_HEAD(&lp->ports[i].loop_in);
+		INIT_LIST_HEAD(&lp->ports[i].loop_out);
+		lp->ports[i].fifo = vmalloc(fifo_size);
+		if(unlikely(!lp->ports[i].fifo))
+			goto free_fifos;
+	}
+	return 0;
+
+free_fifos:
+	while(i--)
+		vfree(lp->ports[i].fifo);
+	kfree(lp->ports);
+	lp->ports = NULL;
+	return -ENOMEM;
+}
+
+static void loop_destroy(void *ifc_priv)
+{
+	struct loop_priv *lp = ifc_priv;
+	struct loop_pending *p, *tmp;
+	unsigned int i;
+
+	// (loop_stop has done this already, unless the controller never started)
+	cancel_work_sync(&lp->work);
+	if(unlikely(!lp->ports))
+		return;
+	for(i = 0; i < lp->port_count; i++)
+	{
+		// the urbs of the remaining entries were given back by vhci_hcd_remove
+		list_for_each_entry_safe(p, tmp, &lp->ports[i].loop_in, list)
+			kfree(p);
+		list_for_each_entry_safe(p, tmp, &lp->ports[i].loop_out, list)
+			kfree(p);
+		vfree(lp->ports[i].fifo);
+	}
+	kfree(lp->ports);
+	lp->ports = NULL;
+}
+
+// called in atomic context (usually with vhc->lock held)
+static void loop_wakeup(struct usb_vhci_device *vdev)
+{
+	struct loop_priv *lp = vhcidev_to_loopp(vdev);
+	if(likely(!lp->stopped))
+		schedule_work(&lp->work);
+}
+
+// called in vhci_stop only; the work item must not run anymore after this
+static void loop_stop(struct usb_vhci_device *vdev)
+{
+	struct loop_priv *lp = vhcidev_to_loopp(vdev);
+	lp->stopped = 1;
+	cancel_work_sync(&lp->work);
+}
+
+static struct usb_vhci_ifc loop_ifc = {
+	.ifc_desc      = "USB VHCI in-kernel loopback device",
+	.owner         = THIS_MODULE,
+	.ifc_priv_size = sizeof(struct loop_priv),
+
+	.init    = loop_init,
+	.destroy = loop_destroy,
+	.wakeup  = loop_wakeup,
+	.stop    = loop_stop
+};
+
+static int __init init(void)
+{
+	unsigned int i;
+	int retval;
+
+	if(usb_disabled()) return -ENODEV;
+
+	vhci_printk(KERN_INFO, DRIVER_DESC " -- Version " DRIVER_VERSION "\n");
+
+	if(unlikely(!controllers || controllers > LOOP_MAX_CONTROLLERS || !ports || ports > USB_VHCI_MAX_PORTS || fifo_size < 512))
+	{
+		vhci_printk(KERN_ERR, "invalid module parameters\n");
+		return -EINVAL;
+	}
+
+	for(i = 0; i < controllers; i++)
+	{
+		retval = usb_vhci_hcd_register(&loop_ifc, (void *)(unsigned long)ports, ports, 0, &loop_vdevs[i]);
+		if(unlikely(retval < 0))
+		{
+			vhci_printk(KERN_ERR, "registering controller %u failed (%d)\n", i, retval);
+			goto unreg;
+		}
+		vhci_printk(KERN_INFO, "%s (usb bus %d) has %u loopback device(s)\n",
+			usb_vhci_dev_name(loop_vdevs[i]), usb_vhci_dev_busnum(loop_vdevs[i]), ports);
+	}
+	return 0;
+
+unreg:
+	while(i--)
+		usb_vhci_hcd_unregister(loop_vdevs[i]);
+	return retval;
+}
+module_init(init);
+
+static void __exit cleanup(void)
+{
+	unsigned int i = controllers;
+	while(i--)
+		usb_vhci_hcd_unregister(loop_vdevs[i]);
+}
+module_exit(cleanup);
@@ -0,0 +1,159 @@
+/*
+ * usb-vhci-trace.h -- VHCI USB host controller driver trace events.
+ *
+ * Copyright (C) 2007-2010 Michael Singer <michael@a-singer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// This header has to be included after usb-vhci-hcd.h. usb-vhci-hcd.c defines CREATE_TRACE_POINTS
+// before including it.
+// The events show up in /sys/kernel/debug/tracing/events/usb_vhci/. While they are disabled, each of
+// them costs a single test of a static flag.
+
+#ifdef NO_TRACE_EVENTS
+
+#ifndef _USB_VHCI_TRACE_H
+#define _USB_VHCI_TRACE_H
+
+// no trace events available; these calls vanish
+static inline void trace_usb_vhci_urb_enqueue(const struct urb *urb, u64 handle, int status) {}
+static inline void trace_usb_vhci_urb_dequeue(const struct urb *urb, u64 handle, int status) {}
+static inline void trace_usb_vhci_urb_fetch(const struct urb *urb, u64 handle, int status) {}
+static inline void trace_usb_vhci_urb_fetch_data(const struct urb *urb, u64 handle, int status) {}
+static inline void trace_usb_vhci_urb_deposit_data(const struct urb *urb, u64 handle, int status) {}
+static inline void trace_usb_vhci_urb_giveback(const struct urb *urb, u64 handle, int status) {}
+static inline void trace_usb_vhci_port_stat(struct usb_vhci_hcd *vhc, u8 index) {}
+
+#endif
+
+#else // !NO_TRACE_EVENTS
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM usb_vhci
+
+#if !defined(_USB_VHCI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _USB_VHCI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// handle is zero as long as user space hasn't fetched the urb
+DECLARE_EVENT_CLASS(usb_vhci_urb,
+	TP_PROTO(const struct urb *urb, u64 handle, int status),
+	TP_ARGS(urb, handle, status),
+	TP_STRUCT__entry(
+		__field(u64,          handle)
+		__field(const void *, urb)
+		__field(int,          busnum)
+		__field(u8,           devnum)
+		__field(u8,           epnum)
+		__field(u8,           in)
+		__field(u8,           type)
+		__field(u32,          length)
+		__field(u32,          actual)
+		__field(int,          status)
+	),
+	TP_fast_assign(
+		__entry->handle = handle;
+		__entry->urb    = urb;
+		__entry->busnum = urb->dev->bus->busnum;
+		__entry->devnum = usb_pipedevice(urb->pipe);
+		__entry->epnum  = usb_pipeendpoint(urb->pipe);
+		__entry->in     = usb_vhci_urb_dir_in(urb);
+		__entry->type   = usb_pipetype(urb->pipe);
+		__entry->length = urb->transfer_buffer_length;
+		__entry->actual = urb->actual_length;
+		__entry->status = status;
+	),
+	TP_printk("bus=%d urb=%p handle=0x%016llx dev=%u ep=%u%s type=%s len=%u actual=%u status=%d",
+		__entry->busnum, __entry->urb, (unsigned long long)__entry->handle,
+		__entry->devnum, __entry->epnum, __entry->in ? "in" : "out",
+		__print_symbolic(__entry->type,
+			{ PIPE_ISOCHRONOUS, "iso" },
+			{ PIPE_INTERRUPT,   "int" },
+			{ PIPE_CONTROL,     "ctrl" },
+			{ PIPE_BULK,        "bulk" }),
+		__entry->length, __entry->actual, __entry->status)
+);
+
+// the usb core handed the urb to us
+DEFINE_EVENT(usb_vhci_urb, usb_vhci_urb_enqueue,
+	TP_PROTO(const struct urb *urb, u64 handle, int status),
+	TP_ARGS(urb, handle, status)
+);
+
+// the usb core wants the urb back (status is the unlink reason)
+DEFINE_EVENT(usb_vhci_urb, usb_vhci_urb_dequeue,
+	TP_PROTO(const struct urb *urb, u64 handle, int status),
+	TP_ARGS(urb, handle, status)
+);
+
+// user space fetched the urb and got its handle
+DEFINE_EVENT(usb_vhci_urb, usb_vhci_urb_fetch,
+	TP_PROTO(const struct urb *urb, u64 handle, int status),
+	TP_ARGS(urb, handle, status)
+);
+
+// user space copied the OUT data (or the iso packet descriptors) of the urb (status is the result)
+DEFINE_EVENT(usb_vhci_urb, usb_vhci_urb_fetch_data,
+	TP_PROTO(const struct urb *urb, u64 handle, int status),
+	TP_ARGS(urb, handle, status)
+);
+
+// user space deposited IN data into the urb (status is the result)
+DEFINE_EVENT(usb_vhci_urb, usb_vhci_urb_deposit_data,
+	TP_PROTO(const struct urb *urb, u64 handle, int status),
+	TP_ARGS(urb, handle, status)
+);
+
+// the urb goes back to the usb core
+DEFINE_EVENT(usb_vhci_urb, usb_vhci_urb_giveback,
+	TP_PROTO(const struct urb *urb, u64 handle, int status),
+	TP_ARGS(urb, handle, status)
+);
+
+// user space changed the status of a port; the resulting port status is recorded
+TRACE_EVENT(usb_vhci_port_stat,
+	TP_PROTO(struct usb_vhci_hcd *vhc, u8 index),
+	TP_ARGS(vhc, index),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(u8,  index)
+		__field(u16, status)
+		__field(u16, change)
+		__field(u8,  flags)
+	),
+	TP_fast_assign(
+		__entry->busnum = vhcihcd_to_usbhcd(vhc)->self.busnum;
+		__entry->index  = index;
+		__entry->status = vhc->ports[index - 1].port_status;
+		__entry->change = vhc->ports[index - 1].port_change;
+		__entry->flags  = vhc->ports[index - 1].port_flags;
+	),
+	TP_printk("bus=%d port=%u status=0x%04x change=0x%04x flags=0x%02x",
+		__entry->busnum, __entry->index, __entry->status, __entry->change, __entry->flags)
+);
+
+#endif // _USB_VHCI_TRACE_H
+
+// the kernel looks for this header in TRACE_INCLUDE_PATH, so the Makefile adds our source directory
+// to the include path of usb-vhci-hcd.o
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usb-vhci-trace
+#include <trace/define_trace.h>
+
+#endif // NO_TRACE_EVENTS
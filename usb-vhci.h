@@ -62,7 +62,20 @@
 
 #endif
 
-// structure for the USB_VHCI_HCD_IOCREGISTER ioctl
+// One file can own up to USB_VHCI_MAX_CONTROLLERS controllers; USB_VHCI_HCD_IOCREGISTER (or
+// USB_VHCI_HCD_IOCREGISTEREX) can be called once for each of them. Work items tell which controller they belong
+// to. The index of the controller is encoded in the upper bits of the handles,
+// so that givebacks and data requests are routed to the right controller
+// automatically.
+#define USB_VHCI_MAX_CONTROLLERS        256
+#define USB_VHCI_HANDLE_CONTROLLER_SHIFT 56
+#define USB_VHCI_HANDLE_CONTROLLER(handle) \
+	((__u8)((handle) >> USB_VHCI_HANDLE_CONTROLLER_SHIFT))
+
+// structure for the USB_VHCI_HCD_IOCREGISTER and USB_VHCI_HCD_IOCREGISTEREX ioctls
+// The bytes behind port_count were padding in older versions, so
+// USB_VHCI_HCD_IOCREGISTER never reads them (callers did not have to clear
+// them); use USB_VHCI_HCD_IOCREGISTEREX for passing flags.
 struct usb_vhci_ioc_register
 {
 	__s32 id;         // [out] identifier which was assigned by the kernel
@@ -70,6 +83,39 @@ struct usb_vhci_ioc_register
 	char bus_id[20];  // [out] null-terminated bus-id of the controller
 	                  //       (something similar to usb_vhci_hcd.<id>)
 	__u8 port_count;  // [in]  number of ports the controller should have
+	                  //       (max. USB_MAXCHILDREN of the kernel, usually 31)
+	__u8 controller;  // [out] index of the controller within the file
+	                  //       (0 for the first registered one)
+	__u8 flags;       // [in]  USB_VHCI_HCD_IOCREGISTEREX only: flags (must be
+	                  //       zero, if none of them is used):
+#define USB_VHCI_REGISTER_FLAG_SUPERSPEED 0x01 // The controller gets a USB 3.0
+                                               // root hub in addition to the
+                                               // USB 2.0 one (both with
+                                               // port_count ports). Ports
+                                               // 1..port_count belong to the
+                                               // USB 2.0 root hub, the ports
+                                               // behind them to the USB 3.0
+                                               // one. (Needs linux >= 2.6.39.)
+#define USB_VHCI_REGISTER_FLAG_LOCAL_NODE 0x02 // The memory of the controller
+                                               // (ports, urb descriptors,
+                                               // endpoint data) is allocated
+                                               // on the NUMA node of the CPU
+                                               // which registers it. Pin the
+                                               // registering thread and the
+                                               // threads which serve the
+                                               // controller to CPUs of the
+                                               // same node.
+#define USB_VHCI_REGISTER_FLAG_COALESCE_OUT 0x04 // Consecutive bulk OUT urbs
+                                                 // of an endpoint are handed
+                                                 // out as one work item (see
+                                                 // USB_VHCI_WORK_TYPE_PROCESS_URBS).
+                                                 // Only callers which set it
+                                                 // get such work items.
+#define USB_VHCI_REGISTER_FLAG_NAK          0x08 // Interrupt IN urbs can be
+                                                 // given back with
+                                                 // USB_VHCI_STATUS_NAK (see
+                                                 // USB_VHCI_HCD_IOCINREADY).
+	__u8 reserved;    // [in]  USB_VHCI_HCD_IOCREGISTEREX only: must be zero
 };
 
 struct usb_vhci_ioc_port_stat
@@ -78,8 +124,89 @@ struct usb_vhci_ioc_port_stat
 	__u16 change;    // indicates changed status bits
 	__u8 index;      // index of port
 	__u8 flags;      // additional information from kernel to user space:
-#define USB_VHCI_PORT_STAT_FLAG_RESUMING 0x01 // indicates resuming
-	__u8 reserved1, reserved2; // size of the struct should be dividable by four
+#define USB_VHCI_PORT_STAT_FLAG_RESUMING   0x01 // indicates resuming
+#define USB_VHCI_PORT_STAT_FLAG_SUPERSPEED 0x02 // port of the USB 3.0 root hub:
+                                                // status and change use the
+                                                // USB 2.0 bits like all other
+                                                // ports, but the speed bits are
+                                                // ignored, because devices are
+                                                // always SuperSpeed devices,
+                                                // and there is no USB 2.0
+                                                // enable change bit
+	__u8 controller; // USB_VHCI_HCD_IOCPORTSTATEX and
+	                 // USB_VHCI_HCD_IOCPORTSTATMULTI: index of the controller
+	                 // (in work items see usb_vhci_ioc_work.controller);
+	                 // USB_VHCI_HCD_IOCPORTSTAT ignores this byte (it was
+	                 // reserved in older versions) and always addresses the
+	                 // first controller of the file
+	__u8 reserved;   // size of the struct should be dividable by four
+	                 // (USB_VHCI_HCD_IOCPORTSTATEX: must be zero)
+};
+
+// structure for the USB_VHCI_HCD_IOCPORTSTATMULTI ioctl
+// Applies many port changes at once, e.g. when a lot of devices are attached
+// or reset together. Consecutive changes for the same controller are applied
+// without anybody seeing the ports in between, and the root hub of the
+// controller looks at its ports only once afterwards.
+struct usb_vhci_ioc_port_stat_multi
+{
+	struct usb_vhci_ioc_port_stat *stats; // [in] points to the beginning of
+	                                      //      the array of changes
+	__s32 *results;                       // [in] points to an array which
+	                                      //      receives the result of each
+	                                      //      change (the value PORTSTAT
+	                                      //      would have failed with, or 0);
+	                                      //      may be a null pointer
+	__u32 count;                          // [in] number of elements (max.
+	                                      //      USB_VHCI_PORT_STAT_MULTI_MAX)
+};
+#define USB_VHCI_PORT_STAT_MULTI_MAX 256
+
+// structure for the USB_VHCI_HCD_IOCDESCCACHE ioctl
+// Preloads the descriptors of the device at a port, so that the kernel answers
+// standard GET_DESCRIPTOR requests for them on its own, without passing the
+// urbs to user space. data holds a sequence of records: each one is a
+// struct usb_vhci_desc_record followed by length bytes of the descriptor, padded
+// with zeros to a multiple of four. A new cache replaces the old one; a length
+// of zero just drops the old one. The cache of a port is dropped when its
+// device is disconnected (PORTSTAT with USB_PORT_STAT_C_CONNECTION).
+// Requests which depend on the state of the device (GET_STATUS,
+// GET_CONFIGURATION, ...) still go to user space.
+struct usb_vhci_ioc_desc_cache
+{
+	void *data;      // [in] points to the records; ignored if length is zero
+	__u32 length;    // [in] size of data in bytes (max.
+	                 //      USB_VHCI_DESC_CACHE_MAX)
+	__u8 controller; // [in] index of the controller
+	__u8 index;      // [in] index of port
+	__u16 reserved;  // (must be zero)
+};
+#define USB_VHCI_DESC_CACHE_MAX 65536
+
+struct usb_vhci_desc_record
+{
+	__u16 value;    // wValue of the request (descriptor type << 8 | index)
+	__u16 index;    // wIndex of the request (language id for strings, else 0)
+	__u16 length;   // number of bytes following this header
+	__u16 reserved; // (must be zero)
+};
+
+// structure for the USB_VHCI_HCD_IOCOPENCHANNEL ioctl
+// Opens a channel for a port: a new file descriptor which gets all the work of
+// the port and of the devices behind it (instead of the file which registered
+// the controller), so that one thread or process per device can serve it. The
+// channel supports the same ioctls, read/write, splice and rings as the main
+// file, except for REGISTER and OPENCHANNEL; PORTSTAT and DESCCACHE are
+// restricted to its own port. The controller index in handles and work items
+// stays the one of the main file. Urbs which were fetched through a channel can
+// only be given back through it. Closing the channel gives back its pending
+// urbs with -ESHUTDOWN and routes the port back to the main file.
+struct usb_vhci_ioc_channel
+{
+	__u8 controller; // [in] index of the controller
+	__u8 index;      // [in] index of port
+	__u16 reserved;  // (must be zero)
+	__s32 fd;        // [out] file descriptor of the channel
 };
 
 struct usb_vhci_ioc_setup_packet
@@ -115,6 +242,17 @@ struct usb_vhci_ioc_urb
 #define USB_VHCI_URB_TYPE_INT     1
 #define USB_VHCI_URB_TYPE_CONTROL 2
 #define USB_VHCI_URB_TYPE_BULK    3
+	__u8 uframe;                                   // microframe (0-7) within
+	                                               // frame (was padding; zero
+	                                               // for older modules)
+	__u16 frame;                                   // ISO: frame in which the urb
+	                                               // starts (the kernel holds it
+	                                               // back until then);
+	                                               // INT: frame of the next slot
+	                                               // which the endpoint has
+	                                               // reserved;
+	                                               // others: current frame
+	                                               // number (11 bits)
 };
 
 union usb_vhci_ioc_work_union
@@ -128,8 +266,8 @@ struct usb_vhci_ioc_work
 	__u64 handle;                        // for USB_VHCI_IOC_WORK_TYPE_PROCESS_URB
 	                                     // and USB_VHCI_IOC_WORK_TYPE_CANCEL_URB;
 	                                     // handle which identifies the urb
-	                                     // (it is just a pointer to the urb
-	                                     // in kernel space)
+	                                     // (an opaque non-zero value assigned
+	                                     // by the kernel)
 	union usb_vhci_ioc_work_union work;
 	__s16 timeout;                       // timeout in milliseconds (max. 1000)
 #define USB_VHCI_TIMEOUT_INFINITE     -1
@@ -139,8 +277,62 @@ struct usb_vhci_ioc_work
                                          // hardware
 #define USB_VHCI_WORK_TYPE_CANCEL_URB  2 // cancel urb if it isn't processed
                                          // already
+#define USB_VHCI_WORK_TYPE_PROCESS_URBS 3 // a group of bulk OUT urbs (only
+                                          // with USB_VHCI_REGISTER_FLAG_COALESCE_OUT)
+	__u8 controller;                     // index of the controller which
+	                                     // produced this work item
 };
 
+// structure for the USB_VHCI_HCD_IOCFETCHWORKNS ioctl
+// Like FETCHWORK, but the timeout is given in nanoseconds and there is no
+// upper limit. The kernel waits with a high resolution timer (its slack is the
+// timer slack of the calling thread), so sub-millisecond timeouts work.
+struct usb_vhci_ioc_work_ns
+{
+	struct usb_vhci_ioc_work work; // [out] (work.timeout is not used)
+	__s64 timeout_ns;              // [in]  timeout in nanoseconds (zero:
+	                               //       don't wait; negative: wait forever)
+};
+
+// structure for the USB_VHCI_HCD_IOCFETCHWORKMULTI ioctl
+struct usb_vhci_ioc_work_multi
+{
+	struct usb_vhci_ioc_work *works; // [in]  points to the beginning of the work
+	                                 //       array (the timeout field of the
+	                                 //       elements is ignored)
+	__u32 count;                     // [in]  number of elements in the array
+	                                 //       (at most USB_VHCI_WORK_MULTI_MAX
+	                                 //       elements are filled in)
+	__u32 fetched;                   // [out] number of elements filled in
+	__s16 timeout;                   // [in]  timeout in milliseconds (max. 1000);
+	                                 //       only waited for if there is no
+	                                 //       work at all
+};
+#define USB_VHCI_WORK_MULTI_MAX 64
+
+// Groups of bulk OUT urbs (USB_VHCI_WORK_TYPE_PROCESS_URBS): If a controller was
+// registered with USB_VHCI_REGISTER_FLAG_COALESCE_OUT (which only
+// USB_VHCI_HCD_IOCREGISTEREX accepts), then bulk OUT urbs which are queued
+// back to back on an endpoint (with the same flags) are handed out as one work
+// item. work.urb describes the first urb of the group, except for
+// buffer_length, which is the sum of the lengths of all urbs, and
+// packet_count, which is the number of urbs (at most USB_VHCI_URB_GROUP_MAX).
+// Each urb still is a transfer of its own (so a short packet ends each of them
+// when URB_ZERO_PACKET asks for it), and it has a handle of its own: the urbs
+// of a group have consecutive handles, starting with the handle of the work
+// item. Cancelations go to the single urbs.
+// The data of all urbs is fetched at once with FETCHDATA for the handle of the
+// group: packet_count is the number of urbs and iso_packets receives the
+// location of the data of each urb within buffer. An urb which was canceled
+// meanwhile gets the offset USB_VHCI_URB_GROUP_GONE. (FETCHWORKDATA and the
+// stream never copy the data of groups inline.)
+// The urbs can be given back one by one, or all at once with GIVEBACKGROUP.
+#define USB_VHCI_URB_GROUP_MAX        32
+#define USB_VHCI_URB_GROUP_MAX_LENGTH 0x100000 // (a group only grows to this
+                                               // size; a single urb may be
+                                               // larger)
+#define USB_VHCI_URB_GROUP_GONE       0xffffffff
+
 struct usb_vhci_ioc_iso_packet_data
 {
 	__u32 offset;
@@ -157,6 +349,27 @@ struct usb_vhci_ioc_urb_data
 	__s32 packet_count;  // number of iso packets
 };
 
+// structure for the USB_VHCI_HCD_IOCFETCHWORKDATA ioctl
+struct usb_vhci_ioc_work_data
+{
+	struct usb_vhci_ioc_work work; // [in,out] same as for FETCHWORK
+	void *buffer;                  // [in]  receives the data of OUT urbs
+	struct usb_vhci_ioc_iso_packet_data *iso_packets; // [in]  receives the iso
+	                                                  //       packet descriptors
+	__s32 buffer_length;           // [in]  number of bytes which were allocated
+	                               //       for the buffer
+	__s32 packet_count;            // [in]  number of elements which were
+	                               //       allocated for iso_packets
+	__u32 flags;                   // [out] flags:
+#define USB_VHCI_WORK_DATA_FLAG_INLINE 0x0001 // the data (and the iso packet
+                                              // descriptors) of the urb were
+                                              // copied; if this flag isn't set
+                                              // for an urb which has some, then
+                                              // FETCHDATA has to be used
+	__u32 reserved;                // size of the struct should be the same
+	                               // for 32 and 64 bit alignments of __u64
+};
+
 struct usb_vhci_ioc_iso_packet_giveback
 {
 	__u32 packet_actual;
@@ -167,7 +380,9 @@ struct usb_vhci_ioc_giveback
 {
 	__u64 handle;
 	void *buffer;        // only for IN URBs: the received data (for OUT URBs
-	                     // always a null pointer)
+	                     // always a null pointer; for IN URBs a null pointer
+	                     // means that the data was written with
+	                     // USB_VHCI_HCD_IOCDEPOSITDATA already)
 	struct usb_vhci_ioc_iso_packet_giveback *iso_packets; // for ISO
 	__s32 status;        // (ignored for ISO URBs)
 	__s32 buffer_actual; // number of bytes which were actually transfered
@@ -178,6 +393,237 @@ struct usb_vhci_ioc_giveback
 	__s32 error_count;   // for ISO
 };
 
+// structure for the USB_VHCI_HCD_IOCDEPOSITDATA ioctl
+// Writes a part of the data of a fetched IN urb into its buffer, while the urb
+// stays fetched. So user space can pass on large transfers piece by piece as
+// they arrive from its backend. The urb is completed by a GIVEBACK without
+// buffer, whose buffer_actual must not exceed the end of the deposited data.
+struct usb_vhci_ioc_deposit
+{
+	__u64 handle;
+	void *buffer;    // data for the buffer of the urb
+	__s32 offset;    // offset within the buffer of the urb
+	__s32 length;    // number of bytes (offset + length must not exceed
+	                 // buffer_length of the urb)
+	__u32 reserved;  // size of the struct should be the same for 32 and 64
+	                 // bit alignments of __u64
+};
+
+// structure for the USB_VHCI_HCD_IOCINREADY ioctl
+// If the controller was registered with USB_VHCI_REGISTER_FLAG_NAK, then a
+// fetched interrupt IN urb for which user space has no data can be given back
+// with the status USB_VHCI_STATUS_NAK. The kernel doesn't complete it
+// then, but parks it, and its handle becomes invalid. As soon as user space has
+// data for the endpoint, it calls INREADY, and the parked urbs of the endpoint
+// are handed out again as new PROCESS_URB work items (with new handles). So an
+// idle endpoint costs nothing until its device has something to say. (Other
+// urbs which are given back with this status, and all urbs of controllers
+// without the flag, are completed with it.)
+struct usb_vhci_ioc_in_ready
+{
+	__u8 controller; // index of the controller
+	__u8 address;    // address of the device (see usb_vhci_ioc_urb.address)
+	__u8 endpoint;   // number of the endpoint (the direction bit is ignored)
+	__u8 reserved;   // (must be zero)
+};
+#define USB_VHCI_STATUS_NAK (-11) // -EAGAIN
+
+// structure for the USB_VHCI_HCD_IOCPOSTIN ioctl
+// Posts data for a bulk IN endpoint before its urbs arrive (for devices which
+// stream, so that user space has the data already when it would fetch the
+// urb). The kernel answers the urbs of the endpoint with the posted data right
+// when they are enqueued, without passing them to user space: each urb takes
+// as much of the oldest posted chunk as fits into its buffer (the rest of the
+// chunk goes to the next urb), and it completes short if the chunk ends
+// earlier. Urbs which are waiting in the inbox already are answered at once.
+// Posted data is only used while user space has no fetched urbs of the
+// endpoint, so urbs always complete in order; the urbs which user space
+// fetches while there is posted data complete before that data is used.
+// The endpoint must have seen an urb already (else this fails with ENOENT), and
+// at most USB_VHCI_POST_IN_QUEUE_MAX chunks may wait per endpoint (EAGAIN).
+// The posted data is dropped when the endpoint is disabled.
+struct usb_vhci_ioc_post_in
+{
+	void *data;      // [in] points to the data
+	__u32 length;    // [in] number of bytes (1 .. USB_VHCI_POST_IN_MAX)
+	__u8 controller; // [in] index of the controller
+	__u8 address;    // [in] address of the device (see usb_vhci_ioc_urb.address)
+	__u8 endpoint;   // [in] number of the endpoint (the direction bit is ignored)
+	__u8 reserved;   // (must be zero)
+};
+#define USB_VHCI_POST_IN_MAX       65536
+#define USB_VHCI_POST_IN_QUEUE_MAX 64
+
+// structure for the USB_VHCI_HCD_IOCBUSYPOLL ioctl
+// Lets the file spin for up to usecs microseconds, looking for work, before a
+// fetch (or a ring enter with USB_VHCI_RING_ENTER_WAIT, or a read) goes to
+// sleep. This saves the cost of sleeping and waking up when work arrives soon,
+// at the expense of burning cpu time, which is accounted in the stats of the
+// first controller of the file. Zero (the default) switches it off. It may be
+// called before USB_VHCI_HCD_IOCREGISTER.
+struct usb_vhci_ioc_busy_poll
+{
+	__u32 usecs;    // max. USB_VHCI_BUSY_POLL_MAX
+	__u32 reserved; // (must be zero)
+};
+#define USB_VHCI_BUSY_POLL_MAX 10000
+
+// result of one urb for the USB_VHCI_HCD_IOCGIVEBACKGROUP ioctl
+struct usb_vhci_ioc_group_result
+{
+	__s32 status;
+	__u32 buffer_actual; // number of bytes which were actually transfered
+};
+
+// structure for the USB_VHCI_HCD_IOCGIVEBACKGROUP ioctl
+// Gives back count urbs of a group (see USB_VHCI_WORK_TYPE_PROCESS_URBS) with
+// consecutive handles, starting with handle, in one go.
+struct usb_vhci_ioc_giveback_group
+{
+	__u64 handle;                              // [in]  handle of the first urb
+	struct usb_vhci_ioc_group_result *results; // [in]  count results
+	__s32 *errors;                             // [in]  points to an array which
+	                                           //       receives the value GIVEBACK
+	                                           //       would have failed with for
+	                                           //       each urb (or 0); may be a
+	                                           //       null pointer
+	__u32 count;                               // [in]  number of urbs (max.
+	                                           //       USB_VHCI_URB_GROUP_MAX)
+	__u32 reserved;                            // (must be zero)
+};
+
+// structure for the USB_VHCI_HCD_IOCGIVEBACKMULTI ioctl
+struct usb_vhci_ioc_giveback_multi
+{
+	struct usb_vhci_ioc_giveback *givebacks; // [in]  points to the beginning of
+	                                         //       the giveback array
+	__s32 *results;                          // [in]  points to an array which
+	                                         //       receives the result of each
+	                                         //       giveback (the value GIVEBACK
+	                                         //       would have failed with, or 0);
+	                                         //       may be a null pointer
+	__u32 count;                             // [in]  number of elements (max.
+	                                         //       USB_VHCI_GIVEBACK_MULTI_MAX)
+};
+#define USB_VHCI_GIVEBACK_MULTI_MAX 64
+
+// Ring buffer mode: After USB_VHCI_HCD_IOCRINGSETUP the ring buffers can be
+// mapped into user space by calling mmap on the file descriptor (offset 0,
+// length usb_vhci_ioc_ring_setup.size). The kernel produces work items into
+// the work ring; user space produces completed urbs into the giveback ring.
+// Both rings are driven by the USB_VHCI_HCD_IOCRINGENTER ioctl, which is only
+// needed if user space has put new entries into an empty giveback ring or if
+// it has consumed all entries of the work ring.
+// The indices are free running; an entry is located at (index & (entries - 1)).
+// The number of entries in a ring is head - tail.
+struct usb_vhci_ring_header
+{
+	__u32 head;     // index of the next entry the producer will write
+	                // (only written by the producer)
+	__u32 tail;     // index of the next entry the consumer will read
+	                // (only written by the consumer)
+	__u32 entries;  // number of entries (a power of two)
+	__u32 reserved; // size of the header should be dividable by eight
+};
+// The header of a ring is followed by its entries. For the work ring these are
+// struct usb_vhci_ioc_work (the timeout field is not used).
+
+// entry of the giveback ring (same layout for 32 and 64 bit user space)
+struct usb_vhci_ioc_ring_giveback
+{
+	__u64 handle;
+	__u64 buffer;        // same as usb_vhci_ioc_giveback.buffer
+	__u64 iso_packets;   // same as usb_vhci_ioc_giveback.iso_packets
+	__s32 status;
+	__s32 buffer_actual;
+	__s32 packet_count;
+	__s32 error_count;
+};
+
+// structure for the USB_VHCI_HCD_IOCRINGSETUP ioctl
+struct usb_vhci_ioc_ring_setup
+{
+	__u32 work_entries;     // [in,out] number of entries in the work ring
+	                        //          (rounded up to a power of two; max.
+	                        //          USB_VHCI_RING_MAX_ENTRIES)
+	__u32 giveback_entries; // [in,out] number of entries in the giveback ring
+	__u32 work_offset;      // [out] offset of the header of the work ring
+	__u32 giveback_offset;  // [out] offset of the header of the giveback ring
+	__u32 size;             // [out] size of the memory region to mmap
+};
+#define USB_VHCI_RING_MAX_ENTRIES 4096
+
+// structure for the USB_VHCI_HCD_IOCRINGENTER ioctl
+struct usb_vhci_ioc_ring_enter
+{
+	__u32 flags;      // [in]  flags:
+#define USB_VHCI_RING_ENTER_GIVEBACK 0x0001 // consume the giveback ring
+#define USB_VHCI_RING_ENTER_FETCH    0x0002 // fill the work ring
+#define USB_VHCI_RING_ENTER_WAIT     0x0004 // FETCH: wait for work if nothing
+                                            // could be put into the work ring
+	__s16 timeout;    // [in]  timeout in milliseconds for
+	                  //       USB_VHCI_RING_ENTER_WAIT (max. 1000)
+	__u16 reserved;
+	__u32 given_back; // [out] number of consumed giveback entries
+	__u32 failed;     // [out] number of those which were rejected (the urb
+	                  //       was given back anyway, unless its handle was
+	                  //       unknown)
+	__u32 fetched;    // [out] number of entries put into the work ring
+};
+
+// Stream mode: read() and write() on the file move many work items and
+// givebacks (including their data) with one system call each, so that the
+// usual I/O machinery (readv/writev, aio, io_uring) can drive the file.
+// read() returns a packed sequence of struct usb_vhci_stream_work records. It
+// blocks until there is some work, unless the file is opened with O_NONBLOCK
+// (then it fails with EAGAIN). The buffer must hold at least one record
+// header. write() takes a packed sequence of struct usb_vhci_stream_giveback
+// records and returns the number of bytes consumed; it stops in front of the
+// first malformed record (EINVAL if it is the first one). The results of the
+// individual givebacks are not reported, like for GIVEBACKMULTI without
+// results. Each record starts at a multiple of USB_VHCI_STREAM_ALIGN; the
+// layout is the same for 32 and 64 bit user space.
+// The same streams can be spliced from and to the file, so that the data of
+// the urbs moves between them and a pipe (and from there a socket) without a
+// copy in user space. A spliced giveback record may arrive in pieces; the data
+// is deposited into the urb as it comes in. A file should either be read or
+// spliced from, but not both, because bytes which didn't fit into the pipe are
+// held back for the next splice. After a malformed record, a spliced giveback
+// stream is out of sync.
+#define USB_VHCI_STREAM_ALIGN 8
+#define USB_VHCI_STREAM_RECORD_LENGTH(len) \
+	(((len) + USB_VHCI_STREAM_ALIGN - 1) & ~(USB_VHCI_STREAM_ALIGN - 1))
+
+struct usb_vhci_stream_work
+{
+	__u32 length;                  // size of the record (header, trailing
+	                               // data and padding)
+	__u32 flags;                   // USB_VHCI_WORK_DATA_FLAG_INLINE: for a
+	                               // PROCESS_URB work the header is followed by
+	                               // the iso packet descriptors (packet_count
+	                               // struct usb_vhci_ioc_iso_packet_data) and
+	                               // the data of an OUT urb (buffer_length
+	                               // bytes); otherwise (no data, or it didn't
+	                               // fit into the buffer) FETCHDATA has to be
+	                               // used if the urb has some
+	struct usb_vhci_ioc_work work; // (the timeout field is not used)
+};
+
+struct usb_vhci_stream_giveback
+{
+	__u32 length;        // size of the record (header, trailing data and
+	                     // padding)
+	__u32 data_length;   // number of data bytes behind the iso packets; for IN
+	                     // urbs at least buffer_actual, or zero if the data was
+	                     // deposited already (see usb_vhci_ioc_giveback.buffer)
+	__u64 handle;
+	__s32 status;        // same as in usb_vhci_ioc_giveback
+	__s32 buffer_actual;
+	__s32 packet_count;  // number of struct usb_vhci_ioc_iso_packet_giveback
+	                     // which follow the header
+	__s32 error_count;
+};
+
 #ifdef __KERNEL__
 #ifdef CONFIG_COMPAT
 #include <linux/compat.h>
@@ -190,6 +636,76 @@ struct usb_vhci_ioc_urb_data32
 	__s32 packet_count;
 };
 
+struct usb_vhci_ioc_work_data32
+{
+	struct usb_vhci_ioc_work work;
+	compat_caddr_t buffer;
+	compat_caddr_t iso_packets;
+	__s32 buffer_length;
+	__s32 packet_count;
+	__u32 flags;
+	__u32 reserved;
+};
+
+struct usb_vhci_ioc_port_stat_multi32
+{
+	compat_caddr_t stats;
+	compat_caddr_t results;
+	__u32 count;
+};
+
+struct usb_vhci_ioc_desc_cache32
+{
+	compat_caddr_t data;
+	__u32 length;
+	__u8 controller;
+	__u8 index;
+	__u16 reserved;
+};
+
+struct usb_vhci_ioc_giveback_group32
+{
+	__u64 handle;
+	compat_caddr_t results;
+	compat_caddr_t errors;
+	__u32 count;
+	__u32 reserved;
+};
+
+struct usb_vhci_ioc_giveback_multi32
+{
+	compat_caddr_t givebacks;
+	compat_caddr_t results;
+	__u32 count;
+};
+
+struct usb_vhci_ioc_work_multi32
+{
+	compat_caddr_t works;
+	__u32 count;
+	__u32 fetched;
+	__s16 timeout;
+};
+
+struct usb_vhci_ioc_deposit32
+{
+	__u64 handle;
+	compat_caddr_t buffer;
+	__s32 offset;
+	__s32 length;
+	__u32 reserved;
+};
+
+struct usb_vhci_ioc_post_in32
+{
+	compat_caddr_t data;
+	__u32 length;
+	__u8 controller;
+	__u8 address;
+	__u8 endpoint;
+	__u8 reserved;
+};
+
 struct usb_vhci_ioc_giveback32
 {
 	__u64 handle;
@@ -221,7 +737,55 @@ struct usb_vhci_ioc_giveback32
                                        struct usb_vhci_ioc_urb_data)
 #define USB_VHCI_HCD_IOCFETCHDATA32  _IOW (USB_VHCI_HCD_IOC_MAGIC, 4, \
                                        struct usb_vhci_ioc_urb_data32)
-#define USB_VHCI_HCD_IOC_MAXNR       4
+#define USB_VHCI_HCD_IOCFETCHWORKMULTI   _IOWR(USB_VHCI_HCD_IOC_MAGIC, 5, \
+                                           struct usb_vhci_ioc_work_multi)
+#define USB_VHCI_HCD_IOCFETCHWORKMULTI32 _IOWR(USB_VHCI_HCD_IOC_MAGIC, 5, \
+                                           struct usb_vhci_ioc_work_multi32)
+#define USB_VHCI_HCD_IOCGIVEBACKMULTI    _IOW (USB_VHCI_HCD_IOC_MAGIC, 6, \
+                                           struct usb_vhci_ioc_giveback_multi)
+#define USB_VHCI_HCD_IOCGIVEBACKMULTI32  _IOW (USB_VHCI_HCD_IOC_MAGIC, 6, \
+                                           struct usb_vhci_ioc_giveback_multi32)
+#define USB_VHCI_HCD_IOCFETCHWORKDATA    _IOWR(USB_VHCI_HCD_IOC_MAGIC, 7, \
+                                           struct usb_vhci_ioc_work_data)
+#define USB_VHCI_HCD_IOCFETCHWORKDATA32  _IOWR(USB_VHCI_HCD_IOC_MAGIC, 7, \
+                                           struct usb_vhci_ioc_work_data32)
+#define USB_VHCI_HCD_IOCRINGSETUP        _IOWR(USB_VHCI_HCD_IOC_MAGIC, 8, \
+                                           struct usb_vhci_ioc_ring_setup)
+#define USB_VHCI_HCD_IOCRINGENTER        _IOWR(USB_VHCI_HCD_IOC_MAGIC, 9, \
+                                           struct usb_vhci_ioc_ring_enter)
+#define USB_VHCI_HCD_IOCDEPOSITDATA      _IOW (USB_VHCI_HCD_IOC_MAGIC, 10, \
+                                           struct usb_vhci_ioc_deposit)
+#define USB_VHCI_HCD_IOCDEPOSITDATA32    _IOW (USB_VHCI_HCD_IOC_MAGIC, 10, \
+                                           struct usb_vhci_ioc_deposit32)
+#define USB_VHCI_HCD_IOCINREADY          _IOW (USB_VHCI_HCD_IOC_MAGIC, 11, \
+                                           struct usb_vhci_ioc_in_ready)
+#define USB_VHCI_HCD_IOCBUSYPOLL         _IOW (USB_VHCI_HCD_IOC_MAGIC, 12, \
+                                           struct usb_vhci_ioc_busy_poll)
+#define USB_VHCI_HCD_IOCFETCHWORKNS      _IOWR(USB_VHCI_HCD_IOC_MAGIC, 13, \
+                                           struct usb_vhci_ioc_work_ns)
+#define USB_VHCI_HCD_IOCPORTSTATMULTI    _IOW (USB_VHCI_HCD_IOC_MAGIC, 14, \
+                                           struct usb_vhci_ioc_port_stat_multi)
+#define USB_VHCI_HCD_IOCPORTSTATMULTI32  _IOW (USB_VHCI_HCD_IOC_MAGIC, 14, \
+                                           struct usb_vhci_ioc_port_stat_multi32)
+#define USB_VHCI_HCD_IOCDESCCACHE        _IOW (USB_VHCI_HCD_IOC_MAGIC, 15, \
+                                           struct usb_vhci_ioc_desc_cache)
+#define USB_VHCI_HCD_IOCDESCCACHE32      _IOW (USB_VHCI_HCD_IOC_MAGIC, 15, \
+                                           struct usb_vhci_ioc_desc_cache32)
+#define USB_VHCI_HCD_IOCOPENCHANNEL      _IOWR(USB_VHCI_HCD_IOC_MAGIC, 16, \
+                                           struct usb_vhci_ioc_channel)
+#define USB_VHCI_HCD_IOCPOSTIN           _IOW (USB_VHCI_HCD_IOC_MAGIC, 17, \
+                                           struct usb_vhci_ioc_post_in)
+#define USB_VHCI_HCD_IOCPOSTIN32         _IOW (USB_VHCI_HCD_IOC_MAGIC, 17, \
+                                           struct usb_vhci_ioc_post_in32)
+#define USB_VHCI_HCD_IOCGIVEBACKGROUP    _IOW (USB_VHCI_HCD_IOC_MAGIC, 18, \
+                                           struct usb_vhci_ioc_giveback_group)
+#define USB_VHCI_HCD_IOCGIVEBACKGROUP32  _IOW (USB_VHCI_HCD_IOC_MAGIC, 18, \
+                                           struct usb_vhci_ioc_giveback_group32)
+#define USB_VHCI_HCD_IOCREGISTEREX       _IOWR(USB_VHCI_HCD_IOC_MAGIC, 19, \
+                                           struct usb_vhci_ioc_register)
+#define USB_VHCI_HCD_IOCPORTSTATEX       _IOW (USB_VHCI_HCD_IOC_MAGIC, 20, \
+                                           struct usb_vhci_ioc_port_stat)
+#define USB_VHCI_HCD_IOC_MAXNR       20
 
 #endif
 